@@ -0,0 +1,201 @@
+// Benchmark for UserSearchIndex, the in-memory index behind /search.
+//
+// Builds the index from N synthetic usernames, then times queries of the
+// shapes a search box produces: prefixes and substrings of real names as the
+// user types them (2 to 8 characters), plus terms that match nothing. A
+// linear scan over the same names stands in for LIKE '%term%' as baseline.
+
+#include "UserSearchIndex.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+using namespace std;
+
+struct BenchConfig {
+    size_t users = 1000000;
+    size_t queries = 100000;
+    size_t limit = 10;
+    size_t baseline_queries = 200;
+    unsigned seed = 42;
+};
+
+static uint64_t nowNanos() {
+    return chrono::duration_cast<chrono::nanoseconds>(
+        chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void usage(const char* argv0) {
+    cerr << "Usage: " << argv0 << " [--users N] [--queries N] [--limit K] [--baseline-queries N] [--seed S]" << endl;
+}
+
+static bool parseArgs(int argc, char** argv, BenchConfig& config) {
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (i + 1 >= argc) {
+            usage(argv[0]);
+            return false;
+        }
+        string value = argv[++i];
+        try {
+            if (arg == "--users") config.users = stoul(value);
+            else if (arg == "--queries") config.queries = stoul(value);
+            else if (arg == "--limit") config.limit = stoul(value);
+            else if (arg == "--baseline-queries") config.baseline_queries = stoul(value);
+            else if (arg == "--seed") config.seed = static_cast<unsigned>(stoul(value));
+            else {
+                usage(argv[0]);
+                return false;
+            }
+        } catch (const exception&) {
+            usage(argv[0]);
+            return false;
+        }
+    }
+    return true;
+}
+
+static size_t residentKb() {
+    ifstream status("/proc/self/status");
+    string line;
+    while (getline(status, line)) {
+        if (line.rfind("VmRSS:", 0) == 0) {
+            return stoul(line.substr(6));
+        }
+    }
+    return 0;
+}
+
+// Syllable names with an optional number, close to what people pick
+static vector<string> makeUsernames(size_t count, mt19937& rng) {
+    static const vector<string> syllables = {
+        "an", "ar", "ba", "be", "ch", "da", "el", "en", "fa", "ga", "ha", "in", "ja", "ka", "ki",
+        "la", "li", "ma", "mi", "na", "ni", "no", "or", "pa", "ra", "ri", "ro", "sa", "sh", "ta",
+        "th", "to", "va", "vi", "wa", "ya", "yo", "za", "zu", "x", "q", "_", "dev", "cool"};
+    uniform_int_distribution<size_t> syllable(0, syllables.size() - 1);
+    uniform_int_distribution<int> parts(2, 5);
+    uniform_int_distribution<int> number(0, 9999);
+    bernoulli_distribution with_number(0.6);
+
+    vector<string> names;
+    names.reserve(count);
+    for (size_t i = 0; i < count; i++) {
+        string name;
+        int n = parts(rng);
+        for (int p = 0; p < n; p++) {
+            name += syllables[syllable(rng)];
+        }
+        if (with_number(rng)) {
+            name += to_string(number(rng));
+        }
+        // Keep names unique so the index holds exactly N entries
+        name += "_" + to_string(i);
+        names.push_back(move(name));
+    }
+    return names;
+}
+
+static vector<string> makeQueries(const vector<string>& names, size_t count, mt19937& rng) {
+    uniform_int_distribution<size_t> pick(0, names.size() - 1);
+    uniform_int_distribution<int> length(2, 8);
+    uniform_int_distribution<int> kind(0, 9);
+    uniform_int_distribution<int> letter('a', 'z');
+
+    vector<string> queries;
+    queries.reserve(count);
+    for (size_t i = 0; i < count; i++) {
+        const string& name = names[pick(rng)];
+        size_t len = min<size_t>(length(rng), name.size());
+        int k = kind(rng);
+        if (k < 5) {
+            queries.push_back(name.substr(0, len));  // typing a name
+        } else if (k < 9) {
+            uniform_int_distribution<size_t> start(0, name.size() - len);
+            queries.push_back(name.substr(start(rng), len));  // a part of it
+        } else {
+            string miss;
+            for (size_t c = 0; c < len; c++) {
+                miss += static_cast<char>(letter(rng));
+            }
+            queries.push_back(miss);  // typo or probe, usually no match
+        }
+    }
+    return queries;
+}
+
+static void report(const string& label, vector<uint64_t>& samples) {
+    if (samples.empty()) {
+        return;
+    }
+    sort(samples.begin(), samples.end());
+    auto at = [&samples](double q) {
+        return samples[min(samples.size() - 1, static_cast<size_t>(q * samples.size()))] / 1000.0;
+    };
+    uint64_t total = 0;
+    for (uint64_t s : samples) {
+        total += s;
+    }
+    cout << label << ": " << samples.size() << " queries, p50 " << at(0.50) << " us, p99 " << at(0.99)
+         << " us, p999 " << at(0.999) << " us, max " << samples.back() / 1000.0 << " us, "
+         << static_cast<uint64_t>(samples.size() * 1e9 / max<uint64_t>(1, total)) << " queries/s" << endl;
+}
+
+int main(int argc, char** argv) {
+    BenchConfig config;
+    if (!parseArgs(argc, argv, config)) {
+        return 1;
+    }
+
+    mt19937 rng(config.seed);
+    vector<string> names = makeUsernames(config.users, rng);
+    vector<string> queries = makeQueries(names, config.queries, rng);
+
+    size_t rss_before = residentKb();
+    UserSearchIndex index;
+    uint64_t build_start = nowNanos();
+    for (const auto& name : names) {
+        index.add(name);
+    }
+    index.markLoaded();
+    uint64_t build_ns = nowNanos() - build_start;
+    size_t rss_after = residentKb();
+
+    cout << "Indexed " << index.size() << " usernames in " << build_ns / 1000000 << " ms, about "
+         << (rss_after - rss_before) / 1024 << " MiB" << endl;
+
+    vector<uint64_t> samples;
+    samples.reserve(queries.size());
+    size_t returned = 0;
+    for (const auto& query : queries) {
+        uint64_t start = nowNanos();
+        auto results = index.search(query, config.limit);
+        samples.push_back(nowNanos() - start);
+        returned += results.size();
+    }
+    report("index", samples);
+    cout << "Average results per query: " << static_cast<double>(returned) / max<size_t>(1, queries.size()) << endl;
+
+    // What the database did for every keystroke: look at every row
+    vector<uint64_t> baseline;
+    for (size_t i = 0; i < min(config.baseline_queries, queries.size()); i++) {
+        string term = queries[i];
+        transform(term.begin(), term.end(), term.begin(), [](unsigned char c) { return tolower(c); });
+        uint64_t start = nowNanos();
+        vector<string> results;
+        for (const auto& name : names) {
+            if (name.find(term) != string::npos) {
+                results.push_back(name);
+                if (results.size() >= config.limit) {
+                    break;
+                }
+            }
+        }
+        baseline.push_back(nowNanos() - start);
+    }
+    report("linear scan", baseline);
+    return 0;
+}
@@ -0,0 +1,146 @@
+// Throughput benchmark for /verify-token's verification path.
+//
+// Issues a set of tokens and verifies them repeatedly from several threads
+// in three modes:
+//   rebuild  - decode, build a jwt::verify() verifier and check the HMAC on
+//              every call (what the endpoint used to do)
+//   verifier - TokenManager with the cache disabled, prebuilt verifier only
+//   cached   - TokenManager with its TokenCache, the repeat verification case
+//   revoked  - as cached, with --revoked other tokens revoked, so every call
+//              also looks its jti up in the RevocationList
+
+#include "TokenManager.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+using namespace std;
+
+struct BenchConfig {
+    size_t tokens = 1000;
+    size_t iterations = 200000;  // per thread
+    size_t revoked = 100000;
+    int threads = 4;
+    string secret = "bench-secret";
+};
+
+static void usage(const char* argv0) {
+    cerr << "Usage: " << argv0 << " [--tokens N] [--iterations N_PER_THREAD] [--threads T] [--revoked N]" << endl;
+}
+
+static bool parseArgs(int argc, char** argv, BenchConfig& config) {
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (i + 1 >= argc) {
+            usage(argv[0]);
+            return false;
+        }
+        string value = argv[++i];
+        try {
+            if (arg == "--tokens") config.tokens = stoul(value);
+            else if (arg == "--iterations") config.iterations = stoul(value);
+            else if (arg == "--threads") config.threads = stoi(value);
+            else if (arg == "--revoked") config.revoked = stoul(value);
+            else {
+                usage(argv[0]);
+                return false;
+            }
+        } catch (const exception&) {
+            usage(argv[0]);
+            return false;
+        }
+    }
+    return config.tokens > 0 && config.threads > 0;
+}
+
+template <typename Verify>
+static void run(const string& label, const BenchConfig& config, const vector<string>& tokens, Verify verify) {
+    atomic<size_t> failures{0};
+    vector<thread> workers;
+    auto start = chrono::steady_clock::now();
+    for (int t = 0; t < config.threads; t++) {
+        workers.emplace_back([&, t]() {
+            mt19937 rng(t + 1);
+            uniform_int_distribution<size_t> pick(0, tokens.size() - 1);
+            for (size_t i = 0; i < config.iterations; i++) {
+                if (!verify(tokens[pick(rng)])) {
+                    failures++;
+                }
+            }
+        });
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    size_t total = config.iterations * config.threads;
+    cout << label << ": " << static_cast<uint64_t>(total / seconds) << " verifications/s, "
+         << seconds * 1e9 / total * config.threads << " ns per call per thread";
+    if (failures) {
+        cout << ", " << failures << " FAILED";
+    }
+    cout << endl;
+}
+
+int main(int argc, char** argv) {
+    BenchConfig config;
+    if (!parseArgs(argc, argv, config)) {
+        return 1;
+    }
+
+    TokenManager issuer(config.secret, 0);
+    vector<string> tokens;
+    for (size_t i = 0; i < config.tokens; i++) {
+        tokens.push_back(issuer.createToken("user" + to_string(i)));
+    }
+    cout << config.tokens << " tokens, " << config.threads << " threads, " << config.iterations
+         << " verifications per thread" << endl;
+
+    run("rebuild", config, tokens, [&config](const string& token) {
+        try {
+            auto decoded = jwt::decode(token);
+            auto verifier = jwt::verify()
+                .allow_algorithm(jwt::algorithm::hs256{config.secret})
+                .with_type("JWT")
+                .with_issuer("snibble-auth")
+                .leeway(60UL);
+            verifier.verify(decoded);
+            return decoded.get_expires_at() >= chrono::system_clock::now() &&
+                   !decoded.get_payload_claim("username").as_string().empty();
+        } catch (const exception&) {
+            return false;
+        }
+    });
+
+    TokenManager uncached(config.secret, 0);
+    run("verifier", config, tokens, [&uncached](const string& token) {
+        string username;
+        string error;
+        return uncached.verifyToken(token, username, error);
+    });
+
+    TokenManager cached(config.secret, config.tokens * 2);
+    run("cached", config, tokens, [&cached](const string& token) {
+        string username;
+        string error;
+        return cached.verifyToken(token, username, error);
+    });
+
+    // Revoked tokens are spread over the whole lifetime, like real logouts
+    TokenManager revoking(config.secret, config.tokens * 2);
+    auto now = chrono::system_clock::now();
+    for (size_t i = 0; i < config.revoked; i++) {
+        auto expiry = now + chrono::seconds(static_cast<long long>(i % (120 * 3600)) + 60);
+        revoking.revocations().revoke(RevocationList::keyOf("revoked" + to_string(i)), expiry, now);
+    }
+    run("revoked", config, tokens, [&revoking](const string& token) {
+        string username;
+        string error;
+        return revoking.verifyToken(token, username, error);
+    });
+    return 0;
+}
@@ -1,27 +1,68 @@
 #include "crow.h"
 #include "src/AuthManager.h"
+#include "src/HashExecutor.h"
+#include "TokenManager.h"
+#include "RevocationFeed.h"
+#include "Metrics.h"
+#include "ProfiledMutex.h"
 #include <dotenv.h>
 #include <iostream>
+#include <limits>
+#include <stdexcept>
 #include <string>
-#include <jwt-cpp/jwt.h>
 #include <chrono>
+#include <sodium.h>
+#include <thread>
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <set>
 
 using namespace std;
 
-// JWT secret key (in production, store this securely in environment variables)
-
-// Helper function to create JWT token
-string createJWTToken(const string& username, const string& JWT_SECRET) {
-    auto now = std::chrono::system_clock::now();
-    auto token = jwt::create()
-        .set_issuer("snibble-auth")
-        .set_type("JWT")
-        .set_payload_claim("username", jwt::claim(username))
-        .set_issued_at(now)
-        .set_expires_at(now + std::chrono::hours{120}) // 120 hour expiry
-        .sign(jwt::algorithm::hs256{JWT_SECRET});
-    
-    return token;
+// Completes an asynchronous handler from whichever thread finished the work
+static void reply(crow::response& res, crow::response response) {
+    res = move(response);
+    res.end();
+}
+
+static crow::response failureResponse(exception_ptr error) {
+    try {
+        rethrow_exception(error);
+    } catch (const HashRejected& e) {
+        return crow::response(e.httpStatus(), e.what());
+    } catch (const DatabaseUnavailable&) {
+        return crow::response(503, "Database unavailable, try again later");
+    } catch (const exception& e) {
+        cerr << "Request failed: " << e.what() << endl;
+    }
+    return crow::response(500, "Internal Server Error");
+}
+
+// Each numeric setting is parsed on its own, as in the chat server: an
+// invalid or negative one is reported and keeps its default. Every setting
+// here is a size, a count, a port or a duration, so a negative is never
+// meant and would wrap in a size_t.
+template <typename T>
+static T envNumber(const char* name, T fallback) {
+    string value = dotenv::getenv(name, "");
+    if (value.empty()) {
+        return fallback;
+    }
+    try {
+        size_t used = 0;
+        long long number = stoll(value, &used);
+        if (number < 0 || static_cast<unsigned long long>(number) > numeric_limits<T>::max()) {
+            throw out_of_range(name);
+        }
+        if (used != value.size()) {
+            throw invalid_argument(name);
+        }
+        return static_cast<T>(number);
+    } catch (const std::exception&) {
+        cerr << "Invalid " << name << " value: " << value << ", using default " << fallback << endl;
+        return fallback;
+    }
 }
 
 int main() {
@@ -30,130 +71,332 @@ int main() {
     string DATABASE = dotenv::getenv("AZURE_SQL_DATABASE");
     string USERNAME = dotenv::getenv("AZURE_SQL_USERNAME");
     string PASSWORD = dotenv::getenv("AZURE_SQL_PASSWORD");
+    string STORAGE_BACKEND = dotenv::getenv("STORAGE_BACKEND", "odbc");
+    if (STORAGE_BACKEND == "sqlite") {
+        DATABASE = dotenv::getenv("SQLITE_PATH", "snibble_users.db");
+    }
     bool verbose = dotenv::getenv("VERBOSE") == "true";
-    int port = stoi(dotenv::getenv("PORT", "8000"));
+    int port = envNumber("PORT", 8000);
     string JWT_SECRET = dotenv::getenv("JWT_SECRET", "your-super-secret-key-change-this-in-production");
 
+    // Argon2 runs on its own pool sized by a memory budget, so a credential
+    // storm cannot exhaust RAM or occupy every Crow worker.
+    size_t hash_budget_mb = envNumber<size_t>("HASH_MEMORY_BUDGET_MB", 1024);
+    size_t hash_max_queue = envNumber<size_t>("HASH_MAX_QUEUE", 32);
+    int hash_max_queue_ms = envNumber<int>("HASH_MAX_QUEUE_MS", 2000);
+    size_t hash_per_ip = envNumber<size_t>("HASH_PER_IP_LIMIT", 4);
+    size_t hash_per_user = envNumber<size_t>("HASH_PER_USER_LIMIT", 2);
+    HashExecutor hashExecutor(hash_budget_mb * 1024 * 1024, crypto_pwhash_MEMLIMIT_MODERATE, hash_max_queue,
+                              std::chrono::milliseconds(hash_max_queue_ms), hash_per_ip, hash_per_user);
+
+    size_t user_cache_size = envNumber<size_t>("USER_CACHE_SIZE", 10000);
+    TokenManager tokenManager(JWT_SECRET, envNumber<size_t>("TOKEN_CACHE_SIZE", 100000));
+
+    // /logout revocations reach the other auth and chat servers over Redis;
+    // without it they only hold on this instance.
+    unique_ptr<RevocationFeed> revocationFeed;
+    if (dotenv::getenv("REVOCATION_FEED", "true") == "true") {
+        revocationFeed = make_unique<RevocationFeed>(tokenManager.revocations(),
+                                                     dotenv::getenv("REDIS_HOST", "127.0.0.1"),
+                                                     envNumber("REDIS_PORT", 6379), verbose);
+        revocationFeed->start();
+    }
+
     crow::SimpleApp app;
-    AuthManager authManager(verbose, SERVER, DATABASE, USERNAME, PASSWORD);
+    AuthManager authManager(verbose, SERVER, DATABASE, USERNAME, PASSWORD, STORAGE_BACKEND, user_cache_size);
+    authManager.setHashExecutor(&hashExecutor);
+
+    // Handlers that touch the database run on this pool, each worker with
+    // its own connection, and answer through crow::response& when done. A
+    // slow query then holds a queue slot rather than one of Crow's threads.
+    authManager.startIoPool(envNumber<size_t>("DB_IO_WORKERS", 8),
+                            envNumber<size_t>("DB_IO_MAX_QUEUE", 1024));
+    auto offload = [&authManager](crow::response& res, function<crow::response()> handler) {
+        bool queued = authManager.submit([&res, handler]() {
+            crow::response response;
+            try {
+                response = handler();
+            } catch (const DatabaseUnavailable&) {
+                response = crow::response(503, "Database unavailable, try again later");
+            } catch (const exception& e) {
+                cerr << "Request failed: " << e.what() << endl;
+                response = crow::response(500, "Internal Server Error");
+            }
+            reply(res, move(response));
+        });
+        if (!queued) {
+            reply(res, crow::response(503, "Server busy, try again later"));
+        }
+    };
+
+    // Unknown usernames and /search are answered from memory. Disable them
+    // when several auth servers share one database, since each only sees
+    // its own signups.
+    authManager.loadUsernames(dotenv::getenv("USERNAME_FILTER", "true") == "true",
+                              envNumber<size_t>("USERNAME_FILTER_CAPACITY", 100000),
+                              dotenv::getenv("SEARCH_INDEX", "true") == "true");
 
-    CROW_ROUTE(app, "/login").methods(crow::HTTPMethod::POST)([&authManager, &JWT_SECRET](const crow::request& req) {
+    CROW_ROUTE(app, "/login").methods(crow::HTTPMethod::POST)([&authManager, &tokenManager](const crow::request& req, crow::response& res) {
         auto json = crow::json::load(req.body);
         if (!json) {
-            return crow::response(400, "Invalid JSON");
+            return reply(res, crow::response(400, "Invalid JSON"));
         }
 
         string username = json["username"].s();
         string password = json["password"].s();
-        
-        if (authManager.isUserRegistered(username)) {
-            if (authManager.login(username, password)) {
+        string clientIp = req.remote_ip_address;
+
+        bool queued = authManager.submit([&authManager, &tokenManager, &res, username, password, clientIp]() {
+            // One lookup serves both the existence check and the password hash
+            UserRecord record;
+            if (!authManager.getUserRecord(username, record)) {
+                if (!authManager.databaseAvailable()) {
+                    return reply(res, crow::response(503, "Database unavailable, try again later"));
+                }
+                return reply(res, crow::response(404, "Invalid credentials"));
+            }
 
-                string token = createJWTToken(username, JWT_SECRET);
+            // Argon2 runs on the hashing pool, this I/O worker moves on
+            authManager.loginAsync(username, record, password, clientIp,
+                                   [&tokenManager, &res, username](bool authenticated, exception_ptr error) {
+                if (error) {
+                    return reply(res, failureResponse(error));
+                }
+                if (!authenticated) {
+                    return reply(res, crow::response(401, "Invalid credentials"));
+                }
+
+                string token = tokenManager.createToken(username);
                 
                 crow::json::wvalue response;
                 response["message"] = "Login successful";
                 response["token"] = token;
                 response["username"] = username;
                 
-                return crow::response(200, response);
-            } else {
-                return crow::response(401, "Invalid credentials");
-            } 
-        } else {
-            return crow::response(404, "Invalid credentials");
+                reply(res, crow::response(200, response));
+            });
+        });
+        if (!queued) {
+            reply(res, crow::response(503, "Server busy, try again later"));
         }
     });
 
-    CROW_ROUTE(app, "/signup").methods(crow::HTTPMethod::POST)([&authManager](const crow::request& req) {
+    CROW_ROUTE(app, "/signup").methods(crow::HTTPMethod::POST)([&authManager](const crow::request& req, crow::response& res) {
         auto json = crow::json::load(req.body);
         if(!json) {
-            return crow::response(400, "Invalid JSON");
+            return reply(res, crow::response(400, "Invalid JSON"));
         }
         string username = json["username"].s();
         string password = json["password"].s();
-        if (authManager.isUserRegistered(username)) {
-            return crow::response(401, "User Already Exist");
-        } else {
-            if (authManager.signup(username, password)) {
-                return crow::response(201, "User Created Successfully");
-            } else {
-                return crow::response(500, "Internal Server Error");
+        string clientIp = req.remote_ip_address;
+
+        bool queued = authManager.submit([&authManager, &res, username, password, clientIp]() {
+            if (authManager.isUserRegistered(username)) {
+                return reply(res, crow::response(401, "User Already Exist"));
             }
+            authManager.signupAsync(username, password, clientIp, [&res](bool created, exception_ptr error) {
+                if (error) {
+                    return reply(res, failureResponse(error));
+                }
+                if (created) {
+                    reply(res, crow::response(201, "User Created Successfully"));
+                } else {
+                    reply(res, crow::response(500, "Internal Server Error"));
+                }
+            });
+        });
+        if (!queued) {
+            reply(res, crow::response(503, "Server busy, try again later"));
         }
     });
 
-    CROW_ROUTE(app, "/search").methods(crow::HTTPMethod::GET)([&authManager](const crow::request& req) {
+    CROW_ROUTE(app, "/search").methods(crow::HTTPMethod::GET)([&authManager, &offload](const crow::request& req, crow::response& res) {
         auto query = req.url_params.get("q");
         if (!query) {
-            return crow::response(400, "Missing search query parameter 'q'");
+            return reply(res, crow::response(400, "Missing search query parameter 'q'"));
         }
         
         string searchTerm = string(query);
         if (searchTerm.length() < 2) {
-            return crow::response(400, "Search query must be at least 2 characters");
+            return reply(res, crow::response(400, "Search query must be at least 2 characters"));
         }
         
-        try {
-            vector<string> results = authManager.searchUsers(searchTerm);
+        offload(res, [&authManager, searchTerm]() {
+            try {
+                vector<string> results = authManager.searchUsers(searchTerm);
             
-            // Create JSON array response
-            crow::json::wvalue response;
-            response = crow::json::wvalue::list();
+                // Create JSON array response
+                crow::json::wvalue response;
+                response = crow::json::wvalue::list();
             
-            for (size_t i = 0; i < results.size(); ++i) {
-                response[i] = results[i];
-            }
+                for (size_t i = 0; i < results.size(); ++i) {
+                    response[i] = results[i];
+                }
             
-            return crow::response(200, response);
-        } catch (const exception& e) {
-            return crow::response(500, "Search failed: " + string(e.what()));
-        }
+                return crow::response(200, response);
+            } catch (const exception& e) {
+                return crow::response(500, "Search failed: " + string(e.what()));
+            }
+        });
     });
 
     // Store public key endpoint
-    CROW_ROUTE(app, "/store_public_key").methods(crow::HTTPMethod::POST)([&authManager](const crow::request& req) {
+    CROW_ROUTE(app, "/store_public_key").methods(crow::HTTPMethod::POST)([&authManager, &offload](const crow::request& req, crow::response& res) {
         auto json = crow::json::load(req.body);
         if (!json) {
-            return crow::response(400, "Invalid JSON");
+            return reply(res, crow::response(400, "Invalid JSON"));
         }
 
         if (!json.has("username") || !json.has("public_key")) {
-            return crow::response(400, "Missing username or public_key");
+            return reply(res, crow::response(400, "Missing username or public_key"));
         }
 
         string username = json["username"].s();
         string publicKey = json["public_key"].s();
 
-        if (authManager.storePublicKey(username, publicKey)) {
-            return crow::response(200, "Public key stored successfully");
-        } else {
-            return crow::response(500, "Failed to store public key");
-        }
+        offload(res, [&authManager, username, publicKey]() {
+            if (authManager.storePublicKey(username, publicKey)) {
+                return crow::response(200, "Public key stored successfully");
+            } else {
+                return crow::response(500, "Failed to store public key");
+            }
+        });
     });
 
 
-    CROW_ROUTE(app, "/get_public_key").methods(crow::HTTPMethod::POST)([&authManager](const crow::request& req) {
+    CROW_ROUTE(app, "/get_public_key").methods(crow::HTTPMethod::POST)([&authManager, &offload](const crow::request& req, crow::response& res) {
         auto json = crow::json::load(req.body);
         if (!json) {
-            return crow::response(400, "Invalid JSON");
+            return reply(res, crow::response(400, "Invalid JSON"));
         }
 
         if (!json.has("recipient")) {
-            return crow::response(400, "Missing recipient");
+            return reply(res, crow::response(400, "Missing recipient"));
         }
 
         string recipient = json["recipient"].s();
-        string publicKey = authManager.getPublicKey(recipient);
+        string ifNoneMatch = req.get_header_value("If-None-Match");
+
+        offload(res, [&authManager, recipient, ifNoneMatch]() {
+            string publicKey = authManager.getPublicKey(recipient);
+
+            if (!publicKey.empty()) {
+                string etag = "\"" + AuthManager::publicKeyVersion(publicKey) + "\"";
+                crow::response response(ifNoneMatch == etag ? 304 : 200);
+                if (response.code == 200) {
+                    response.body = publicKey;
+                }
+                response.set_header("ETag", etag);
+                return response;
+            } else {
+                return crow::response(404, "Public key not found for user");
+            }
+        });
+    });
+
+    // Body: {"usernames": [...], "known": {"username": "version", ...}}
+    // Keys whose version the client already holds are listed as unchanged
+    // instead of being sent again; If-None-Match on the whole set gives 304.
+    CROW_ROUTE(app, "/get_public_keys").methods(crow::HTTPMethod::POST)([&authManager, &offload](const crow::request& req, crow::response& res) {
+        const size_t MAX_BATCH = 500;
+        auto json = crow::json::load(req.body);
+        if (!json) {
+            return reply(res, crow::response(400, "Invalid JSON"));
+        }
+        if (!json.has("usernames") || json["usernames"].t() != crow::json::type::List) {
+            return reply(res, crow::response(400, "Missing usernames"));
+        }
 
-        if (!publicKey.empty()) {
-            return crow::response(200, publicKey);
-        } else {
-            return crow::response(404, "Public key not found for user");
+        vector<string> usernames;
+        set<string> seen;
+        for (const auto& item : json["usernames"].lo()) {
+            if (item.t() != crow::json::type::String) {
+                return reply(res, crow::response(400, "usernames must be strings"));
+            }
+            string username = item.s();
+            if (seen.insert(username).second) {
+                usernames.push_back(username);
+            }
+        }
+        if (usernames.size() > MAX_BATCH) {
+            return reply(res, crow::response(400, "Too many usernames, at most " + to_string(MAX_BATCH)));
         }
+
+        map<string, string> known;
+        if (json.has("known") && json["known"].t() == crow::json::type::Object) {
+            for (const auto& item : json["known"].lo()) {
+                if (item.t() == crow::json::type::String) {
+                    known[item.key()] = item.s();
+                }
+            }
+        }
+
+        string ifNoneMatch = req.get_header_value("If-None-Match");
+
+        offload(res, [&authManager, usernames, known, ifNoneMatch]() {
+            vector<PublicKeyEntry> entries = authManager.getPublicKeys(usernames);
+            sort(entries.begin(), entries.end(),
+                 [](const PublicKeyEntry& a, const PublicKeyEntry& b) { return a.username < b.username; });
+
+            // The set's ETag covers everything the body depends on: the names
+            // asked for, the key versions found and the versions the client
+            // said it holds, each section closed by an empty field
+            string fingerprint;
+            for (const auto& username : usernames) {
+                fingerprint += username + '\0';
+            }
+            fingerprint += '\0';
+            set<string> found;
+            for (const auto& entry : entries) {
+                fingerprint += entry.username + '\0' + entry.version + '\0';
+                found.insert(entry.username);
+            }
+            fingerprint += '\0';
+            for (const auto& [username, version] : known) {
+                fingerprint += username + '\0' + version + '\0';
+            }
+            string etag = "\"" + AuthManager::publicKeyVersion(fingerprint) + "\"";
+            if (ifNoneMatch == etag) {
+                crow::response not_modified(304);
+                not_modified.set_header("ETag", etag);
+                return not_modified;
+            }
+
+            crow::json::wvalue body;
+            body["keys"] = crow::json::wvalue::object();
+            body["unchanged"] = crow::json::wvalue::list();
+            body["missing"] = crow::json::wvalue::list();
+            size_t unchanged_count = 0;
+            for (const auto& entry : entries) {
+                auto client_version = known.find(entry.username);
+                if (client_version != known.end() && client_version->second == entry.version) {
+                    body["unchanged"][unchanged_count++] = entry.username;
+                } else {
+                    body["keys"][entry.username]["public_key"] = entry.public_key;
+                    body["keys"][entry.username]["version"] = entry.version;
+                }
+            }
+            size_t missing_count = 0;
+            for (const auto& username : usernames) {
+                if (!found.count(username)) {
+                    body["missing"][missing_count++] = username;
+                }
+            }
+
+            crow::response response(200, body);
+            response.set_header("ETag", etag);
+            return response;
+        });
+    });
+
+    // Prometheus scrape endpoint: DB query and hashing latency, queue depths
+    CROW_ROUTE(app, "/metrics").methods(crow::HTTPMethod::GET)([]() {
+        crow::response response(200, MetricsRegistry::instance().render());
+        response.set_header("Content-Type", "text/plain; version=0.0.4");
+        return response;
     });
 
-    CROW_ROUTE(app, "/verify-token").methods(crow::HTTPMethod::POST)([&JWT_SECRET](const crow::request& req) {
+    CROW_ROUTE(app, "/verify-token").methods(crow::HTTPMethod::POST)([&tokenManager](const crow::request& req) {
         string authHeader = req.get_header_value("Authorization");
         if (authHeader.empty()) {
             return crow::response(401, "Missing Authorization header");
@@ -169,58 +412,60 @@ int main() {
             return crow::response(401, "Missing token");
         }
 
-        try {
-            auto decoded = jwt::decode(token);
+        string username;
+        string error;
+        if (!tokenManager.verifyToken(token, username, error)) {
+            return crow::response(401, error);
+        }
 
-            auto verifier = jwt::verify()
-                .allow_algorithm(jwt::algorithm::hs256{JWT_SECRET})
-                .with_type("JWT")
-                .with_issuer("snibble-auth")
-                .leeway(60UL);
+        crow::json::wvalue response;
+        response["valid"] = true;
+        response["username"] = username;
+        response["message"] = "Token is valid";
 
-            verifier.verify(decoded);
+        return crow::response(200, response);
+    });
 
-            auto now = std::chrono::system_clock::now();
-            auto exp = decoded.get_expires_at();
-            if (exp < now) {
-                return crow::response(401, "Token has expired");
-            }
+    // Revokes the bearer token until it expires, on every server sharing Redis
+    CROW_ROUTE(app, "/logout").methods(crow::HTTPMethod::POST)([&tokenManager, &revocationFeed, verbose](const crow::request& req) {
+        string authHeader = req.get_header_value("Authorization");
+        if (authHeader.empty()) {
+            return crow::response(401, "Missing Authorization header");
+        }
 
-            string username;
-            if (decoded.has_payload_claim("username")) {
-                username = decoded.get_payload_claim("username").as_string();
-            } else {
-                return crow::response(401, "Invalid token payload");
-            }
+        const string bearerPrefix = "Bearer ";
+        if (authHeader.find(bearerPrefix) != 0) {
+            return crow::response(401, "Invalid Authorization header format");
+        }
 
-            crow::json::wvalue response;
-            response["valid"] = true;
-            response["username"] = username;
-            response["message"] = "Token is valid";
+        string token = authHeader.substr(bearerPrefix.length());
+        if (token.empty()) {
+            return crow::response(401, "Missing token");
+        }
 
-            return crow::response(200, response);
+        string id;
+        chrono::system_clock::time_point expiresAt;
+        string error;
+        if (!tokenManager.revokeToken(token, id, expiresAt, error)) {
+            return crow::response(401, error);
+        }
 
-        } catch (const jwt::error::signature_verification_exception& e) {
-            return crow::response(401, "Token signature verification failed");
-        } catch (const jwt::error::token_verification_exception& e) {
-            return crow::response(401, "Token verification failed");
-        } catch (const std::exception& e) {
-            return crow::response(401, "Token verification error: " + string(e.what()));
+        if (revocationFeed && !revocationFeed->publish(id, expiresAt) && verbose) {
+            cerr << "[-] Revocation not shared, Redis unavailable" << endl;
         }
-    });
 
-    // Logout endpoint (optional - can be used to invalidate sessions)
-    CROW_ROUTE(app, "/logout").methods(crow::HTTPMethod::POST)([](const crow::request& req) {
-        // In a stateless JWT system, logout is typically handled client-side
-        // by removing the token. However, for better security, you could maintain
-        // a blacklist of tokens or use refresh tokens.
-        
         crow::json::wvalue response;
         response["message"] = "Logout successful";
         return crow::response(200, response);
     });
 
-    app.port(port).multithreaded().bindaddr("127.0.0.1").run();
+    // Handlers hand their blocking work to the I/O and hashing pools and
+    // return, so Crow only needs a thread per core for parsing and replies.
+    unsigned int crow_threads = std::max(1u, std::thread::hardware_concurrency());
+    // Only does anything in SNIBBLE_LOCK_PROFILING builds
+    LockProfiler::instance().startDump(chrono::seconds(envNumber("LOCK_PROFILE_DUMP_SEC", 60)));
+    app.port(port).concurrency(crow_threads).bindaddr("127.0.0.1").run();
+    LockProfiler::instance().stopDump();
 
     return 0;
 }
@@ -1,14 +1,19 @@
 #include "AuthManager.h"
+#include <algorithm>
+#include <memory>
+#include <cctype>
 #include <iostream>
+#include <unordered_map>
 #include <EncryptionManager.h>
+#include "HashExecutor.h"
 #include <jwt-cpp/jwt.h>
 #include <dotenv.h>
 using namespace std;
 
-AuthManager::AuthManager(bool verbose, const string& server, const string& database, const string& username, const string& password)
-    : verbose(verbose) {
+AuthManager::AuthManager(bool verbose, const string& server, const string& database, const string& username, const string& password, const string& backend, size_t user_cache_size)
+    : verbose(verbose), user_cache(user_cache_size) {
     dotenv::init("../.env");
-    db_manager = DatabaseManager::getInstance(server, database, username, password, verbose);
+    db_manager = StorageBackend::getInstance(backend, server, database, username, password, verbose);
     if (!db_manager || !db_manager->isConnected()) {
         cerr << "Failed to connect to database at " << server << endl;
     }
@@ -17,31 +22,130 @@ AuthManager::AuthManager(bool verbose, const string& server, const string& datab
 AuthManager::~AuthManager() {
 }
 
-bool AuthManager::login(const string& username, const string& password) {
-    if (this->verbose) {
-        cout << "Attempting to log in user: " << username << endl;
+void AuthManager::setHashExecutor(HashExecutor* executor) {
+    hash_executor = executor;
+}
+
+void AuthManager::startIoPool(size_t workers, size_t max_queue) {
+    if (db_manager) {
+        db_manager->startIoPool(workers, max_queue);
     }
+}
 
+bool AuthManager::submit(function<void()> work) {
+    if (!db_manager) {
+        work();
+        return true;
+    }
+    return db_manager->submit(move(work));
+}
+
+bool AuthManager::fetchUserRecord(const string& username, UserRecord& record) {
+    if (!db_manager || !db_manager->isConnected()) {
+        throw runtime_error("Database connection is not open.");
+    }
+
+    uint64_t generation = user_cache.generation();
+    vector<string> params = {username};
+    auto result = db_manager->executeParamQuery("SELECT id, password, public_key FROM users WHERE username = ?", params);
+    if (result.empty()) {
+        return false;
+    }
+
+    record.id = result[0][0];
+    record.password_hash = result[0][1];
+    record.public_key = result[0][2];
+    user_cache.put(username, record, generation);
+    return true;
+}
+
+bool AuthManager::loadUsernames(bool filter, size_t filter_min_capacity, bool search_index) {
+    if (!filter && !search_index) {
+        return true;
+    }
     try {
         if (!db_manager || !db_manager->isConnected()) {
             throw runtime_error("Database connection is not open.");
         }
 
-        vector<string> params = {username};
-        auto result = db_manager->executeParamQuery("SELECT password FROM users WHERE username = ?", params);
-
-        if(!result.empty()) {
-            string hashedPassword = result[0][0]; // First row, first column (password)
-            if (EncryptionManager::verifyPassword(password, hashedPassword)) {
-                return true;
+        if (filter) {
+            auto count = db_manager->executeQuery("SELECT COUNT(1) FROM users");
+            size_t user_count = count.empty() ? 0 : stoul(count[0][0]);
+            username_filter.reset(max(filter_min_capacity, user_count * 2));
+        }
+        // One pass over the table feeds both structures
+        db_manager->forEachRow("SELECT username FROM users", {}, [&](const vector<string>& row) {
+            if (filter) {
+                username_filter.add(row[0]);
             }
-            else{
-                return false;
+            if (search_index) {
+                user_search_index.add(row[0]);
             }
+        });
+        if (filter) {
+            username_filter.markLoaded();
+        }
+        if (search_index) {
+            user_search_index.markLoaded();
         }
 
+        if (verbose) {
+            cout << "Loaded " << max(username_filter.size(), user_search_index.size()) << " usernames" << endl;
+        }
+        return true;
+    }
+    catch (const exception& e) {
+        cerr << "loadUsernames error: " << e.what() << endl;
         return false;
     }
+}
+
+bool AuthManager::getUserRecord(const string& username, UserRecord& record) {
+    if (user_cache.get(username, record)) {
+        return true;
+    }
+    if (username_filter.isLoaded() && !username_filter.mightContain(username)) {
+        return false;
+    }
+    try {
+        return fetchUserRecord(username, record);
+    }
+    catch (const exception& e) {
+        cerr << "getUserRecord error: " << e.what() << endl;
+        return false;
+    }
+}
+
+bool AuthManager::databaseAvailable() const {
+    return db_manager && db_manager->isConnected();
+}
+
+bool AuthManager::login(const string& username, const string& password, const string& client_ip) {
+    UserRecord record;
+    if (!getUserRecord(username, record)) {
+        return false;
+    }
+    return login(username, record, password, client_ip);
+}
+
+bool AuthManager::login(const string& username, const UserRecord& record, const string& password, const string& client_ip) {
+    if (this->verbose) {
+        cout << "Attempting to log in user: " << username << endl;
+    }
+
+    try {
+        bool verified = false;
+        auto verify = [&]() { verified = EncryptionManager::verifyPassword(password, record.password_hash); };
+        if (hash_executor) {
+            hash_executor->run(client_ip, username, verify);
+        } else {
+            verify();
+        }
+        return verified;
+    }
+    catch (const HashRejected&) {
+        throw;
+    }
     catch (const exception& e) {
         cerr << "Login error: " << e.what() << endl;
         return false;
@@ -71,22 +175,30 @@ bool AuthManager::logout() {
     }
 }
 
-bool AuthManager::signup(const string& username, const string& password) {
+bool AuthManager::signup(const string& username, const string& password, const string& client_ip) {
     try {
         if (!db_manager || !db_manager->isConnected()) {
             cerr << "Database connection is not open." << endl;
             return false;
         }
 
-        string hashedPassword = EncryptionManager::hashPassword(password);
+        string hashedPassword;
+        auto hash = [&]() { hashedPassword = EncryptionManager::hashPassword(password); };
+        if (hash_executor) {
+            hash_executor->run(client_ip, username, hash);
+        } else {
+            hash();
+        }
 
         if(hashedPassword.empty()) {
             cerr << "Failed to hash password." << endl;
             return false;
         }
 
-        vector<string> params = {username, hashedPassword};
-        return db_manager->executeParamUpdate("INSERT INTO users (username, password) VALUES (?, ?)", params);
+        return createUser(username, hashedPassword);
+    }
+    catch (const HashRejected&) {
+        throw;
     }
     catch (const exception& e) {
         cerr << "Signup error: " << e.what() << endl;
@@ -94,28 +206,91 @@ bool AuthManager::signup(const string& username, const string& password) {
     }
 }
 
-bool AuthManager::isUserRegistered(const string& username) {
-    try {
-        if (!db_manager || !db_manager->isConnected()) {
-            throw runtime_error("Database connection is not open.");
-        }
+bool AuthManager::createUser(const string& username, const string& hashedPassword) {
+    // Added before the insert so there is never a window where the row
+    // exists but the filter says it does not
+    username_filter.add(username);
+    if (username_filter.size() == username_filter.sizeLimit() + 1) {
+        cerr << "Username filter is over its sizing, false positives will rise until restart" << endl;
+    }
 
-        vector<string> params = {username};
-        auto result = db_manager->executeParamQuery("SELECT COUNT(1) FROM users WHERE username = ?", params);
+    vector<string> params = {username, hashedPassword};
+    bool created = db_manager->executeParamUpdate("INSERT INTO users (username, password) VALUES (?, ?)", params);
+    user_cache.invalidate(username);
+    if (created && user_search_index.isLoaded()) {
+        user_search_index.add(username);
+    }
+    return created;
+}
 
-        if (!result.empty() && stoi(result[0][0]) > 0) {
-            return true;
-        }
+void AuthManager::loginAsync(const string& username, const UserRecord& record, const string& password,
+                             const string& client_ip, function<void(bool, exception_ptr)> done) {
+    if (!hash_executor) {
+        done(login(username, record, password, client_ip), nullptr);
+        return;
+    }
 
-        return false;
+    auto verified = make_shared<bool>(false);
+    string password_hash = record.password_hash;
+    try {
+        hash_executor->submit(
+            client_ip, username,
+            [verified, password, password_hash]() { *verified = EncryptionManager::verifyPassword(password, password_hash); },
+            [verified, done](exception_ptr error) { done(!error && *verified, error); });
+    } catch (const HashRejected&) {
+        done(false, current_exception());
     }
-    catch (const exception& e) {
-        cerr << "isUserRegistered error: " << e.what() << endl;
-        return false;
+}
+
+void AuthManager::signupAsync(const string& username, const string& password, const string& client_ip,
+                              function<void(bool, exception_ptr)> done) {
+    if (!hash_executor) {
+        done(signup(username, password, client_ip), nullptr);
+        return;
+    }
+
+    auto hashed = make_shared<string>();
+    try {
+        hash_executor->submit(
+            client_ip, username,
+            [hashed, password]() { *hashed = EncryptionManager::hashPassword(password); },
+            [this, hashed, username, done](exception_ptr error) {
+                if (error || hashed->empty()) {
+                    if (!error) {
+                        cerr << "Failed to hash password." << endl;
+                    }
+                    done(false, error);
+                    return;
+                }
+                // Back to the I/O pool for the INSERT, the hash worker moves on
+                bool queued = submit([this, hashed, username, done]() {
+                    bool created = false;
+                    try {
+                        created = createUser(username, *hashed);
+                    } catch (const exception& e) {
+                        cerr << "Signup error: " << e.what() << endl;
+                    }
+                    done(created, nullptr);
+                });
+                if (!queued) {
+                    done(false, make_exception_ptr(HashRejected(503, "Server busy, try again later")));
+                }
+            });
+    } catch (const HashRejected&) {
+        done(false, current_exception());
     }
 }
 
+bool AuthManager::isUserRegistered(const string& username) {
+    UserRecord record;
+    return getUserRecord(username, record);
+}
+
 vector<string> AuthManager::searchUsers(const string& searchTerm) {
+    if (user_search_index.isLoaded()) {
+        return user_search_index.search(searchTerm, 10);
+    }
+
     vector<string> userList;
     try {
         if (!db_manager || !db_manager->isConnected()) {
@@ -124,7 +299,10 @@ vector<string> AuthManager::searchUsers(const string& searchTerm) {
 
         string searchPattern = "%" + searchTerm + "%";
         vector<string> params = {searchPattern};
-        auto result = db_manager->executeParamQuery("SELECT TOP 10 username FROM users WHERE username LIKE ?", params);
+        string query = db_manager->dialect() == SqlDialect::Sqlite
+            ? "SELECT username FROM users WHERE username LIKE ? LIMIT 10"
+            : "SELECT TOP 10 username FROM users WHERE username LIKE ?";
+        auto result = db_manager->executeParamQuery(query, params);
 
         for (const auto& row : result) {
             userList.push_back(row[0]); // First column (username)
@@ -149,6 +327,7 @@ bool AuthManager::storePublicKey(const string& username, const string& publicKey
 
         vector<string> params = {publicKey, username};
         bool result = db_manager->executeParamUpdate("UPDATE users SET public_key = ? WHERE username = ?", params);
+        user_cache.invalidate(username);
         
         if (verbose && result) {
             cout << "Stored public key for user: " << username << endl;
@@ -163,22 +342,90 @@ bool AuthManager::storePublicKey(const string& username, const string& publicKey
 }
 
 string AuthManager::getPublicKey(const string& username) {
+    UserRecord record;
+    if (getUserRecord(username, record)) {
+        return record.public_key;
+    }
+    return "";
+}
+
+vector<PublicKeyEntry> AuthManager::getPublicKeys(const vector<string>& usernames) {
+    vector<PublicKeyEntry> entries;
+    vector<string> misses;
+    for (const auto& username : usernames) {
+        UserRecord record;
+        if (user_cache.get(username, record)) {
+            if (!record.public_key.empty()) {
+                entries.push_back({username, record.public_key, publicKeyVersion(record.public_key)});
+            }
+            continue;
+        }
+        if (username_filter.isLoaded() && !username_filter.mightContain(username)) {
+            continue;
+        }
+        misses.push_back(username);
+    }
+    if (misses.empty()) {
+        return entries;
+    }
+
+    auto lower = [](string text) {
+        transform(text.begin(), text.end(), text.begin(), [](unsigned char c) { return tolower(c); });
+        return text;
+    };
+
+    // A partial answer would be cached by clients as "these users have no
+    // key", so any failure fails the whole request
     try {
         if (!db_manager || !db_manager->isConnected()) {
-            throw runtime_error("Database connection is not open.");
+            throw DatabaseUnavailable("Database connection is not open.");
         }
 
-        vector<string> params = {username};
-        auto result = db_manager->executeParamQuery("SELECT public_key FROM users WHERE username = ?", params);
+        for (size_t start = 0; start < misses.size(); start += PUBLIC_KEY_BATCH) {
+            size_t end = min(misses.size(), start + PUBLIC_KEY_BATCH);
+            vector<string> params(misses.begin() + start, misses.begin() + end);
 
-        if (!result.empty() && !result[0][0].empty()) {
-            return result[0][0]; // First row, first column (public_key)
-        }
+            // Usernames compare case-insensitively, so rows are matched
+            // back to every requested spelling by their lower-cased name
+            unordered_map<string, vector<string>> requested;
+            string placeholders;
+            for (const auto& username : params) {
+                requested[lower(username)].push_back(username);
+                placeholders += placeholders.empty() ? "?" : ", ?";
+            }
+
+            uint64_t generation = user_cache.generation();
+            auto result = db_manager->executeParamQuery(
+                "SELECT id, username, password, public_key FROM users WHERE username IN (" + placeholders + ")", params);
 
-        return "";
+            for (const auto& row : result) {
+                UserRecord record{row[0], row[2], row[3]};
+                user_cache.put(row[1], record, generation);
+                auto found = requested.find(lower(row[1]));
+                if (found != requested.end() && !record.public_key.empty()) {
+                    string version = publicKeyVersion(record.public_key);
+                    for (const auto& spelling : found->second) {
+                        entries.push_back({spelling, record.public_key, version});
+                    }
+                }
+            }
+        }
+    }
+    catch (const DatabaseUnavailable&) {
+        throw;
     }
     catch (const exception& e) {
-        cerr << "getPublicKey error: " << e.what() << endl;
-        return "";
+        cerr << "getPublicKeys error: " << e.what() << endl;
+        throw DatabaseUnavailable(e.what());
     }
-}
\ No newline at end of file
+    return entries;
+}
+
+string AuthManager::publicKeyVersion(const string& publicKey) {
+    unsigned char digest[crypto_generichash_BYTES_MIN];
+    crypto_generichash(digest, sizeof(digest), reinterpret_cast<const unsigned char*>(publicKey.data()),
+                       publicKey.size(), nullptr, 0);
+    char hex[sizeof(digest) * 2 + 1];
+    sodium_bin2hex(hex, sizeof(hex), digest, sizeof(digest));
+    return string(hex);
+}
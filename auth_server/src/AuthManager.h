@@ -1,23 +1,82 @@
 #ifndef AUTH_MANAGER_H
 #define AUTH_MANAGER_H
 
+#include <exception>
+#include <functional>
 #include <string>
 #include <vector>
-#include "DatabaseManager.h"
+#include "StorageBackend.h"
+#include "UserCache.h"
+#include "UsernameFilter.h"
+#include "UserSearchIndex.h"
+
+class HashExecutor;
+
+struct PublicKeyEntry {
+    std::string username;     // as the caller asked for it
+    std::string public_key;
+    std::string version;      // changes whenever the key changes
+};
 
 class AuthManager {
 private:
-    DatabaseManager* db_manager;
+    StorageBackend* db_manager;
     bool verbose;
+    HashExecutor* hash_executor = nullptr;
+    UserCache user_cache;
+    UsernameFilter username_filter;
+    UserSearchIndex user_search_index;
+
+    static const size_t PUBLIC_KEY_BATCH = 100;
+
+    bool fetchUserRecord(const std::string& username, UserRecord& record);
+    bool createUser(const std::string& username, const std::string& hashedPassword);
 
 public:
-    explicit AuthManager(bool verbose, const std::string& server, const std::string& database, const std::string& username, const std::string& password);
+    explicit AuthManager(bool verbose, const std::string& server, const std::string& database, const std::string& username, const std::string& password, const std::string& backend = "odbc", size_t user_cache_size = 10000);
     ~AuthManager();
 
-    bool login(const std::string& username, const std::string& password);
+    // Password hashing goes through the executor when one is set; its
+    // HashRejected is passed through to the caller.
+    void setHashExecutor(HashExecutor* executor);
+
+    // Starts the storage I/O pool; workers get their own connection where
+    // the backend supports it.
+    void startIoPool(size_t workers, size_t max_queue);
+
+    // Runs work on the storage I/O pool, where the methods below can block
+    // on the database without holding a request thread. False when the
+    // queue is full.
+    bool submit(std::function<void()> work);
+
+    // Streams every username into the Bloom filter (sized for at least
+    // filter_min_capacity names or twice the current count) and/or the
+    // search index in one pass. Until this succeeds lookups and searches
+    // go to the database.
+    bool loadUsernames(bool filter, size_t filter_min_capacity, bool search_index);
+
+    // Looks the user up in the record cache, then the username filter, falling
+    // back to one SELECT of id, password hash and public key. Returns false
+    // if there is no such user.
+    bool getUserRecord(const std::string& username, UserRecord& record);
+
+    // False while the database's circuit breaker is open; cached users can
+    // still log in, everything else should answer 503
+    bool databaseAvailable() const;
+
+    bool login(const std::string& username, const std::string& password, const std::string& client_ip = "");
+    bool login(const std::string& username, const UserRecord& record, const std::string& password, const std::string& client_ip = "");
     bool logout();
 
-    bool signup(const std::string& username, const std::string& password);
+    bool signup(const std::string& username, const std::string& password, const std::string& client_ip = "");
+
+    // Non-blocking login and signup: hashing runs on the hash executor and
+    // the INSERT on the I/O pool, and done receives the result with the
+    // HashRejected (or other failure) as an exception_ptr.
+    void loginAsync(const std::string& username, const UserRecord& record, const std::string& password,
+                    const std::string& client_ip, std::function<void(bool, std::exception_ptr)> done);
+    void signupAsync(const std::string& username, const std::string& password, const std::string& client_ip,
+                     std::function<void(bool, std::exception_ptr)> done);
 
     bool isUserRegistered(const std::string& username);
 
@@ -25,6 +84,15 @@ public:
     
     bool storePublicKey(const std::string& username, const std::string& publicKey);
     std::string getPublicKey(const std::string& username);
+
+    // Resolves many usernames at once: cache hits first, the rest with one
+    // IN query per PUBLIC_KEY_BATCH names. Unknown users and users without a
+    // key are left out; every requested spelling of a name gets its entry.
+    // Throws DatabaseUnavailable rather than returning a partial answer.
+    std::vector<PublicKeyEntry> getPublicKeys(const std::vector<std::string>& usernames);
+
+    // Short content hash of a public key, used as its version tag and ETag.
+    static std::string publicKeyVersion(const std::string& publicKey);
 };
 
 #endif
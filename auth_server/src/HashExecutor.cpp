@@ -0,0 +1,180 @@
+#include "HashExecutor.h"
+#include <algorithm>
+#include <iostream>
+#include <memory>
+using namespace std;
+
+HashExecutor::HashExecutor(size_t memory_budget_bytes, size_t bytes_per_job, size_t max_queue,
+                           chrono::milliseconds max_queue_time, size_t per_ip_limit, size_t per_user_limit)
+    : max_queue(max_queue), max_queue_time(max_queue_time),
+      per_ip_limit(max<size_t>(1, per_ip_limit)), per_user_limit(max<size_t>(1, per_user_limit)),
+      queue_depth(MetricsRegistry::instance().gauge("snibble_auth_hash_queue_depth", "Password hashes waiting for a worker")),
+      queue_wait(MetricsRegistry::instance().histogram("snibble_auth_hash_queue_wait_seconds",
+                                                       "Time a password hash waited for a worker")),
+      hash_time(MetricsRegistry::instance().histogram("snibble_auth_hash_seconds",
+                                                      "Argon2 time per /login or /signup password hash")) {
+    // Every running crypto_pwhash allocates its full memlimit, so the worker
+    // count is what bounds peak hashing memory.
+    size_t worker_count = max<size_t>(1, memory_budget_bytes / max<size_t>(1, bytes_per_job));
+    for (size_t i = 0; i < worker_count; i++) {
+        workers.emplace_back(&HashExecutor::workerLoop, this);
+    }
+}
+
+HashExecutor::~HashExecutor() {
+    {
+        lock_guard<mutex> lock(mutex_);
+        stopping = true;
+    }
+    work_available.notify_all();
+    for (auto& worker : workers) {
+        worker.join();
+    }
+}
+
+size_t HashExecutor::workerCount() const {
+    return workers.size();
+}
+
+size_t HashExecutor::maxQueue() const {
+    return max_queue;
+}
+
+// Called with mutex_ held. Throws HashRejected if the job is not admitted.
+void HashExecutor::enqueue(Job* job) {
+    if (queued >= max_queue) {
+        throw HashRejected(503, "Server busy, try again later");
+    }
+    auto pending = [](const unordered_map<string, size_t>& counts, const string& key) -> size_t {
+        auto found = counts.find(key);
+        return found == counts.end() ? 0 : found->second;
+    };
+    if (pending(pending_by_ip, job->client_ip) >= per_ip_limit ||
+        pending(pending_by_user, job->username) >= per_user_limit) {
+        throw HashRejected(429, "Too many concurrent requests");
+    }
+    pending_by_ip[job->client_ip]++;
+    pending_by_user[job->username]++;
+    queued++;
+    queue_depth.set(static_cast<int64_t>(queued));
+
+    auto& ip_queue = queues_by_ip[job->client_ip];
+    if (ip_queue.empty()) {
+        ip_rotation.push_back(job->client_ip);
+    }
+    job->enqueued_at = chrono::steady_clock::now();
+    ip_queue.push_back(job);
+    work_available.notify_one();
+}
+
+void HashExecutor::run(const string& client_ip, const string& username, function<void()> work) {
+    Job job;
+    job.work = move(work);
+    job.client_ip = client_ip;
+    job.username = username;
+
+    unique_lock<mutex> lock(mutex_);
+    enqueue(&job);
+    job_finished.wait(lock, [&job] { return job.finished; });
+    lock.unlock();
+
+    if (job.expired) {
+        throw HashRejected(503, "Server busy, try again later");
+    }
+    if (job.error) {
+        rethrow_exception(job.error);
+    }
+}
+
+void HashExecutor::submit(const string& client_ip, const string& username, function<void()> work,
+                          function<void(exception_ptr)> done) {
+    auto job = make_unique<Job>();
+    job->work = move(work);
+    job->client_ip = client_ip;
+    job->username = username;
+    job->done = move(done);
+
+    lock_guard<mutex> lock(mutex_);
+    enqueue(job.get());
+    job.release();
+}
+
+// Called with mutex_ held. Takes the head job of the next IP in rotation.
+HashExecutor::Job* HashExecutor::nextJob() {
+    while (!ip_rotation.empty()) {
+        string ip = ip_rotation.front();
+        ip_rotation.pop_front();
+        auto found = queues_by_ip.find(ip);
+        if (found == queues_by_ip.end() || found->second.empty()) {
+            continue;
+        }
+        Job* job = found->second.front();
+        found->second.pop_front();
+        if (found->second.empty()) {
+            queues_by_ip.erase(found);
+        } else {
+            ip_rotation.push_back(ip);
+        }
+        queued--;
+        queue_depth.set(static_cast<int64_t>(queued));
+        return job;
+    }
+    return nullptr;
+}
+
+// Called with mutex_ held.
+void HashExecutor::release(const Job& job) {
+    if (--pending_by_ip[job.client_ip] == 0) {
+        pending_by_ip.erase(job.client_ip);
+    }
+    if (--pending_by_user[job.username] == 0) {
+        pending_by_user.erase(job.username);
+    }
+}
+
+void HashExecutor::workerLoop() {
+    while (true) {
+        unique_lock<mutex> lock(mutex_);
+        work_available.wait(lock, [this] { return stopping || queued > 0; });
+        if (stopping && queued == 0) {
+            return;
+        }
+        Job* job = nextJob();
+        if (!job) {
+            continue;
+        }
+
+        // A caller that already waited too long has likely given up; do not
+        // spend 256 MiB and a core on it.
+        auto waited = chrono::steady_clock::now() - job->enqueued_at;
+        queue_wait.record(waited);
+        if (waited > max_queue_time) {
+            job->expired = true;
+        } else {
+            lock.unlock();
+            try {
+                ScopedTimer timer(hash_time);
+                job->work();
+            } catch (...) {
+                job->error = current_exception();
+            }
+            lock.lock();
+        }
+        release(*job);
+        if (job->done) {
+            unique_ptr<Job> owned(job);
+            exception_ptr error = owned->expired
+                ? make_exception_ptr(HashRejected(503, "Server busy, try again later"))
+                : owned->error;
+            lock.unlock();
+            try {
+                owned->done(error);
+            } catch (const exception& e) {
+                cerr << "Hash completion error: " << e.what() << endl;
+            }
+            continue;
+        }
+        job->finished = true;
+        job_finished.notify_all();
+    }
+}
@@ -0,0 +1,91 @@
+#ifndef HASH_EXECUTOR_H
+#define HASH_EXECUTOR_H
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "Metrics.h"
+
+// Thrown when a password hashing job is not admitted or waited too long.
+class HashRejected : public std::runtime_error {
+    int status;
+
+public:
+    HashRejected(int http_status, const std::string& message)
+        : std::runtime_error(message), status(http_status) {}
+    int httpStatus() const { return status; }
+};
+
+// Runs Argon2 jobs on a fixed pool sized by a memory budget instead of on
+// Crow's request threads. Waiting jobs are queued per client IP and served
+// round robin, so one address cannot monopolize the pool.
+class HashExecutor {
+private:
+    struct Job {
+        std::function<void()> work;
+        std::string client_ip;
+        std::string username;
+        std::chrono::steady_clock::time_point enqueued_at;
+        bool finished = false;
+        bool expired = false;
+        std::exception_ptr error;
+        std::function<void(std::exception_ptr)> done;  // set for submit(), the job owns itself
+    };
+
+    size_t max_queue;
+    std::chrono::milliseconds max_queue_time;
+    size_t per_ip_limit;
+    size_t per_user_limit;
+
+    std::mutex mutex_;
+    std::condition_variable work_available;
+    std::condition_variable job_finished;
+    std::unordered_map<std::string, std::deque<Job*>> queues_by_ip;
+    std::deque<std::string> ip_rotation;
+    std::unordered_map<std::string, size_t> pending_by_ip;
+    std::unordered_map<std::string, size_t> pending_by_user;
+    size_t queued = 0;
+    bool stopping = false;
+    std::vector<std::thread> workers;
+    Gauge& queue_depth;
+    Histogram& queue_wait;
+    Histogram& hash_time;
+
+    void workerLoop();
+    void enqueue(Job* job);
+    Job* nextJob();
+    void release(const Job& job);
+
+public:
+    HashExecutor(size_t memory_budget_bytes, size_t bytes_per_job, size_t max_queue,
+                 std::chrono::milliseconds max_queue_time, size_t per_ip_limit, size_t per_user_limit);
+    ~HashExecutor();
+
+    // Runs work on the pool and blocks until it has finished. Throws
+    // HashRejected with 503 when the queue is full or the job waited longer
+    // than max_queue_time, and 429 when the IP or username already has its
+    // share of jobs pending. Exceptions from work are rethrown.
+    void run(const std::string& client_ip, const std::string& username, std::function<void()> work);
+
+    // Same admission as run() (HashRejected is thrown here), but returns at
+    // once; done is called on the worker with the job's exception, or with
+    // HashRejected(503) if it expired in the queue, or with nullptr.
+    void submit(const std::string& client_ip, const std::string& username, std::function<void()> work,
+                std::function<void(std::exception_ptr)> done);
+
+    size_t workerCount() const;
+    size_t maxQueue() const;
+
+    HashExecutor(const HashExecutor&) = delete;
+    HashExecutor& operator=(const HashExecutor&) = delete;
+};
+
+#endif
@@ -0,0 +1,61 @@
+#include "UserCache.h"
+#include <algorithm>
+#include <cctype>
+using namespace std;
+
+UserCache::UserCache(size_t capacity) : capacity(max<size_t>(1, capacity)) {
+}
+
+string UserCache::keyFor(const string& username) {
+    string key = username;
+    transform(key.begin(), key.end(), key.begin(), [](unsigned char c) { return tolower(c); });
+    return key;
+}
+
+bool UserCache::get(const string& username, UserRecord& record) {
+    string key = keyFor(username);
+    lock_guard<mutex> lock(mutex_);
+    auto found = index.find(key);
+    if (found == index.end()) {
+        return false;
+    }
+    lru.splice(lru.begin(), lru, found->second);
+    record = found->second->second;
+    return true;
+}
+
+uint64_t UserCache::generation() {
+    lock_guard<mutex> lock(mutex_);
+    return invalidations;
+}
+
+void UserCache::put(const string& username, const UserRecord& record, uint64_t generation) {
+    string key = keyFor(username);
+    lock_guard<mutex> lock(mutex_);
+    if (generation != invalidations) {
+        return;
+    }
+    auto found = index.find(key);
+    if (found != index.end()) {
+        found->second->second = record;
+        lru.splice(lru.begin(), lru, found->second);
+        return;
+    }
+    lru.emplace_front(key, record);
+    index[key] = lru.begin();
+    if (index.size() > capacity) {
+        index.erase(lru.back().first);
+        lru.pop_back();
+    }
+}
+
+void UserCache::invalidate(const string& username) {
+    string key = keyFor(username);
+    lock_guard<mutex> lock(mutex_);
+    invalidations++;
+    auto found = index.find(key);
+    if (found != index.end()) {
+        lru.erase(found->second);
+        index.erase(found);
+    }
+}
@@ -0,0 +1,46 @@
+#ifndef USER_CACHE_H
+#define USER_CACHE_H
+
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+struct UserRecord {
+    std::string id;
+    std::string password_hash;
+    std::string public_key;
+};
+
+// Bounded LRU of username -> user record. Keys are lower-cased because the
+// users table compares usernames case-insensitively.
+class UserCache {
+private:
+    using Entry = std::pair<std::string, UserRecord>;
+
+    size_t capacity;
+    std::list<Entry> lru;
+    std::unordered_map<std::string, std::list<Entry>::iterator> index;
+    std::mutex mutex_;
+    uint64_t invalidations = 0;
+
+    static std::string keyFor(const std::string& username);
+
+public:
+    explicit UserCache(size_t capacity = 10000);
+
+    bool get(const std::string& username, UserRecord& record);
+
+    // Take a generation before reading the database and pass it to put; the
+    // record is dropped if any invalidation happened in between, so a slow
+    // read cannot overwrite a newer update.
+    uint64_t generation();
+    void put(const std::string& username, const UserRecord& record, uint64_t generation);
+    void invalidate(const std::string& username);
+
+    UserCache(const UserCache&) = delete;
+    UserCache& operator=(const UserCache&) = delete;
+};
+
+#endif
@@ -0,0 +1,210 @@
+#include "UserSearchIndex.h"
+#include <algorithm>
+#include <cctype>
+#include <mutex>
+#include <tuple>
+using namespace std;
+
+namespace {
+
+uint32_t trigramAt(string_view text, size_t i) {
+    return (static_cast<uint32_t>(static_cast<unsigned char>(text[i])) << 16) |
+           (static_cast<uint32_t>(static_cast<unsigned char>(text[i + 1])) << 8) |
+           static_cast<uint32_t>(static_cast<unsigned char>(text[i + 2]));
+}
+
+uint32_t bigramAt(string_view text, size_t i) {
+    return (static_cast<uint32_t>(static_cast<unsigned char>(text[i])) << 8) |
+           static_cast<uint32_t>(static_cast<unsigned char>(text[i + 1]));
+}
+
+// Ids are handed out in increasing order, so appending keeps a posting list
+// sorted; a name repeating a gram only needs it once.
+void addPosting(vector<uint32_t>& postings, uint32_t id) {
+    if (postings.empty() || postings.back() != id) {
+        postings.push_back(id);
+    }
+}
+
+string lowerCase(const string& text) {
+    string result = text;
+    transform(result.begin(), result.end(), result.begin(), [](unsigned char c) { return tolower(c); });
+    return result;
+}
+
+}
+
+UserSearchIndex::UserSearchIndex(size_t max_candidates) : max_candidates(max<size_t>(1, max_candidates)) {
+    offsets.push_back(0);
+}
+
+string_view UserSearchIndex::loweredName(uint32_t id) const {
+    return string_view(lowered).substr(offsets[id], offsets[id + 1] - offsets[id]);
+}
+
+string UserSearchIndex::nameOf(uint32_t id) const {
+    return names.substr(offsets[id], offsets[id + 1] - offsets[id]);
+}
+
+vector<uint32_t>::const_iterator UserSearchIndex::firstNotBefore(string_view key) const {
+    return lower_bound(sorted_ids.begin(), sorted_ids.end(), key,
+                       [this](uint32_t id, string_view value) { return loweredName(id) < value; });
+}
+
+void UserSearchIndex::add(const string& username) {
+    string key = lowerCase(username);
+    unique_lock<shared_mutex> lock(mutex_);
+    uint32_t id = static_cast<uint32_t>(offsets.size() - 1);
+    if (loaded.load(memory_order_relaxed)) {
+        auto position = firstNotBefore(key);
+        if (position != sorted_ids.end() && loweredName(*position) == key) {
+            return;
+        }
+        // A memmove of the tail, well under a millisecond at 1M users
+        sorted_ids.insert(position, id);
+    } else {
+        // While loading, names come from the unique users table and are
+        // sorted once in markLoaded
+        sorted_ids.push_back(id);
+    }
+    names += username;
+    lowered += key;
+    offsets.push_back(static_cast<uint32_t>(lowered.size()));
+
+    for (size_t i = 0; i + 3 <= key.size(); i++) {
+        addPosting(trigrams[trigramAt(key, i)], id);
+    }
+    for (size_t i = 0; i + 2 <= key.size(); i++) {
+        addPosting(bigrams[bigramAt(key, i)], id);
+    }
+}
+
+// Names holding every gram of key, checked for the actual substring. Every
+// match is ranked; a bounded max-heap keeps the keep best, worst on top.
+void UserSearchIndex::collectSubstringMatches(const string& key, size_t keep, vector<Match>& best) const {
+    // Posting lists of every gram of the term, rarest first
+    vector<const vector<uint32_t>*> lists;
+    if (key.size() == 2) {
+        auto found = bigrams.find(bigramAt(key, 0));
+        if (found == bigrams.end()) {
+            return;
+        }
+        lists.push_back(&found->second);
+    } else {
+        for (size_t i = 0; i + 3 <= key.size(); i++) {
+            auto found = trigrams.find(trigramAt(key, i));
+            if (found == trigrams.end()) {
+                return;
+            }
+            lists.push_back(&found->second);
+        }
+        sort(lists.begin(), lists.end(), [](const vector<uint32_t>* a, const vector<uint32_t>* b) {
+            return a->size() < b->size();
+        });
+        lists.erase(unique(lists.begin(), lists.end()), lists.end());
+    }
+
+    // Leapfrog join: every cursor gallops to the largest id seen so far until
+    // all of them agree, so long lists are skipped through, not walked.
+    vector<vector<uint32_t>::const_iterator> cursors;
+    for (const auto* list : lists) {
+        cursors.push_back(list->begin());
+    }
+    auto seek = [](vector<uint32_t>::const_iterator& cursor, vector<uint32_t>::const_iterator end, uint32_t target) {
+        size_t step = 1;
+        while (end - cursor > static_cast<ptrdiff_t>(step) && cursor[step] < target) {
+            cursor += step;
+            step *= 2;
+        }
+        cursor = lower_bound(cursor, end - cursor > static_cast<ptrdiff_t>(step) ? cursor + step + 1 : end, target);
+    };
+
+    while (cursors[0] != lists[0]->end()) {
+        uint32_t candidate = *cursors[0];
+        bool agreed = true;
+        for (size_t l = 1; l < lists.size(); l++) {
+            seek(cursors[l], lists[l]->end(), candidate);
+            if (cursors[l] == lists[l]->end()) {
+                return;
+            }
+            if (*cursors[l] != candidate) {
+                seek(cursors[0], lists[0]->end(), *cursors[l]);
+                agreed = false;
+                break;
+            }
+        }
+        if (!agreed) {
+            continue;
+        }
+        string_view name = loweredName(candidate);
+        size_t position = name.find(key);
+        // Position 0 was returned as a prefix match
+        if (position != string_view::npos && position > 0) {
+            Match match(position, name.size(), candidate);
+            if (best.size() < keep) {
+                best.push_back(match);
+                push_heap(best.begin(), best.end());
+            } else if (match < best.front()) {
+                pop_heap(best.begin(), best.end());
+                best.back() = match;
+                push_heap(best.begin(), best.end());
+            }
+        }
+        ++cursors[0];
+    }
+}
+
+vector<string> UserSearchIndex::search(const string& term, size_t limit) const {
+    vector<string> results;
+    string key = lowerCase(term);
+    if (key.size() < 2 || limit == 0) {
+        return results;
+    }
+
+    shared_lock<shared_mutex> lock(mutex_);
+
+    // Prefix matches, the exact name sorts first among them
+    for (auto it = firstNotBefore(key);
+         it != sorted_ids.end() && results.size() < limit && loweredName(*it).substr(0, key.size()) == key; ++it) {
+        results.push_back(nameOf(*it));
+    }
+    if (results.size() >= limit) {
+        return results;
+    }
+
+    vector<Match> matches;
+    collectSubstringMatches(key, min(limit - results.size(), max_candidates), matches);
+    sort_heap(matches.begin(), matches.end());
+    for (const auto& match : matches) {
+        results.push_back(nameOf(get<2>(match)));
+    }
+    return results;
+}
+
+void UserSearchIndex::markLoaded() {
+    {
+        unique_lock<shared_mutex> lock(mutex_);
+        sort(sorted_ids.begin(), sorted_ids.end(),
+             [this](uint32_t a, uint32_t b) { return loweredName(a) < loweredName(b); });
+        names.shrink_to_fit();
+        lowered.shrink_to_fit();
+        offsets.shrink_to_fit();
+        sorted_ids.shrink_to_fit();
+        for (auto& entry : trigrams) {
+            entry.second.shrink_to_fit();
+        }
+        for (auto& entry : bigrams) {
+            entry.second.shrink_to_fit();
+        }
+    }
+    loaded.store(true, memory_order_release);
+}
+
+bool UserSearchIndex::isLoaded() const {
+    return loaded.load(memory_order_acquire);
+}
+
+size_t UserSearchIndex::size() const {
+    shared_lock<shared_mutex> lock(mutex_);
+    return offsets.size() - 1;
+}
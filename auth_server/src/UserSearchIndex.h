@@ -0,0 +1,60 @@
+#ifndef USER_SEARCH_INDEX_H
+#define USER_SEARCH_INDEX_H
+
+#include <atomic>
+#include <cstdint>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+
+// In-memory username search for /search. Ids sorted by name answer prefix
+// queries and n-gram postings (trigrams, plus bigrams for two character
+// terms) narrow substring queries to a few candidates, so a keystroke
+// never scans the users table.
+class UserSearchIndex {
+private:
+    // Names live back to back in two arenas, as registered and lower-cased,
+    // so 1M users cost a few tens of MiB and a scan stays cache friendly.
+    std::string names;
+    std::string lowered;
+    std::vector<uint32_t> offsets;        // id -> start in both arenas, plus end sentinel
+    std::vector<uint32_t> sorted_ids;     // ids ordered by lower-cased name
+    std::unordered_map<uint32_t, std::vector<uint32_t>> trigrams;
+    std::unordered_map<uint32_t, std::vector<uint32_t>> bigrams;
+    size_t max_candidates;
+    mutable std::shared_mutex mutex_;
+    std::atomic<bool> loaded{false};
+
+    std::string_view loweredName(uint32_t id) const;
+    std::string nameOf(uint32_t id) const;
+    std::vector<uint32_t>::const_iterator firstNotBefore(std::string_view key) const;
+    using Match = std::tuple<size_t, size_t, uint32_t>;  // position, length, id
+    void collectSubstringMatches(const std::string& key, size_t keep, std::vector<Match>& best) const;
+
+public:
+    // max_candidates bounds how many of the best substring matches are kept
+    // while all of them are ranked.
+    explicit UserSearchIndex(size_t max_candidates = 64);
+
+    // Adding a name already present (in any case) does nothing once loaded.
+    void add(const std::string& username);
+
+    // Up to limit usernames containing term, case-insensitively. Ranked as
+    // exact match, then prefix matches in name order, then other matches
+    // by how early the term occurs and then by length.
+    std::vector<std::string> search(const std::string& term, size_t limit) const;
+
+    // Until the whole table has been added, callers fall back to SQL.
+    // Sorts the names added while loading and trims spare capacity.
+    void markLoaded();
+    bool isLoaded() const;
+    size_t size() const;
+
+    UserSearchIndex(const UserSearchIndex&) = delete;
+    UserSearchIndex& operator=(const UserSearchIndex&) = delete;
+};
+
+#endif
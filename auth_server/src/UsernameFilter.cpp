@@ -0,0 +1,78 @@
+#include "UsernameFilter.h"
+#include <algorithm>
+#include <cctype>
+using namespace std;
+
+// FNV-1a over the lower-cased name, since the users table compares
+// usernames case-insensitively, then a splitmix64 finalizer to spread the bits.
+uint64_t UsernameFilter::hashName(const string& username) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (unsigned char c : username) {
+        hash ^= static_cast<uint64_t>(tolower(c));
+        hash *= 1099511628211ULL;
+    }
+    hash ^= hash >> 30;
+    hash *= 0xbf58476d1ce4e5b9ULL;
+    hash ^= hash >> 27;
+    hash *= 0x94d049bb133111ebULL;
+    hash ^= hash >> 31;
+    return hash;
+}
+
+void UsernameFilter::reset(size_t expected_items, size_t bits_per_item) {
+    capacity = max<size_t>(1, expected_items);
+    block_count = max<size_t>(1, (capacity * max<size_t>(1, bits_per_item) + BLOCK_BITS - 1) / BLOCK_BITS);
+    blocks.reset(new Block[block_count]());
+    items.store(0, memory_order_relaxed);
+    loaded.store(false, memory_order_release);
+}
+
+void UsernameFilter::add(const string& username) {
+    if (!blocks) {
+        return;
+    }
+    uint64_t hash = hashName(username);
+    Block& block = blocks[hash % block_count];
+    uint64_t probe = hash * 0x9e3779b97f4a7c15ULL;
+    uint32_t h1 = static_cast<uint32_t>(probe);
+    uint32_t h2 = static_cast<uint32_t>(probe >> 32) | 1;
+    for (int i = 0; i < PROBES; i++) {
+        uint32_t bit = (h1 + i * h2) % BLOCK_BITS;
+        block.words[bit / 64].fetch_or(1ULL << (bit % 64), memory_order_relaxed);
+    }
+    items.fetch_add(1, memory_order_relaxed);
+}
+
+bool UsernameFilter::mightContain(const string& username) const {
+    if (!blocks) {
+        return true;
+    }
+    uint64_t hash = hashName(username);
+    const Block& block = blocks[hash % block_count];
+    uint64_t probe = hash * 0x9e3779b97f4a7c15ULL;
+    uint32_t h1 = static_cast<uint32_t>(probe);
+    uint32_t h2 = static_cast<uint32_t>(probe >> 32) | 1;
+    for (int i = 0; i < PROBES; i++) {
+        uint32_t bit = (h1 + i * h2) % BLOCK_BITS;
+        if (!(block.words[bit / 64].load(memory_order_relaxed) & (1ULL << (bit % 64)))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void UsernameFilter::markLoaded() {
+    loaded.store(true, memory_order_release);
+}
+
+bool UsernameFilter::isLoaded() const {
+    return loaded.load(memory_order_acquire);
+}
+
+size_t UsernameFilter::size() const {
+    return items.load(memory_order_relaxed);
+}
+
+size_t UsernameFilter::sizeLimit() const {
+    return capacity;
+}
@@ -0,0 +1,52 @@
+#ifndef USERNAME_FILTER_H
+#define USERNAME_FILTER_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+// Blocked Bloom filter of every registered username. All probes for a name
+// land in one 64 byte block, so a lookup touches a single cache line.
+// A negative answer is definite; a positive one still has to be checked
+// against the database. Names are only ever added, never removed.
+class UsernameFilter {
+private:
+    static constexpr size_t BLOCK_BITS = 512;
+    static constexpr int PROBES = 8;
+
+    struct alignas(64) Block {
+        std::atomic<uint64_t> words[BLOCK_BITS / 64];
+    };
+
+    std::unique_ptr<Block[]> blocks;
+    size_t block_count = 0;
+    size_t capacity = 0;
+    std::atomic<size_t> items{0};
+    std::atomic<bool> loaded{false};
+
+    static uint64_t hashName(const std::string& username);
+
+public:
+    UsernameFilter() = default;
+
+    // Sizes the filter for expected_items names and clears it. Not safe to
+    // call while other threads use the filter, so only before serving.
+    void reset(size_t expected_items, size_t bits_per_item = 12);
+
+    void add(const std::string& username);
+    bool mightContain(const std::string& username) const;
+
+    // Until the full table has been streamed in, a miss proves nothing.
+    void markLoaded();
+    bool isLoaded() const;
+
+    size_t size() const;
+    size_t sizeLimit() const;
+
+    UsernameFilter(const UsernameFilter&) = delete;
+    UsernameFilter& operator=(const UsernameFilter&) = delete;
+};
+
+#endif
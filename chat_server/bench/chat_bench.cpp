@@ -0,0 +1,372 @@
+// Load generator and end-to-end latency benchmark for the chat protocol.
+//
+// Opens N clients that speak the plain handshake (first frame is the user
+// name) and send "sender:recipient:content" frames at a fixed rate. The
+// forwarded "sender: content" frames are timed on arrival. Sender and
+// receiver live in this process, so one monotonic clock timestamps both ends.
+//
+// Run the server with STORAGE_BACKEND=none to measure it without a database,
+// and raise the RATE_LIMIT_* settings above the offered load. With
+// --server-pid it also reports the server RSS and its CPU time and context
+// switches per delivered message.
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sstream>
+#include <string>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+using namespace std;
+
+struct BenchConfig {
+    string host = "127.0.0.1";
+    int port = 8080;
+    int clients = 100;
+    double rate = 5.0;          // messages per second per sending client
+    int duration_sec = 10;
+    int warmup_sec = 2;
+    string topology = "pairs";  // pairs, hot, groups
+    int group_size = 8;
+    int payload = 64;
+    int sender_threads = 4;
+    int server_pid = 0;
+};
+
+struct BenchClient {
+    int fd = -1;
+    string name;
+    vector<int> peers;
+    size_t next_peer = 0;
+    string pending;
+};
+
+static uint64_t nowNanos() {
+    return chrono::duration_cast<chrono::nanoseconds>(
+        chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void usage(const char* argv0) {
+    cerr << "Usage: " << argv0 << " [--host H] [--port P] [--clients N] [--rate MSGS_PER_SEC]\n"
+         << "       [--duration SEC] [--warmup SEC] [--topology pairs|hot|groups] [--group-size G]\n"
+         << "       [--payload BYTES] [--sender-threads T] [--server-pid PID]" << endl;
+}
+
+static bool parseArgs(int argc, char** argv, BenchConfig& config) {
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (i + 1 >= argc) {
+            usage(argv[0]);
+            return false;
+        }
+        string value = argv[++i];
+        try {
+            if (arg == "--host") config.host = value;
+            else if (arg == "--port") config.port = stoi(value);
+            else if (arg == "--clients") config.clients = stoi(value);
+            else if (arg == "--rate") config.rate = stod(value);
+            else if (arg == "--duration") config.duration_sec = stoi(value);
+            else if (arg == "--warmup") config.warmup_sec = stoi(value);
+            else if (arg == "--topology") config.topology = value;
+            else if (arg == "--group-size") config.group_size = stoi(value);
+            else if (arg == "--payload") config.payload = stoi(value);
+            else if (arg == "--sender-threads") config.sender_threads = stoi(value);
+            else if (arg == "--server-pid") config.server_pid = stoi(value);
+            else {
+                usage(argv[0]);
+                return false;
+            }
+        } catch (const exception& e) {
+            cerr << "Invalid value for " << arg << ": " << value << endl;
+            return false;
+        }
+    }
+    if (config.clients < 2 || config.rate <= 0 || config.sender_threads < 1 || config.group_size < 2) {
+        cerr << "Need at least 2 clients, a positive rate, one sender thread and groups of 2 or more" << endl;
+        return false;
+    }
+    return config.topology == "pairs" || config.topology == "hot" || config.topology == "groups";
+}
+
+static long readRssKb(int pid) {
+    if (pid <= 0) {
+        return -1;
+    }
+    ifstream status("/proc/" + to_string(pid) + "/status");
+    string line;
+    while (getline(status, line)) {
+        if (line.rfind("VmRSS:", 0) == 0) {
+            return strtol(line.c_str() + 6, nullptr, 10);
+        }
+    }
+    return -1;
+}
+
+// CPU time of the whole server and context switches summed over its
+// threads, sampled around the measured window to compare IO_ENGINE settings
+struct ServerUsage {
+    double cpu_sec = -1;
+    unsigned long long context_switches = 0;
+};
+
+static ServerUsage readServerUsage(int pid) {
+    ServerUsage usage;
+    if (pid <= 0) {
+        return usage;
+    }
+    string proc = "/proc/" + to_string(pid);
+    ifstream stat(proc + "/stat");
+    string line;
+    if (!getline(stat, line) || line.rfind(')') == string::npos) {
+        return usage;
+    }
+    // utime and stime are fields 14 and 15, the name in parentheses may hold spaces
+    istringstream fields(line.substr(line.rfind(')') + 2));
+    string field;
+    unsigned long long utime = 0, stime = 0;
+    for (int i = 3; i <= 15 && fields >> field; i++) {
+        if (i == 14) utime = stoull(field);
+        if (i == 15) stime = stoull(field);
+    }
+    usage.cpu_sec = static_cast<double>(utime + stime) / sysconf(_SC_CLK_TCK);
+    DIR* tasks = opendir((proc + "/task").c_str());
+    if (!tasks) {
+        return usage;
+    }
+    while (dirent* entry = readdir(tasks)) {
+        if (entry->d_name[0] == '.') continue;
+        ifstream status(proc + "/task/" + entry->d_name + "/status");
+        while (getline(status, line)) {
+            if (line.rfind("voluntary_ctxt_switches:", 0) == 0 || line.rfind("nonvoluntary_ctxt_switches:", 0) == 0) {
+                usage.context_switches += strtoull(line.c_str() + line.find(':') + 1, nullptr, 10);
+            }
+        }
+    }
+    closedir(tasks);
+    return usage;
+}
+
+static void assignPeers(vector<BenchClient>& clients, const BenchConfig& config) {
+    int n = static_cast<int>(clients.size());
+    for (int i = 0; i < n; i++) {
+        if (config.topology == "pairs") {
+            int peer = (i % 2 == 0) ? i + 1 : i - 1;
+            clients[i].peers.push_back(peer < n ? peer : 0);
+        } else if (config.topology == "hot") {
+            // Everyone writes to client 0, client 0 answers round robin
+            if (i == 0) {
+                for (int j = 1; j < n; j++) clients[i].peers.push_back(j);
+            } else {
+                clients[i].peers.push_back(0);
+            }
+        } else {
+            int group_start = (i / config.group_size) * config.group_size;
+            int group_end = min(n, group_start + config.group_size);
+            for (int j = group_start; j < group_end; j++) {
+                if (j != i) clients[i].peers.push_back(j);
+            }
+            if (clients[i].peers.empty()) clients[i].peers.push_back(i == 0 ? 1 : 0);
+        }
+    }
+}
+
+static int connectClient(const BenchConfig& config, const string& name) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(config.port);
+    addr.sin_addr.s_addr = inet_addr(config.host.c_str());
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (send(fd, name.c_str(), name.length(), MSG_NOSIGNAL) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int main(int argc, char** argv) {
+    BenchConfig config;
+    if (!parseArgs(argc, argv, config)) {
+        return 1;
+    }
+
+    string run_id = to_string(getpid());
+    vector<BenchClient> clients(config.clients);
+    for (int i = 0; i < config.clients; i++) {
+        clients[i].name = "bench" + run_id + "_" + to_string(i);
+        clients[i].fd = connectClient(config, clients[i].name);
+        if (clients[i].fd < 0) {
+            cerr << "Failed to connect client " << i << ": " << strerror(errno) << endl;
+            return 1;
+        }
+        // The server reads the name with a single recv, keep it a frame of its own
+        usleep(2000);
+    }
+    assignPeers(clients, config);
+    long rss_before = readRssKb(config.server_pid);
+    sleep(1);
+
+    atomic<bool> running{true};
+    // Only frames stamped inside [window_start, window_end) are measured
+    atomic<uint64_t> window_start{UINT64_MAX}, window_end{UINT64_MAX};
+    atomic<uint64_t> sent{0}, send_errors{0}, rate_limited{0}, busy{0}, stored_offline{0};
+    vector<uint64_t> latencies_ns;
+    mutex latencies_mutex;
+
+    thread receiver([&]() {
+        int epfd = epoll_create1(0);
+        for (int i = 0; i < config.clients; i++) {
+            struct epoll_event ev;
+            ev.events = EPOLLIN;
+            ev.data.u32 = static_cast<uint32_t>(i);
+            epoll_ctl(epfd, EPOLL_CTL_ADD, clients[i].fd, &ev);
+        }
+        vector<uint64_t> local;
+        struct epoll_event events[256];
+        char buffer[65536];
+        while (running) {
+            int ready = epoll_wait(epfd, events, 256, 100);
+            for (int e = 0; e < ready; e++) {
+                BenchClient& client = clients[events[e].data.u32];
+                ssize_t n = recv(client.fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+                if (n <= 0) continue;
+                uint64_t arrived = nowNanos();
+                client.pending.append(buffer, n);
+                size_t line_end;
+                while ((line_end = client.pending.find('\n')) != string::npos) {
+                    string line = client.pending.substr(0, line_end);
+                    client.pending.erase(0, line_end + 1);
+                    size_t marker = line.find("BENCH|");
+                    if (marker != string::npos) {
+                        uint64_t sent_at = strtoull(line.c_str() + marker + 6, nullptr, 10);
+                        if (sent_at >= window_start && sent_at < window_end && arrived >= sent_at) {
+                            local.push_back(arrived - sent_at);
+                        }
+                    } else if (line.rfind("ERROR:RATE_LIMITED", 0) == 0) {
+                        rate_limited++;
+                    } else if (line.rfind("ERROR:SERVER_BUSY", 0) == 0) {
+                        busy++;
+                    } else if (line.rfind("Server: Message stored", 0) == 0) {
+                        stored_offline++;
+                    } else if (line == "PING") {
+                        send(client.fd, "PONG\n", 5, MSG_NOSIGNAL);
+                    }
+                }
+            }
+        }
+        close(epfd);
+        lock_guard<mutex> lock(latencies_mutex);
+        latencies_ns.swap(local);
+    });
+
+    string padding(max(0, config.payload), 'x');
+    uint64_t interval_ns = static_cast<uint64_t>(1e9 / config.rate);
+    vector<thread> senders;
+    for (int t = 0; t < config.sender_threads; t++) {
+        senders.emplace_back([&, t]() {
+            vector<int> mine;
+            for (int i = t; i < config.clients; i += config.sender_threads) mine.push_back(i);
+            if (mine.empty()) return;
+            // Open loop: each client has its own schedule, offset so the
+            // whole population does not fire in the same instant.
+            vector<uint64_t> next_send(mine.size());
+            uint64_t start = nowNanos();
+            for (size_t k = 0; k < mine.size(); k++) {
+                next_send[k] = start + (interval_ns * k) / mine.size();
+            }
+            while (running) {
+                uint64_t now = nowNanos();
+                uint64_t earliest = UINT64_MAX;
+                for (size_t k = 0; k < mine.size(); k++) {
+                    if (next_send[k] <= now) {
+                        BenchClient& client = clients[mine[k]];
+                        const BenchClient& peer = clients[client.peers[client.next_peer++ % client.peers.size()]];
+                        uint64_t stamp = nowNanos();
+                        string frame = client.name + ":" + peer.name + ":BENCH|" + to_string(stamp) + "|" + padding + "\n";
+                        if (send(client.fd, frame.c_str(), frame.length(), MSG_NOSIGNAL) < 0) {
+                            send_errors++;
+                        } else if (stamp >= window_start && stamp < window_end) {
+                            sent++;
+                        }
+                        next_send[k] += interval_ns;
+                    }
+                    earliest = min(earliest, next_send[k]);
+                }
+                now = nowNanos();
+                if (earliest > now) {
+                    this_thread::sleep_for(chrono::nanoseconds(min<uint64_t>(earliest - now, 1000000)));
+                }
+            }
+        });
+    }
+
+    this_thread::sleep_for(chrono::seconds(config.warmup_sec));
+    uint64_t measure_start = nowNanos();
+    window_start = measure_start;
+    ServerUsage usage_before = readServerUsage(config.server_pid);
+    this_thread::sleep_for(chrono::seconds(config.duration_sec));
+    uint64_t measure_end = nowNanos();
+    window_end = measure_end;
+    ServerUsage usage_after = readServerUsage(config.server_pid);
+    // Let in-flight frames land before stopping the receiver
+    this_thread::sleep_for(chrono::milliseconds(500));
+    running = false;
+    for (auto& sender : senders) sender.join();
+    receiver.join();
+    long rss_after = readRssKb(config.server_pid);
+    for (auto& client : clients) close(client.fd);
+
+    double seconds = (measure_end - measure_start) / 1e9;
+    sort(latencies_ns.begin(), latencies_ns.end());
+    auto percentile = [&](double p) -> double {
+        if (latencies_ns.empty()) return 0.0;
+        size_t idx = min(latencies_ns.size() - 1, static_cast<size_t>(p * latencies_ns.size()));
+        return latencies_ns[idx] / 1000.0;
+    };
+
+    printf("topology=%s clients=%d rate=%.1f/s/client duration=%ds payload=%dB\n",
+           config.topology.c_str(), config.clients, config.rate, config.duration_sec, config.payload);
+    printf("sent=%llu delivered=%zu send_errors=%llu rate_limited=%llu server_busy=%llu stored_offline=%llu\n",
+           (unsigned long long)sent.load(), latencies_ns.size(), (unsigned long long)send_errors.load(),
+           (unsigned long long)rate_limited.load(), (unsigned long long)busy.load(),
+           (unsigned long long)stored_offline.load());
+    printf("throughput: sent %.0f msg/s, delivered %.0f msg/s\n", sent.load() / seconds, latencies_ns.size() / seconds);
+    printf("forward latency (us): p50=%.1f p99=%.1f p999=%.1f max=%.1f\n",
+           percentile(0.50), percentile(0.99), percentile(0.999), percentile(1.0));
+    if (rss_before >= 0 && rss_after >= 0) {
+        printf("server rss: before=%ld KiB after=%ld KiB\n", rss_before, rss_after);
+    }
+    if (usage_before.cpu_sec >= 0 && usage_after.cpu_sec >= 0 && !latencies_ns.empty()) {
+        // Threads that exited during the window drop out of the switch count
+        double delivered = static_cast<double>(latencies_ns.size());
+        unsigned long long switches = usage_after.context_switches > usage_before.context_switches
+            ? usage_after.context_switches - usage_before.context_switches : 0;
+        printf("server cpu: %.2fs, %.1f us/msg, %.2f context switches/msg\n",
+               usage_after.cpu_sec - usage_before.cpu_sec,
+               (usage_after.cpu_sec - usage_before.cpu_sec) * 1e6 / delivered,
+               static_cast<double>(switches) / delivered);
+    }
+    return 0;
+}
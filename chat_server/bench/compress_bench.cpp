@@ -0,0 +1,222 @@
+// Compression ratio and CPU cost of MessageCompressor on chat messages.
+//
+// Trains a zstd dictionary on the first 80% of the samples and measures the
+// rest, once without a dictionary and once with it:
+//   message - one body at a time, what COMPRESS_STORED does per insert; the
+//             stored ratio includes base64 and keeping bodies that do not
+//             shrink as they are
+//   batch   - --batch history lines at a time, what a COMPRESSED frame holds
+//
+// Samples are one message per line from --samples, or synthetic chat text.
+// --write-dict keeps the trained dictionary for COMPRESSION_DICT.
+
+#include "MessageCompressor.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <string>
+#include <unistd.h>
+#include <vector>
+#include <zdict.h>
+using namespace std;
+
+struct BenchConfig {
+    string samples;
+    size_t messages = 20000;
+    size_t dict_size = 16384;
+    int level = 3;
+    size_t batch = 50;
+    string write_dict;
+};
+
+static void usage(const char* argv0) {
+    cerr << "Usage: " << argv0 << " [--samples FILE] [--messages N] [--dict-size BYTES] [--level L]\n"
+         << "       [--batch LINES] [--write-dict PATH]" << endl;
+}
+
+static bool parseArgs(int argc, char** argv, BenchConfig& config) {
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (i + 1 >= argc) {
+            usage(argv[0]);
+            return false;
+        }
+        string value = argv[++i];
+        try {
+            if (arg == "--samples") config.samples = value;
+            else if (arg == "--messages") config.messages = stoul(value);
+            else if (arg == "--dict-size") config.dict_size = stoul(value);
+            else if (arg == "--level") config.level = stoi(value);
+            else if (arg == "--batch") config.batch = stoul(value);
+            else if (arg == "--write-dict") config.write_dict = value;
+            else {
+                usage(argv[0]);
+                return false;
+            }
+        } catch (const exception&) {
+            usage(argv[0]);
+            return false;
+        }
+    }
+    return config.messages > 0 && config.batch > 0;
+}
+
+// Short messages from a small vocabulary with recurring phrases, roughly
+// what a dictionary learns from real traffic
+static vector<string> syntheticMessages(size_t count) {
+    static const vector<string> openers = {"hey", "hi", "ok", "sure", "lol", "yeah", "no worries", "thanks",
+                                           "good morning", "did you see", "can you send", "are you coming to"};
+    static const vector<string> words = {"the", "meeting", "tomorrow", "at", "link", "file", "project", "call",
+                                         "later", "tonight", "dinner", "deploy", "build", "is", "broken", "again",
+                                         "review", "my", "PR", "please", "weekend", "plans", "train", "late",
+                                         "coffee", "office", "update", "status", "release", "notes", "ticket"};
+    static const vector<string> closers = {"?", "!", " :)", " thanks!", " see you then", " let me know", ""};
+    mt19937 rng(42);
+    vector<string> messages;
+    messages.reserve(count);
+    for (size_t i = 0; i < count; i++) {
+        string message = openers[rng() % openers.size()];
+        size_t length = 3 + rng() % 20;
+        for (size_t w = 0; w < length; w++) {
+            message += " " + words[rng() % words.size()];
+        }
+        if (rng() % 8 == 0) {
+            message += " https://snibble.example/share/" + to_string(rng() % 100000);
+        }
+        message += closers[rng() % closers.size()];
+        messages.push_back(move(message));
+    }
+    return messages;
+}
+
+static double nanosSince(chrono::steady_clock::time_point start) {
+    return chrono::duration<double, nano>(chrono::steady_clock::now() - start).count();
+}
+
+static void measure(const string& label, const MessageCompressor& compressor, const vector<string>& inputs) {
+    size_t raw_bytes = 0;
+    size_t frame_bytes = 0;
+    size_t stored_bytes = 0;
+    vector<string> frames(inputs.size());
+    auto start = chrono::steady_clock::now();
+    for (size_t i = 0; i < inputs.size(); i++) {
+        if (!compressor.compress(inputs[i], frames[i])) {
+            frames[i].clear();
+        }
+    }
+    double compress_ns = nanosSince(start) / inputs.size();
+    start = chrono::steady_clock::now();
+    size_t failed = 0;
+    for (size_t i = 0; i < inputs.size(); i++) {
+        if (!frames[i].empty() && compressor.decompress(frames[i]) != inputs[i]) {
+            failed++;
+        }
+    }
+    double decompress_ns = nanosSince(start) / inputs.size();
+    for (size_t i = 0; i < inputs.size(); i++) {
+        raw_bytes += inputs[i].size();
+        frame_bytes += frames[i].empty() ? inputs[i].size() : frames[i].size();
+        string stored;
+        compressor.encodeBody(inputs[i], stored);
+        stored_bytes += stored.size();
+    }
+    printf("%-22s ratio %.2f, stored ratio %.2f, %.0f ns compress, %.0f ns decompress per item",
+           label.c_str(), static_cast<double>(raw_bytes) / frame_bytes,
+           static_cast<double>(raw_bytes) / stored_bytes, compress_ns, decompress_ns);
+    if (failed) {
+        printf(", %zu FAILED", failed);
+    }
+    printf("\n");
+}
+
+int main(int argc, char** argv) {
+    BenchConfig config;
+    if (!parseArgs(argc, argv, config)) {
+        return 1;
+    }
+
+    vector<string> messages;
+    if (!config.samples.empty()) {
+        ifstream file(config.samples);
+        string line;
+        while (getline(file, line) && messages.size() < config.messages) {
+            if (!line.empty()) {
+                messages.push_back(line);
+            }
+        }
+    } else {
+        messages = syntheticMessages(config.messages);
+    }
+    if (messages.size() < 100) {
+        cerr << "Need at least 100 sample messages" << endl;
+        return 1;
+    }
+    size_t split = messages.size() * 8 / 10;
+    vector<string> training(messages.begin(), messages.begin() + split);
+    vector<string> testing(messages.begin() + split, messages.end());
+
+    // The trainer takes the samples back to back with their sizes
+    string concatenated;
+    vector<size_t> sizes;
+    for (const auto& message : training) {
+        concatenated += message;
+        sizes.push_back(message.size());
+    }
+    string dictionary(config.dict_size, '\0');
+    size_t trained = ZDICT_trainFromBuffer(dictionary.data(), dictionary.size(), concatenated.data(), sizes.data(),
+                                           static_cast<unsigned>(sizes.size()));
+    if (ZDICT_isError(trained)) {
+        cerr << "Dictionary training failed: " << ZDICT_getErrorName(trained) << endl;
+        return 1;
+    }
+    dictionary.resize(trained);
+
+    string dict_path = config.write_dict;
+    if (dict_path.empty()) {
+        char temp[] = "/tmp/compress_bench_XXXXXX";
+        int fd = mkstemp(temp);
+        if (fd < 0) {
+            cerr << "Could not create a temporary dictionary file" << endl;
+            return 1;
+        }
+        close(fd);
+        dict_path = temp;
+    }
+    ofstream(dict_path, ios::binary).write(dictionary.data(), dictionary.size());
+
+    vector<string> batches;
+    for (size_t i = 0; i < testing.size(); i += config.batch) {
+        string batch;
+        for (size_t j = i; j < min(i + config.batch, testing.size()); j++) {
+            batch += "CHAT_HISTORY_MSG:alice:bob:" + testing[j] + ":2026-01-01 12:00:00.000:true\n";
+        }
+        batches.push_back(move(batch));
+    }
+
+    size_t raw_bytes = 0;
+    for (const auto& message : testing) {
+        raw_bytes += message.size();
+    }
+    cout << training.size() << " training and " << testing.size() << " test messages, " << raw_bytes / testing.size()
+         << " bytes average, " << trained << " byte dictionary, level " << config.level << endl;
+
+    MessageCompressor plain;
+    plain.configure("", config.level, true, 0);
+    MessageCompressor trained_compressor;
+    trained_compressor.configure(dict_path, config.level, true, 0);
+
+    measure("message, no dictionary", plain, testing);
+    measure("message, dictionary", trained_compressor, testing);
+    measure("batch, no dictionary", plain, batches);
+    measure("batch, dictionary", trained_compressor, batches);
+
+    if (config.write_dict.empty()) {
+        remove(dict_path.c_str());
+    } else {
+        cout << "Dictionary written to " << dict_path << " (id " << trained_compressor.dictionaryId() << ")" << endl;
+    }
+    return 0;
+}
@@ -1,21 +1,49 @@
 #include "src/SocketServer.h"
+#include "src/ListenerHandoff.h"
+#include "src/MetricsListener.h"
+#include "Logger.h"
+#include "ProfiledMutex.h"
+#include "Tracer.h"
+#include <algorithm>
+#include <chrono>
 #include <iostream>
+#include <limits>
+#include <stdexcept>
+#include <type_traits>
 #include <signal.h>
 #include <unistd.h>
 #include <dotenv.h>
 using namespace std;
 
-SocketServer* server = nullptr;
-bool g_verbose = false;
-
-void signalHandler(int signum) {
-    if (g_verbose) {
-        std::cout << "\n[+] Interrupt signal (" << signum << ") received.\n";
+// Each numeric setting is parsed on its own, an invalid one is reported and
+// keeps its default without affecting the others
+template <typename T>
+static T envNumber(const char* name, T fallback) {
+    string value = dotenv::getenv(name, "");
+    if (value.empty()) {
+        return fallback;
     }
-    if (server) {
-        server->stop();
+    try {
+        size_t used = 0;
+        T parsed;
+        if constexpr (is_floating_point_v<T>) {
+            parsed = static_cast<T>(stod(value, &used));
+        } else {
+            long long number = stoll(value, &used);
+            if (number < static_cast<long long>(numeric_limits<T>::min()) ||
+                (number > 0 && static_cast<unsigned long long>(number) > numeric_limits<T>::max())) {
+                throw out_of_range(name);
+            }
+            parsed = static_cast<T>(number);
+        }
+        if (used != value.size()) {
+            throw invalid_argument(name);
+        }
+        return parsed;
+    } catch (const std::exception&) {
+        cerr << "Invalid " << name << " value: " << value << ", using default " << fallback << endl;
+        return fallback;
     }
-    exit(signum);
 }
 
 int main() {
@@ -23,8 +51,8 @@ int main() {
     string host = dotenv::getenv("SOCKET_HOST", "127.0.0.1");
     string port_str = dotenv::getenv("SOCKET_PORT", "8080");
     bool verbose = dotenv::getenv("VERBOSE", "false") == "true";
-    g_verbose = verbose;
     cout << "the verbose is " << verbose << endl;
+    Logger::instance().setLevel(verbose ? LogLevel::Debug : LogLevel::Info);
     int port = 8081;
     try {
         port = stoi(port_str);
@@ -36,26 +64,155 @@ int main() {
     string DATABASE = dotenv::getenv("AZURE_SQL_DATABASE", "snibble_db");
     string USERNAME = dotenv::getenv("AZURE_SQL_USERNAME", "sa");
     string PASSWORD = dotenv::getenv("AZURE_SQL_PASSWORD", "your_password_here");
-    signal(SIGINT, signalHandler);
-    signal(SIGTERM, signalHandler);
+    double conn_rate = 20.0, conn_burst = 40.0, user_rate = 30.0, user_burst = 60.0;
+    int max_stores_in_flight = 256;
+    int idle_timeout_sec = 60, pong_timeout_sec = 15;
+    int drain_timeout_sec = 30, reconnect_window_ms = 10000;
+    string drain_redirect = dotenv::getenv("DRAIN_REDIRECT", "");
+    string handoff_socket = dotenv::getenv("HANDOFF_SOCKET", "");
+    string storage_backend = dotenv::getenv("STORAGE_BACKEND", "odbc");
+    // Same secret as the auth server, so its tokens verify here without a round trip
+    string jwt_secret = dotenv::getenv("JWT_SECRET", "");
+    bool require_auth = dotenv::getenv("REQUIRE_AUTH", "false") == "true";
+    size_t token_cache_size = 100000;
+    // Prometheus scrape endpoint, 0 turns it off
+    string metrics_host = dotenv::getenv("METRICS_HOST", "127.0.0.1");
+    int metrics_port = 9100;
+    int lock_profile_dump_sec = 60;
+    // One message in TRACE_SAMPLE_EVERY gets spans, SIGUSR1 writes them to TRACE_FILE
+    int trace_sample_every = 1000;
+    size_t trace_ring_spans = 16384;
+    string trace_file = dotenv::getenv("TRACE_FILE", "snibble_trace.json");
+    // Messages are made durable here before the database, empty turns it off
+    string journal_dir = dotenv::getenv("JOURNAL_DIR", "snibble_journal");
+    size_t journal_segment_mb = 64;
+    size_t journal_max_segments = 64;
+    // Delivered messages older than ARCHIVE_AFTER_DAYS move to messages_archive, 0 keeps everything hot
+    int archive_after_days = 30;
+    size_t archive_batch = 1000;
+    int archive_interval_sec = 60;
+    // zstd dictionaries (':' separated, newest first) for stored bodies and COMPRESSED batches
+    string compression_dict = dotenv::getenv("COMPRESSION_DICT", "");
+    bool compress_stored = dotenv::getenv("COMPRESS_STORED", "false") == "true";
+    int compression_level = 3;
+    size_t compress_min_bytes = 64;
+    // threads (one per client), epoll or io_uring; IO_WORKERS run the frames for the event loop
+    string io_engine = dotenv::getenv("IO_ENGINE", "threads");
+    size_t io_workers = 8;
+    // Database pool for the engines' handlers, as in the auth server
+    size_t db_io_workers = 8;
+    size_t db_io_max_queue = 1024;
+    if (storage_backend == "sqlite") {
+        DATABASE = dotenv::getenv("SQLITE_PATH", "snibble_chat.db");
+    }
+    conn_rate = envNumber("RATE_LIMIT_CONN_PER_SEC", conn_rate);
+    conn_burst = envNumber("RATE_LIMIT_CONN_BURST", conn_burst);
+    user_rate = envNumber("RATE_LIMIT_USER_PER_SEC", user_rate);
+    user_burst = envNumber("RATE_LIMIT_USER_BURST", user_burst);
+    max_stores_in_flight = envNumber("MAX_STORES_IN_FLIGHT", max_stores_in_flight);
+    idle_timeout_sec = envNumber("IDLE_TIMEOUT_SEC", idle_timeout_sec);
+    pong_timeout_sec = envNumber("PONG_TIMEOUT_SEC", pong_timeout_sec);
+    drain_timeout_sec = envNumber("DRAIN_TIMEOUT_SEC", drain_timeout_sec);
+    reconnect_window_ms = envNumber("RECONNECT_WINDOW_MS", reconnect_window_ms);
+    token_cache_size = envNumber("TOKEN_CACHE_SIZE", token_cache_size);
+    metrics_port = envNumber("METRICS_PORT", metrics_port);
+    lock_profile_dump_sec = envNumber("LOCK_PROFILE_DUMP_SEC", lock_profile_dump_sec);
+    trace_sample_every = envNumber("TRACE_SAMPLE_EVERY", trace_sample_every);
+    trace_ring_spans = envNumber("TRACE_RING_SPANS", trace_ring_spans);
+    journal_segment_mb = envNumber("JOURNAL_SEGMENT_MB", journal_segment_mb);
+    journal_max_segments = envNumber("JOURNAL_MAX_SEGMENTS", journal_max_segments);
+    archive_after_days = envNumber("ARCHIVE_AFTER_DAYS", archive_after_days);
+    archive_batch = envNumber("ARCHIVE_BATCH", archive_batch);
+    archive_interval_sec = envNumber("ARCHIVE_INTERVAL_SEC", archive_interval_sec);
+    compression_level = envNumber("COMPRESSION_LEVEL", compression_level);
+    compress_min_bytes = envNumber("COMPRESS_MIN_BYTES", compress_min_bytes);
+    io_workers = envNumber("IO_WORKERS", io_workers);
+    db_io_workers = envNumber("DB_IO_WORKERS", db_io_workers);
+    db_io_max_queue = envNumber("DB_IO_MAX_QUEUE", db_io_max_queue);
+
+    if (require_auth && jwt_secret.empty()) {
+        cerr << "REQUIRE_AUTH is set but JWT_SECRET is empty" << endl;
+        return 1;
+    }
+    Tracer::instance().configure(static_cast<uint32_t>(max(trace_sample_every, 0)), trace_ring_spans);
+
+    // Signals are taken synchronously by sigwait below instead of doing the
+    // shutdown work inside a signal handler. The mask is set before any
+    // thread is created so every thread inherits it.
+    sigset_t shutdown_signals;
+    sigemptyset(&shutdown_signals);
+    sigaddset(&shutdown_signals, SIGINT);
+    sigaddset(&shutdown_signals, SIGTERM);
+    sigaddset(&shutdown_signals, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &shutdown_signals, nullptr);
+    signal(SIGPIPE, SIG_IGN);
     
+    SocketServer* server = nullptr;
+    ListenerHandoff handoff(verbose);
+    MetricsListener metrics;
     try {
         if (verbose) {
             cout << host << ":" << port << endl;
         }
         server = new SocketServer(host, port, SERVER, DATABASE, USERNAME, PASSWORD);
+        server->configureAdmission(conn_rate, conn_burst, user_rate, user_burst, max_stores_in_flight);
+        server->configureHeartbeat(idle_timeout_sec, pong_timeout_sec);
+        server->configureStorage(storage_backend);
+        server->configureAuth(jwt_secret, require_auth, token_cache_size);
+        server->configureJournal(journal_dir, journal_segment_mb << 20, journal_max_segments);
+        server->configureArchive(archive_after_days, archive_batch, archive_interval_sec);
+        server->configureCompression(compression_dict, compression_level, compress_stored, compress_min_bytes);
+        server->configureIoEngine(io_engine, io_workers, db_io_workers, db_io_max_queue);
+
+        if (!handoff_socket.empty()) {
+            int inherited_fd = ListenerHandoff::receiveListener(handoff_socket);
+            if (inherited_fd >= 0) {
+                server->adoptListener(inherited_fd);
+            }
+        }
         
         if (verbose) {
             cout << "[+] Starting Cryptalk Chat Server...\n";
         }
         server->start();
+        if (metrics_port > 0 && !metrics.start(metrics_host, metrics_port)) {
+            cerr << "[-] Metrics listener could not bind " << metrics_host << ":" << metrics_port << endl;
+        }
+        // Only does anything in SNIBBLE_LOCK_PROFILING builds
+        LockProfiler::instance().startDump(chrono::seconds(lock_profile_dump_sec));
+        if (!handoff_socket.empty() && !handoff.serve(handoff_socket, server->listenerFd())) {
+            // The next process would not find us and open its own listener
+            cerr << "[-] Listener handoff could not serve " << handoff_socket << endl;
+        }
         
-        while (true) {
-            sleep(1);
+        int signum = 0;
+        sigwait(&shutdown_signals, &signum);
+        // SIGUSR1 exports the trace ring and keeps serving
+        while (signum == SIGUSR1) {
+            if (Tracer::instance().writeChromeTrace(trace_file)) {
+                cout << "[+] Trace written to " << trace_file << endl;
+            } else {
+                cerr << "[-] Could not write trace to " << trace_file << endl;
+            }
+            sigwait(&shutdown_signals, &signum);
         }
+        if (verbose) {
+            cout << "\n[+] Signal (" << signum << ") received.\n";
+        }
+        // SIGTERM (deploys, listener handed to a new process) drains; SIGINT
+        // stops immediately.
+        if (signum == SIGTERM) {
+            server->drain(drain_timeout_sec, reconnect_window_ms, drain_redirect);
+        }
+        handoff.stop();
+        metrics.stop();
+        LockProfiler::instance().stopDump();
+        server->stop();
+        delete server;
         
     } catch (const std::exception& e) {
         cerr << "[-] Error: " << e.what() << endl;
+        delete server;
         return 1;
     }
     
@@ -1,6 +1,11 @@
 #include "ClientHandler.h"
 #include "SocketServer.h"
 #include "MessageHandler.h"
+#include "TokenManager.h"
+#include "Logger.h"
+#include "Metrics.h"
+#include <poll.h>
+#include <sys/time.h>
 using namespace std;
 
 
@@ -10,7 +15,10 @@ struct ThreadArgs {
     int client_fd;
 };
 
-ClientHandler::ClientHandler(SocketServer* server) : server_ref(server) {
+ClientHandler::ClientHandler(SocketServer* server)
+    : server_ref(server),
+      accepted(MetricsRegistry::instance().counter("snibble_chat_connections_accepted_total",
+                                                   "Client connections accepted")) {
     connectToRedis();
 }
 
@@ -29,58 +37,253 @@ ClientHandler::~ClientHandler() {
 void ClientHandler::clientConnectionHandler() {
     
     socklen_t addr_len = sizeof(server_ref->client_addr);
-    while(server_ref->running) {
+    while(server_ref->running && server_ref->accepting) {
+        struct pollfd fds[2] = {
+            {server_ref->server_fd, POLLIN, 0},
+            {server_ref->accept_wake_pipe[0], POLLIN, 0}
+        };
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (fds[1].revents != 0 || !server_ref->accepting) break;
+        if (!(fds[0].revents & POLLIN)) continue;
         int client_fd = accept(server_ref->server_fd, (struct sockaddr*)& server_ref->client_addr, &addr_len);
         if(client_fd < 0) {
             if(!server_ref->running) break;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) continue;
             if (debugMode) {
-                cerr << "[-] Error accepting client connection: " << strerror(errno) << endl;
+                LOG_WARN("Error accepting client connection: {}", strerror(errno));
             }
             continue;
         }
-        char client_name[100];
-        int bytes_receiver = recv(client_fd, client_name, sizeof(client_name) - 1, 0);
-        if (bytes_receiver <= 0) {
-            if (debugMode) {
-                cerr << "[-] Error receiving client name: " << strerror(errno) << endl;
-            }
-            close(client_fd);
-            continue;
-        }
-        client_name[bytes_receiver] = '\0';
-        pthread_mutex_lock(&server_ref->mutex);
-        string name(client_name);
-        server_ref->client_fds.push_back(client_fd);
-        server_ref->client_map[name] = client_fd;
-        server_ref->client_names[client_fd] = name;
-        
-        MessageHandler* offlineMessageHandler = new MessageHandler(server_ref, this);
-        offlineMessageHandler->deliverOfflineMessagesToUser(name, client_fd);
-        delete offlineMessageHandler;
-        
+        accepted.add();
+        // The handshake is read on the client's own thread, a client that
+        // connects and says nothing must not hold up the accepts behind it
         pthread_t thread_id;
         ThreadArgs* args = new ThreadArgs{server_ref, this, client_fd};
-        pthread_create(&thread_id, nullptr, [](void* arg)->void* {
+        {
+            lock_guard<mutex> lock(threads_mutex);
+            live_threads++;
+        }
+        int created = pthread_create(&thread_id, nullptr, [](void* arg)->void* {
             ThreadArgs* args = static_cast<ThreadArgs*>(arg);
-            MessageHandler* msgHandler = new MessageHandler(args->server, args->client_handler);
-            msgHandler->storeAndForwardMessage(args->client_fd);
-            delete msgHandler;
+            ClientHandler* client_handler = args->client_handler;
+            client_handler->serveClient(args->client_fd);
             delete args;
+            // Last use of the server, it may be freed right after
+            client_handler->receiveThreadExited();
             return nullptr;
         }, args);
+        if (created != 0) {
+            LOG_ERROR("Could not start receive thread fd={}: {}", client_fd, strerror(created));
+            delete args;
+            receiveThreadExited();
+            close(client_fd);
+            continue;
+        }
         pthread_detach(thread_id);
-        server_ref->client_threads[client_fd] = thread_id;
-        publisher = (redisReply*)redisCommand(redis_context, "PUBLISH %s %s", name.c_str(), "joined");
-        if (publisher) {
-            freeReplyObject(publisher);
-            publisher = nullptr;
+    }
+}
+
+void ClientHandler::serveClient(int client_fd) {
+    string handshake;
+    if (!readHandshake(client_fd, handshake)) {
+        if (debugMode) {
+            LOG_WARN("Error receiving client name: {}", strerror(errno));
         }
-        pthread_mutex_unlock(&server_ref->mutex);
+        close(client_fd);
+        return;
+    }
+    bool registered = registerConnection(client_fd, handshake, [this](int fd) {
+        server_ref->client_threads[fd] = pthread_self();
+    });
+    if (!registered) {
+        close(client_fd);
+        return;
+    }
+    MessageHandler* msgHandler = new MessageHandler(server_ref, this);
+    msgHandler->storeAndForwardMessage(client_fd);
+    delete msgHandler;
+}
+
+void ClientHandler::receiveThreadExited() {
+    lock_guard<mutex> lock(threads_mutex);
+    if (--live_threads == 0) {
+        threads_exited.notify_all();
     }
 }
 
-void ClientHandler::clientDisconnectHandler(const int client_fd) {
-    pthread_mutex_lock(&server_ref->mutex);
+void ClientHandler::waitForReceiveThreads() {
+    unique_lock<mutex> lock(threads_mutex);
+    threads_exited.wait(lock, [this] { return live_threads == 0; });
+}
+
+void ClientHandler::countAccepted() {
+    accepted.add();
+}
+
+bool ClientHandler::registerConnection(int client_fd, const string& handshake, const function<void(int)>& start) {
+    string name;
+    bool authenticated = false;
+    bool compress = false;
+    if (!authenticate(client_fd, handshake, name, authenticated, compress)) {
+        static Counter& rejected = MetricsRegistry::instance().counter(
+            "snibble_chat_handshakes_rejected_total", "Handshakes refused for a bad or missing token");
+        rejected.add();
+        return false;
+    }
+    // Outside the server mutex, a miss reads chat_users. With the
+    // database down it stays 0 and the name is resolved when stored.
+    int32_t user_id = 0;
+    try {
+        user_id = server_ref->user_directory.resolve(name);
+    } catch (const exception& e) {
+        LOG_SAMPLED(LogLevel::Warn, 1, "Could not resolve user id at handshake user={}: {}", name, e.what());
+    }
+    LOCK_TAG("registerClient");
+    server_ref->mutex.lock(LOCK_SITE());
+    if (!server_ref->accepting) {
+        // Draining or stopping finished a handshake: the clients were already
+        // told to reconnect or shut down, this one would be missed
+        server_ref->mutex.unlock();
+        return false;
+    }
+    auto bound = server_ref->client_map.find(name);
+    if (!authenticated && bound != server_ref->client_map.end() && server_ref->authenticated_fds.count(bound->second)) {
+        // A bare name never takes over a name a verified token holds
+        server_ref->mutex.unlock();
+        const string error_msg = "ERROR:AUTH_REQUIRED\n";
+        server_ref->sendFrame(client_fd, error_msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+        return false;
+    }
+    server_ref->client_fds.push_back(client_fd);
+    if (authenticated) {
+        server_ref->authenticated_fds.insert(client_fd);
+    }
+    if (compress) {
+        server_ref->compressed_fds.insert(client_fd);
+    }
+    server_ref->client_map[name] = client_fd;
+    server_ref->client_names[client_fd] = name;
+    server_ref->client_ids[client_fd] = user_id;
+    server_ref->idle_reaper.track(client_fd);
+    server_ref->active_sessions.add();
+    if (start) {
+        start(client_fd);
+    }
+    server_ref->mutex.unlock();
+
+    // Outside the server mutex: delivery waits for pending stores and the
+    // journal replay, then the database. Forwarding goes on meanwhile, a
+    // message forwarded from here on is sent live and may arrive before the
+    // offline batch. The fd stays ours: only this connection's own receive
+    // thread or engine session closes it, after this returns.
+    MessageHandler* offlineMessageHandler = new MessageHandler(server_ref, this);
+    offlineMessageHandler->deliverOfflineMessagesToUser(name, client_fd, compress);
+    delete offlineMessageHandler;
+
+    publishPresence(name, "joined");
+    return true;
+}
+
+void ClientHandler::publishPresence(const string& name, const char* status) {
+    lock_guard<mutex> lock(redis_mutex);
+    if (!redis_context) {
+        return;
+    }
+    ScopedTimer timer(server_ref->redis_publish_time);
+    publisher = (redisReply*)redisCommand(redis_context, "PUBLISH %s %s", name.c_str(), status);
+    if (publisher) {
+        freeReplyObject(publisher);
+        publisher = nullptr;
+    }
+}
+
+// The first frame is either a bare username (legacy) or "AUTH:<token>\n".
+// A token is longer than one small read may return, so an AUTH frame is
+// read up to its newline, giving up after a short wait. A client that
+// sends nothing is given up on after the same wait.
+bool ClientHandler::readHandshake(int client_fd, string& frame) {
+    char buffer[2048];
+    struct timeval timeout = {HANDSHAKE_TIMEOUT_MS / 1000, 0};
+    setsockopt(client_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    int bytes_received = recv(client_fd, buffer, sizeof(buffer) - 1, 0);
+    // The receive loop after the handshake blocks without a timeout
+    timeout = {0, 0};
+    setsockopt(client_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    if (bytes_received <= 0) {
+        return false;
+    }
+    frame.assign(buffer, bytes_received);
+    while (frame.rfind("AUTH:", 0) == 0 && frame.find('\n') == string::npos && frame.size() < sizeof(buffer)) {
+        struct pollfd pfd = {client_fd, POLLIN, 0};
+        if (poll(&pfd, 1, HANDSHAKE_TIMEOUT_MS) <= 0) {
+            break;
+        }
+        bytes_received = recv(client_fd, buffer, sizeof(buffer) - frame.size(), 0);
+        if (bytes_received <= 0) {
+            return false;
+        }
+        frame.append(buffer, bytes_received);
+    }
+    return true;
+}
+
+// Resolves the connection's identity. With an AUTH frame the name comes
+// from the verified token and the connection is marked authenticated;
+// a bare name is only accepted while REQUIRE_AUTH is off. An AUTH frame
+// may ask for compressed batches after the token: "AUTH:<token> COMPRESS:zstd",
+// so the offline messages sent right after the handshake are compressed too.
+bool ClientHandler::authenticate(int client_fd, const string& frame, string& name, bool& authenticated,
+                                 bool& compress) {
+    authenticated = false;
+    compress = false;
+    if (frame.rfind("AUTH:", 0) != 0) {
+        if (server_ref->require_auth) {
+            const string error_msg = "ERROR:AUTH_REQUIRED\n";
+            server_ref->sendFrame(client_fd, error_msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+            return false;
+        }
+        name = frame;
+        return true;
+    }
+
+    if (!server_ref->token_manager) {
+        const string error_msg = "ERROR:AUTH_UNAVAILABLE\n";
+        server_ref->sendFrame(client_fd, error_msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+        return false;
+    }
+    string token = frame.substr(5);
+    token.erase(token.find_last_not_of(" \n\r\t") + 1);
+    bool compress_requested = false;
+    size_t options = token.find(' ');
+    if (options != string::npos) {
+        compress_requested = token.find("COMPRESS:zstd", options) != string::npos;
+        token.erase(options);
+    }
+    string error;
+    if (!server_ref->token_manager->verifyToken(token, name, error)) {
+        // Format: ERROR:AUTH_FAILED:reason
+        string error_msg = "ERROR:AUTH_FAILED:" + error + "\n";
+        server_ref->sendFrame(client_fd, error_msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (debugMode) {
+            LOG_WARN("Rejected handshake: {}", error);
+        }
+        return false;
+    }
+    authenticated = true;
+    compress = compress_requested && MessageCompressor::available();
+    string ok_msg = "AUTH_OK:" + name + "\n";
+    if (compress_requested) {
+        ok_msg += MessageHandler::compressionReply(server_ref->compressor, compress);
+    }
+    server_ref->sendFrame(client_fd, ok_msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+    return true;
+}
+
+void ClientHandler::clientDisconnectHandler(const int client_fd, bool close_socket) {
+    server_ref->mutex.lock(LOCK_SITE());
     
     auto it = find(server_ref->client_fds.begin(), server_ref->client_fds.end(), client_fd);
     if (it != server_ref->client_fds.end()) {
@@ -89,21 +292,22 @@ void ClientHandler::clientDisconnectHandler(const int client_fd) {
         string name = server_ref->client_names[client_fd];
         server_ref->client_map.erase(name);
         server_ref->client_names.erase(client_fd);
+        server_ref->client_ids.erase(client_fd);
         server_ref->client_threads.erase(client_fd);
-        if (redis_context) {
-            publisher = (redisReply*)redisCommand(redis_context, "PUBLISH %s %s", name.c_str(), "left");
-            if (publisher) {
-                freeReplyObject(publisher);
-                publisher = nullptr;
-            }
+        server_ref->authenticated_fds.erase(client_fd);
+        server_ref->compressed_fds.erase(client_fd);
+        server_ref->idle_reaper.untrack(client_fd);
+        server_ref->active_sessions.sub();
+        publishPresence(name, "left");
+        if (close_socket) {
+            close(client_fd);
         }
-        close(client_fd);
         if (debugMode) {
-            cout << "[+] Client " << name << " disconnected." << endl;
+            LOG_DEBUG("Client disconnected user={}", name);
         }
     }
     
-    pthread_mutex_unlock(&server_ref->mutex);
+    server_ref->mutex.unlock();
 }
 
 
@@ -8,7 +8,12 @@
 #include <iostream>
 #include <cstring>
 #include <algorithm>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
 #include <hiredis/hiredis.h>
+#include <string>
+#include "Metrics.h"
 
 class SocketServer;
 
@@ -17,14 +22,46 @@ private:
     bool debugMode = false; // Debug mode flag
     redisContext* redis_context = nullptr; // Redis context for message storage
     redisReply* publisher = nullptr; // Redis publisher for message broadcasting
+    // The context is one connection: joined is published outside the server
+    // mutex, so every use takes this
+    std::mutex redis_mutex;
     void connectToRedis();
+    void publishPresence(const std::string& name, const char* status);
     SocketServer* server_ref = nullptr;
+    Counter& accepted;
+    // Receive threads are detached, these let stop wait until the last one
+    // no longer touches the server
+    std::mutex threads_mutex;
+    std::condition_variable threads_exited;
+    size_t live_threads = 0;
+    void receiveThreadExited();
+    static constexpr int HANDSHAKE_TIMEOUT_MS = 2000;
+    bool readHandshake(int client_fd, std::string& frame);
+    // Receive thread of the threaded model: handshake, then the message loop
+    void serveClient(int client_fd);
+    bool authenticate(int client_fd, const std::string& frame, std::string& name, bool& authenticated, bool& compress);
 
 public:
     ClientHandler(SocketServer* server);
     ~ClientHandler();
+    // Accept loop of the threaded model, one receive thread per client that
+    // also reads its handshake
     void clientConnectionHandler();
-    void clientDisconnectHandler(const int client_fd);
+    void countAccepted();
+    // Authenticates the first frame, adds the connection to the server's
+    // tables and sends its offline messages. start runs under the server
+    // mutex once the connection is registered (the threaded model records
+    // its receive thread there); offline delivery and the joined publish
+    // run after the mutex is released, on the caller's thread, before its
+    // receive loop. A bare name is refused while a token authenticated
+    // connection holds it. False when refused; the caller closes.
+    bool registerConnection(int client_fd, const std::string& handshake, const std::function<void(int)>& start);
+    // close_socket is false for the I/O engines, which close the fd on their
+    // own thread once the data queued for it is written
+    void clientDisconnectHandler(const int client_fd, bool close_socket = true);
+    // Returns once every receive thread has exited, no timeout: the server
+    // they use is freed after this
+    void waitForReceiveThreads();
 };
 
 #endif // CLIENT_HANDLER_H
\ No newline at end of file
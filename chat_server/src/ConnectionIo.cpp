@@ -0,0 +1,27 @@
+#include "ConnectionIo.h"
+#include "SocketServer.h"
+#include "Logger.h"
+#include <cerrno>
+#include <cstring>
+#include <sys/socket.h>
+using namespace std;
+
+optional<string> BlockingConnectionIo::takeFrame() {
+    if (!server->running) {
+        return nullopt;
+    }
+    int bytes_received = recv(fd(), buffer, sizeof(buffer) - 1, 0);
+    if (bytes_received <= 0 || !server->running) {
+        if (bytes_received < 0) {
+            LOG_WARN("Error receiving message: {}", strerror(errno));
+        } else {
+            LOG_INFO("Client disconnected normally, fd={}", fd());
+        }
+        return nullopt;
+    }
+    return string(buffer, bytes_received);
+}
+
+void BlockingConnectionIo::send(const string& data, int flags) {
+    server->sendFrame(fd(), data, flags);
+}
@@ -0,0 +1,152 @@
+#ifndef CONNECTION_IO_H
+#define CONNECTION_IO_H
+
+#include <coroutine>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include "StorageBackend.h"
+
+class SocketServer;
+
+// What a connection handler coroutine awaits: its next frame, its writes
+// and its database work. On the threaded model every operation completes on
+// the connection's own thread and nothing suspends. Under an IoEngine a
+// handler waiting for a frame or for the database holds no thread; it is
+// resumed on its connection's worker.
+class ConnectionIo {
+public:
+    class FrameAwaiter {
+    private:
+        ConnectionIo& io;
+
+    public:
+        explicit FrameAwaiter(ConnectionIo& io) : io(io) {}
+        bool await_ready() { return io.frameReady(); }
+        void await_suspend(std::coroutine_handle<> waiter) { io.awaitFrame(waiter); }
+        std::optional<std::string> await_resume() { return io.takeFrame(); }
+    };
+
+    class WriteAwaiter {
+    private:
+        ConnectionIo& io;
+        std::string data;
+        int flags;
+
+    public:
+        WriteAwaiter(ConnectionIo& io, std::string data, int flags) : io(io), data(std::move(data)), flags(flags) {}
+        bool await_ready() { return true; }
+        void await_suspend(std::coroutine_handle<>) {}
+        void await_resume() { io.send(data, flags); }
+    };
+
+    template <typename Result>
+    class DbAwaiter {
+    private:
+        ConnectionIo& io;
+        StorageBackend& db;
+        std::function<Result()> work;
+        std::optional<Result> value;
+        std::exception_ptr error;
+
+    public:
+        DbAwaiter(ConnectionIo& io, StorageBackend& db, std::function<Result()> work)
+            : io(io), db(db), work(std::move(work)) {}
+
+        // Run inline where nothing suspends
+        bool await_ready() { return !io.suspends(); }
+
+        bool await_suspend(std::coroutine_handle<> waiter) {
+            // The owner keeps the connection, and with it this awaiter, alive
+            // until the pool thread has handed the waiter back
+            bool queued = db.submit([this, owner = io.keepAlive(), waiter] {
+                try {
+                    value.emplace(work());
+                } catch (...) {
+                    error = std::current_exception();
+                }
+                owner->resumeLater(waiter);
+            });
+            if (!queued) {
+                error = std::make_exception_ptr(std::runtime_error("Database queue is full"));
+            }
+            return queued;
+        }
+
+        Result await_resume() {
+            if (!io.suspends()) {
+                return work();
+            }
+            if (error) {
+                std::rethrow_exception(error);
+            }
+            return std::move(*value);
+        }
+    };
+
+    virtual ~ConnectionIo() = default;
+
+    int fd() const { return client_fd; }
+
+    // The next frame, nullopt once the peer is gone
+    FrameAwaiter readFrame() { return FrameAwaiter(*this); }
+    // Sent on the threaded model (flags as for send), queued on the engine
+    WriteAwaiter write(std::string data, int flags = 0) { return WriteAwaiter(*this, std::move(data), flags); }
+    // Runs work on the database I/O pool and resumes with what it returned.
+    // Rethrows what work threw, throws when the pool queue is full. work
+    // should capture by reference, the handler's frame outlives it; GCC 12
+    // miscompiles lambdas capturing by value inside a co_await.
+    template <typename Work>
+    DbAwaiter<std::invoke_result_t<Work&>> dbQuery(StorageBackend& db, Work work) {
+        return DbAwaiter<std::invoke_result_t<Work&>>(*this, db, std::move(work));
+    }
+
+    ConnectionIo(const ConnectionIo&) = delete;
+    ConnectionIo& operator=(const ConnectionIo&) = delete;
+
+protected:
+    explicit ConnectionIo(int client_fd) : client_fd(client_fd) {}
+
+    // A frame, or the end of the connection, can be taken without waiting
+    virtual bool frameReady() = 0;
+    virtual std::optional<std::string> takeFrame() = 0;
+    // Resumes waiter once frameReady would be true
+    virtual void awaitFrame(std::coroutine_handle<> waiter) = 0;
+    virtual void send(const std::string& data, int flags) = 0;
+    // False when database work runs inline on the calling thread
+    virtual bool suspends() const = 0;
+    // Called from a pool thread: resumes waiter where the handler runs
+    virtual void resumeLater(std::coroutine_handle<> waiter) = 0;
+    // Keeps the connection alive while database work for it runs
+    virtual std::shared_ptr<ConnectionIo> keepAlive() = 0;
+
+private:
+    int client_fd;
+};
+
+// The threaded model: one blocking recv per frame on the connection's own
+// thread, so a handler driven by it runs start() to completion
+class BlockingConnectionIo : public ConnectionIo {
+private:
+    SocketServer* server;
+    char buffer[1024];
+
+protected:
+    bool frameReady() override { return true; }
+    std::optional<std::string> takeFrame() override;
+    void awaitFrame(std::coroutine_handle<> waiter) override { waiter.resume(); }
+    void send(const std::string& data, int flags) override;
+    bool suspends() const override { return false; }
+    void resumeLater(std::coroutine_handle<> waiter) override { waiter.resume(); }
+    std::shared_ptr<ConnectionIo> keepAlive() override { return nullptr; }
+
+public:
+    BlockingConnectionIo(SocketServer* server, int client_fd) : ConnectionIo(client_fd), server(server) {}
+};
+
+#endif // CONNECTION_IO_H
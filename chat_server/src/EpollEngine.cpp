@@ -0,0 +1,208 @@
+#include "EpollEngine.h"
+#include "IdleReaper.h"
+#include "Logger.h"
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+using namespace std;
+
+EpollEngine::EpollEngine(SocketServer* server, ClientHandler* handler, size_t workers, bool debug)
+    : IoEngine(server, handler, workers, debug) {}
+
+EpollEngine::~EpollEngine() {
+    teardown();
+}
+
+bool EpollEngine::setup() {
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0 || wake_fd < 0) {
+        cerr << "[-] epoll could not be set up: " << strerror(errno) << endl;
+        return false;
+    }
+    struct epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.fd = wake_fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &event) < 0) {
+        cerr << "[-] epoll could not be set up: " << strerror(errno) << endl;
+        return false;
+    }
+    return true;
+}
+
+void EpollEngine::teardown() {
+    if (epoll_fd >= 0) {
+        close(epoll_fd);
+        epoll_fd = -1;
+    }
+    interest.clear();
+}
+
+void EpollEngine::run() {
+    struct epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.fd = listener_fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listener_fd, &event) < 0) {
+        LOG_ERROR("Could not watch the listening socket: {}", strerror(errno));
+    }
+    struct epoll_event events[MAX_EVENTS];
+    uint64_t next_tick_ms = IdleReaper::nowMillis() + TICK_MS;
+    while (running) {
+        int ready = epoll_wait(epoll_fd, events, MAX_EVENTS, static_cast<int>(TICK_MS));
+        syscalls.add();
+        loop_wakeups.add();
+        if (ready < 0 && errno != EINTR) {
+            LOG_ERROR("epoll_wait failed: {}", strerror(errno));
+            break;
+        }
+        for (int i = 0; i < ready; i++) {
+            int fd = events[i].data.fd;
+            if (fd == wake_fd) {
+                uint64_t value;
+                if (read(wake_fd, &value, sizeof(value)) < 0 && errno != EAGAIN) {
+                    LOG_WARN("Could not read the I/O engine wakeup: {}", strerror(errno));
+                }
+                syscalls.add();
+                continue;
+            }
+            if (fd == listener_fd) {
+                acceptConnections();
+                continue;
+            }
+            auto found = connections.find(fd);
+            if (found == connections.end()) {
+                continue;
+            }
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                readFrom(fd, found->second);
+                found = connections.find(fd);
+                if (found == connections.end()) {
+                    continue;
+                }
+            }
+            if (events[i].events & EPOLLOUT) {
+                written(fd, found->second);
+            }
+        }
+        // Sends queued by the workers meanwhile, then timeouts
+        runCommands();
+        uint64_t now_ms = IdleReaper::nowMillis();
+        if (now_ms >= next_tick_ms) {
+            tick(now_ms);
+            next_tick_ms = now_ms + TICK_MS;
+        }
+    }
+}
+
+void EpollEngine::acceptConnections() {
+    for (int i = 0; i < MAX_ACCEPTS && accepting; i++) {
+        int fd = accept4(listener_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        syscalls.add();
+        if (fd < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            // EAGAIN also when the other process of a handoff took it first
+            if (errno != EAGAIN && errno != EWOULDBLOCK && debugMode) {
+                LOG_WARN("Error accepting client connection: {}", strerror(errno));
+            }
+            return;
+        }
+        update(fd, accepted(fd));
+    }
+}
+
+void EpollEngine::readFrom(int fd, Connection& connection) {
+    char buffer[RECV_BUFFER_BYTES];
+    ssize_t bytes_received = recv(fd, buffer, sizeof(buffer), 0);
+    syscalls.add();
+    if (bytes_received > 0) {
+        received(fd, connection, buffer, static_cast<size_t>(bytes_received));
+        return;
+    }
+    if (bytes_received < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+            return;
+        }
+        LOG_WARN("Error receiving message: {}", strerror(errno));
+    }
+    peerClosed(fd, connection);
+}
+
+void EpollEngine::flush(int fd, Connection& connection) {
+    coalesce(connection);
+    while (!connection.out.empty()) {
+        const string& front = connection.out.front();
+        ssize_t sent = ::send(fd, front.data() + connection.out_offset, front.size() - connection.out_offset,
+                              MSG_NOSIGNAL);
+        syscalls.add();
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            // The peer is gone; its read side reports the close
+            connection.out.clear();
+            connection.out_offset = 0;
+            break;
+        }
+        connection.out_offset += static_cast<size_t>(sent);
+        if (connection.out_offset == front.size()) {
+            connection.out.pop_front();
+            connection.out_offset = 0;
+        }
+    }
+    update(fd, connection);
+}
+
+void EpollEngine::stopListening() {
+    if (listener_fd >= 0) {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, listener_fd, nullptr);
+        // The caller closes it and the number may come back as a client
+        listener_fd = -1;
+    }
+}
+
+void EpollEngine::pauseReads(int fd, Connection& connection) {
+    update(fd, connection);
+}
+
+void EpollEngine::resumeReads(int fd, Connection& connection) {
+    update(fd, connection);
+}
+
+void EpollEngine::forget(int fd, Connection& connection) {
+    (void)connection;
+    // close() takes the socket out of the epoll set
+    interest.erase(fd);
+}
+
+// Hangups are reported whatever the mask, so a socket with nothing to read
+// or write leaves the set instead of waking the loop until it is closed
+void EpollEngine::update(int fd, const Connection& connection) {
+    uint32_t wanted = (connection.reads_paused ? 0u : static_cast<uint32_t>(EPOLLIN)) |
+                      (connection.out.empty() ? 0u : static_cast<uint32_t>(EPOLLOUT));
+    uint32_t& current = interest[fd];
+    if (wanted == current) {
+        return;
+    }
+    struct epoll_event event = {};
+    event.events = wanted;
+    event.data.fd = fd;
+    int result;
+    if (wanted == 0) {
+        result = epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+    } else {
+        result = epoll_ctl(epoll_fd, current == 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, fd, &event);
+    }
+    syscalls.add();
+    if (result < 0) {
+        LOG_WARN("epoll_ctl failed for fd={}: {}", fd, strerror(errno));
+        return;
+    }
+    current = wanted;
+}
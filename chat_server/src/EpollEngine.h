@@ -0,0 +1,42 @@
+#ifndef EPOLL_ENGINE_H
+#define EPOLL_ENGINE_H
+
+#include <cstdint>
+#include <unordered_map>
+#include "IoEngine.h"
+
+// IO_ENGINE=epoll, and the fallback for io_uring. Level triggered: one recv
+// per readable socket per wakeup, so a read is still one frame as in the
+// threaded model, and one send for everything queued to a socket since the
+// last wakeup.
+class EpollEngine : public IoEngine {
+private:
+    int epoll_fd = -1;
+    // Events each socket is registered for, 0 when it is not in the set
+    std::unordered_map<int, uint32_t> interest;
+
+    static constexpr int MAX_EVENTS = 256;
+    // Accepts per wakeup, so a connection storm does not starve the rest
+    static constexpr int MAX_ACCEPTS = 64;
+
+    void update(int fd, const Connection& connection);
+    void acceptConnections();
+    void readFrom(int fd, Connection& connection);
+
+protected:
+    bool setup() override;
+    void run() override;
+    void teardown() override;
+    void stopListening() override;
+    void pauseReads(int fd, Connection& connection) override;
+    void resumeReads(int fd, Connection& connection) override;
+    void flush(int fd, Connection& connection) override;
+    void forget(int fd, Connection& connection) override;
+
+public:
+    EpollEngine(SocketServer* server, ClientHandler* handler, size_t workers, bool debug);
+    ~EpollEngine() override;
+    const char* name() const override { return "epoll"; }
+};
+
+#endif // EPOLL_ENGINE_H
@@ -0,0 +1,152 @@
+#include "IdleReaper.h"
+#include "Logger.h"
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+#include <vector>
+using namespace std;
+
+IdleReaper::IdleReaper(bool debug) : debugMode(debug) {
+    pthread_mutex_init(&mutex, nullptr);
+}
+
+IdleReaper::~IdleReaper() {
+    if (running) {
+        stop();
+    }
+    pthread_mutex_destroy(&mutex);
+}
+
+void IdleReaper::configure(int idle_timeout_sec, int pong_timeout_sec) {
+    pthread_mutex_lock(&mutex);
+    idle_timeout_ms = static_cast<uint64_t>(idle_timeout_sec > 0 ? idle_timeout_sec : 60) * 1000;
+    pong_timeout_ms = static_cast<uint64_t>(pong_timeout_sec > 0 ? pong_timeout_sec : 15) * 1000;
+    pthread_mutex_unlock(&mutex);
+}
+
+void IdleReaper::setSender(function<void(int, const string&)> sender) {
+    this->sender = move(sender);
+}
+
+void IdleReaper::start() {
+    running = true;
+    pthread_create(&reaper_thread, nullptr, [](void* arg)->void* {
+        static_cast<IdleReaper*>(arg)->run();
+        return nullptr;
+    }, this);
+}
+
+void IdleReaper::stop() {
+    if (!running) {
+        return;
+    }
+    running = false;
+    pthread_join(reaper_thread, nullptr);
+}
+
+void IdleReaper::track(int client_fd) {
+    // Kernel keepalive catches peers that vanished without a FIN even when the
+    // application heartbeat is not answered by an old client.
+    int enable = 1;
+    int keep_idle = static_cast<int>(idle_timeout_ms / 1000);
+    int keep_interval = 10;
+    int keep_count = 3;
+    setsockopt(client_fd, SOL_SOCKET, SO_KEEPALIVE, &enable, sizeof(enable));
+    setsockopt(client_fd, IPPROTO_TCP, TCP_KEEPIDLE, &keep_idle, sizeof(keep_idle));
+    setsockopt(client_fd, IPPROTO_TCP, TCP_KEEPINTVL, &keep_interval, sizeof(keep_interval));
+    setsockopt(client_fd, IPPROTO_TCP, TCP_KEEPCNT, &keep_count, sizeof(keep_count));
+
+    auto activity = make_shared<ConnectionActivity>();
+    activity->last_seen_ms.store(nowMillis(), memory_order_relaxed);
+
+    pthread_mutex_lock(&mutex);
+    connections[client_fd] = Tracked{activity, 0, false};
+    wheel.schedule(client_fd, ticksFor(idle_timeout_ms));
+    pthread_mutex_unlock(&mutex);
+}
+
+shared_ptr<ConnectionActivity> IdleReaper::activityFor(int client_fd) {
+    shared_ptr<ConnectionActivity> activity;
+    pthread_mutex_lock(&mutex);
+    auto found = connections.find(client_fd);
+    if (found != connections.end()) {
+        activity = found->second.activity;
+    }
+    pthread_mutex_unlock(&mutex);
+    return activity;
+}
+
+void IdleReaper::untrack(int client_fd) {
+    pthread_mutex_lock(&mutex);
+    wheel.cancel(client_fd);
+    connections.erase(client_fd);
+    pthread_mutex_unlock(&mutex);
+}
+
+void IdleReaper::run() {
+    vector<int> expired;
+    while (running) {
+        usleep(TICK_MS * 1000);
+        uint64_t now_ms = nowMillis();
+        pthread_mutex_lock(&mutex);
+        expired.clear();
+        wheel.advance(expired);
+        for (int client_fd : expired) {
+            onDeadline(client_fd, now_ms);
+        }
+        pthread_mutex_unlock(&mutex);
+    }
+}
+
+// Called with mutex held. Connections are re-armed lazily here instead of on
+// every received frame, so the receive path only stores a timestamp.
+void IdleReaper::onDeadline(int client_fd, uint64_t now_ms) {
+    auto found = connections.find(client_fd);
+    if (found == connections.end() || found->second.reaped) {
+        return;
+    }
+    Tracked& tracked = found->second;
+    uint64_t last_seen = tracked.activity->last_seen_ms.load(memory_order_relaxed);
+
+    if (tracked.ping_sent_ms != 0 && last_seen >= tracked.ping_sent_ms) {
+        tracked.ping_sent_ms = 0;
+    }
+
+    if (tracked.ping_sent_ms == 0) {
+        uint64_t idle_for = now_ms > last_seen ? now_ms - last_seen : 0;
+        if (idle_for < idle_timeout_ms) {
+            wheel.schedule(client_fd, ticksFor(idle_timeout_ms - idle_for));
+            return;
+        }
+        const string ping = "PING\n";
+        if (sender) {
+            sender(client_fd, ping);
+        } else {
+            send(client_fd, ping.c_str(), ping.length(), MSG_DONTWAIT | MSG_NOSIGNAL);
+        }
+        tracked.ping_sent_ms = now_ms;
+        wheel.schedule(client_fd, ticksFor(pong_timeout_ms));
+        return;
+    }
+
+    // No traffic since the PING went out: wake the blocked recv so the normal
+    // disconnect path removes the session and publishes the presence change.
+    tracked.reaped = true;
+    shutdown(client_fd, SHUT_RDWR);
+    if (debugMode) {
+        LOG_DEBUG("Reaped idle connection fd={}", client_fd);
+    }
+}
+
+uint64_t IdleReaper::ticksFor(uint64_t delay_ms) const {
+    return (delay_ms + TICK_MS - 1) / TICK_MS;
+}
+
+uint64_t IdleReaper::nowMillis() {
+    return chrono::duration_cast<chrono::milliseconds>(
+        chrono::steady_clock::now().time_since_epoch()).count();
+}
@@ -0,0 +1,64 @@
+#ifndef IDLE_REAPER_H
+#define IDLE_REAPER_H
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <pthread.h>
+#include <unordered_map>
+#include "TimingWheel.h"
+
+// Written by the connection's receive loop on every frame, read by the reaper.
+struct ConnectionActivity {
+    std::atomic<uint64_t> last_seen_ms{0};
+};
+
+class IdleReaper {
+private:
+    struct Tracked {
+        std::shared_ptr<ConnectionActivity> activity;
+        uint64_t ping_sent_ms = 0;
+        bool reaped = false;
+    };
+
+    bool debugMode = false;
+    TimingWheel wheel;
+    std::unordered_map<int, Tracked> connections;
+    pthread_mutex_t mutex;
+    pthread_t reaper_thread;
+    std::function<void(int, const std::string&)> sender;
+    volatile bool running = false;
+    uint64_t idle_timeout_ms = 60000;
+    uint64_t pong_timeout_ms = 15000;
+    static constexpr uint64_t TICK_MS = 1000;
+
+    void run();
+    void onDeadline(int client_fd, uint64_t now_ms);
+    uint64_t ticksFor(uint64_t delay_ms) const;
+
+public:
+    explicit IdleReaper(bool debug = false);
+    ~IdleReaper();
+
+    void configure(int idle_timeout_sec, int pong_timeout_sec);
+    // Writes the PING; with an I/O engine it must go through its queue.
+    // Set before start, a plain send() without one.
+    void setSender(std::function<void(int, const std::string&)> sender);
+    void start();
+    void stop();
+
+    // Registers an accepted connection, enables TCP keepalive on it and arms
+    // its idle deadline. Must be paired with untrack before the fd is closed.
+    void track(int client_fd);
+    void untrack(int client_fd);
+    std::shared_ptr<ConnectionActivity> activityFor(int client_fd);
+
+    static uint64_t nowMillis();
+
+    IdleReaper(const IdleReaper&) = delete;
+    IdleReaper& operator=(const IdleReaper&) = delete;
+};
+
+#endif // IDLE_REAPER_H
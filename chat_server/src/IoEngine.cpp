@@ -0,0 +1,540 @@
+#include "IoEngine.h"
+#include "ClientHandler.h"
+#include "ConnectionIo.h"
+#include "EpollEngine.h"
+#include "IdleReaper.h"
+#include "Logger.h"
+#include "MessageHandler.h"
+#ifdef SNIBBLE_HAVE_URING
+#include "UringEngine.h"
+#endif
+#include <algorithm>
+#include <iostream>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+using namespace std;
+
+// Lets database pool threads hand a suspended handler back to its worker.
+// Sessions hold it, so it outlives the engine when a query is still running
+// at stop; the hand-back is then dropped.
+struct IoEngine::WorkerGate {
+    std::mutex mutex_;
+    IoEngine* engine = nullptr;  // null once the workers are gone
+};
+
+// The handler coroutine of one connection and what it awaits. Everything
+// but the counters is used on the connection's worker only.
+struct IoEngine::Session : ConnectionIo, enable_shared_from_this<Session> {
+    IoEngine* engine;
+    uint32_t generation;
+    shared_ptr<WorkerGate> gate;
+    // Set once the handshake registered the connection, null if refused
+    unique_ptr<MessageHandler> handler;
+    Task task;
+    deque<string> inbox;
+    coroutine_handle<> reader;  // the handler waiting in readFrame
+    bool closed = false;        // the peer is gone
+    bool finished = false;      // the handler returned and was disconnected
+    // Frames handed to the worker and not taken by the handler yet
+    atomic<uint32_t> queued{0};
+    atomic<bool> reads_paused{false};
+
+    Session(IoEngine* engine, int fd, uint32_t generation)
+        : ConnectionIo(fd), engine(engine), generation(generation), gate(engine->gate) {}
+
+    bool frameReady() override { return !inbox.empty() || closed; }
+
+    optional<string> takeFrame() override {
+        if (inbox.empty()) {
+            return nullopt;
+        }
+        string frame = move(inbox.front());
+        inbox.pop_front();
+        engine->frameTaken(*this);
+        return frame;
+    }
+
+    void awaitFrame(coroutine_handle<> waiter) override { reader = waiter; }
+
+    void send(const string& data, int) override { engine->send(fd(), data); }
+
+    bool suspends() const override { return true; }
+
+    void resumeLater(coroutine_handle<> waiter) override {
+        lock_guard<std::mutex> lock(gate->mutex_);
+        if (gate->engine) {
+            gate->engine->dispatch(fd(), [session = shared_from_this(), waiter] {
+                waiter.resume();
+                session->engine->settle(*session);
+            });
+        }
+    }
+
+    shared_ptr<ConnectionIo> keepAlive() override { return shared_from_this(); }
+};
+
+// One thread with its own FIFO. IoPool shares one queue between its threads,
+// which would let two frames of a connection run at once or out of order.
+struct IoEngine::Worker {
+    std::mutex mutex_;
+    condition_variable work_available;
+    deque<function<void()>> tasks;
+    bool stopping = false;
+    thread worker_thread;
+
+    Worker() : worker_thread(&Worker::run, this) {}
+
+    // Runs the tasks already queued, then joins
+    ~Worker() {
+        {
+            lock_guard<std::mutex> lock(mutex_);
+            stopping = true;
+        }
+        work_available.notify_one();
+        worker_thread.join();
+    }
+
+    void post(function<void()> task) {
+        {
+            lock_guard<std::mutex> lock(mutex_);
+            tasks.push_back(move(task));
+        }
+        work_available.notify_one();
+    }
+
+    void run() {
+        while (true) {
+            function<void()> task;
+            {
+                unique_lock<std::mutex> lock(mutex_);
+                work_available.wait(lock, [this] { return stopping || !tasks.empty(); });
+                if (tasks.empty()) {
+                    return;
+                }
+                task = move(tasks.front());
+                tasks.pop_front();
+            }
+            try {
+                task();
+            } catch (const exception& e) {
+                LOG_ERROR("I/O engine task failed: {}", e.what());
+            }
+        }
+    }
+};
+
+bool IoEngine::parseKind(const string& name, Kind& kind) {
+    if (name == "threads") {
+        kind = Kind::Threads;
+    } else if (name == "epoll") {
+        kind = Kind::Epoll;
+    } else if (name == "io_uring") {
+        kind = Kind::IoUring;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+unique_ptr<IoEngine> IoEngine::create(Kind kind, SocketServer* server, ClientHandler* handler, size_t workers,
+                                      bool debug) {
+    if (kind == Kind::Threads) {
+        return nullptr;
+    }
+    if (kind == Kind::IoUring) {
+#ifdef SNIBBLE_HAVE_URING
+        unique_ptr<IoEngine> engine = make_unique<UringEngine>(server, handler, workers, debug);
+        if (engine->setup()) {
+            return engine;
+        }
+        cerr << "[-] io_uring could not be set up, using epoll" << endl;
+#else
+        cerr << "[-] Built without liburing, IO_ENGINE=io_uring uses epoll" << endl;
+#endif
+    }
+    unique_ptr<IoEngine> engine = make_unique<EpollEngine>(server, handler, workers, debug);
+    if (!engine->setup()) {
+        return nullptr;
+    }
+    return engine;
+}
+
+IoEngine::IoEngine(SocketServer* server, ClientHandler* handler, size_t workers, bool debug)
+    : server(server), client_handler(handler), debugMode(debug),
+      syscalls(MetricsRegistry::instance().counter("snibble_chat_io_syscalls_total",
+                                                   "Syscalls the I/O engine made for client sockets")),
+      loop_wakeups(MetricsRegistry::instance().counter("snibble_chat_io_loop_wakeups_total",
+                                                       "Times the I/O engine loop returned from waiting")),
+      worker_count(max<size_t>(1, workers)), gate(make_shared<WorkerGate>()) {
+    gate->engine = this;
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+}
+
+IoEngine::~IoEngine() {
+    {
+        lock_guard<std::mutex> lock(gate->mutex_);
+        gate->engine = nullptr;
+    }
+    if (wake_fd >= 0) {
+        close(wake_fd);
+    }
+}
+
+bool IoEngine::start(int listener_fd) {
+    if (wake_fd < 0 || running) {
+        return false;
+    }
+    this->listener_fd = listener_fd;
+    accepting = true;
+    running = true;
+    for (size_t i = 0; i < worker_count; i++) {
+        workers.push_back(make_unique<Worker>());
+    }
+    loop_thread = thread([this] { run(); });
+    if (debugMode) {
+        cout << "[+] " << name() << " engine started with " << worker_count << " workers" << endl;
+    }
+    return true;
+}
+
+void IoEngine::stopAccepting() {
+    if (!running) {
+        return;
+    }
+    post(Command{Command::Type::StopAccepting, -1, 0, {}});
+    unique_lock<std::mutex> lock(command_mutex);
+    accept_stopped_cv.wait(lock, [this] { return accept_stopped; });
+}
+
+void IoEngine::stop() {
+    if (!running.exchange(false)) {
+        return;
+    }
+    post(Command{Command::Type::StopAccepting, -1, 0, {}});
+    loop_thread.join();
+    // Handlers waiting for a frame end as if their peer left. What was queued
+    // still runs, and what it sends is dropped with the sockets below.
+    for (auto& [fd, connection] : connections) {
+        if (connection.session) {
+            dispatch(fd, [this, session = connection.session] { closeSession(*session); });
+        }
+    }
+    // A handler still inside the database is not resumed after this; it is
+    // disconnected below and its coroutine goes with the session
+    {
+        lock_guard<std::mutex> lock(gate->mutex_);
+        gate->engine = nullptr;
+    }
+    workers.clear();
+    for (auto& [fd, connection] : connections) {
+        if (connection.session && connection.session->handler && !connection.session->finished) {
+            client_handler->clientDisconnectHandler(fd, false);
+        }
+    }
+    // Before the buffers go away: io_uring may still be writing from them
+    teardown();
+    for (auto& [fd, connection] : connections) {
+        close(fd);
+    }
+    connections.clear();
+}
+
+void IoEngine::send(int fd, string data) {
+    post(Command{Command::Type::Send, fd, 0, move(data)});
+}
+
+void IoEngine::post(Command command) {
+    {
+        lock_guard<std::mutex> lock(command_mutex);
+        commands.push_back(move(command));
+    }
+    // One write wakes the loop for everything queued until it runs commands
+    if (!wake_pending.exchange(true)) {
+        uint64_t one = 1;
+        if (write(wake_fd, &one, sizeof(one)) < 0 && debugMode) {
+            cerr << "[-] Failed to wake the I/O engine" << endl;
+        }
+        syscalls.add();
+    }
+}
+
+void IoEngine::dispatch(int fd, function<void()> task) {
+    workers[static_cast<size_t>(fd) % workers.size()]->post(move(task));
+}
+
+IoEngine::Connection& IoEngine::accepted(int fd) {
+    client_handler->countAccepted();
+    Connection& connection = connections[fd];
+    connection = Connection();
+    next_generation = (next_generation + 1) & GENERATION_MASK;
+    if (next_generation == 0) {
+        next_generation = 1;
+    }
+    connection.generation = next_generation;
+    connection.since_ms = IdleReaper::nowMillis();
+    return connection;
+}
+
+// The first read collects the handshake like ClientHandler::readHandshake:
+// a bare name is complete at once, an AUTH frame at its newline
+void IoEngine::received(int fd, Connection& connection, const char* data, size_t length) {
+    if (connection.state == Connection::State::Closing) {
+        return;
+    }
+    if (connection.state == Connection::State::Handshake) {
+        connection.handshake.append(data, length);
+        const string& handshake = connection.handshake;
+        if (handshake.rfind("AUTH:", 0) == 0 && handshake.find('\n') == string::npos &&
+            handshake.size() < MAX_HANDSHAKE_BYTES) {
+            return;
+        }
+        connection.state = Connection::State::Open;
+        connection.session = make_shared<Session>(this, fd, connection.generation);
+        dispatch(fd, [this, session = connection.session, frame = move(connection.handshake)] {
+            openSession(*session, frame);
+        });
+        connection.handshake.clear();
+        return;
+    }
+
+    // Stop reading a connection that is far ahead of its worker, like a
+    // receive thread blocked in the database would
+    shared_ptr<Session> session = connection.session;
+    if (session->queued.fetch_add(1, memory_order_relaxed) + 1 >= MAX_QUEUED_FRAMES && !connection.reads_paused) {
+        session->reads_paused.store(true, memory_order_relaxed);
+        connection.reads_paused = true;
+        pauseReads(fd, connection);
+    }
+    dispatch(fd, [this, session, frame = string(data, length)]() mutable { deliver(*session, move(frame)); });
+}
+
+void IoEngine::peerClosed(int fd, Connection& connection) {
+    if (connection.state == Connection::State::Closing) {
+        return;
+    }
+    if (connection.state == Connection::State::Handshake) {
+        // Nothing was registered
+        connection.released = true;
+        beginClose(fd, connection);
+        return;
+    }
+    dispatch(fd, [this, session = connection.session] { closeSession(*session); });
+    beginClose(fd, connection);
+}
+
+void IoEngine::openSession(Session& session, const string& handshake) {
+    int fd = session.fd();
+    if (!client_handler->registerConnection(fd, handshake, nullptr)) {
+        // The refusal is queued already, the socket closes once it is written
+        session.finished = true;
+        post(Command{Command::Type::Close, fd, session.generation, {}});
+        return;
+    }
+    session.handler = make_unique<MessageHandler>(server, client_handler);
+    session.task = session.handler->serve(session);
+    // Runs to the first frame it waits for
+    session.task.start();
+    settle(session);
+}
+
+void IoEngine::deliver(Session& session, string frame) {
+    if (session.finished || session.closed) {
+        frameTaken(session);
+        return;
+    }
+    session.inbox.push_back(move(frame));
+    resumeReader(session);
+}
+
+void IoEngine::frameTaken(Session& session) {
+    uint32_t left = session.queued.fetch_sub(1, memory_order_relaxed) - 1;
+    if (left <= MAX_QUEUED_FRAMES / 4 && session.reads_paused.exchange(false, memory_order_relaxed)) {
+        post(Command{Command::Type::Resume, session.fd(), session.generation, {}});
+    }
+}
+
+void IoEngine::closeSession(Session& session) {
+    if (session.closed) {
+        return;
+    }
+    session.closed = true;
+    if (!session.handler) {
+        // Refused, or the handshake never ran
+        if (!session.finished) {
+            session.finished = true;
+            post(Command{Command::Type::Release, session.fd(), session.generation, {}});
+        }
+        return;
+    }
+    // A handler waiting for a frame gets the end of the connection now, one
+    // inside the database when it comes back for its next frame
+    resumeReader(session);
+}
+
+void IoEngine::resumeReader(Session& session) {
+    if (session.reader) {
+        exchange(session.reader, {}).resume();
+    }
+    settle(session);
+}
+
+void IoEngine::settle(Session& session) {
+    if (session.finished || !session.handler || !session.task.done()) {
+        return;
+    }
+    session.finished = true;
+    try {
+        session.task.result();
+    } catch (const exception& e) {
+        LOG_ERROR("Connection handler failed, fd={}: {}", session.fd(), e.what());
+    }
+    LOG_INFO("Client disconnected normally, fd={}", session.fd());
+    client_handler->clientDisconnectHandler(session.fd(), false);
+    // A handler that failed before its peer left closes the connection
+    Command::Type type = session.closed ? Command::Type::Release : Command::Type::Close;
+    post(Command{type, session.fd(), session.generation, {}});
+}
+
+void IoEngine::beginClose(int fd, Connection& connection) {
+    if (connection.state == Connection::State::Closing) {
+        return;
+    }
+    connection.state = Connection::State::Closing;
+    connection.since_ms = IdleReaper::nowMillis();
+    if (!connection.reads_paused) {
+        connection.reads_paused = true;
+        pauseReads(fd, connection);
+    }
+    written(fd, connection);
+}
+
+void IoEngine::written(int fd, Connection& connection) {
+    if (!connection.out.empty() && !connection.send_in_flight) {
+        flush(fd, connection);
+    }
+    if (connection.state == Connection::State::Closing && connection.released && connection.out.empty() &&
+        !connection.send_in_flight) {
+        finishClose(fd, connection);
+    }
+}
+
+void IoEngine::finishClose(int fd, Connection& connection) {
+    forget(fd, connection);
+    close(fd);
+    syscalls.add();
+    connections.erase(fd);
+}
+
+void IoEngine::coalesce(Connection& connection) {
+    if (connection.out.size() < 2) {
+        return;
+    }
+    string& front = connection.out.front();
+    front.erase(0, connection.out_offset);
+    connection.out_offset = 0;
+    while (connection.out.size() > 1 && front.size() + connection.out[1].size() <= MAX_WRITE_BYTES) {
+        front += connection.out[1];
+        connection.out.erase(connection.out.begin() + 1);
+    }
+}
+
+void IoEngine::runCommands() {
+    // Cleared before taking the batch, so a post after the swap wakes again
+    wake_pending.store(false);
+    vector<Command> batch;
+    {
+        lock_guard<std::mutex> lock(command_mutex);
+        batch.swap(commands);
+    }
+    vector<int> touched;
+    for (Command& command : batch) {
+        if (command.type == Command::Type::StopAccepting) {
+            if (accepting) {
+                accepting = false;
+                stopListening();
+            }
+            {
+                lock_guard<std::mutex> lock(command_mutex);
+                accept_stopped = true;
+            }
+            accept_stopped_cv.notify_all();
+            continue;
+        }
+        auto found = connections.find(command.fd);
+        if (found == connections.end()) {
+            continue;
+        }
+        Connection& connection = found->second;
+        if (command.generation != 0 && command.generation != connection.generation) {
+            // For an earlier connection on the same fd
+            continue;
+        }
+        switch (command.type) {
+        case Command::Type::Send:
+            if (connection.out.empty()) {
+                touched.push_back(command.fd);
+            }
+            connection.out.push_back(move(command.data));
+            break;
+        case Command::Type::Close:
+            connection.released = true;
+            beginClose(command.fd, connection);
+            break;
+        case Command::Type::Release:
+            connection.released = true;
+            touched.push_back(command.fd);
+            break;
+        case Command::Type::Resume:
+            if (connection.reads_paused && connection.state == Connection::State::Open) {
+                connection.reads_paused = false;
+                resumeReads(command.fd, connection);
+            }
+            break;
+        case Command::Type::StopAccepting:
+            break;
+        }
+    }
+    // All frames queued for a connection in this batch go out in one write
+    for (int fd : touched) {
+        auto found = connections.find(fd);
+        if (found != connections.end()) {
+            written(fd, found->second);
+        }
+    }
+}
+
+void IoEngine::tick(uint64_t now_ms) {
+    vector<int> expired;
+    for (auto& [fd, connection] : connections) {
+        if (connection.state == Connection::State::Handshake && now_ms - connection.since_ms >= HANDSHAKE_TIMEOUT_MS) {
+            expired.push_back(fd);
+        } else if (connection.state == Connection::State::Closing && connection.released &&
+                   now_ms - connection.since_ms >= CLOSE_TIMEOUT_MS) {
+            expired.push_back(fd);
+        }
+    }
+    for (int fd : expired) {
+        Connection& connection = connections[fd];
+        if (connection.state == Connection::State::Handshake) {
+            if (debugMode) {
+                LOG_WARN("Handshake timed out, fd={}", fd);
+            }
+            connection.released = true;
+            beginClose(fd, connection);
+            continue;
+        }
+        // The peer stopped reading: drop what is queued and fail the write
+        // in flight, if any, so the socket can close
+        connection.since_ms = now_ms;
+        if (connection.send_in_flight) {
+            connection.out.erase(connection.out.begin() + 1, connection.out.end());
+        } else {
+            connection.out.clear();
+            connection.out_offset = 0;
+        }
+        shutdown(fd, SHUT_RDWR);
+        syscalls.add();
+        written(fd, connection);
+    }
+}
@@ -0,0 +1,187 @@
+#ifndef IO_ENGINE_H
+#define IO_ENGINE_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "Metrics.h"
+
+class SocketServer;
+class ClientHandler;
+
+// Event driven alternative to one blocking thread per client, picked with
+// IO_ENGINE. One loop thread owns every client socket: it accepts, reads and
+// writes what other threads queued with send(). Handshakes and frames run on
+// a few workers with the same ClientHandler and MessageHandler code as the
+// threaded model. Each connection's handler is a coroutine resumed on the
+// same worker every time, so its frames keep their order; while it waits for
+// a frame or for the database it holds no thread.
+//
+// A socket is closed by the loop, only after its queued data is written and
+// its worker removed the session, so a reused fd never gets data meant for
+// the connection before it.
+class IoEngine {
+public:
+    enum class Kind {
+        Threads,
+        Epoll,
+        IoUring
+    };
+
+    // "threads", "epoll" or "io_uring"
+    static bool parseKind(const std::string& name, Kind& kind);
+    // nullptr for Threads. io_uring falls back to epoll when the server was
+    // built without liburing or the kernel refuses the ring.
+    static std::unique_ptr<IoEngine> create(Kind kind, SocketServer* server, ClientHandler* handler,
+                                            size_t workers, bool debug);
+
+    virtual ~IoEngine();
+    virtual const char* name() const = 0;
+
+    // Takes connections from listener_fd, which stays owned by the caller
+    bool start(int listener_fd);
+    // Returns once the loop no longer uses the listener
+    void stopAccepting();
+    // Closes the sockets still open and joins the loop and the workers
+    void stop();
+    // Any thread; written by the loop in the order queued
+    void send(int fd, std::string data);
+
+    IoEngine(const IoEngine&) = delete;
+    IoEngine& operator=(const IoEngine&) = delete;
+
+protected:
+    // Worker side of a connection, see IoEngine.cpp
+    struct Session;
+
+    struct Connection {
+        enum class State {
+            Handshake,  // collecting the first frame
+            Open,       // frames go to the worker
+            Closing     // waiting for the worker and the queued data
+        };
+        State state = State::Handshake;
+        // Tells completions for an earlier connection on the same fd apart
+        uint32_t generation = 0;
+        uint64_t since_ms = 0;  // accepted, or started closing
+        std::string handshake;
+        std::shared_ptr<Session> session;
+        std::deque<std::string> out;
+        size_t out_offset = 0;        // bytes of out.front() already written
+        bool send_in_flight = false;  // io_uring: a send SQE owns out.front()
+        bool recv_armed = false;      // io_uring: a multishot recv is pending
+        bool reads_paused = false;
+        bool released = false;        // the worker is done with the session
+    };
+
+    SocketServer* server = nullptr;
+    ClientHandler* client_handler = nullptr;
+    bool debugMode = false;
+    int listener_fd = -1;
+    int wake_fd = -1;
+    std::atomic<bool> running{false};
+    bool accepting = false;  // loop thread
+    std::unordered_map<int, Connection> connections;  // loop thread
+
+    // Syscalls made for client I/O: divided by forwarded messages this is
+    // what the engines are compared on
+    Counter& syscalls;
+    Counter& loop_wakeups;
+
+    static constexpr size_t RECV_BUFFER_BYTES = 1024;
+    // Queued frames are merged into writes of up to this size
+    static constexpr size_t MAX_WRITE_BYTES = 64 << 10;
+    static constexpr uint64_t TICK_MS = 250;
+    static constexpr uint32_t GENERATION_MASK = 0xffffff;
+
+    IoEngine(SocketServer* server, ClientHandler* handler, size_t workers, bool debug);
+
+    // Called by start before the loop thread exists; false if the engine can
+    // not run (the factory then falls back)
+    virtual bool setup() = 0;
+    // Loop thread until running is cleared; calls the hooks below
+    virtual void run() = 0;
+    virtual void teardown() = 0;
+    virtual void stopListening() = 0;
+    virtual void pauseReads(int fd, Connection& connection) = 0;
+    virtual void resumeReads(int fd, Connection& connection) = 0;
+    // out is not empty and nothing is in flight
+    virtual void flush(int fd, Connection& connection) = 0;
+    // Forgets fd in the kernel side structures, the base closes it
+    virtual void forget(int fd, Connection& connection) = 0;
+
+    // Hooks for the loop thread
+    Connection& accepted(int fd);
+    void received(int fd, Connection& connection, const char* data, size_t length);
+    void peerClosed(int fd, Connection& connection);
+    // After a write completed or data was queued: starts the next write, or
+    // closes and erases a closing connection that has nothing left to wait
+    // for, so the connection must not be used after this returns
+    void written(int fd, Connection& connection);
+    // Merges the queued frames into out.front(), nothing may be in flight
+    void coalesce(Connection& connection);
+    void runCommands();
+    void tick(uint64_t now_ms);
+
+private:
+    struct Worker;
+    struct WorkerGate;
+    struct Command {
+        enum class Type {
+            Send,
+            Close,     // refuse the connection once queued data is written
+            Release,   // the worker removed the session
+            Resume,    // the worker caught up with the connection's frames
+            StopAccepting
+        };
+        Type type;
+        int fd;
+        // 0 for sends, which are for whatever connection holds fd
+        uint32_t generation = 0;
+        std::string data;
+    };
+
+    size_t worker_count;
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::shared_ptr<WorkerGate> gate;
+    std::thread loop_thread;
+    uint32_t next_generation = 0;
+
+    std::mutex command_mutex;
+    std::vector<Command> commands;
+    std::atomic<bool> wake_pending{false};
+    std::condition_variable accept_stopped_cv;
+    bool accept_stopped = false;
+
+    // Frames a connection may have waiting on its worker before reads pause
+    static constexpr uint32_t MAX_QUEUED_FRAMES = 64;
+    static constexpr uint64_t HANDSHAKE_TIMEOUT_MS = 2000;
+    // Queued data is dropped after this when the peer does not read
+    static constexpr uint64_t CLOSE_TIMEOUT_MS = 2000;
+    static constexpr size_t MAX_HANDSHAKE_BYTES = 2047;
+
+    void post(Command command);
+    void dispatch(int fd, std::function<void()> task);
+    void beginClose(int fd, Connection& connection);
+    void finishClose(int fd, Connection& connection);
+    // Worker side of a connection: the handshake starts the handler
+    // coroutine, frames and the peer going away resume it where it waits
+    // for a frame, and once it returns the client is disconnected
+    void openSession(Session& session, const std::string& handshake);
+    void deliver(Session& session, std::string frame);
+    void frameTaken(Session& session);
+    void closeSession(Session& session);
+    void resumeReader(Session& session);
+    void settle(Session& session);
+};
+
+#endif // IO_ENGINE_H
@@ -0,0 +1,145 @@
+#include "ListenerHandoff.h"
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <iostream>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+using namespace std;
+
+static bool fillUnixAddress(const string& path, struct sockaddr_un& addr) {
+    if (path.empty() || path.length() >= sizeof(addr.sun_path)) {
+        return false;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+    return true;
+}
+
+ListenerHandoff::~ListenerHandoff() {
+    stop();
+}
+
+int ListenerHandoff::receiveListener(const string& path) {
+    struct sockaddr_un addr;
+    if (!fillUnixAddress(path, addr)) {
+        return -1;
+    }
+    int peer_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (peer_fd < 0) {
+        return -1;
+    }
+    if (connect(peer_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(peer_fd);
+        return -1;
+    }
+
+    char marker;
+    struct iovec iov = {&marker, sizeof(marker)};
+    char control[CMSG_SPACE(sizeof(int))];
+    memset(control, 0, sizeof(control));
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    int listener = -1;
+    if (recvmsg(peer_fd, &msg, 0) > 0) {
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            memcpy(&listener, CMSG_DATA(cmsg), sizeof(int));
+        }
+    }
+    close(peer_fd);
+    return listener;
+}
+
+bool ListenerHandoff::serve(const string& path, int listener) {
+    struct sockaddr_un addr;
+    if (listener < 0 || !fillUnixAddress(path, addr)) {
+        return false;
+    }
+    // A previous generation has already handed over, its socket file is stale.
+    unlink(path.c_str());
+    handoff_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (handoff_fd < 0) {
+        return false;
+    }
+    if (bind(handoff_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(handoff_fd, 1) < 0) {
+        if (debugMode) {
+            cerr << "[-] Listener handoff socket unavailable: " << strerror(errno) << endl;
+        }
+        close(handoff_fd);
+        handoff_fd = -1;
+        return false;
+    }
+    socket_path = path;
+    listener_fd = listener;
+    running = true;
+    pthread_create(&handoff_thread, nullptr, [](void* arg)->void* {
+        static_cast<ListenerHandoff*>(arg)->run();
+        return nullptr;
+    }, this);
+    return true;
+}
+
+void ListenerHandoff::stop() {
+    if (!running) {
+        return;
+    }
+    running = false;
+    pthread_join(handoff_thread, nullptr);
+}
+
+void ListenerHandoff::run() {
+    bool handed_over = false;
+    while (running && !handed_over) {
+        struct pollfd pfd = {handoff_fd, POLLIN, 0};
+        if (poll(&pfd, 1, 500) <= 0) {
+            continue;
+        }
+        int peer_fd = accept(handoff_fd, nullptr, nullptr);
+        if (peer_fd < 0) {
+            continue;
+        }
+        handed_over = sendListener(peer_fd);
+        close(peer_fd);
+    }
+    // The socket file now belongs to the next process, only close our end.
+    close(handoff_fd);
+    handoff_fd = -1;
+    if (handed_over) {
+        if (debugMode) {
+            cout << "[+] Listener handed over, draining" << endl;
+        }
+        kill(getpid(), SIGTERM);
+    } else {
+        unlink(socket_path.c_str());
+    }
+}
+
+bool ListenerHandoff::sendListener(int peer_fd) {
+    char marker = 'L';
+    struct iovec iov = {&marker, sizeof(marker)};
+    char control[CMSG_SPACE(sizeof(int))];
+    memset(control, 0, sizeof(control));
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &listener_fd, sizeof(int));
+
+    return sendmsg(peer_fd, &msg, MSG_NOSIGNAL) > 0;
+}
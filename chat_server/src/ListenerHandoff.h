@@ -0,0 +1,39 @@
+#ifndef LISTENER_HANDOFF_H
+#define LISTENER_HANDOFF_H
+
+#include <pthread.h>
+#include <string>
+
+// Passes the listening socket between an old and a new server process over a
+// unix domain socket (SCM_RIGHTS), so a restart never closes the listener.
+class ListenerHandoff {
+private:
+    bool debugMode = false;
+    std::string socket_path;
+    int handoff_fd = -1;
+    int listener_fd = -1;
+    pthread_t handoff_thread;
+    volatile bool running = false;
+
+    void run();
+    bool sendListener(int peer_fd);
+
+public:
+    explicit ListenerHandoff(bool debug = false) : debugMode(debug) {}
+    ~ListenerHandoff();
+
+    // Called by a starting process. Returns the listener of the running
+    // process, or -1 if nobody is serving the handoff socket.
+    static int receiveListener(const std::string& path);
+
+    // Waits for the next process on path. After the listener has been handed
+    // over, SIGTERM is raised so this process drains and exits. False when
+    // the handoff socket could not be bound.
+    bool serve(const std::string& path, int listener);
+    void stop();
+
+    ListenerHandoff(const ListenerHandoff&) = delete;
+    ListenerHandoff& operator=(const ListenerHandoff&) = delete;
+};
+
+#endif // LISTENER_HANDOFF_H
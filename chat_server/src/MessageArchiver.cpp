@@ -0,0 +1,128 @@
+#include "MessageArchiver.h"
+#include "StorageBackend.h"
+#include "Logger.h"
+#include <chrono>
+#include <iostream>
+using namespace std;
+
+MessageArchiver::MessageArchiver(StorageBackend* db, int after_days, size_t batch_size, int interval_sec, bool debug)
+    : debugMode(debug), db(db), after_days(after_days), batch_size(batch_size > 0 ? batch_size : 1000),
+      interval_sec(interval_sec > 0 ? interval_sec : 60),
+      archived(MetricsRegistry::instance().counter("snibble_chat_messages_archived_total",
+                                                   "Messages moved from messages to messages_archive")),
+      failures(MetricsRegistry::instance().counter("snibble_chat_archive_failures_total",
+                                                   "Archive batches rolled back")),
+      batch_time(MetricsRegistry::instance().histogram("snibble_chat_archive_batch_seconds",
+                                                       "One archive batch, select to commit")) {}
+
+MessageArchiver::~MessageArchiver() {
+    stop();
+}
+
+void MessageArchiver::start() {
+    lock_guard<mutex> lock(mutex_);
+    if (running || !db || after_days <= 0) {
+        return;
+    }
+    running = true;
+    archive_thread = thread([this]() { run(); });
+}
+
+void MessageArchiver::stop() {
+    {
+        lock_guard<mutex> lock(mutex_);
+        if (!running) {
+            return;
+        }
+        running = false;
+    }
+    wake.notify_all();
+    archive_thread.join();
+}
+
+// One transaction: pick the oldest delivered messages past the archive age,
+// copy them to the archive and delete them from messages. The copy skips ids
+// already archived, so a batch committed by a server that died before
+// reading the count is not copied twice. Integers only are spliced in.
+string MessageArchiver::batchStatement() const {
+    string limit = to_string(batch_size);
+    string days = to_string(after_days);
+    if (db->dialect() == SqlDialect::SqlServer) {
+        // READPAST lets several chat servers archive at once without
+        // waiting on each other's batches
+        return R"(
+            SET NOCOUNT ON;
+            SET XACT_ABORT ON;
+            DECLARE @moved TABLE (id INT PRIMARY KEY);
+            BEGIN TRANSACTION;
+            INSERT INTO @moved (id)
+                SELECT TOP ()" + limit + R"() id FROM messages WITH (UPDLOCK, READPAST)
+                WHERE delivered = 1 AND timestamp < DATEADD(day, -)" + days + R"(, SYSUTCDATETIME())
+                ORDER BY timestamp;
+            INSERT INTO messages_archive (id, sender_id, recipient_id, message_content, timestamp, conversation_key,
+                                          content_encoding)
+                SELECT m.id, m.sender_id, m.recipient_id, m.message_content, m.timestamp, m.conversation_key,
+                       m.content_encoding
+                FROM messages m JOIN @moved v ON v.id = m.id
+                WHERE NOT EXISTS (SELECT 1 FROM messages_archive a WHERE a.id = m.id);
+            DELETE m FROM messages m JOIN @moved v ON v.id = m.id;
+            COMMIT TRANSACTION;
+            SELECT COUNT(1) FROM @moved;
+        )";
+    }
+    return R"(
+        BEGIN IMMEDIATE;
+        CREATE TEMP TABLE IF NOT EXISTS archive_batch (id INTEGER PRIMARY KEY);
+        DELETE FROM archive_batch;
+        INSERT INTO archive_batch (id)
+            SELECT id FROM messages
+            WHERE delivered = 1 AND timestamp < strftime('%Y-%m-%d %H:%M:%f', 'now', '-)" + days + R"( days')
+            ORDER BY timestamp LIMIT )" + limit + R"(;
+        INSERT OR IGNORE INTO messages_archive (conversation_key, timestamp, id, sender_id, recipient_id, message_content,
+                                                content_encoding)
+            SELECT conversation_key, timestamp, id, sender_id, recipient_id, message_content, content_encoding
+            FROM messages WHERE id IN (SELECT id FROM archive_batch);
+        DELETE FROM messages WHERE id IN (SELECT id FROM archive_batch);
+        COMMIT;
+        SELECT COUNT(1) FROM archive_batch;
+    )";
+}
+
+size_t MessageArchiver::archiveBatch() {
+    ScopedTimer timer(batch_time);
+    auto rows = db->executeQuery(batchStatement());
+    if (rows.empty() || rows.back().empty()) {
+        return 0;
+    }
+    size_t moved = stoul(rows.back()[0]);
+    archived.add(moved);
+    return moved;
+}
+
+void MessageArchiver::run() {
+    unique_lock<mutex> lock(mutex_);
+    while (running) {
+        wake.wait_for(lock, chrono::seconds(interval_sec), [this]() { return !running; });
+        // A backlog (first start, or after the database was down) is worked
+        // off in batches with a pause between them, so inserts and history
+        // reads get the tables in between
+        while (running && db->isConnected()) {
+            lock.unlock();
+            size_t moved = 0;
+            try {
+                moved = archiveBatch();
+            } catch (const exception& e) {
+                failures.add();
+                LOG_SAMPLED(LogLevel::Error, 1, "Archiving messages failed: {}", e.what());
+            }
+            lock.lock();
+            if (moved > 0 && debugMode) {
+                cout << "[+] Archived " << moved << " messages" << endl;
+            }
+            if (moved < batch_size) {
+                break;
+            }
+            wake.wait_for(lock, chrono::milliseconds(BATCH_PAUSE_MS), [this]() { return !running; });
+        }
+    }
+}
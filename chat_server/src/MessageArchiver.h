@@ -0,0 +1,56 @@
+#ifndef MESSAGE_ARCHIVER_H
+#define MESSAGE_ARCHIVER_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <string>
+#include <thread>
+#include "Metrics.h"
+
+class StorageBackend;
+
+// Keeps the messages table to recent traffic. A background thread moves
+// delivered messages older than the archive age into messages_archive in
+// small transactions, so the hot table and its indexes stay small enough
+// for the database cache while history reads span both tables.
+// Undelivered messages stay in messages until offline delivery marks them.
+class MessageArchiver {
+private:
+    bool debugMode = false;
+    StorageBackend* db = nullptr;
+    int after_days = 30;
+    size_t batch_size = 1000;
+    int interval_sec = 60;
+
+    std::mutex mutex_;
+    std::condition_variable wake;
+    bool running = false;
+    std::thread archive_thread;
+
+    Counter& archived;
+    Counter& failures;
+    Histogram& batch_time;
+
+    // Between full batches, so a large backlog does not hold the database
+    static constexpr int BATCH_PAUSE_MS = 100;
+
+    void run();
+    std::string batchStatement() const;
+
+public:
+    MessageArchiver(StorageBackend* db, int after_days, size_t batch_size, int interval_sec, bool debug = false);
+    ~MessageArchiver();
+
+    void start();
+    void stop();
+
+    // Moves one batch in one transaction and returns how many messages it
+    // moved; throws when the database fails
+    size_t archiveBatch();
+
+    MessageArchiver(const MessageArchiver&) = delete;
+    MessageArchiver& operator=(const MessageArchiver&) = delete;
+};
+
+#endif // MESSAGE_ARCHIVER_H
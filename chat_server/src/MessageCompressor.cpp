@@ -0,0 +1,236 @@
+#include "MessageCompressor.h"
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <sodium.h>
+#include <sstream>
+#include <stdexcept>
+#ifdef SNIBBLE_HAVE_ZSTD
+#include <zstd.h>
+#endif
+using namespace std;
+
+struct MessageCompressor::Dictionary {
+    uint32_t id = 0;
+    string bytes;
+#ifdef SNIBBLE_HAVE_ZSTD
+    ZSTD_CDict* cdict = nullptr;
+    ZSTD_DDict* ddict = nullptr;
+
+    ~Dictionary() {
+        ZSTD_freeCDict(cdict);
+        ZSTD_freeDDict(ddict);
+    }
+#endif
+};
+
+#ifdef SNIBBLE_HAVE_ZSTD
+namespace {
+
+// Contexts are reused per thread, creating one costs more than compressing
+// a chat message. The digested dictionaries are shared read-only.
+struct ContextDeleter {
+    void operator()(ZSTD_CCtx* context) const { ZSTD_freeCCtx(context); }
+    void operator()(ZSTD_DCtx* context) const { ZSTD_freeDCtx(context); }
+};
+
+ZSTD_CCtx* compressionContext() {
+    thread_local unique_ptr<ZSTD_CCtx, ContextDeleter> context(ZSTD_createCCtx());
+    return context.get();
+}
+
+ZSTD_DCtx* decompressionContext() {
+    thread_local unique_ptr<ZSTD_DCtx, ContextDeleter> context(ZSTD_createDCtx());
+    return context.get();
+}
+
+}
+#endif
+
+MessageCompressor::MessageCompressor(bool debug)
+    : debugMode(debug),
+      bytes_in(MetricsRegistry::instance().counter("snibble_chat_compress_input_bytes_total",
+                                                   "Bytes of bodies and batches handed to zstd")),
+      bytes_out(MetricsRegistry::instance().counter("snibble_chat_compress_output_bytes_total",
+                                                    "Bytes of the zstd frames that were kept")),
+      failures(MetricsRegistry::instance().counter("snibble_chat_decompress_failures_total",
+                                                   "Stored bodies or frames that could not be decompressed")) {}
+
+MessageCompressor::~MessageCompressor() {
+    for (Dictionary* dictionary : dictionaries) {
+        delete dictionary;
+    }
+}
+
+bool MessageCompressor::available() {
+#ifdef SNIBBLE_HAVE_ZSTD
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool MessageCompressor::configure(const string& dictionary_paths, int level, bool compress_stored, size_t min_bytes) {
+    this->level = level;
+    this->compress_stored = compress_stored;
+    this->min_bytes = min_bytes;
+    if (compress_stored && !available()) {
+        cerr << "[-] COMPRESS_STORED is set but the server was built without zstd, bodies are stored plain" << endl;
+    }
+    bool loaded = true;
+    stringstream paths(dictionary_paths);
+    string path;
+    while (getline(paths, path, ':')) {
+        if (!path.empty() && !loadDictionary(path)) {
+            loaded = false;
+        }
+    }
+    return loaded;
+}
+
+bool MessageCompressor::loadDictionary(const string& path) {
+#ifdef SNIBBLE_HAVE_ZSTD
+    ifstream file(path, ios::binary);
+    if (!file) {
+        cerr << "[-] Compression dictionary " << path << " could not be read" << endl;
+        return false;
+    }
+    auto dictionary = make_unique<Dictionary>();
+    dictionary->bytes.assign(istreambuf_iterator<char>(file), istreambuf_iterator<char>());
+    dictionary->id = ZSTD_getDictID_fromDict(dictionary->bytes.data(), dictionary->bytes.size());
+    if (dictionary->id == 0) {
+        // Raw content dictionaries have no id, frames could not name it
+        cerr << "[-] " << path << " is not a trained zstd dictionary" << endl;
+        return false;
+    }
+    if (by_id.count(dictionary->id)) {
+        return true;
+    }
+    dictionary->cdict = ZSTD_createCDict(dictionary->bytes.data(), dictionary->bytes.size(), level);
+    dictionary->ddict = ZSTD_createDDict(dictionary->bytes.data(), dictionary->bytes.size());
+    if (!dictionary->cdict || !dictionary->ddict) {
+        cerr << "[-] Compression dictionary " << path << " could not be loaded" << endl;
+        return false;
+    }
+    if (debugMode) {
+        cout << "[+] Loaded compression dictionary " << path << " id=" << dictionary->id << endl;
+    }
+    by_id[dictionary->id] = dictionary.get();
+    dictionaries.push_back(dictionary.release());
+    return true;
+#else
+    cerr << "[-] Compression dictionary " << path << " ignored, the server was built without zstd" << endl;
+    return false;
+#endif
+}
+
+uint32_t MessageCompressor::dictionaryId() const {
+    return dictionaries.empty() ? 0 : dictionaries.front()->id;
+}
+
+const string& MessageCompressor::dictionary() const {
+    static const string none;
+    return dictionaries.empty() ? none : dictionaries.front()->bytes;
+}
+
+bool MessageCompressor::compress(const string& input, string& output) const {
+#ifdef SNIBBLE_HAVE_ZSTD
+    output.resize(ZSTD_compressBound(input.size()));
+    ZSTD_CCtx* context = compressionContext();
+    size_t written = dictionaries.empty()
+        ? ZSTD_compressCCtx(context, output.data(), output.size(), input.data(), input.size(), level)
+        : ZSTD_compress_usingCDict(context, output.data(), output.size(), input.data(), input.size(),
+                                   dictionaries.front()->cdict);
+    if (ZSTD_isError(written) || written >= input.size()) {
+        return false;
+    }
+    output.resize(written);
+    bytes_in.add(input.size());
+    bytes_out.add(written);
+    return true;
+#else
+    (void)input;
+    (void)output;
+    return false;
+#endif
+}
+
+string MessageCompressor::decompress(const string& frame) const {
+#ifdef SNIBBLE_HAVE_ZSTD
+    unsigned long long size = ZSTD_getFrameContentSize(frame.data(), frame.size());
+    if (size == ZSTD_CONTENTSIZE_ERROR || size == ZSTD_CONTENTSIZE_UNKNOWN || size > MAX_DECOMPRESSED_BYTES) {
+        failures.add();
+        throw runtime_error("Not a zstd frame of a known size");
+    }
+    const ZSTD_DDict* ddict = nullptr;
+    unsigned dictionary_id = ZSTD_getDictID_fromFrame(frame.data(), frame.size());
+    if (dictionary_id != 0) {
+        auto found = by_id.find(dictionary_id);
+        if (found == by_id.end()) {
+            failures.add();
+            throw runtime_error("Compression dictionary " + to_string(dictionary_id) + " is not loaded");
+        }
+        ddict = found->second->ddict;
+    }
+    string output(size, '\0');
+    ZSTD_DCtx* context = decompressionContext();
+    size_t read = ddict
+        ? ZSTD_decompress_usingDDict(context, output.data(), output.size(), frame.data(), frame.size(), ddict)
+        : ZSTD_decompressDCtx(context, output.data(), output.size(), frame.data(), frame.size());
+    if (ZSTD_isError(read) || read != size) {
+        failures.add();
+        throw runtime_error(string("Corrupt zstd frame: ") + (ZSTD_isError(read) ? ZSTD_getErrorName(read) : "short"));
+    }
+    return output;
+#else
+    (void)frame;
+    failures.add();
+    throw runtime_error("Compressed message, but the server was built without zstd");
+#endif
+}
+
+MessageCompressor::Encoding MessageCompressor::encodeBody(const string& body, string& stored) const {
+    string frame;
+    if (compressesStored() && body.size() >= min_bytes && compress(body, frame)) {
+        // base64 grows the frame by a third, keep it only if still smaller
+        string encoded = toBase64(frame);
+        if (encoded.size() < body.size()) {
+            stored = move(encoded);
+            return Encoding::Zstd;
+        }
+    }
+    stored = body;
+    return Encoding::Plain;
+}
+
+string MessageCompressor::decodeBody(const string& stored, const string& encoding) const {
+    // Empty for rows read from a table without the column
+    if (encoding.empty() || encoding == "0") {
+        return stored;
+    }
+    if (encoding != "1") {
+        failures.add();
+        throw runtime_error("Unknown content encoding " + encoding);
+    }
+    return decompress(fromBase64(stored));
+}
+
+string MessageCompressor::toBase64(const string& bytes) {
+    string text(sodium_base64_ENCODED_LEN(bytes.size(), sodium_base64_VARIANT_ORIGINAL), '\0');
+    sodium_bin2base64(text.data(), text.size(), reinterpret_cast<const unsigned char*>(bytes.data()), bytes.size(),
+                      sodium_base64_VARIANT_ORIGINAL);
+    text.resize(text.size() - 1);  // the terminating NUL
+    return text;
+}
+
+string MessageCompressor::fromBase64(const string& text) {
+    string bytes(text.size() / 4 * 3 + 3, '\0');
+    size_t length = 0;
+    if (sodium_base642bin(reinterpret_cast<unsigned char*>(bytes.data()), bytes.size(), text.data(), text.size(),
+                          nullptr, &length, nullptr, sodium_base64_VARIANT_ORIGINAL) != 0) {
+        throw runtime_error("Invalid base64");
+    }
+    bytes.resize(length);
+    return bytes;
+}
@@ -0,0 +1,86 @@
+#ifndef MESSAGE_COMPRESSOR_H
+#define MESSAGE_COMPRESSOR_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "Metrics.h"
+
+// zstd compression of stored message bodies and of large outbound batches
+// (history, offline delivery), with a dictionary trained on chat traffic:
+// a chat message is too short to compress on its own, the dictionary
+// supplies the shared context. Without SNIBBLE_HAVE_ZSTD (built without
+// libzstd) nothing is compressed and available() is false.
+//
+// Stored bodies are base64 of a zstd frame with content_encoding 1 in the
+// messages tables, so they fit the NTEXT/TEXT column. Frames carry the id of
+// their dictionary; older dictionaries stay loaded to read older rows.
+class MessageCompressor {
+public:
+    // messages.content_encoding
+    enum class Encoding {
+        Plain = 0,
+        Zstd = 1
+    };
+
+private:
+    struct Dictionary;
+
+    bool debugMode = false;
+    int level = 3;
+    bool compress_stored = false;
+    size_t min_bytes = 64;
+    // First one compresses, all of them decompress (by dictionary id)
+    std::vector<Dictionary*> dictionaries;
+    std::unordered_map<uint32_t, Dictionary*> by_id;
+
+    Counter& bytes_in;
+    Counter& bytes_out;
+    Counter& failures;
+
+    // Largest body or batch decompressed, a corrupt frame can not make the
+    // server allocate more
+    static constexpr size_t MAX_DECOMPRESSED_BYTES = 16 << 20;
+
+    bool loadDictionary(const std::string& path);
+
+public:
+    explicit MessageCompressor(bool debug = false);
+    ~MessageCompressor();
+
+    // dictionary_paths: ':' separated files written by compress_bench
+    // --write-dict (or zstd --train), the newest first. level is the zstd
+    // level, bodies below min_bytes are left plain. False when a dictionary
+    // could not be loaded; compression then runs without one.
+    bool configure(const std::string& dictionary_paths, int level, bool compress_stored, size_t min_bytes);
+
+    // Built with zstd
+    static bool available();
+    bool compressesStored() const { return compress_stored && available(); }
+    // Id of the dictionary new frames use, 0 when there is none
+    uint32_t dictionaryId() const;
+    // Raw bytes of that dictionary, sent to clients on GET_DICTIONARY
+    const std::string& dictionary() const;
+
+    // One zstd frame of input, false when it would not be smaller
+    bool compress(const std::string& input, std::string& output) const;
+    // Throws on a corrupt frame or one needing a dictionary not loaded
+    std::string decompress(const std::string& frame) const;
+
+    // The column value and content_encoding for a message body; Plain
+    // (the body as is) unless compression is on and makes it smaller
+    Encoding encodeBody(const std::string& body, std::string& stored) const;
+    // The body for a stored column value; throws when it can not be decoded
+    std::string decodeBody(const std::string& stored, const std::string& encoding) const;
+
+    static std::string toBase64(const std::string& bytes);
+    // Throws on invalid input
+    static std::string fromBase64(const std::string& text);
+
+    MessageCompressor(const MessageCompressor&) = delete;
+    MessageCompressor& operator=(const MessageCompressor&) = delete;
+};
+
+#endif // MESSAGE_COMPRESSOR_H
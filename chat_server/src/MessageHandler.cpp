@@ -1,7 +1,14 @@
 #include "MessageHandler.h"
 #include "SocketServer.h"
 #include "ClientHandler.h"
+#include "RateLimiter.h"
+#include "Logger.h"
+#include "MessageJournal.h"
+#include "MessageCompressor.h"
+#include "ConnectionIo.h"
+#include <algorithm>
 #include <chrono>
+#include <optional>
 using namespace std;
 
 MessageHandler::MessageHandler(SocketServer* server, ClientHandler* handler) 
@@ -12,190 +19,535 @@ MessageHandler::MessageHandler(SocketServer* server, ClientHandler* handler)
 MessageHandler::~MessageHandler() {
 }
 
+MessageHandler::ConnectionState MessageHandler::openConnection(int client_fd) {
+    ConnectionState connection;
+    connection.client_fd = client_fd;
+    server_ref->mutex.lock(LOCK_SITE());
+    auto name_it = server_ref->client_names.find(client_fd);
+    if (name_it != server_ref->client_names.end()) {
+        connection.user = name_it->second;
+    }
+    auto id_it = server_ref->client_ids.find(client_fd);
+    if (id_it != server_ref->client_ids.end()) {
+        connection.user_id = id_it->second;
+    }
+    connection.authenticated = server_ref->authenticated_fds.count(client_fd) > 0;
+    connection.compress = server_ref->compressed_fds.count(client_fd) > 0;
+    server_ref->mutex.unlock();
+    connection.connection_bucket = server_ref->rate_limiter.newConnectionBucket();
+    connection.user_bucket = server_ref->rate_limiter.userBucket(connection.user);
+    connection.activity = server_ref->idle_reaper.activityFor(client_fd);
+    return connection;
+}
+
 void MessageHandler::storeAndForwardMessage(const int client_fd) {
-    char buffer[1024];
-    while (server_ref->running) {
-        int bytes_received = recv(client_fd, buffer, sizeof(buffer) - 1, 0);
-        if (bytes_received <= 0 || !server_ref->running) {
-            if (bytes_received < 0) {
-                cerr << "[-] Error receiving message: " << strerror(errno) << endl;
-            } else {
-                cout << "[+] Client disconnected normally." << endl;
-            }
-            if (client_handler) {
-                client_handler->clientDisconnectHandler(client_fd);
-            }
-            break;
+    BlockingConnectionIo io(server_ref, client_fd);
+    // Nothing suspends on a blocking connection, this returns once the client left
+    Task task = serve(io);
+    task.start();
+    if (client_handler) {
+        client_handler->clientDisconnectHandler(client_fd);
+    }
+}
+
+Task MessageHandler::serve(ConnectionIo& io) {
+    ConnectionState connection = openConnection(io.fd());
+    while (optional<string> frame = co_await io.readFrame()) {
+        try {
+            co_await processFrame(connection, io, move(*frame));
+        } catch (const exception& e) {
+            LOG_SAMPLED(LogLevel::Error, 10, "Frame failed fd={}: {}", io.fd(), e.what());
         }
-        buffer[bytes_received] = '\0';
-        string message(buffer);
-        
-        if (message.substr(0, 16) == "GET_CONTACTS_FOR") {
-            size_t pos = message.find(':');
-            if (pos != string::npos) {
-                string requested_username = message.substr(pos + 1);
-                requested_username.erase(requested_username.find_last_not_of(" \n\r\t") + 1);
-                getContactedUsers(requested_username, client_fd);
+    }
+}
+
+Task MessageHandler::processFrame(ConnectionState& connection, ConnectionIo& io, string frame) {
+    const int client_fd = connection.client_fd;
+    const string& connection_user = connection.user;
+    const bool authenticated = connection.authenticated;
+    bool& compress = connection.compress;
+    auto received_at = chrono::steady_clock::now();
+    // Spans from here to the end of the frame for sampled frames
+    TraceContext trace = Tracer::instance().startTrace();
+    TraceSpan message_span(trace, "message");
+    TraceSpan parse_span(trace, "parse");
+    // Up to the first NUL, as the receive loop always read it
+    string message = frame.substr(0, strnlen(frame.data(), frame.size()));
+    if (connection.activity) {
+        connection.activity->last_seen_ms.store(IdleReaper::nowMillis(), memory_order_relaxed);
+    }
+
+    // Heartbeat frames only refresh the idle deadline
+    string trimmed = message.substr(0, message.find_last_not_of(" \n\r\t") + 1);
+    if (trimmed == "PONG") {
+        co_return;
+    }
+    if (trimmed == "PING") {
+        co_await io.write("PONG\n", MSG_DONTWAIT | MSG_NOSIGNAL);
+        co_return;
+    }
+
+    if (!admitFrame(client_fd, *connection.connection_bucket, *connection.user_bucket)) {
+        co_return;
+    }
+    const string forbidden = "ERROR:FORBIDDEN\n";
+    
+    if (trimmed == "COMPRESS:zstd" || trimmed == "COMPRESS:none") {
+        // Format: COMPRESS_OK:zstd:dictionary_id or COMPRESS_OK:none
+        compress = trimmed == "COMPRESS:zstd" && MessageCompressor::available();
+        server_ref->mutex.lock(LOCK_SITE());
+        if (compress) {
+            server_ref->compressed_fds.insert(client_fd);
+        } else {
+            server_ref->compressed_fds.erase(client_fd);
+        }
+        server_ref->mutex.unlock();
+        co_await io.write(compressionReply(server_ref->compressor, compress));
+        co_return;
+    }
+
+    if (trimmed == "GET_DICTIONARY") {
+        // Format: DICTIONARY:id:base64, id 0 and nothing after it without one
+        const string& dictionary = server_ref->compressor.dictionary();
+        string reply = "DICTIONARY:" + to_string(server_ref->compressor.dictionaryId()) + ":" +
+                       MessageCompressor::toBase64(dictionary) + "\n";
+        co_await io.write(move(reply));
+        co_return;
+    }
+
+    if (message.substr(0, 16) == "GET_CONTACTS_FOR") {
+        size_t pos = message.find(':');
+        if (authenticated) {
+            // Format: GET_CONTACTS_FOR, any name given must be the connection's
+            string requested_username = pos == string::npos ? connection_user : message.substr(pos + 1);
+            requested_username.erase(requested_username.find_last_not_of(" \n\r\t") + 1);
+            if (requested_username == connection_user) {
+                co_await getContactedUsers(io, connection_user);
+            } else {
+                co_await io.write(forbidden, MSG_DONTWAIT | MSG_NOSIGNAL);
             }
-            continue;
+        } else if (pos != string::npos) {
+            string requested_username = message.substr(pos + 1);
+            requested_username.erase(requested_username.find_last_not_of(" \n\r\t") + 1);
+            co_await getContactedUsers(io, requested_username);
         }
-        
-        if (message.substr(0, 17) == "GET_CHAT_HISTORY:") {
-            // Format: GET_CHAT_HISTORY:username:otheruser
-            size_t pos1 = message.find(':', 17);
-            if (pos1 != string::npos) {
-                string username = message.substr(17, pos1 - 17);
-                string otherUser = message.substr(pos1 + 1);
-                // Remove any trailing newline or whitespace
-                username.erase(username.find_last_not_of(" \n\r\t") + 1);
-                otherUser.erase(otherUser.find_last_not_of(" \n\r\t") + 1);
-                getChatHistory(username, otherUser, client_fd);
+        co_return;
+    }
+    
+    if (message.substr(0, 17) == "GET_CHAT_HISTORY:") {
+        // Format: GET_CHAT_HISTORY:username:otheruser
+        // Authenticated connections may leave out username: GET_CHAT_HISTORY:otheruser
+        size_t pos1 = message.find(':', 17);
+        if (pos1 != string::npos) {
+            string username = message.substr(17, pos1 - 17);
+            string otherUser = message.substr(pos1 + 1);
+            // Remove any trailing newline or whitespace
+            username.erase(username.find_last_not_of(" \n\r\t") + 1);
+            otherUser.erase(otherUser.find_last_not_of(" \n\r\t") + 1);
+            if (authenticated && username != connection_user) {
+                co_await io.write(forbidden, MSG_DONTWAIT | MSG_NOSIGNAL);
+            } else {
+                co_await getChatHistory(io, username, otherUser, compress);
             }
-            continue;
+        } else if (authenticated) {
+            string otherUser = message.substr(17);
+            otherUser.erase(otherUser.find_last_not_of(" \n\r\t") + 1);
+            co_await getChatHistory(io, connection_user, otherUser, compress);
         }
-        
+        co_return;
+    }
+    
+    // Format: sender:recipient:content, or recipient:content once authenticated
+    string sender;
+    string recipient;
+    string msg_content;
+    if (authenticated) {
+        size_t pos = message.find(':');
+        if (pos == string::npos) co_return;
+        sender = connection_user;
+        recipient = message.substr(0, pos);
+        msg_content = message.substr(pos + 1);
+    } else {
         size_t pos1 = message.find(':');
         size_t pos2 = message.find(':', pos1 + 1);
-        if (pos1 == string::npos || pos2 == string::npos) continue;
-    
-        string sender = message.substr(0, pos1);
-        string recipient = message.substr(pos1 + 1, pos2 - pos1 - 1);
-        string msg_content = message.substr(pos2 + 1);
-
-        pthread_mutex_lock(&server_ref->mutex);
-        if (server_ref->client_map.count(recipient)) {
-            // Recipient is online - send message immediately
-            int dest_fd = server_ref->client_map[recipient];
+        if (pos1 == string::npos || pos2 == string::npos) co_return;
+
+        sender = message.substr(0, pos1);
+        recipient = message.substr(pos1 + 1, pos2 - pos1 - 1);
+        msg_content = message.substr(pos2 + 1);
+    }
+
+    parse_span.end();
+    co_await forwardMessage(connection, io, move(sender), move(recipient), move(msg_content), trace, received_at);
+}
+
+Task MessageHandler::forwardMessage(ConnectionState& connection, ConnectionIo& io, string sender, string recipient,
+                                    string msg_content, TraceContext trace, chrono::steady_clock::time_point received_at) {
+    // The connection's own id was resolved at handshake, the recipient's
+    // only when the message is inserted
+    int32_t sender_id = sender == connection.user ? connection.user_id : 0;
+    // Stored with the message, however long the journal or the database takes
+    int64_t sent_at_ms = sentAtNow();
+
+    server_ref->stores_in_flight.fetch_add(1, memory_order_relaxed);
+    bool online = false;
+    optional<OfflineStore> offline_store;
+    {
+        // The tag is per thread, it must not be held across a suspension
+        LOCK_TAG("forwardMessage");
+        TraceSpan lock_span(trace, "lock_wait");
+        server_ref->mutex.lock(LOCK_SITE());
+        lock_span.end();
+        auto recipient_it = server_ref->client_map.find(recipient);
+        online = recipient_it != server_ref->client_map.end();
+        if (online) {
+            // Recipient is online - send message immediately, under the lock
+            // so its fd cannot be closed and reused meanwhile
             string msg_to_send = sender + ": " + msg_content;
-            send(dest_fd, msg_to_send.c_str(), msg_to_send.length(), 0);
-            
-            // Store message in database as delivered (for message history)
-            storeMessageInDatabase(sender, recipient, msg_content, true);
-        } else {
-            // Recipient is offline - store message in database for later delivery
-            storeMessageInDatabase(sender, recipient, msg_content, false);
-            string success_msg = "Server: Message stored for offline user '" + recipient + "'.\n";
-            send(client_fd, success_msg.c_str(), success_msg.length(), 0);
+            TraceSpan send_span(trace, "send_recipient");
+            server_ref->sendFrame(recipient_it->second, msg_to_send);
+            send_span.end();
+            server_ref->messages_forwarded.add();
+            server_ref->forward_time.record(chrono::steady_clock::now() - received_at);
+        } else if (persistence_enabled) {
+            // Before the unlock: a login of the recipient from here on
+            // waits for this store before reading its offline messages
+            offline_store.emplace(server_ref, recipient);
         }
-        pthread_mutex_unlock(&server_ref->mutex);
+        server_ref->mutex.unlock();
     }
-    
+
+    // Stored as delivered for history, or undelivered for later delivery.
+    // Outside the server mutex: other clients keep forwarding while this
+    // waits on the journal fsync or the database.
+    bool stored = true;
+    if (persistence_enabled && db_manager) {
+        try {
+            co_await io.dbQuery(*db_manager, [&] {
+                storeMessageInDatabase(sender, recipient, sender_id, msg_content, online, sent_at_ms, trace);
+                // On the pool thread: the login waiting for it may be
+                // holding the worker this handler resumes on
+                if (offline_store) {
+                    offline_store->end();
+                }
+                return true;
+            });
+        } catch (const exception& e) {
+            LOG_SAMPLED(LogLevel::Error, 10, "Message not stored sender={} recipient={}: {}", sender, recipient, e.what());
+            stored = false;
+        }
+    } else if (persistence_enabled) {
+        storeMessageInDatabase(sender, recipient, sender_id, msg_content, online, sent_at_ms, trace);
+    }
+    offline_store.reset();
+    server_ref->stores_in_flight.fetch_sub(1, memory_order_relaxed);
+    if (!online && stored) {
+        co_await io.write("Server: Message stored for offline user '" + recipient + "'.\n");
+    }
+}
+
+bool MessageHandler::admitFrame(int client_fd, TokenBucket& connection_bucket, TokenBucket& user_bucket) {
+    uint64_t now = RateLimiter::nowNanos();
+    uint64_t retry_after_ms = 0;
+    bool admitted = connection_bucket.tryConsume(now, retry_after_ms);
+    if (admitted && !user_bucket.tryConsume(now, retry_after_ms)) {
+        // A throttled user does not spend the connection's own budget
+        connection_bucket.refund();
+        admitted = false;
+    }
+    if (!admitted) {
+        // Format: ERROR:RATE_LIMITED:retry_after_ms
+        string error_msg = "ERROR:RATE_LIMITED:" + to_string(retry_after_ms) + "\n";
+        server_ref->sendFrame(client_fd, error_msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+        return false;
+    }
+    // Shed load before queueing more work behind the database instead of
+    // letting every sender wait on the server mutex.
+    if (server_ref->stores_in_flight.load(memory_order_relaxed) >= server_ref->MAX_STORES_IN_FLIGHT) {
+        string error_msg = "ERROR:SERVER_BUSY\n";
+        server_ref->sendFrame(client_fd, error_msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+        return false;
+    }
+    return true;
 }
 
 void MessageHandler::connectToDatabase(const string& server, const string& database, const string& username, const string& password) {
-    db_manager = DatabaseManager::getInstance(server, database, username, password, true);
+    // STORAGE_BACKEND=none runs without any database, messages are only
+    // forwarded. Used by chat_bench so the server can be measured offline.
+    if (server_ref->STORAGE_BACKEND == "none") {
+        persistence_enabled = false;
+        return;
+    }
+    db_manager = StorageBackend::getInstance(server_ref->STORAGE_BACKEND, server, database, username, password, true);
     if (!db_manager || !db_manager->isConnected()) {
-        cout << "Failed to connect to database for message storage" << endl;
+        LOG_ERROR("Failed to connect to database for message storage");
     } else {
-        cout << "Connected to database for message storage" << endl;
+        LOG_INFO("Connected to database for message storage");
     }
 }
 
-void MessageHandler::storeMessageInDatabase(const string& sender, const string& recipient, const string& message, bool delivered) {
+void MessageHandler::storeMessageInDatabase(const string& sender, const string& recipient, int32_t sender_id,
+                                            const string& message, bool delivered, int64_t sent_at_ms,
+                                            const TraceContext& trace) {
+    LOCK_TAG("storeMessageInDatabase");
+    if (!persistence_enabled) {
+        return;
+    }
+    // Durable in the local journal is enough, it replays into the database.
+    // A full or failed journal falls back to the direct insert below, keyed
+    // like the replay when the record was written but its fsync failed.
+    uint64_t journal_sequence = 0;
+    int64_t journal_id = 0;
+    if (server_ref->journal) {
+        TraceSpan journal_span(trace, "journal_append");
+        if (server_ref->journal->append(sender, recipient, message, delivered, sent_at_ms, journal_sequence)) {
+            return;
+        }
+        if (journal_sequence != 0) {
+            journal_id = server_ref->journal->id();
+        }
+    }
+    TraceSpan store_span(trace, "db_insert");
     if (!db_manager || !db_manager->isConnected()) {
-        cout << "Database not connected, cannot store message" << endl;
+        LOG_SAMPLED(LogLevel::Error, 5, "Database not connected, cannot store message");
         return;
     }
     
     try {
-        // Create a unique conversation ID (consistent ordering)
-        string conversation_id = (sender < recipient) ? sender + ":" + recipient : recipient + ":" + sender;
-        
-        // Store message in database with delivered flag
-        vector<string> params = {sender, recipient, message, conversation_id, delivered ? "true" : "false"};
-        bool success = db_manager->executeParamUpdate(
-            "INSERT INTO messages (sender, recipient, message_content, conversation_id, delivered) VALUES ($1, $2, $3, $4, $5)", 
-            params
-        );
-        
-        if (success) {
-            cout << "Message stored in database for conversation: " << conversation_id << " (delivered: " << delivered << ")" << endl;
+        // Usually cached; a name seen for the first time gets its chat_users row
+        if (sender_id == 0) {
+            sender_id = server_ref->user_directory.resolve(sender);
+        }
+        int32_t recipient_id = server_ref->user_directory.resolve(recipient);
+        if (sender_id != 0 && recipient_id != 0 &&
+            insertMessage(*db_manager, server_ref->compressor, sender_id, recipient_id, message, delivered, sent_at_ms,
+                          journal_id, journal_sequence)) {
+            server_ref->messages_stored.add();
+            LOG_SAMPLED(LogLevel::Info, 10, "Message stored sender={} recipient={} delivered={}", sender, recipient, delivered);
         } else {
-            cout << "Failed to store message in database" << endl;
+            LOG_SAMPLED(LogLevel::Error, 10, "Failed to store message sender={} recipient={}", sender, recipient);
         }
     }
     catch (const exception& e) {
-        cout << "Error storing message in database: " << e.what() << endl;
+        LOG_SAMPLED(LogLevel::Error, 10, "Error storing message in database: {}", e.what());
+    }
+}
+
+MessageHandler::OfflineStore::OfflineStore(SocketServer* server, const string& recipient)
+    : server(server), recipient(recipient) {
+    server->beginOfflineStore(recipient);
+}
+
+MessageHandler::OfflineStore::~OfflineStore() {
+    end();
+}
+
+void MessageHandler::OfflineStore::end() {
+    if (server) {
+        server->endOfflineStore(recipient);
+        server = nullptr;
+    }
+}
+
+int64_t MessageHandler::sentAtNow() {
+    return chrono::duration_cast<chrono::milliseconds>(chrono::system_clock::now().time_since_epoch()).count();
+}
+
+bool MessageHandler::insertMessage(StorageBackend& db, const MessageCompressor& compressor, int32_t sender_id,
+                                   int32_t recipient_id, const string& message, bool delivered, int64_t sent_at_ms,
+                                   int64_t journal_id, uint64_t journal_sequence) {
+    // Same key for both directions, history reads it through idx_messages_conversation
+    int64_t conversation_key = UserDirectory::conversationKey(sender_id, recipient_id);
+
+    // Compressed with COMPRESS_STORED when that makes the body smaller
+    string stored;
+    auto encoding = compressor.encodeBody(message, stored);
+    
+    // Store message in database with delivered flag
+    vector<string> params = {to_string(sender_id), to_string(recipient_id), stored, to_string(conversation_key),
+                             delivered ? "1" : "0", to_string(static_cast<int>(encoding))};
+    string columns = "sender_id, recipient_id, message_content, conversation_key, delivered, content_encoding";
+    string values = "?, ?, ?, ?, ?, ?";
+    if (sent_at_ms != 0) {
+        // The send time, not the insert's: a message that waited in the
+        // journal through a database outage keeps its place in history.
+        // UTC like both column defaults (SYSUTCDATETIME(), SQLite's 'now'),
+        // in a text form DATETIME2 and SQLite both take.
+        time_t seconds = static_cast<time_t>(sent_at_ms / 1000);
+        struct tm utc;
+        gmtime_r(&seconds, &utc);
+        char timestamp[32];
+        snprintf(timestamp, sizeof(timestamp), "%04d-%02d-%02d %02d:%02d:%02d.%03d", utc.tm_year + 1900, utc.tm_mon + 1,
+                 utc.tm_mday, utc.tm_hour, utc.tm_min, utc.tm_sec, static_cast<int>(sent_at_ms % 1000));
+        params.push_back(timestamp);
+        columns += ", timestamp";
+        values += ", ?";
+    }
+    if (journal_id == 0) {
+        return db.executeParamUpdate("INSERT INTO messages (" + columns + ") VALUES (" + values + ")", params);
+    }
+    // Insert if absent, in a form both engines take; idx_messages_journal
+    // rejects a racing duplicate, which the replay then retries and skips
+    params.push_back(to_string(journal_id));
+    params.push_back(to_string(journal_sequence));
+    params.push_back(to_string(journal_id));
+    params.push_back(to_string(journal_sequence));
+    return db.executeParamUpdate(
+        "INSERT INTO messages (" + columns + ", journal_id, journal_sequence) SELECT " + values + ", ?, ? "
+        "WHERE NOT EXISTS (SELECT 1 FROM messages WHERE journal_id = ? AND journal_sequence = ?)",
+        params
+    );
+}
+
+string MessageHandler::compressionReply(const MessageCompressor& compressor, bool enabled) {
+    if (!enabled) {
+        return "COMPRESS_OK:none\n";
+    }
+    return "COMPRESS_OK:zstd:" + to_string(compressor.dictionaryId()) + "\n";
+}
+
+string MessageHandler::batchFrame(const string& lines, bool compress) {
+    string frame;
+    if (compress && lines.size() >= COMPRESSED_BATCH_MIN_BYTES && server_ref->compressor.compress(lines, frame)) {
+        // Format: COMPRESSED:original_bytes:base64 of one zstd frame, which
+        // holds the lines exactly as they would have been sent
+        return "COMPRESSED:" + to_string(lines.size()) + ":" + MessageCompressor::toBase64(frame) + "\n";
+    }
+    return lines;
+}
+
+string MessageHandler::messageBody(const string& stored, const string& encoding) {
+    try {
+        return server_ref->compressor.decodeBody(stored, encoding);
+    } catch (const exception& e) {
+        LOG_SAMPLED(LogLevel::Error, 1, "Stored message could not be decoded: {}", e.what());
+        return "[message unavailable]";
     }
 }
 
-void MessageHandler::deliverOfflineMessages(const string& username, int client_fd) {
+void MessageHandler::waitForJournalReplay() {
+    // Bounded, and skipped while the database is down: the replay is
+    // waiting for it too and the reads below fail fast anyway
+    if (server_ref->journal && db_manager && db_manager->isConnected()) {
+        server_ref->journal->waitApplied(IdleReaper::nowMillis() + JOURNAL_READ_WAIT_MS);
+    }
+}
+
+void MessageHandler::deliverOfflineMessages(const string& username, int client_fd, bool compress) {
+    LOCK_TAG("deliverOfflineMessages");
+    if (!persistence_enabled) {
+        return;
+    }
     if (!db_manager || !db_manager->isConnected()) {
-        cout << "Database not connected, cannot retrieve offline messages" << endl;
+        LOG_ERROR("Database not connected, cannot retrieve offline messages");
         return;
     }
+    // Messages forwarded to this user just before it logged in may still be
+    // on their way to the journal or the database, then in the journal
+    if (!server_ref->waitOfflineStores(username, IdleReaper::nowMillis() + JOURNAL_READ_WAIT_MS)) {
+        LOG_SAMPLED(LogLevel::Warn, 1, "Offline delivery did not wait for every pending store user={}", username);
+    }
+    waitForJournalReplay();
     
     try {
+        int32_t user_id = server_ref->user_directory.resolve(username, false);
+        if (user_id == 0) {
+            return;
+        }
         // Retrieve all undelivered messages for this user
-        vector<string> params = {username};
+        vector<string> params = {to_string(user_id)};
         auto result = db_manager->executeParamQuery(
-            "SELECT sender, message_content, timestamp FROM messages WHERE recipient = ? AND delivered = 0 ORDER BY timestamp ASC", 
+            "SELECT sender_id, message_content, timestamp, content_encoding, id FROM messages "
+            "WHERE recipient_id = ? AND delivered = 0 ORDER BY timestamp ASC", 
             params
         );
         
         if (result.size() > 0) {
             string offline_notification = "Server: You have " + to_string(result.size()) + " offline message(s):\n";
-            send(client_fd, offline_notification.c_str(), offline_notification.length(), 0);
+            server_ref->sendFrame(client_fd, offline_notification);
             
-            // Send each offline message
+            // All offline messages in one batch
+            string batch;
             for (const auto& row : result) {
-                string sender = row[0];           // sender column
-                string message_content = row[1];  // message_content column
+                string sender = server_ref->user_directory.name(static_cast<int32_t>(stol(row[0])));  // sender_id column
+                string message_content = messageBody(row[1], row[3]);  // message_content, content_encoding columns
                 string timestamp = row[2];        // timestamp column
                 
-                string offline_msg = "[OFFLINE] " + sender + " (" + timestamp + "): " + message_content + "\n";
-                send(client_fd, offline_msg.c_str(), offline_msg.length(), 0);
+                batch += "[OFFLINE] " + sender + " (" + timestamp + "): " + message_content + "\n";
             }
+            server_ref->sendFrame(client_fd, batchFrame(batch, compress));
             
-            // Mark messages as delivered
-            bool success = db_manager->executeParamUpdate(
-                "UPDATE messages SET delivered = true WHERE recipient = $1 AND delivered = false", 
-                params
-            );
+            // Mark the messages just sent as delivered, by id: the journal
+            // replay or a store in flight may have added undelivered rows
+            // for this user since the SELECT, those wait for the next login.
+            // Integers only are spliced in, OFFLINE_MARK_BATCH ids at a time.
+            bool success = true;
+            for (size_t first = 0; first < result.size(); first += OFFLINE_MARK_BATCH) {
+                string ids;
+                for (size_t i = first; i < min(result.size(), first + OFFLINE_MARK_BATCH); i++) {
+                    ids += (ids.empty() ? "" : ",") + to_string(stoll(result[i][4]));  // id column
+                }
+                success = db_manager->executeParamUpdate(
+                    "UPDATE messages SET delivered = 1 WHERE recipient_id = ? AND id IN (" + ids + ")",
+                    params
+                ) && success;
+            }
             
             if (success) {
-                cout << "Marked " << result.size() << " offline messages as delivered for user: " << username << endl;
+                LOG_INFO("Marked {} offline messages as delivered user={}", result.size(), username);
             }
         }
     }
     catch (const exception& e) {
-        cout << "Error retrieving offline messages: " << e.what() << endl;
+        LOG_ERROR("Error retrieving offline messages: {}", e.what());
     }
 }
 
-void MessageHandler::deliverOfflineMessagesToUser(const string& username, int client_fd) {
-    deliverOfflineMessages(username, client_fd);
+void MessageHandler::deliverOfflineMessagesToUser(const string& username, int client_fd, bool compress) {
+    deliverOfflineMessages(username, client_fd, compress);
 }
 
-void MessageHandler::getContactedUsers(const string& username, int client_fd) {
+Task MessageHandler::getContactedUsers(ConnectionIo& io, string username) {
+    if (!persistence_enabled) {
+        co_await io.write("CONTACTED_USERS:\n");
+        co_return;
+    }
     if (!db_manager || !db_manager->isConnected()) {
-        cout << "Database not connected, cannot retrieve contacted users" << endl;
-        string error_msg = "Server: Error retrieving contacted users\n";
-        send(client_fd, error_msg.c_str(), error_msg.length(), 0);
-        return;
+        LOG_SAMPLED(LogLevel::Error, 5, "Database not connected, cannot retrieve contacted users");
+        co_await io.write("Server: Error retrieving contacted users\n");
+        co_return;
     }
     
+    string reply;
     try {
-        vector<string> params = {username, username, username, username, username, username};
-        auto result = db_manager->executeParamQuery(
-            "SELECT DISTINCT CASE "
-            "WHEN sender = ? THEN recipient "
-            "WHEN recipient = ? THEN sender "
-            "END as contacted_user "
-            "FROM messages "
-            "WHERE (sender = ? OR recipient = ?) "
-            "AND CASE "
-            "WHEN sender = ? THEN recipient "
-            "WHEN recipient = ? THEN sender "
-            "END IS NOT NULL "
-            "ORDER BY contacted_user", 
-            params
-        );
+        // Resolving the id may wait on the database as well as the query
+        StorageBackend::Rows result = co_await io.dbQuery(*db_manager, [&] {
+            LOCK_TAG("getContactedUsers");
+            int32_t user_id = server_ref->user_directory.resolve(username, false);
+            if (user_id == 0) {
+                return StorageBackend::Rows();
+            }
+            // Each part is an index range: idx_messages_sender and
+            // idx_messages_recipient_delivered in the hot table, their
+            // archive counterparts in the cold one. Names come from the same
+            // query and are interned for later lookups.
+            string id = to_string(user_id);
+            return db_manager->executeParamQuery(
+                "SELECT id, username FROM chat_users WHERE id IN ("
+                "SELECT recipient_id FROM messages WHERE sender_id = ? "
+                "UNION SELECT sender_id FROM messages WHERE recipient_id = ? "
+                "UNION SELECT recipient_id FROM messages_archive WHERE sender_id = ? "
+                "UNION SELECT sender_id FROM messages_archive WHERE recipient_id = ?) "
+                "ORDER BY username", 
+                {id, id, id, id}
+            );
+        });
         
         if (result.size() > 0) {
             string contacted_list = "CONTACTED_USERS:";
             for (const auto& row : result) {
-                string contacted_user = row[0]; // contacted_user column
+                string contacted_user = row[1]; // username column
+                server_ref->user_directory.remember(static_cast<int32_t>(stol(row[0])), contacted_user);
                 if (!contacted_user.empty()) {
                     contacted_list += contacted_user + ",";
                 }
@@ -204,78 +556,98 @@ void MessageHandler::getContactedUsers(const string& username, int client_fd) {
             if (contacted_list.back() == ',') {
                 contacted_list.pop_back();
             }
-            contacted_list += "\n";
-            
-            send(client_fd, contacted_list.c_str(), contacted_list.length(), 0);
-            cout << "Sent contacted users list to " << username << ": " << result.size() << " users" << endl;
+            reply = contacted_list + "\n";
+            LOG_SAMPLED(LogLevel::Info, 10, "Sent contacted users user={} count={}", username, result.size());
         } else {
-            string no_contacts = "CONTACTED_USERS:\n";
-            send(client_fd, no_contacts.c_str(), no_contacts.length(), 0);
-            cout << "No contacted users found for " << username << endl;
+            reply = "CONTACTED_USERS:\n";
+            LOG_SAMPLED(LogLevel::Info, 10, "No contacted users user={}", username);
         }
     }
     catch (const exception& e) {
-        cout << "Error retrieving contacted users: " << e.what() << endl;
-        string error_msg = "Server: Error retrieving contacted users\n";
-        send(client_fd, error_msg.c_str(), error_msg.length(), 0);
+        LOG_SAMPLED(LogLevel::Error, 10, "Error retrieving contacted users: {}", e.what());
+        reply = "Server: Error retrieving contacted users\n";
     }
+    co_await io.write(move(reply));
 }
 
-void MessageHandler::getChatHistory(const string& username, const string& otherUser, int client_fd) {
+Task MessageHandler::getChatHistory(ConnectionIo& io, string username, string otherUser, bool compress) {
+    if (!persistence_enabled) {
+        co_await io.write("CHAT_HISTORY_START:" + username + ":" + otherUser + "\n" +
+                          "CHAT_HISTORY_END:" + username + ":" + otherUser + "\n");
+        co_return;
+    }
     if (!db_manager || !db_manager->isConnected()) {
-        cout << "Database not connected, cannot retrieve chat history" << endl;
-        string error_msg = "CHAT_HISTORY_ERROR:Database not connected\n";
-        send(client_fd, error_msg.c_str(), error_msg.length(), 0);
-        return;
+        LOG_SAMPLED(LogLevel::Error, 5, "Database not connected, cannot retrieve chat history");
+        co_await io.write("CHAT_HISTORY_ERROR:Database not connected\n");
+        co_return;
     }
     
+    string reply;
     try {
-        // Get all messages between these two users, ordered by timestamp
-        vector<string> params = {username, otherUser, otherUser, username};
-        auto result = db_manager->executeParamQuery(
-            "SELECT sender, recipient, message_content, timestamp, delivered "
-            "FROM messages "
-            "WHERE (sender = ? AND recipient = ?) OR (sender = ? AND recipient = ?) "
-            "ORDER BY timestamp ASC", 
-            params
-        );
-        
-        if (result.size() > 0) {
-            string history_response = "CHAT_HISTORY_START:" + username + ":" + otherUser + "\n";
-            send(client_fd, history_response.c_str(), history_response.length(), 0);
+        // The journal wait, the ids, the query and the names of the rows may
+        // all wait on the database; empty when there is no history
+        string history = co_await io.dbQuery(*db_manager, [&] {
+            LOCK_TAG("getChatHistory");
+            waitForJournalReplay();
+            int32_t user_id = server_ref->user_directory.resolve(username, false);
+            int32_t other_id = server_ref->user_directory.resolve(otherUser, false);
+            if (user_id == 0 || other_id == 0) {
+                return string();
+            }
+            // Get all messages between these two users, ordered by timestamp:
+            // one range of idx_messages_conversation for recent messages and
+            // one of the archive's clustered index for those the
+            // MessageArchiver moved. Archived messages were all delivered.
+            // NTEXT can not be combined with NVARCHAR(MAX) on SQL Server.
+            string content = db_manager->dialect() == SqlDialect::SqlServer
+                ? "CAST(message_content AS NVARCHAR(MAX))"
+                : "message_content";
+            string key = to_string(UserDirectory::conversationKey(user_id, other_id));
+            auto result = db_manager->executeParamQuery(
+                "SELECT sender_id, recipient_id, " + content + ", timestamp, delivered, content_encoding "
+                "FROM messages "
+                "WHERE conversation_key = ? "
+                "UNION ALL "
+                "SELECT sender_id, recipient_id, message_content, timestamp, 1, content_encoding "
+                "FROM messages_archive "
+                "WHERE conversation_key = ? "
+                "ORDER BY timestamp ASC", 
+                {key, key}
+            );
+            if (result.empty()) {
+                return string();
+            }
             
-            // Send each message in the conversation
+            // The whole conversation as one batch, START and END included
+            string lines = "CHAT_HISTORY_START:" + username + ":" + otherUser + "\n";
             for (const auto& row : result) {
-                string sender = row[0];           // sender column
-                string recipient = row[1];        // recipient column
-                string message_content = row[2];  // message_content column
+                string sender = server_ref->user_directory.name(static_cast<int32_t>(stol(row[0])));     // sender_id column
+                string recipient = server_ref->user_directory.name(static_cast<int32_t>(stol(row[1])));  // recipient_id column
+                string message_content = messageBody(row[2], row[5]);  // message_content, content_encoding columns
                 string timestamp = row[3];        // timestamp column
                 bool delivered = (row[4] == "1" || row[4] == "true"); // delivered column
                 
                 // Format: CHAT_HISTORY_MSG:sender:recipient:message:timestamp:delivered
-                string msg_line = "CHAT_HISTORY_MSG:" + sender + ":" + recipient + ":" + 
-                                 message_content + ":" + timestamp + ":" + (delivered ? "true" : "false") + "\n";
-                send(client_fd, msg_line.c_str(), msg_line.length(), 0);
+                lines += "CHAT_HISTORY_MSG:" + sender + ":" + recipient + ":" + 
+                         message_content + ":" + timestamp + ":" + (delivered ? "true" : "false") + "\n";
             }
-            
-            string history_end = "CHAT_HISTORY_END:" + username + ":" + otherUser + "\n";
-            send(client_fd, history_end.c_str(), history_end.length(), 0);
-            
-            cout << "Sent chat history to " << username << " for conversation with " << otherUser 
-                 << ": " << result.size() << " messages" << endl;
+            lines += "CHAT_HISTORY_END:" + username + ":" + otherUser + "\n";
+            LOG_SAMPLED(LogLevel::Info, 10, "Sent chat history user={} other={} count={}", username, otherUser,
+                        result.size());
+            return lines;
+        });
+        
+        if (!history.empty()) {
+            reply = batchFrame(history, compress);
         } else {
-            string no_history = "CHAT_HISTORY_START:" + username + ":" + otherUser + "\n";
-            send(client_fd, no_history.c_str(), no_history.length(), 0);
-            string history_end = "CHAT_HISTORY_END:" + username + ":" + otherUser + "\n";
-            send(client_fd, history_end.c_str(), history_end.length(), 0);
-            cout << "No chat history found between " << username << " and " << otherUser << endl;
+            reply = "CHAT_HISTORY_START:" + username + ":" + otherUser + "\n" +
+                    "CHAT_HISTORY_END:" + username + ":" + otherUser + "\n";
+            LOG_SAMPLED(LogLevel::Info, 10, "No chat history user={} other={}", username, otherUser);
         }
     }
     catch (const exception& e) {
-        cout << "Error retrieving chat history: " << e.what() << endl;
-        string error_msg = "CHAT_HISTORY_ERROR:Error retrieving chat history\n";
-        send(client_fd, error_msg.c_str(), error_msg.length(), 0);
+        LOG_SAMPLED(LogLevel::Error, 10, "Error retrieving chat history: {}", e.what());
+        reply = "CHAT_HISTORY_ERROR:Error retrieving chat history\n";
     }
+    co_await io.write(move(reply));
 }
-
-
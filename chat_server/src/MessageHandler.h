@@ -1,32 +1,116 @@
 #ifndef MESSAGE_HANDLER_H
 #define MESSAGE_HANDLER_H
 
+#include <chrono>
+#include <cstdint>
 #include <string>
 #include <cstring>
+#include <memory>
 #include <unistd.h>
 #include <iostream>
-#include "DatabaseManager.h"
+#include "StorageBackend.h"
+#include "Task.h"
+#include "Tracer.h"
+
+class TokenBucket;
+class ConnectionIo;
+class MessageCompressor;
+struct ConnectionActivity;
 
 class SocketServer;
 class ClientHandler;
 
 class MessageHandler {
+public:
+    // What the handler keeps about its connection from one frame to the next
+    struct ConnectionState {
+        int client_fd = -1;
+        std::string user;
+        int32_t user_id = 0;
+        // A token-authenticated connection speaks as its verified user only
+        bool authenticated = false;
+        // Asked for in the handshake, or later with a COMPRESS frame
+        bool compress = false;
+        std::shared_ptr<TokenBucket> connection_bucket;
+        std::shared_ptr<TokenBucket> user_bucket;
+        std::shared_ptr<ConnectionActivity> activity;
+    };
+
 private:
+    // Counts a store for an offline recipient on the server from the
+    // forward until end(), or until the coroutine holding it is destroyed
+    class OfflineStore {
+        SocketServer* server;
+        std::string recipient;
+    public:
+        OfflineStore(SocketServer* server, const std::string& recipient);
+        ~OfflineStore();
+        void end();
+
+        OfflineStore(const OfflineStore&) = delete;
+        OfflineStore& operator=(const OfflineStore&) = delete;
+    };
+
     SocketServer* server_ref = nullptr;
     ClientHandler* client_handler = nullptr;
-    DatabaseManager* db_manager = nullptr;
+    StorageBackend* db_manager = nullptr;
+    bool persistence_enabled = true;
+    static constexpr uint64_t JOURNAL_READ_WAIT_MS = 500;
+    // Ids per UPDATE when offline messages are marked delivered
+    static constexpr size_t OFFLINE_MARK_BATCH = 500;
+    // Smaller history and offline batches are sent as plain lines
+    static constexpr size_t COMPRESSED_BATCH_MIN_BYTES = 512;
     
     void connectToDatabase(const std::string& server, const std::string& database, const std::string& username, const std::string& password);
-    void storeMessageInDatabase(const std::string& sender, const std::string& recipient, const std::string& message, bool delivered = true);
-    void deliverOfflineMessages(const std::string& username, int client_fd);
-    void getContactedUsers(const std::string& username, int client_fd);
-    void getChatHistory(const std::string& username, const std::string& otherUser, int client_fd);
+    // sender_id is the handshake's when known, 0 otherwise; ids are only
+    // resolved for the direct insert, the journal takes the names.
+    // sent_at_ms is when the server received the message, see sentAtNow
+    void storeMessageInDatabase(const std::string& sender, const std::string& recipient, int32_t sender_id,
+                                const std::string& message, bool delivered, int64_t sent_at_ms,
+                                const TraceContext& trace = TraceContext());
+    // Lets reads of the messages table see what the journal has taken so far
+    void waitForJournalReplay();
+    void deliverOfflineMessages(const std::string& username, int client_fd, bool compress);
+    // Command handlers, straight-line coroutines; arguments are taken by
+    // value since the caller's frame may be gone when they resume
+    Task getContactedUsers(ConnectionIo& io, std::string username);
+    Task getChatHistory(ConnectionIo& io, std::string username, std::string otherUser, bool compress);
+    Task forwardMessage(ConnectionState& connection, ConnectionIo& io, std::string sender, std::string recipient,
+                        std::string msg_content, TraceContext trace, std::chrono::steady_clock::time_point received_at);
+    // Newline separated lines as one frame: COMPRESSED when the connection
+    // negotiated it and that is smaller, the lines as they are otherwise
+    std::string batchFrame(const std::string& lines, bool compress);
+    // The stored message_content of a row, decompressed; a row that can not
+    // be decoded is logged and replaced by a placeholder
+    std::string messageBody(const std::string& stored, const std::string& encoding);
+    bool admitFrame(int client_fd, TokenBucket& connection_bucket, TokenBucket& user_bucket);
 
 public:
     MessageHandler(SocketServer* server, ClientHandler* handler = nullptr);
     ~MessageHandler();
+    // Receive thread of the threaded model: runs serve on a blocking
+    // connection, then disconnects the client
     void storeAndForwardMessage(const int client_fd);
-    void deliverOfflineMessagesToUser(const std::string& username, int client_fd);
+    // Handles a registered connection's frames in order until the peer is
+    // gone; the I/O engines run it on their workers
+    Task serve(ConnectionIo& io);
+    // State of a registered connection, read once before its first frame
+    ConnectionState openConnection(int client_fd);
+    // One received frame
+    Task processFrame(ConnectionState& connection, ConnectionIo& io, std::string frame);
+    // Wall clock in Unix milliseconds, the timestamp a message is stored with
+    static int64_t sentAtNow();
+    // The messages table insert, shared with the journal replay. The row's
+    // timestamp is sent_at_ms, or the database's clock when it is 0 (journal
+    // records from before it was kept). A non zero journal_id keys the row
+    // by journal_id and journal_sequence, and a key already there is not
+    // inserted again.
+    static bool insertMessage(StorageBackend& db, const MessageCompressor& compressor, int32_t sender_id,
+                              int32_t recipient_id, const std::string& message, bool delivered, int64_t sent_at_ms,
+                              int64_t journal_id, uint64_t journal_sequence);
+    void deliverOfflineMessagesToUser(const std::string& username, int client_fd, bool compress = false);
+    // COMPRESS_OK reply for a connection that asked for compression
+    static std::string compressionReply(const MessageCompressor& compressor, bool enabled);
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,599 @@
+#include "MessageJournal.h"
+#include "IdleReaper.h"
+#include "Logger.h"
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <iostream>
+#include <random>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+using namespace std;
+
+namespace {
+
+constexpr size_t MIN_SEGMENT_BYTES = 1 << 20;
+constexpr size_t REPLAY_BATCH = 128;
+constexpr auto CHECKPOINT_INTERVAL = chrono::milliseconds(100);
+constexpr uint8_t FLAG_DELIVERED = 1;
+constexpr uint8_t FLAG_SENT_AT = 2;
+
+const array<uint32_t, 256>& crcTable() {
+    static const array<uint32_t, 256> table = []() {
+        array<uint32_t, 256> built{};
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t crc = i;
+            for (int bit = 0; bit < 8; bit++) {
+                crc = (crc & 1) ? (crc >> 1) ^ 0xEDB88320u : crc >> 1;
+            }
+            built[i] = crc;
+        }
+        return built;
+    }();
+    return table;
+}
+
+// CRC-32 (IEEE) of the sequence and payload of a record
+uint32_t recordCrc(const char* data, size_t length) {
+    const auto& table = crcTable();
+    uint32_t crc = 0xFFFFFFFFu;
+    for (size_t i = 0; i < length; i++) {
+        crc = table[(crc ^ static_cast<uint8_t>(data[i])) & 0xFF] ^ (crc >> 8);
+    }
+    return crc ^ 0xFFFFFFFFu;
+}
+
+// Records start on 8 byte boundaries so headers are never split oddly
+size_t paddedRecordBytes(size_t payload) {
+    return (16 + payload + 7) & ~size_t(7);
+}
+
+void putString(char*& out, const string& value) {
+    uint32_t length = static_cast<uint32_t>(value.size());
+    memcpy(out, &length, 4);
+    memcpy(out + 4, value.data(), value.size());
+    out += 4 + value.size();
+}
+
+bool getString(const char*& in, const char* end, string& value) {
+    uint32_t length;
+    if (end - in < 4) {
+        return false;
+    }
+    memcpy(&length, in, 4);
+    in += 4;
+    if (static_cast<size_t>(end - in) < length) {
+        return false;
+    }
+    value.assign(in, length);
+    in += length;
+    return true;
+}
+
+string segmentName(uint64_t first_sequence) {
+    char name[48];
+    snprintf(name, sizeof(name), "journal-%020llu.log", static_cast<unsigned long long>(first_sequence));
+    return name;
+}
+
+void syncDirectory(const string& dir) {
+    int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd >= 0) {
+        fsync(fd);
+        ::close(fd);
+    }
+}
+
+}  // namespace
+
+MessageJournal::Segment::~Segment() {
+    if (base) {
+        munmap(base, size);
+    }
+    if (fd >= 0) {
+        ::close(fd);
+    }
+}
+
+MessageJournal::MessageJournal(const string& dir, size_t segment_bytes, size_t max_segments, bool debug)
+    : debugMode(debug), dir(dir), segment_bytes(max(segment_bytes, MIN_SEGMENT_BYTES)),
+      max_segments(max<size_t>(max_segments, 2)),
+      appended(MetricsRegistry::instance().counter("snibble_journal_appended_total",
+                                                   "Messages made durable in the local journal")),
+      replay_failures(MetricsRegistry::instance().counter(
+          "snibble_journal_replay_failures_total", "Journal records the database refused, retried with backoff")),
+      sync_time(MetricsRegistry::instance().histogram("snibble_journal_sync_seconds",
+                                                      "One group fsync of the journal")) {
+    MetricsRegistry::instance().gaugeFunction("snibble_journal_unapplied_records",
+                                              "Journal records not yet in the database", {},
+                                              [this]() { return static_cast<double>(unapplied()); });
+}
+
+MessageJournal::~MessageJournal() {
+    close();
+    MetricsRegistry::instance().gaugeFunction("snibble_journal_unapplied_records",
+                                              "Journal records not yet in the database", {},
+                                              []() { return 0.0; });
+}
+
+shared_ptr<MessageJournal::Segment> MessageJournal::createSegment(uint64_t first_sequence) {
+    auto segment = make_shared<Segment>();
+    segment->path = dir + "/" + segmentName(first_sequence);
+    segment->first_sequence = first_sequence;
+    segment->size = segment_bytes;
+    segment->fd = ::open(segment->path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (segment->fd < 0) {
+        LOG_ERROR("Journal could not create {}: {}", segment->path, strerror(errno));
+        return nullptr;
+    }
+    // Allocated up front: a write into a sparse mapping on a full disk is a SIGBUS
+    int err = posix_fallocate(segment->fd, 0, static_cast<off_t>(segment->size));
+    if (err != 0) {
+        LOG_ERROR("Journal could not allocate {}: {}", segment->path, strerror(err));
+        unlink(segment->path.c_str());
+        return nullptr;
+    }
+    void* mapped = mmap(nullptr, segment->size, PROT_READ | PROT_WRITE, MAP_SHARED, segment->fd, 0);
+    if (mapped == MAP_FAILED) {
+        LOG_ERROR("Journal could not map {}: {}", segment->path, strerror(errno));
+        unlink(segment->path.c_str());
+        return nullptr;
+    }
+    segment->base = static_cast<char*>(mapped);
+    syncDirectory(dir);
+    return segment;
+}
+
+shared_ptr<MessageJournal::Segment> MessageJournal::openSegment(const string& path, uint64_t first_sequence) {
+    auto segment = make_shared<Segment>();
+    segment->path = path;
+    segment->first_sequence = first_sequence;
+    segment->fd = ::open(path.c_str(), O_RDWR);
+    struct stat info;
+    if (segment->fd < 0 || fstat(segment->fd, &info) != 0 || info.st_size < static_cast<off_t>(HEADER_BYTES)) {
+        return nullptr;
+    }
+    segment->size = static_cast<size_t>(info.st_size);
+    void* mapped = mmap(nullptr, segment->size, PROT_READ | PROT_WRITE, MAP_SHARED, segment->fd, 0);
+    if (mapped == MAP_FAILED) {
+        return nullptr;
+    }
+    segment->base = static_cast<char*>(mapped);
+    return segment;
+}
+
+bool MessageJournal::recoverSegment(Segment& segment, uint64_t& next_sequence) {
+    size_t offset = 0;
+    while (offset + HEADER_BYTES <= segment.size) {
+        uint32_t length;
+        uint32_t crc;
+        uint64_t sequence;
+        memcpy(&length, segment.base + offset, 4);
+        memcpy(&crc, segment.base + offset + 4, 4);
+        memcpy(&sequence, segment.base + offset + 8, 8);
+        if (length == 0) {
+            // Zero filled remainder: the segment ended cleanly here
+            return true;
+        }
+        if (length > segment.size - offset - HEADER_BYTES || sequence != next_sequence ||
+            recordCrc(segment.base + offset + 8, 8 + length) != crc) {
+            LOG_WARN("Journal {} is torn at offset {}, the records after it are dropped", segment.path, offset);
+            return false;
+        }
+        offset += paddedRecordBytes(length);
+        segment.written = min(offset, segment.size);
+        segment.last_sequence = sequence;
+        next_sequence++;
+    }
+    return true;
+}
+
+uint64_t MessageJournal::readCheckpoint() {
+    FILE* file = fopen((dir + "/checkpoint").c_str(), "r");
+    if (!file) {
+        return 0;
+    }
+    unsigned long long applied = 0;
+    if (fscanf(file, "%llu", &applied) != 1) {
+        applied = 0;
+    }
+    fclose(file);
+    return applied;
+}
+
+bool MessageJournal::writeCheckpoint(uint64_t applied) {
+    // Written aside and renamed over, a crash leaves the old or the new one
+    string temporary = dir + "/checkpoint.tmp";
+    int fd = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return false;
+    }
+    string text = to_string(applied) + "\n";
+    bool ok = write(fd, text.data(), text.size()) == static_cast<ssize_t>(text.size()) && fsync(fd) == 0;
+    ::close(fd);
+    return ok && rename(temporary.c_str(), (dir + "/checkpoint").c_str()) == 0;
+}
+
+bool MessageJournal::loadId(bool fresh) {
+    string path = dir + "/journal-id";
+    if (!fresh) {
+        if (FILE* file = fopen(path.c_str(), "r")) {
+            long long stored = 0;
+            bool read = fscanf(file, "%lld", &stored) == 1 && stored > 0;
+            fclose(file);
+            if (read) {
+                journal_id = stored;
+                return true;
+            }
+        }
+    }
+    // Positive so it fits a signed BIGINT column
+    random_device device;
+    uint64_t random = (static_cast<uint64_t>(device()) << 32) | device();
+    journal_id = static_cast<int64_t>(random >> 1);
+    if (journal_id == 0) {
+        journal_id = 1;
+    }
+    string temporary = path + ".tmp";
+    int fd = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        LOG_ERROR("Journal id {} could not be written: {}", path, strerror(errno));
+        return false;
+    }
+    string text = to_string(journal_id) + "\n";
+    bool ok = write(fd, text.data(), text.size()) == static_cast<ssize_t>(text.size()) && fsync(fd) == 0;
+    ::close(fd);
+    if (!ok || rename(temporary.c_str(), path.c_str()) != 0) {
+        LOG_ERROR("Journal id {} could not be written: {}", path, strerror(errno));
+        return false;
+    }
+    syncDirectory(dir);
+    return true;
+}
+
+bool MessageJournal::open(ApplyFunction apply_function) {
+    if (running) {
+        return true;
+    }
+    if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) {
+        LOG_ERROR("Journal directory {} could not be created: {}", dir, strerror(errno));
+        return false;
+    }
+    apply = move(apply_function);
+    uint64_t applied = readCheckpoint();
+
+    vector<pair<uint64_t, string>> found;
+    if (DIR* listing = opendir(dir.c_str())) {
+        while (dirent* entry = readdir(listing)) {
+            string name = entry->d_name;
+            if (name.size() == 32 && name.compare(0, 8, "journal-") == 0 && name.compare(28, 4, ".log") == 0) {
+                found.emplace_back(stoull(name.substr(8, 20)), dir + "/" + name);
+            }
+        }
+        closedir(listing);
+    }
+    sort(found.begin(), found.end());
+    if (!loadId(found.empty() && applied == 0)) {
+        return false;
+    }
+
+    // Each segment keeps the records before its first torn or corrupt one.
+    // A tear at the tail of the newest segment is a write whose group fsync
+    // never finished, so it was never acknowledged; older segments were
+    // synced before it and are kept whole.
+    uint64_t last_sequence = applied;
+    for (const auto& [first_sequence, path] : found) {
+        shared_ptr<Segment> segment = openSegment(path, first_sequence);
+        uint64_t next_sequence = first_sequence;
+        bool clean = segment && recoverSegment(*segment, next_sequence);
+        if (!segment || segment->written == 0) {
+            // Never written to (its name may be reused below) or unreadable
+            if (clean) {
+                unlink(path.c_str());
+            } else {
+                rename(path.c_str(), (path + ".torn").c_str());
+            }
+            continue;
+        }
+        msync(segment->base, segment->size, MS_SYNC);
+        segment->synced = segment->written;
+        segment->sealed = true;
+        segments.push_back(segment);
+        last_sequence = max(last_sequence, next_sequence - 1);
+    }
+
+    auto current = createSegment(last_sequence + 1);
+    if (!current) {
+        segments.clear();
+        return false;
+    }
+    segments.push_back(current);
+    written_sequence = durable_sequence = last_sequence;
+    applied_sequence.store(applied, memory_order_relaxed);
+    replay_segment = segments.front();
+    replay_offset = 0;
+    failed = false;
+    running = true;
+    if (debugMode) {
+        cout << "[+] Journal opened in " << dir << ", " << (last_sequence - applied) << " records to replay" << endl;
+    }
+    sync_thread = thread(&MessageJournal::syncLoop, this);
+    replay_thread = thread(&MessageJournal::replayLoop, this);
+    return true;
+}
+
+void MessageJournal::close() {
+    {
+        lock_guard<mutex> lock(mutex_);
+        if (!running) {
+            return;
+        }
+        running = false;
+    }
+    written_cv.notify_all();
+    durable_cv.notify_all();
+    sync_thread.join();
+    replay_thread.join();
+    lock_guard<mutex> lock(mutex_);
+    replay_segment.reset();
+    unsynced_sealed.clear();
+    segments.clear();
+}
+
+bool MessageJournal::append(const string& sender, const string& recipient, const string& message, bool delivered,
+                            int64_t sent_at_ms, uint64_t& sequence) {
+    sequence = 0;
+    size_t payload = 1 + 8 + 4 + sender.size() + 4 + recipient.size() + 4 + message.size();
+    size_t record_bytes = paddedRecordBytes(payload);
+    if (record_bytes > segment_bytes / 2) {
+        return false;
+    }
+
+    unique_lock<mutex> lock(mutex_);
+    if (!running || failed) {
+        return false;
+    }
+    Segment* segment = segments.back().get();
+    if (segment->written + record_bytes > segment->size) {
+        if (segments.size() >= max_segments) {
+            LOG_SAMPLED(LogLevel::Warn, 1, "Journal is full ({} segments), storing messages directly", segments.size());
+            return false;
+        }
+        auto next = createSegment(written_sequence + 1);
+        if (!next) {
+            return false;
+        }
+        segment->sealed = true;
+        unsynced_sealed.push_back(segments.back());
+        segments.push_back(next);
+        segment = next.get();
+    }
+
+    sequence = ++written_sequence;
+    char* record = segment->base + segment->written;
+    char* out = record + HEADER_BYTES;
+    *out++ = static_cast<char>((delivered ? FLAG_DELIVERED : 0) | FLAG_SENT_AT);
+    memcpy(out, &sent_at_ms, 8);
+    out += 8;
+    putString(out, sender);
+    putString(out, recipient);
+    putString(out, message);
+    uint32_t length = static_cast<uint32_t>(payload);
+    memcpy(record + 8, &sequence, 8);
+    uint32_t crc = recordCrc(record + 8, 8 + payload);
+    memcpy(record + 4, &crc, 4);
+    // Length last: a record without it reads as the clean end of the segment
+    memcpy(record, &length, 4);
+    segment->written += record_bytes;
+    segment->last_sequence = sequence;
+
+    written_cv.notify_one();
+    durable_cv.wait(lock, [&]() { return durable_sequence >= sequence || failed; });
+    if (durable_sequence < sequence) {
+        return false;
+    }
+    appended.add();
+    return true;
+}
+
+void MessageJournal::syncLoop() {
+    const size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    auto backoff = chrono::milliseconds(100);
+    unique_lock<mutex> lock(mutex_);
+    while (true) {
+        written_cv.wait(lock, [&]() { return !running || written_sequence > durable_sequence; });
+        if (written_sequence == durable_sequence) {
+            break;
+        }
+        // Everything written while the previous fsync ran goes in this one
+        uint64_t target = written_sequence;
+        vector<pair<shared_ptr<Segment>, size_t>> work;
+        for (auto& sealed : unsynced_sealed) {
+            work.emplace_back(sealed, sealed->written);
+        }
+        unsynced_sealed.clear();
+        work.emplace_back(segments.back(), segments.back()->written);
+        lock.unlock();
+
+        auto started = chrono::steady_clock::now();
+        bool ok = true;
+        for (auto& [segment, end] : work) {
+            if (end <= segment->synced) {
+                continue;
+            }
+            size_t from = segment->synced & ~(page - 1);
+            if (msync(segment->base + from, end - from, MS_SYNC) != 0) {
+                LOG_ERROR("Journal fsync of {} failed: {}", segment->path, strerror(errno));
+                ok = false;
+                break;
+            }
+            segment->synced = end;
+        }
+        sync_time.record(chrono::steady_clock::now() - started);
+
+        lock.lock();
+        if (ok) {
+            durable_sequence = target;
+            if (failed) {
+                LOG_INFO("Journal fsync recovered, appending again");
+                failed = false;
+                backoff = chrono::milliseconds(100);
+            }
+            durable_cv.notify_all();
+            continue;
+        }
+        // Waiting appenders store their messages directly, keyed by their
+        // sequence, and new ones do until a retry gets the same records to
+        // disk; the replay then skips the rows already inserted
+        failed = true;
+        durable_cv.notify_all();
+        vector<shared_ptr<Segment>> retry;
+        for (size_t i = 0; i + 1 < work.size(); i++) {
+            if (work[i].first->synced < work[i].first->written) {
+                retry.push_back(work[i].first);
+            }
+        }
+        unsynced_sealed.insert(unsynced_sealed.begin(), retry.begin(), retry.end());
+        if (!running) {
+            break;
+        }
+        written_cv.wait_for(lock, backoff, [&]() { return !running; });
+        backoff = min(backoff * 2, chrono::milliseconds(5000));
+    }
+}
+
+vector<JournalEntry> MessageJournal::readBatch(size_t max) {
+    vector<JournalEntry> batch;
+    uint64_t applied = applied_sequence.load(memory_order_relaxed);
+    lock_guard<mutex> lock(mutex_);
+    while (batch.size() < max && replay_segment) {
+        Segment& segment = *replay_segment;
+        if (replay_offset + HEADER_BYTES <= segment.written) {
+            const char* record = segment.base + replay_offset;
+            uint32_t length;
+            uint64_t sequence;
+            memcpy(&length, record, 4);
+            memcpy(&sequence, record + 8, 8);
+            if (sequence > durable_sequence) {
+                break;
+            }
+            replay_offset += paddedRecordBytes(length);
+            if (sequence <= applied) {
+                continue;
+            }
+            JournalEntry entry;
+            entry.sequence = sequence;
+            const char* in = record + HEADER_BYTES;
+            const char* end = in + length;
+            uint8_t flags = static_cast<uint8_t>(*in++);
+            entry.delivered = (flags & FLAG_DELIVERED) != 0;
+            if ((flags & FLAG_SENT_AT) && end - in >= 8) {
+                memcpy(&entry.sent_at_ms, in, 8);
+                in += 8;
+            }
+            if (getString(in, end, entry.sender) && getString(in, end, entry.recipient) &&
+                getString(in, end, entry.message)) {
+                batch.push_back(move(entry));
+            }
+            continue;
+        }
+        if (!segment.sealed) {
+            break;
+        }
+        // Finished a sealed segment, move to the one after it
+        shared_ptr<Segment> next;
+        for (auto& candidate : segments) {
+            if (candidate->first_sequence > segment.first_sequence) {
+                next = candidate;
+                break;
+            }
+        }
+        if (!next) {
+            break;
+        }
+        replay_segment = next;
+        replay_offset = 0;
+    }
+    return batch;
+}
+
+void MessageJournal::releaseApplied(uint64_t applied) {
+    lock_guard<mutex> lock(mutex_);
+    while (segments.size() > 1 && segments.front()->sealed && segments.front()->last_sequence <= applied &&
+           segments.front() != replay_segment) {
+        unlink(segments.front()->path.c_str());
+        segments.pop_front();
+    }
+}
+
+void MessageJournal::replayLoop() {
+    auto last_checkpoint = chrono::steady_clock::now();
+    uint64_t checkpointed = applied_sequence.load(memory_order_relaxed);
+    while (true) {
+        {
+            unique_lock<mutex> lock(mutex_);
+            durable_cv.wait_for(lock, CHECKPOINT_INTERVAL, [&]() {
+                return !running || durable_sequence > applied_sequence.load(memory_order_relaxed);
+            });
+            if (!running) {
+                break;
+            }
+        }
+        vector<JournalEntry> batch = readBatch(REPLAY_BATCH);
+        bool stopping = false;
+        for (const auto& entry : batch) {
+            auto backoff = chrono::milliseconds(100);
+            while (!stopping && !apply(entry)) {
+                replay_failures.add();
+                LOG_SAMPLED(LogLevel::Warn, 1, "Journal replay of record {} failed, retrying in {}ms",
+                            entry.sequence, backoff.count());
+                unique_lock<mutex> lock(mutex_);
+                stopping = durable_cv.wait_for(lock, backoff, [&]() { return !running; });
+                backoff = min(backoff * 2, chrono::milliseconds(5000));
+            }
+            if (stopping) {
+                break;
+            }
+            applied_sequence.store(entry.sequence, memory_order_relaxed);
+        }
+        // Checkpointed at most every 100ms: after a crash up to that much is
+        // replayed again, and skipped by the database on its journal key
+        uint64_t applied = applied_sequence.load(memory_order_relaxed);
+        if (applied != checkpointed && chrono::steady_clock::now() - last_checkpoint >= CHECKPOINT_INTERVAL) {
+            if (writeCheckpoint(applied)) {
+                checkpointed = applied;
+                releaseApplied(applied);
+            }
+            last_checkpoint = chrono::steady_clock::now();
+        }
+    }
+    uint64_t applied = applied_sequence.load(memory_order_relaxed);
+    if (applied != checkpointed) {
+        writeCheckpoint(applied);
+    }
+}
+
+bool MessageJournal::waitApplied(uint64_t deadline_ms) {
+    uint64_t target;
+    {
+        lock_guard<mutex> lock(mutex_);
+        target = written_sequence;
+    }
+    while (applied_sequence.load(memory_order_relaxed) < target) {
+        if (IdleReaper::nowMillis() >= deadline_ms) {
+            return false;
+        }
+        usleep(10000);
+    }
+    return true;
+}
+
+uint64_t MessageJournal::unapplied() {
+    lock_guard<mutex> lock(mutex_);
+    return written_sequence - applied_sequence.load(memory_order_relaxed);
+}
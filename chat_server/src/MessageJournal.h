@@ -0,0 +1,139 @@
+#ifndef MESSAGE_JOURNAL_H
+#define MESSAGE_JOURNAL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "Metrics.h"
+
+struct JournalEntry {
+    uint64_t sequence = 0;
+    std::string sender;
+    std::string recipient;
+    std::string message;
+    bool delivered = false;
+    // When the server received it, Unix milliseconds (UTC); 0 for records
+    // written before the journal kept it
+    int64_t sent_at_ms = 0;
+};
+
+// Append-only log of chat messages on local disk, written ahead of the
+// database. append() returns once the record is on disk; a replay thread
+// then inserts the records into the database in order and checkpoints how
+// far it got, so messages survive a slow or unreachable database and a
+// crash of the server.
+//
+// On disk: dir/journal-<first sequence>.log segments of a fixed size, each
+// mapped and filled with records of
+//     uint32 length | uint32 crc32 | uint64 sequence | payload
+// where payload is a flags byte (1 delivered, 2 sent_at present), the
+// int64 sent_at when flagged and the length prefixed sender, recipient and
+// message; dir/checkpoint with the last sequence applied to the database;
+// and dir/journal-id, a random id that with the sequence keys each message
+// in the database so a record replayed twice is inserted once.
+class MessageJournal {
+public:
+    // Inserts one entry into the database; false means retry later
+    using ApplyFunction = std::function<bool(const JournalEntry&)>;
+
+private:
+    struct Segment {
+        std::string path;
+        int fd = -1;
+        char* base = nullptr;
+        size_t size = 0;
+        uint64_t first_sequence = 0;
+        uint64_t last_sequence = 0;  // 0 while empty
+        size_t written = 0;          // under mutex_
+        size_t synced = 0;           // sync thread only
+        bool sealed = false;
+
+        ~Segment();
+    };
+
+    static constexpr size_t HEADER_BYTES = 16;
+
+    bool debugMode = false;
+    std::string dir;
+    size_t segment_bytes = 64 << 20;
+    size_t max_segments = 64;
+    ApplyFunction apply;
+    int64_t journal_id = 0;
+
+    std::mutex mutex_;
+    std::condition_variable written_cv;  // sync thread waits for records
+    std::condition_variable durable_cv;  // appenders and replay wait for fsync
+    std::deque<std::shared_ptr<Segment>> segments;  // oldest first, back is current
+    std::vector<std::shared_ptr<Segment>> unsynced_sealed;
+    uint64_t written_sequence = 0;
+    uint64_t durable_sequence = 0;
+    std::atomic<uint64_t> applied_sequence{0};
+    bool failed = false;
+    bool running = false;
+    std::thread sync_thread;
+    std::thread replay_thread;
+
+    // Replay cursor, moved under mutex_ by the replay thread only
+    std::shared_ptr<Segment> replay_segment;
+    size_t replay_offset = 0;
+
+    Counter& appended;
+    Counter& replay_failures;
+    Histogram& sync_time;
+
+    std::shared_ptr<Segment> createSegment(uint64_t first_sequence);
+    std::shared_ptr<Segment> openSegment(const std::string& path, uint64_t first_sequence);
+    // Scans a recovered segment, returns false at a torn or corrupt record
+    bool recoverSegment(Segment& segment, uint64_t& next_sequence);
+    void syncLoop();
+    void replayLoop();
+    // Copies up to max durable, unapplied entries starting at the replay cursor
+    std::vector<JournalEntry> readBatch(size_t max);
+    // Deletes the sealed segments whose records are all in the database
+    void releaseApplied(uint64_t applied);
+    bool writeCheckpoint(uint64_t applied);
+    uint64_t readCheckpoint();
+    // Reads dir/journal-id, or writes a new one when missing or fresh (no
+    // sequence was ever handed out, so no row can carry the old one)
+    bool loadId(bool fresh);
+
+public:
+    MessageJournal(const std::string& dir, size_t segment_bytes, size_t max_segments, bool debug = false);
+    ~MessageJournal();
+
+    // Recovers existing segments and starts the sync and replay threads.
+    // Recovered records not yet in the database are replayed through apply
+    // before anything appended after open.
+    bool open(ApplyFunction apply);
+    // Stops both threads; unapplied records stay on disk for the next open
+    void close();
+
+    // Writes the entry and waits for the group fsync that covers it.
+    // Returns false when the journal cannot take it (full, not open, disk
+    // error) and the caller must store the message itself. sequence is the
+    // record's whenever one was written, 0 otherwise: a record whose fsync
+    // failed may still be replayed once the sync recovers, so the caller's
+    // insert carries the same key.
+    bool append(const std::string& sender, const std::string& recipient, const std::string& message, bool delivered,
+                int64_t sent_at_ms, uint64_t& sequence);
+
+    // Waits until everything appended so far is in the database
+    bool waitApplied(uint64_t deadline_ms);
+
+    uint64_t unapplied();
+
+    // Stored with the sequence of every row the journal inserts
+    int64_t id() const { return journal_id; }
+
+    MessageJournal(const MessageJournal&) = delete;
+    MessageJournal& operator=(const MessageJournal&) = delete;
+};
+
+#endif // MESSAGE_JOURNAL_H
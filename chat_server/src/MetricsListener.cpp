@@ -0,0 +1,109 @@
+#include "MetricsListener.h"
+#include "Metrics.h"
+#include <arpa/inet.h>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+using namespace std;
+
+MetricsListener::~MetricsListener() {
+    stop();
+}
+
+bool MetricsListener::start(const string& host, int port) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, host.c_str(), &addr.sin_addr) != 1) {
+        return false;
+    }
+    listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_fd < 0) {
+        return false;
+    }
+    int reuse = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    if (bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(listen_fd, 16) < 0) {
+        if (debugMode) {
+            cerr << "[-] Metrics listener unavailable: " << strerror(errno) << endl;
+        }
+        close(listen_fd);
+        listen_fd = -1;
+        return false;
+    }
+    running = true;
+    pthread_create(&listener_thread, nullptr, [](void* arg)->void* {
+        static_cast<MetricsListener*>(arg)->run();
+        return nullptr;
+    }, this);
+    return true;
+}
+
+void MetricsListener::stop() {
+    if (!running) {
+        return;
+    }
+    running = false;
+    pthread_join(listener_thread, nullptr);
+}
+
+void MetricsListener::run() {
+    while (running) {
+        struct pollfd pfd = {listen_fd, POLLIN, 0};
+        if (poll(&pfd, 1, 500) <= 0) {
+            continue;
+        }
+        int client_fd = accept(listen_fd, nullptr, nullptr);
+        if (client_fd < 0) {
+            continue;
+        }
+        serveConnection(client_fd);
+        close(client_fd);
+    }
+    close(listen_fd);
+    listen_fd = -1;
+}
+
+void MetricsListener::serveConnection(int client_fd) {
+    // Only the request line matters; a scraper that stalls is dropped
+    // rather than holding up the next one.
+    struct timeval timeout = {2, 0};
+    setsockopt(client_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(client_fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    char buffer[1024];
+    string request;
+    while (request.find("\r\n\r\n") == string::npos && request.size() < 8192) {
+        int bytes_received = recv(client_fd, buffer, sizeof(buffer), 0);
+        if (bytes_received <= 0) {
+            break;
+        }
+        request.append(buffer, bytes_received);
+    }
+
+    string status = "200 OK";
+    string body;
+    if (request.rfind("GET /metrics ", 0) == 0 || request.rfind("GET /metrics?", 0) == 0) {
+        body = MetricsRegistry::instance().render();
+    } else {
+        status = "404 Not Found";
+        body = "Not Found\n";
+    }
+    string response = "HTTP/1.1 " + status + "\r\n"
+                      "Content-Type: text/plain; version=0.0.4\r\n"
+                      "Content-Length: " + to_string(body.size()) + "\r\n"
+                      "Connection: close\r\n\r\n" + body;
+    size_t sent = 0;
+    while (sent < response.size()) {
+        ssize_t written = send(client_fd, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+        if (written <= 0) {
+            break;
+        }
+        sent += written;
+    }
+}
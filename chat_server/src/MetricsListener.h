@@ -0,0 +1,31 @@
+#ifndef METRICS_LISTENER_H
+#define METRICS_LISTENER_H
+
+#include <pthread.h>
+#include <string>
+
+// Minimal HTTP listener next to the chat port that answers GET /metrics
+// with the MetricsRegistry, one request per connection. Kept off the chat
+// listener so scrapes never compete with clients for accept.
+class MetricsListener {
+private:
+    bool debugMode = false;
+    int listen_fd = -1;
+    pthread_t listener_thread;
+    volatile bool running = false;
+
+    void run();
+    void serveConnection(int client_fd);
+
+public:
+    MetricsListener() = default;
+    ~MetricsListener();
+
+    bool start(const std::string& host, int port);
+    void stop();
+
+    MetricsListener(const MetricsListener&) = delete;
+    MetricsListener& operator=(const MetricsListener&) = delete;
+};
+
+#endif // METRICS_LISTENER_H
@@ -0,0 +1,80 @@
+#include "RateLimiter.h"
+#include <algorithm>
+#include <chrono>
+using namespace std;
+
+TokenBucket::TokenBucket(double rate_per_sec, double burst) {
+    if (rate_per_sec <= 0) {
+        rate_per_sec = 1.0;
+    }
+    if (burst < 1) {
+        burst = 1.0;
+    }
+    emission_interval_ns = static_cast<uint64_t>(1e9 / rate_per_sec);
+    burst_tolerance_ns = static_cast<uint64_t>((burst - 1.0) * emission_interval_ns);
+}
+
+bool TokenBucket::tryConsume(uint64_t now_ns, uint64_t& retry_after_ms) {
+    uint64_t tat = tat_ns.load(memory_order_relaxed);
+    while (true) {
+        uint64_t new_tat = max(tat, now_ns) + emission_interval_ns;
+        uint64_t limit = now_ns + emission_interval_ns + burst_tolerance_ns;
+        if (new_tat > limit) {
+            retry_after_ms = (new_tat - limit + 999999) / 1000000;
+            return false;
+        }
+        if (tat_ns.compare_exchange_weak(tat, new_tat, memory_order_relaxed)) {
+            return true;
+        }
+    }
+}
+
+void TokenBucket::refund() {
+    uint64_t tat = tat_ns.load(memory_order_relaxed);
+    while (tat >= emission_interval_ns &&
+           !tat_ns.compare_exchange_weak(tat, tat - emission_interval_ns, memory_order_relaxed)) {
+    }
+}
+
+void RateLimiter::configure(double conn_rate, double conn_burst, double usr_rate, double usr_burst) {
+    lock_guard<mutex> lock(buckets_mutex);
+    connection_rate = conn_rate;
+    connection_burst = conn_burst;
+    user_rate = usr_rate;
+    user_burst = usr_burst;
+}
+
+shared_ptr<TokenBucket> RateLimiter::newConnectionBucket() {
+    lock_guard<mutex> lock(buckets_mutex);
+    return make_shared<TokenBucket>(connection_rate, connection_burst);
+}
+
+shared_ptr<TokenBucket> RateLimiter::userBucket(const string& username) {
+    lock_guard<mutex> lock(buckets_mutex);
+    if (++acquisitions_since_prune >= 1024) {
+        pruneExpiredBuckets();
+    }
+    auto& slot = user_buckets[username];
+    shared_ptr<TokenBucket> bucket = slot.lock();
+    if (!bucket) {
+        bucket = make_shared<TokenBucket>(user_rate, user_burst);
+        slot = bucket;
+    }
+    return bucket;
+}
+
+void RateLimiter::pruneExpiredBuckets() {
+    for (auto it = user_buckets.begin(); it != user_buckets.end();) {
+        if (it->second.expired()) {
+            it = user_buckets.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    acquisitions_since_prune = 0;
+}
+
+uint64_t RateLimiter::nowNanos() {
+    return chrono::duration_cast<chrono::nanoseconds>(
+        chrono::steady_clock::now().time_since_epoch()).count();
+}
@@ -0,0 +1,61 @@
+#ifndef RATE_LIMITER_H
+#define RATE_LIMITER_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+// Token bucket kept as a single atomic "theoretical arrival time" (GCRA form),
+// so consuming a token is one CAS and never takes a lock.
+class TokenBucket {
+private:
+    uint64_t emission_interval_ns;
+    uint64_t burst_tolerance_ns;
+    std::atomic<uint64_t> tat_ns{0};
+
+public:
+    TokenBucket(double rate_per_sec, double burst);
+
+    // Returns true if a token was taken. On rejection retry_after_ms is set
+    // to the time until the next token becomes available.
+    bool tryConsume(uint64_t now_ns, uint64_t& retry_after_ms);
+    // Gives back a token taken by tryConsume
+    void refund();
+
+    TokenBucket(const TokenBucket&) = delete;
+    TokenBucket& operator=(const TokenBucket&) = delete;
+};
+
+class RateLimiter {
+private:
+    double connection_rate = 20.0;
+    double connection_burst = 40.0;
+    double user_rate = 30.0;
+    double user_burst = 60.0;
+
+    // Per-user buckets are shared by every connection of the same user and are
+    // only looked up at handshake, never per message.
+    std::unordered_map<std::string, std::weak_ptr<TokenBucket>> user_buckets;
+    std::mutex buckets_mutex;
+    size_t acquisitions_since_prune = 0;
+
+    void pruneExpiredBuckets();
+
+public:
+    RateLimiter() = default;
+
+    void configure(double conn_rate, double conn_burst, double usr_rate, double usr_burst);
+
+    std::shared_ptr<TokenBucket> newConnectionBucket();
+    std::shared_ptr<TokenBucket> userBucket(const std::string& username);
+
+    static uint64_t nowNanos();
+
+    RateLimiter(const RateLimiter&) = delete;
+    RateLimiter& operator=(const RateLimiter&) = delete;
+};
+
+#endif // RATE_LIMITER_H
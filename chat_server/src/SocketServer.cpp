@@ -1,13 +1,33 @@
 #include "SocketServer.h"
 #include "ClientHandler.h"
 #include "MessageHandler.h"
+#include "MessageJournal.h"
+#include "MessageArchiver.h"
+#include "TokenManager.h"
+#include "RevocationFeed.h"
+#include "Logger.h"
+#include <algorithm>
+#include <fcntl.h>
+#include <random>
 
 using namespace std;
 
 
 SocketServer::SocketServer(const string& host, int port, const string& server, const string& database, const string& username, const string& password) 
-    : HOST(host), PORT(port), SERVER(server), DATABASE(database), USERNAME(username), PASSWORD(password), server_fd(-1) {
-    pthread_mutex_init(&mutex, nullptr);
+    : HOST(host), PORT(port), SERVER(server), DATABASE(database), USERNAME(username), PASSWORD(password), server_fd(-1),
+      idle_reaper(debugMode),
+      active_sessions(MetricsRegistry::instance().gauge("snibble_chat_active_sessions", "Connected clients")),
+      messages_forwarded(MetricsRegistry::instance().counter(
+          "snibble_chat_messages_forwarded_total", "Messages sent straight to an online recipient")),
+      messages_stored(MetricsRegistry::instance().counter(
+          "snibble_chat_messages_stored_total", "Messages written to the database")),
+      forward_time(MetricsRegistry::instance().histogram(
+          "snibble_chat_forward_seconds", "From a message frame being read to it being sent to the recipient")),
+      redis_publish_time(MetricsRegistry::instance().histogram(
+          "snibble_redis_publish_seconds", "Presence PUBLISH round trip to Redis")) {
+    MetricsRegistry::instance().gaugeFunction(
+        "snibble_chat_stores_in_flight", "Messages whose store has started and not finished", {},
+        [this]() { return static_cast<double>(stores_in_flight.load(memory_order_relaxed)); });
     redis_context = redisConnect("127.0.0.1", 6379);
     if (redis_context == nullptr || redis_context->err) {
         if (redis_context) {
@@ -30,89 +50,383 @@ SocketServer::~SocketServer() {
     if(running) {
         stop();
     }
+    revocation_feed.reset();
+    MetricsRegistry::instance().gaugeFunction("snibble_chat_stores_in_flight", "Messages whose store has started and not finished",
+                                              {}, []() { return 0.0; });
     if (redis_context) {
         redisFree(redis_context);
         redis_context = nullptr;
     }
+    // Receive threads call back into the handler until they exit, so it
+    // lives as long as the server rather than the accept thread.
+    io_engine.reset();
+    delete client_handler;
+    client_handler = nullptr;
 }
 
 void SocketServer::start() {
-    try {
-        server_fd = socket(AF_INET, SOCK_STREAM, 0);
-        if(server_fd < 0) {
-            stop();
-            throw "Socket formation unsuccessful";
-        }
-        server_addr.sin_family = AF_INET;
-        server_addr.sin_port = htons(PORT);
-        server_addr.sin_addr.s_addr = inet_addr(HOST.c_str());
-        if(bind(server_fd, (struct sockaddr*)& server_addr, sizeof(server_addr)) < 0) {
-            stop();
-            throw "Binding socket unsuccessful";
-        }
-        if(listen(server_fd, 100) < 0) {
-            stop();
-            throw "Listening on socket unsuccessful";
-        }
-    } catch(const char* msg) {
-        stop();
+    if (server_fd >= 0) {
+        // Listener inherited from the previous process, already bound and listening
         if (debugMode) {
-            cerr << "Error: " << msg << endl;
+            cout << "[+] Adopted listening socket from previous server process" << endl;
         }
-        return;
-    } catch(...) {
-        stop();
-        if (debugMode) {
-            cerr << "An unexpected error occurred while starting the server." << endl;
+    } else {
+        try {
+            server_fd = socket(AF_INET, SOCK_STREAM, 0);
+            if(server_fd < 0) {
+                throw "Socket formation unsuccessful";
+            }
+            server_addr.sin_family = AF_INET;
+            server_addr.sin_port = htons(PORT);
+            server_addr.sin_addr.s_addr = inet_addr(HOST.c_str());
+            if(bind(server_fd, (struct sockaddr*)& server_addr, sizeof(server_addr)) < 0) {
+                throw "Binding socket unsuccessful";
+            }
+            if(listen(server_fd, 100) < 0) {
+                throw "Listening on socket unsuccessful";
+            }
+        } catch(const char* msg) {
+            if (server_fd != -1) {
+                close(server_fd);
+                server_fd = -1;
+            }
+            running = false;
+            if (debugMode) {
+                cerr << "Error: " << msg << endl;
+            }
+            return;
         }
-        return;
+    }
+    // The listener may be shared with another server process during a handoff,
+    // so a connection seen by poll can be taken by the other side first.
+    fcntl(server_fd, F_SETFL, fcntl(server_fd, F_GETFL, 0) | O_NONBLOCK);
+    if (pipe(accept_wake_pipe) < 0) {
+        accept_wake_pipe[0] = accept_wake_pipe[1] = -1;
     }
     if (debugMode) {
         cout << "[+] Server initialized successfully on " << HOST << ":" << PORT << endl;
     }
     running = true;
-    pthread_create(&accept_client_thread, nullptr, [](void* arg)->void* {
-        SocketServer* server = static_cast<SocketServer*>(arg);
-        ClientHandler clientHandler(server);
-        clientHandler.clientConnectionHandler();
-        return nullptr;
-    }, this);
+    accepting = true;
+    if (STORAGE_BACKEND != "none") {
+        StorageBackend* db = StorageBackend::getInstance(STORAGE_BACKEND, SERVER, DATABASE, USERNAME, PASSWORD, debugMode);
+        user_directory.attach(db);
+        if (db && archive_after_days > 0 && !archiver) {
+            archiver = make_unique<MessageArchiver>(db, archive_after_days, archive_batch, archive_interval_sec, debugMode);
+            archiver->start();
+        }
+    }
+    openJournal();
+    idle_reaper.setSender([this](int fd, const string& data) { sendFrame(fd, data, MSG_DONTWAIT | MSG_NOSIGNAL); });
+    idle_reaper.start();
+    if (!client_handler) {
+        client_handler = new ClientHandler(this);
+    }
+    if (io_engine_kind != IoEngine::Kind::Threads && !io_engine) {
+        io_engine = IoEngine::create(io_engine_kind, this, client_handler, io_workers, debugMode);
+        if (io_engine && !io_engine->start(server_fd)) {
+            io_engine.reset();
+        }
+        if (!io_engine) {
+            cerr << "[-] I/O engine could not be started, using a thread per client" << endl;
+        } else if (STORAGE_BACKEND != "none") {
+            // Handlers wait for the database here instead of on a worker
+            StorageBackend* db = StorageBackend::getInstance(STORAGE_BACKEND, SERVER, DATABASE, USERNAME, PASSWORD, debugMode);
+            if (db) {
+                db->startIoPool(db_io_workers, db_io_max_queue);
+            }
+        }
+    }
+    if (!io_engine) {
+        pthread_create(&accept_client_thread, nullptr, [](void* arg)->void* {
+            SocketServer* server = static_cast<SocketServer*>(arg);
+            server->client_handler->clientConnectionHandler();
+            return nullptr;
+        }, this);
+    }
     if (debugMode) {
-        printf("[+] Accepting client connections...\n");
+        printf("[+] Accepting client connections (%s)...\n", io_engine ? io_engine->name() : "threads");
     }
 }
 
 void SocketServer::stop() {
     running = false;
-    shutdown(server_fd, SHUT_RDWR);
-    pthread_mutex_lock(&mutex);
-    for (int fd : client_fds) {
-        close(fd);
+    idle_reaper.stop();
+    if (archiver) {
+        archiver->stop();
     }
-    client_fds.clear();
-    pthread_mutex_unlock(&mutex);
+    stopAccepting();
     if (debugMode) {
         printf("[+] Stopping server...\n");
     }
+
+    // Wake every receive loop; each thread (or the I/O engine) closes its own
+    // socket through the disconnect handler, so no fd is closed twice.
+    mutex.lock(LOCK_SITE());
+    for (int fd : client_fds) {
+        shutdown(fd, SHUT_RDWR);
+    }
+    mutex.unlock();
+
+    uint64_t deadline_ms = IdleReaper::nowMillis() + 5000;
+    if (!waitForClientsToLeave(deadline_ms) && debugMode) {
+        printf("[+] Clients still connected after 5 seconds, waiting for them to finish...\n");
+    }
+    // No timeout from here on: the receive threads and the database pool use
+    // the server, which the caller frees once stop returns
+    if (client_handler) {
+        client_handler->waitForReceiveThreads();
+    }
+    flushPersistence(deadline_ms);
+    if (io_engine) {
+        io_engine->stop();
+        // Runs the work still queued; handlers inside the database are not
+        // resumed any more and their sessions are freed here
+        if (STORAGE_BACKEND != "none") {
+            StorageBackend* db = StorageBackend::getInstance(STORAGE_BACKEND, SERVER, DATABASE, USERNAME, PASSWORD, debugMode);
+            if (db) {
+                db->stopIoPool();
+            }
+        }
+    }
+    if (journal) {
+        // Whatever is not replayed yet stays on disk for the next start
+        journal->close();
+    }
+
+    if (debugMode) {
+        printf("[+] Server shut down cleanly\n");
+    }
+}
+
+void SocketServer::adoptListener(int listener_fd) {
+    server_fd = listener_fd;
+}
+
+int SocketServer::listenerFd() const {
+    return server_fd;
+}
+
+void SocketServer::stopAccepting() {
+    if (!accepting) {
+        return;
+    }
+    accepting = false;
+    if (io_engine) {
+        io_engine->stopAccepting();
+    } else {
+        if (accept_wake_pipe[1] != -1) {
+            if (write(accept_wake_pipe[1], "x", 1) < 0 && debugMode) {
+                cerr << "[-] Failed to wake accept thread" << endl;
+            }
+        }
+        pthread_join(accept_client_thread, nullptr);
+    }
+    for (int& fd : accept_wake_pipe) {
+        if (fd != -1) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    // Only our descriptor is closed; after a handoff the next process keeps
+    // the same listening socket open.
     if (server_fd != -1) {
         close(server_fd);
         server_fd = -1;
     }
-    
-    pthread_join(accept_client_thread, nullptr);
-    
-    for (auto& entry : client_threads) {
-        pthread_join(entry.second, nullptr);
+}
+
+void SocketServer::drain(int timeout_sec, int reconnect_window_ms, const string& redirect) {
+    stopAccepting();
+    if (debugMode) {
+        printf("[+] Draining server...\n");
     }
-    
-    pthread_mutex_destroy(&mutex);
+
+    // Spread reconnects over the window so the next instance does not see
+    // every login and offline replay at the same instant.
+    mt19937 rng(random_device{}());
+    uniform_int_distribution<int> jitter(0, max(0, reconnect_window_ms));
+    mutex.lock(LOCK_SITE());
+    for (int fd : client_fds) {
+        // Format: RECONNECT:delay_ms[:host:port]
+        string notice = "RECONNECT:" + to_string(jitter(rng));
+        if (!redirect.empty()) {
+            notice += ":" + redirect;
+        }
+        notice += "\n";
+        sendFrame(fd, notice, MSG_DONTWAIT | MSG_NOSIGNAL);
+    }
+    mutex.unlock();
+
+    uint64_t deadline_ms = IdleReaper::nowMillis() + static_cast<uint64_t>(max(0, timeout_sec)) * 1000;
+    bool all_left = waitForClientsToLeave(deadline_ms);
+    bool flushed = flushPersistence(deadline_ms);
     if (debugMode) {
-        printf("[+] Server shut down cleanly\n");
+        cout << "[+] Drain finished (clients left: " << all_left << ", persistence flushed: " << flushed << ")" << endl;
+    }
+}
+
+bool SocketServer::waitForClientsToLeave(uint64_t deadline_ms) {
+    while (true) {
+        mutex.lock(LOCK_SITE());
+        bool empty = client_fds.empty();
+        mutex.unlock();
+        if (empty) {
+            return true;
+        }
+        if (IdleReaper::nowMillis() >= deadline_ms) {
+            return false;
+        }
+        usleep(100000);
+    }
+}
+
+bool SocketServer::flushPersistence(uint64_t deadline_ms) {
+    while (stores_in_flight.load(memory_order_relaxed) > 0) {
+        if (IdleReaper::nowMillis() >= deadline_ms) {
+            return false;
+        }
+        usleep(10000);
+    }
+    if (journal && !journal->waitApplied(deadline_ms)) {
+        return false;
+    }
+    return true;
+}
+
+void SocketServer::configureAdmission(double conn_rate, double conn_burst, double user_rate, double user_burst, int max_stores_in_flight) {
+    rate_limiter.configure(conn_rate, conn_burst, user_rate, user_burst);
+    MAX_STORES_IN_FLIGHT = max_stores_in_flight;
+}
+
+void SocketServer::configureHeartbeat(int idle_timeout_sec, int pong_timeout_sec) {
+    idle_reaper.configure(idle_timeout_sec, pong_timeout_sec);
+}
+
+void SocketServer::configureStorage(const string& backend) {
+    STORAGE_BACKEND = backend;
+}
+
+void SocketServer::configureJournal(const string& dir, size_t segment_bytes, size_t max_segments) {
+    journal_dir = dir;
+    journal_segment_bytes = segment_bytes;
+    journal_max_segments = max_segments;
+}
+
+void SocketServer::configureArchive(int after_days, size_t batch_size, int interval_sec) {
+    archive_after_days = after_days;
+    archive_batch = batch_size;
+    archive_interval_sec = interval_sec;
+}
+
+void SocketServer::configureCompression(const string& dictionary_paths, int level, bool compress_stored,
+                                        size_t min_bytes) {
+    compressor.configure(dictionary_paths, level, compress_stored, min_bytes);
+}
+
+void SocketServer::configureIoEngine(const string& engine, size_t workers, size_t db_workers, size_t db_max_queue) {
+    if (!IoEngine::parseKind(engine, io_engine_kind)) {
+        cerr << "[-] Unknown IO_ENGINE " << engine << ", using threads" << endl;
+        io_engine_kind = IoEngine::Kind::Threads;
+    }
+    io_workers = workers;
+    db_io_workers = db_workers;
+    db_io_max_queue = db_max_queue;
+}
+
+void SocketServer::sendFrame(int fd, const string& data, int flags) {
+    if (io_engine) {
+        io_engine->send(fd, data);
+        return;
     }
+    send(fd, data.c_str(), data.length(), flags);
+}
+
+void SocketServer::beginOfflineStore(const string& recipient) {
+    lock_guard<std::mutex> lock(offline_stores_mutex);
+    offline_stores[recipient]++;
+}
+
+void SocketServer::endOfflineStore(const string& recipient) {
+    {
+        lock_guard<std::mutex> lock(offline_stores_mutex);
+        auto it = offline_stores.find(recipient);
+        if (it == offline_stores.end() || --it->second > 0) {
+            return;
+        }
+        offline_stores.erase(it);
+    }
+    offline_stores_done.notify_all();
+}
+
+bool SocketServer::waitOfflineStores(const string& recipient, uint64_t deadline_ms) {
+    unique_lock<std::mutex> lock(offline_stores_mutex);
+    while (offline_stores.count(recipient)) {
+        uint64_t now = IdleReaper::nowMillis();
+        if (now >= deadline_ms) {
+            return false;
+        }
+        offline_stores_done.wait_for(lock, chrono::milliseconds(deadline_ms - now));
+    }
+    return true;
+}
+
+void SocketServer::openJournal() {
+    if (journal || journal_dir.empty() || STORAGE_BACKEND == "none") {
+        return;
+    }
+    StorageBackend* db = StorageBackend::getInstance(STORAGE_BACKEND, SERVER, DATABASE, USERNAME, PASSWORD, debugMode);
+    if (!db) {
+        return;
+    }
+    journal = make_unique<MessageJournal>(journal_dir, journal_segment_bytes, journal_max_segments, debugMode);
+    bool opened = journal->open([this, db](const JournalEntry& entry) {
+        try {
+            if (!db->isConnected()) {
+                return false;
+            }
+            // Journaled by name, the database may have been down at the time
+            int32_t sender_id = user_directory.resolve(entry.sender);
+            int32_t recipient_id = user_directory.resolve(entry.recipient);
+            if (sender_id == 0 || recipient_id == 0) {
+                // An empty name, retrying can not help: skip it rather than stall the replay
+                LOG_SAMPLED(LogLevel::Warn, 1, "Dropped journaled message without a name sender={} recipient={}",
+                            entry.sender, entry.recipient);
+                return true;
+            }
+            if (!MessageHandler::insertMessage(*db, compressor, sender_id, recipient_id, entry.message, entry.delivered,
+                                               entry.sent_at_ms, journal->id(), entry.sequence)) {
+                return false;
+            }
+        } catch (const exception& e) {
+            LOG_SAMPLED(LogLevel::Error, 1, "Journal replay insert failed: {}", e.what());
+            return false;
+        }
+        messages_stored.add();
+        return true;
+    });
+    if (!opened) {
+        // Messages go straight to the database as before
+        journal.reset();
+        if (debugMode) {
+            cerr << "[-] Message journal could not be opened in " << journal_dir << endl;
+        }
+    }
+}
+
+void SocketServer::configureAuth(const string& jwt_secret, bool require_auth, size_t token_cache_size) {
+    // Without a secret only the plain name handshake is possible
+    if (!jwt_secret.empty()) {
+        token_manager = make_unique<TokenManager>(jwt_secret, token_cache_size);
+        // Tokens revoked by /logout on any auth server are refused here too
+        revocation_feed = make_unique<RevocationFeed>(token_manager->revocations(), "127.0.0.1", 6379, debugMode);
+        revocation_feed->start();
+    }
+    this->require_auth = require_auth;
 }
 
 void SocketServer::sendOnlineUsersList(int client_fd) {
-    pthread_mutex_lock(&mutex);
+    mutex.lock(LOCK_SITE());
     std::string online_users = "ONLINE_USERS:";
     for (const auto& pair : isOnline) {
         if (pair.second) {
@@ -122,26 +436,30 @@ void SocketServer::sendOnlineUsersList(int client_fd) {
     if (online_users.back() == ',') {
         online_users.pop_back();
     }
-    send(client_fd, online_users.c_str(), online_users.length(), 0);
-    pthread_mutex_unlock(&mutex);
+    sendFrame(client_fd, online_users);
+    mutex.unlock();
 }
 
 void SocketServer::broadcastUserStatus(const std::string& username, bool online) {
-    pthread_mutex_lock(&mutex);
+    mutex.lock(LOCK_SITE());
     isOnline[username] = online;
     
     if (redis_context) {
         // Publish the status change to Redis
         // Channel name is the username, message is either "joined" or "left"
-        redisReply* reply = (redisReply*)redisCommand(redis_context, 
-            "PUBLISH %s %s", 
-            username.c_str(), 
-            online ? "joined" : "left"
-        );
+        redisReply* reply;
+        {
+            ScopedTimer timer(redis_publish_time);
+            reply = (redisReply*)redisCommand(redis_context, 
+                "PUBLISH %s %s", 
+                username.c_str(), 
+                online ? "joined" : "left"
+            );
+        }
         
         if (reply) {
             if (debugMode && reply->type == REDIS_REPLY_ERROR) {
-                cerr << "Redis publish error: " << reply->str << endl;
+                LOG_WARN("Redis publish error: {}", reply->str);
             }
             freeReplyObject(reply);
         }
@@ -164,5 +482,5 @@ void SocketServer::broadcastUserStatus(const std::string& username, bool online)
         }
     }
     
-    pthread_mutex_unlock(&mutex);
+    mutex.unlock();
 }
@@ -6,15 +6,32 @@
 #include <unistd.h>
 #include <vector>
 #include <map>
+#include <memory>
+#include <set>
 #include <pthread.h>
 #include <hiredis/hiredis.h>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include "RateLimiter.h"
+#include "IdleReaper.h"
+#include "UserDirectory.h"
+#include "MessageCompressor.h"
+#include "IoEngine.h"
+#include "Metrics.h"
+#include "ProfiledMutex.h"
 
 class ClientHandler;
 class MessageHandler;
+class TokenManager;
+class RevocationFeed;
+class MessageJournal;
+class MessageArchiver;
 
 class SocketServer {
     friend class ClientHandler;
     friend class MessageHandler;
+    friend class BlockingConnectionIo;
 private:
     bool debugMode = true;
     std::string HOST;
@@ -28,19 +45,93 @@ private:
     std::vector<int> client_fds;
     std::map<std::string, int> client_map;
     std::map<int, std::string> client_names;
+    std::map<int, int32_t> client_ids;  // chat_users id resolved at handshake, 0 if the database was down
     std::map<std::string, bool> isOnline;
-    pthread_mutex_t mutex;
+    ProfiledMutex mutex{"socket_server"};
     volatile bool running = true;
+    volatile bool accepting = false;
+    int accept_wake_pipe[2] = {-1, -1};
     std::string SERVER;
     std::string DATABASE;
     std::string USERNAME;
     std::string PASSWORD;
+    std::string STORAGE_BACKEND = "odbc";
+    RateLimiter rate_limiter;
+    // Messages from the start of their store to its end, whichever of the
+    // journal, the database pool queue or the insert they are waiting on
+    std::atomic<int> stores_in_flight{0};
+    int MAX_STORES_IN_FLIGHT = 256;
+    // Stores of messages whose recipient was offline when forwarded, per
+    // recipient. Counted under the server mutex, which a login registers
+    // under: a store counted before the login is waited for before its
+    // offline messages are read, a message after it is sent live.
+    std::mutex offline_stores_mutex;
+    std::condition_variable offline_stores_done;
+    std::map<std::string, int> offline_stores;
+    IdleReaper idle_reaper;
+    ClientHandler* client_handler = nullptr;
+    std::unique_ptr<TokenManager> token_manager;
+    std::unique_ptr<RevocationFeed> revocation_feed;
+    bool require_auth = false;
+    std::set<int> authenticated_fds;
+    // Connections that asked for COMPRESSED batch frames
+    std::set<int> compressed_fds;
+    // Local write-ahead copy of every message, empty dir turns it off
+    std::string journal_dir;
+    size_t journal_segment_bytes = 64 << 20;
+    size_t journal_max_segments = 64;
+    std::unique_ptr<MessageJournal> journal;
+    // Delivered messages older than this move to messages_archive, 0 turns it off
+    int archive_after_days = 30;
+    size_t archive_batch = 1000;
+    int archive_interval_sec = 60;
+    std::unique_ptr<MessageArchiver> archiver;
+    UserDirectory user_directory;
+    MessageCompressor compressor;
+    // Threads is one receive thread per client, the others own every client
+    // socket on one loop thread and write what sendFrame queues
+    IoEngine::Kind io_engine_kind = IoEngine::Kind::Threads;
+    size_t io_workers = 8;
+    // Database pool the engine's handlers suspend on, see ConnectionIo
+    size_t db_io_workers = 8;
+    size_t db_io_max_queue = 1024;
+    std::unique_ptr<IoEngine> io_engine;
+
+    // Served on the metrics listener, see MetricsRegistry
+    Gauge& active_sessions;
+    Counter& messages_forwarded;
+    Counter& messages_stored;
+    Histogram& forward_time;
+    Histogram& redis_publish_time;
+
+    bool waitForClientsToLeave(uint64_t deadline_ms);
+    bool flushPersistence(uint64_t deadline_ms);
+    void openJournal();
+    void beginOfflineStore(const std::string& recipient);
+    void endOfflineStore(const std::string& recipient);
+    // False when stores for recipient are still running at the deadline
+    bool waitOfflineStores(const std::string& recipient, uint64_t deadline_ms);
 public:
     SocketServer(const std::string& host, const int port, const std::string& server, const std::string& database, const std::string& username, const std::string& password);
     ~SocketServer();
 
     void start();
     void stop();
+    void adoptListener(int listener_fd);
+    int listenerFd() const;
+    void stopAccepting();
+    void drain(int timeout_sec, int reconnect_window_ms, const std::string& redirect = "");
+    void configureAdmission(double conn_rate, double conn_burst, double user_rate, double user_burst, int max_stores_in_flight);
+    void configureHeartbeat(int idle_timeout_sec, int pong_timeout_sec);
+    void configureStorage(const std::string& backend);
+    void configureAuth(const std::string& jwt_secret, bool require_auth, size_t token_cache_size);
+    void configureJournal(const std::string& dir, size_t segment_bytes, size_t max_segments);
+    void configureArchive(int after_days, size_t batch_size, int interval_sec);
+    void configureCompression(const std::string& dictionary_paths, int level, bool compress_stored, size_t min_bytes);
+    void configureIoEngine(const std::string& engine, size_t workers, size_t db_workers, size_t db_max_queue);
+    // Every write to a client goes through here: a send() on the threaded
+    // model (flags as for send), queued to the I/O engine otherwise
+    void sendFrame(int fd, const std::string& data, int flags = 0);
     void sendOnlineUsersList(int client_fd);
     void broadcastUserStatus(const std::string& username, bool isOnline);
 };
@@ -0,0 +1,88 @@
+#ifndef TASK_H
+#define TASK_H
+
+#include <coroutine>
+#include <exception>
+#include <utility>
+
+// Coroutine type of the connection handlers. A Task starts suspended and
+// runs when it is awaited, or with start() for the outermost one. When it
+// finishes, the coroutine awaiting it resumes right away on the same thread,
+// and an exception thrown inside comes out of the co_await.
+class Task {
+public:
+    struct promise_type;
+
+private:
+    struct FinalAwaiter {
+        bool await_ready() noexcept { return false; }
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> finished) noexcept {
+            std::coroutine_handle<> continuation = finished.promise().continuation;
+            return continuation ? continuation : std::noop_coroutine();
+        }
+        void await_resume() noexcept {}
+    };
+
+    struct Awaiter {
+        std::coroutine_handle<promise_type> handle;
+
+        bool await_ready() noexcept { return !handle || handle.done(); }
+        // Transfers straight into the task, nested tasks do not grow the stack
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+            handle.promise().continuation = awaiting;
+            return handle;
+        }
+        void await_resume() {
+            if (handle && handle.promise().error) {
+                std::rethrow_exception(handle.promise().error);
+            }
+        }
+    };
+
+    std::coroutine_handle<promise_type> handle;
+
+    explicit Task(std::coroutine_handle<promise_type> handle) : handle(handle) {}
+
+public:
+    struct promise_type {
+        std::coroutine_handle<> continuation;
+        std::exception_ptr error;
+
+        Task get_return_object() { return Task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        FinalAwaiter final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { error = std::current_exception(); }
+    };
+
+    Task() = default;
+    Task(Task&& other) noexcept : handle(std::exchange(other.handle, {})) {}
+    Task& operator=(Task&& other) noexcept {
+        if (this != &other) {
+            if (handle) {
+                handle.destroy();
+            }
+            handle = std::exchange(other.handle, {});
+        }
+        return *this;
+    }
+    // Destroys the coroutine wherever it is suspended
+    ~Task() {
+        if (handle) {
+            handle.destroy();
+        }
+    }
+
+    // Runs an outermost task until it first suspends or finishes
+    void start() { handle.resume(); }
+    bool done() const { return !handle || handle.done(); }
+    // Rethrows what ended a finished task, if anything
+    void result() const { Awaiter{handle}.await_resume(); }
+
+    Awaiter operator co_await() && noexcept { return Awaiter{handle}; }
+
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+};
+
+#endif // TASK_H
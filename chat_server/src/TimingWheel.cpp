@@ -0,0 +1,48 @@
+#include "TimingWheel.h"
+using namespace std;
+
+TimingWheel::TimingWheel(size_t slot_count) : slots(slot_count == 0 ? 1 : slot_count) {
+}
+
+void TimingWheel::schedule(int key, uint64_t delay_ticks) {
+    cancel(key);
+    if (delay_ticks == 0) {
+        delay_ticks = 1;
+    }
+    size_t slot = (current_slot + delay_ticks) % slots.size();
+    uint64_t rounds = (delay_ticks - 1) / slots.size();
+    slots[slot].push_front(Entry{key, rounds});
+    index[key] = Position{slot, slots[slot].begin()};
+}
+
+void TimingWheel::cancel(int key) {
+    auto found = index.find(key);
+    if (found == index.end()) {
+        return;
+    }
+    slots[found->second.slot].erase(found->second.it);
+    index.erase(found);
+}
+
+bool TimingWheel::contains(int key) const {
+    return index.count(key) > 0;
+}
+
+size_t TimingWheel::size() const {
+    return index.size();
+}
+
+void TimingWheel::advance(vector<int>& expired) {
+    current_slot = (current_slot + 1) % slots.size();
+    auto& bucket = slots[current_slot];
+    for (auto it = bucket.begin(); it != bucket.end();) {
+        if (it->rounds > 0) {
+            it->rounds--;
+            ++it;
+            continue;
+        }
+        expired.push_back(it->key);
+        index.erase(it->key);
+        it = bucket.erase(it);
+    }
+}
@@ -0,0 +1,43 @@
+#ifndef TIMING_WHEEL_H
+#define TIMING_WHEEL_H
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <unordered_map>
+#include <vector>
+
+// Hashed timing wheel keyed by file descriptor. Scheduling, rescheduling and
+// cancelling a deadline are O(1); advancing one tick only touches the
+// entries hashed into the current slot. Not thread safe, the owner locks.
+class TimingWheel {
+private:
+    struct Entry {
+        int key;
+        uint64_t rounds;
+    };
+    struct Position {
+        size_t slot;
+        std::list<Entry>::iterator it;
+    };
+
+    std::vector<std::list<Entry>> slots;
+    std::unordered_map<int, Position> index;
+    size_t current_slot = 0;
+
+public:
+    explicit TimingWheel(size_t slot_count = 512);
+
+    // Arms (or re-arms) the deadline for key, ticks from now. A delay of zero
+    // fires on the next tick.
+    void schedule(int key, uint64_t delay_ticks);
+    void cancel(int key);
+    bool contains(int key) const;
+    size_t size() const;
+
+    // Moves the wheel forward one tick and appends the keys whose deadline
+    // passed to expired. Expired keys are no longer scheduled.
+    void advance(std::vector<int>& expired);
+};
+
+#endif // TIMING_WHEEL_H
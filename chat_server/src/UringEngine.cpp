@@ -0,0 +1,310 @@
+#include "UringEngine.h"
+#include "IdleReaper.h"
+#include "Logger.h"
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <sys/socket.h>
+#include <sys/utsname.h>
+#include <unistd.h>
+using namespace std;
+
+UringEngine::UringEngine(SocketServer* server, ClientHandler* handler, size_t workers, bool debug)
+    : IoEngine(server, handler, workers, debug) {}
+
+UringEngine::~UringEngine() {
+    teardown();
+}
+
+uint64_t UringEngine::userData(Op op, int fd, uint32_t generation) {
+    return (static_cast<uint64_t>(op) << 56) | (static_cast<uint64_t>(generation & GENERATION_MASK) << 32) |
+           static_cast<uint32_t>(fd);
+}
+
+bool UringEngine::kernelSupported() {
+    struct utsname name;
+    int major = 0;
+    int minor = 0;
+    if (uname(&name) != 0 || sscanf(name.release, "%d.%d", &major, &minor) != 2) {
+        return false;
+    }
+    return major > 6 || (major == 6 && minor >= 0);
+}
+
+bool UringEngine::setup() {
+    if (wake_fd < 0 || !kernelSupported()) {
+        cerr << "[-] io_uring engine needs Linux 6.0 or newer for multishot recv" << endl;
+        return false;
+    }
+    int result = io_uring_queue_init(RING_ENTRIES, &ring, 0);
+    if (result < 0) {
+        cerr << "[-] io_uring_queue_init failed: " << strerror(-result) << endl;
+        return false;
+    }
+    ring_ready = true;
+    buffers.resize(static_cast<size_t>(BUFFER_COUNT) * RECV_BUFFER_BYTES);
+    buffer_ring = io_uring_setup_buf_ring(&ring, BUFFER_COUNT, BUFFER_GROUP, 0, &result);
+    if (!buffer_ring) {
+        cerr << "[-] io_uring provided buffer ring could not be set up: " << strerror(-result) << endl;
+        teardown();
+        return false;
+    }
+    int mask = io_uring_buf_ring_mask(BUFFER_COUNT);
+    for (unsigned i = 0; i < BUFFER_COUNT; i++) {
+        io_uring_buf_ring_add(buffer_ring, buffers.data() + static_cast<size_t>(i) * RECV_BUFFER_BYTES,
+                              RECV_BUFFER_BYTES, static_cast<unsigned short>(i), mask, static_cast<int>(i));
+    }
+    io_uring_buf_ring_advance(buffer_ring, BUFFER_COUNT);
+    // A read SQE on a non-blocking eventfd completes with EAGAIN instead of
+    // waiting; the engine's own writes never block on it
+    fcntl(wake_fd, F_SETFL, fcntl(wake_fd, F_GETFL, 0) & ~O_NONBLOCK);
+    return true;
+}
+
+// Called by stop() while the connections, and the data their sends point
+// into, still exist
+void UringEngine::teardown() {
+    if (!ring_ready) {
+        return;
+    }
+    if (sends_in_flight > 0) {
+        struct io_uring_sqe* sqe = nextSqe();
+        io_uring_prep_cancel64(sqe, 0, IORING_ASYNC_CANCEL_ANY);
+        io_uring_sqe_set_data64(sqe, userData(Op::Cancel, -1, 0));
+        uint64_t deadline_ms = IdleReaper::nowMillis() + 1000;
+        while (sends_in_flight > 0 && IdleReaper::nowMillis() < deadline_ms) {
+            struct __kernel_timespec timeout = {0, static_cast<long long>(TICK_MS) * 1000000};
+            struct io_uring_cqe* cqe = nullptr;
+            io_uring_submit_and_wait_timeout(&ring, &cqe, 1, &timeout, nullptr);
+            struct io_uring_cqe* cqes[MAX_CQES];
+            unsigned count = io_uring_peek_batch_cqe(&ring, cqes, MAX_CQES);
+            for (unsigned i = 0; i < count; i++) {
+                if (static_cast<Op>(io_uring_cqe_get_data64(cqes[i]) >> 56) == Op::Send) {
+                    sends_in_flight--;
+                }
+            }
+            io_uring_cq_advance(&ring, count);
+        }
+    }
+    if (buffer_ring) {
+        io_uring_free_buf_ring(&ring, buffer_ring, BUFFER_COUNT, BUFFER_GROUP);
+        buffer_ring = nullptr;
+    }
+    io_uring_queue_exit(&ring);
+    ring_ready = false;
+}
+
+void UringEngine::run() {
+    armWake();
+    armAccept();
+    uint64_t next_tick_ms = IdleReaper::nowMillis() + TICK_MS;
+    struct io_uring_cqe* cqes[MAX_CQES];
+    while (running) {
+        // Everything prepared since the last iteration goes in with the wait
+        struct __kernel_timespec timeout = {0, static_cast<long long>(TICK_MS) * 1000000};
+        struct io_uring_cqe* cqe = nullptr;
+        int result = io_uring_submit_and_wait_timeout(&ring, &cqe, 1, &timeout, nullptr);
+        syscalls.add();
+        loop_wakeups.add();
+        if (result < 0 && result != -ETIME && result != -EINTR) {
+            LOG_ERROR("io_uring_submit_and_wait_timeout failed: {}", strerror(-result));
+            break;
+        }
+        unsigned count;
+        while ((count = io_uring_peek_batch_cqe(&ring, cqes, MAX_CQES)) > 0) {
+            for (unsigned i = 0; i < count; i++) {
+                complete(cqes[i]);
+            }
+            io_uring_cq_advance(&ring, count);
+        }
+        runCommands();
+        uint64_t now_ms = IdleReaper::nowMillis();
+        if (now_ms >= next_tick_ms) {
+            tick(now_ms);
+            next_tick_ms = now_ms + TICK_MS;
+        }
+    }
+}
+
+void UringEngine::complete(const struct io_uring_cqe* cqe) {
+    uint64_t data = io_uring_cqe_get_data64(cqe);
+    Op op = static_cast<Op>(data >> 56);
+    int fd = static_cast<int>(static_cast<uint32_t>(data));
+    uint32_t generation = static_cast<uint32_t>(data >> 32) & GENERATION_MASK;
+    int result = cqe->res;
+    bool more = (cqe->flags & IORING_CQE_F_MORE) != 0;
+
+    switch (op) {
+    case Op::Wake:
+        // The commands it announced run after this batch
+        armWake();
+        return;
+    case Op::Accept:
+        if (result >= 0) {
+            if (!accepting) {
+                // Completed while stopAccepting's cancel was on its way
+                close(result);
+                syscalls.add();
+            } else {
+                armRecv(result, accepted(result));
+            }
+        } else if (result != -ECANCELED && debugMode) {
+            LOG_WARN("Error accepting client connection: {}", strerror(-result));
+        }
+        if (!more) {
+            accept_armed = false;
+            if (accepting) {
+                armAccept();
+            }
+        }
+        return;
+    case Op::Recv: {
+        auto found = connections.find(fd);
+        bool current = found != connections.end() && found->second.generation == generation;
+        if (cqe->flags & IORING_CQE_F_BUFFER) {
+            unsigned short buffer_id = static_cast<unsigned short>(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+            if (current && result > 0) {
+                received(fd, found->second, buffers.data() + static_cast<size_t>(buffer_id) * RECV_BUFFER_BYTES,
+                         static_cast<size_t>(result));
+            }
+            // received() copied the frame, the buffer goes back right away
+            recycle(buffer_id);
+        }
+        if (!current) {
+            return;
+        }
+        Connection& connection = found->second;
+        if (!more) {
+            connection.recv_armed = false;
+        }
+        if (result == 0 || (result < 0 && result != -ENOBUFS && result != -ECANCELED)) {
+            if (result < 0) {
+                LOG_WARN("Error receiving message: {}", strerror(-result));
+            }
+            peerClosed(fd, connection);
+            return;
+        }
+        // Ended by the kernel or out of buffers, recycled by now
+        if (!connection.recv_armed && !connection.reads_paused && connection.state != Connection::State::Closing) {
+            armRecv(fd, connection);
+        }
+        return;
+    }
+    case Op::Send: {
+        sends_in_flight--;
+        auto found = connections.find(fd);
+        if (found == connections.end() || found->second.generation != generation) {
+            return;
+        }
+        Connection& connection = found->second;
+        connection.send_in_flight = false;
+        if (result < 0) {
+            // The peer is gone; its recv reports the close
+            connection.out.clear();
+            connection.out_offset = 0;
+        } else {
+            connection.out_offset += static_cast<size_t>(result);
+            if (connection.out_offset >= connection.out.front().size()) {
+                connection.out.pop_front();
+                connection.out_offset = 0;
+            }
+        }
+        written(fd, connection);
+        return;
+    }
+    case Op::Cancel:
+        return;
+    }
+}
+
+struct io_uring_sqe* UringEngine::nextSqe() {
+    struct io_uring_sqe* sqe = io_uring_get_sqe(&ring);
+    while (!sqe) {
+        io_uring_submit(&ring);
+        syscalls.add();
+        sqe = io_uring_get_sqe(&ring);
+    }
+    return sqe;
+}
+
+void UringEngine::armAccept() {
+    if (listener_fd < 0 || accept_armed) {
+        return;
+    }
+    struct io_uring_sqe* sqe = nextSqe();
+    // Sockets stay blocking: io_uring waits for them itself
+    io_uring_prep_multishot_accept(sqe, listener_fd, nullptr, nullptr, SOCK_CLOEXEC);
+    io_uring_sqe_set_data64(sqe, userData(Op::Accept, listener_fd, 0));
+    accept_armed = true;
+}
+
+void UringEngine::armRecv(int fd, Connection& connection) {
+    struct io_uring_sqe* sqe = nextSqe();
+    io_uring_prep_recv_multishot(sqe, fd, nullptr, 0, 0);
+    sqe->flags |= IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BUFFER_GROUP;
+    io_uring_sqe_set_data64(sqe, userData(Op::Recv, fd, connection.generation));
+    connection.recv_armed = true;
+}
+
+void UringEngine::armWake() {
+    struct io_uring_sqe* sqe = nextSqe();
+    io_uring_prep_read(sqe, wake_fd, &wake_value, sizeof(wake_value), 0);
+    io_uring_sqe_set_data64(sqe, userData(Op::Wake, wake_fd, 0));
+}
+
+void UringEngine::cancel(uint64_t user_data) {
+    struct io_uring_sqe* sqe = nextSqe();
+    io_uring_prep_cancel64(sqe, user_data, 0);
+    io_uring_sqe_set_data64(sqe, userData(Op::Cancel, -1, 0));
+}
+
+void UringEngine::recycle(unsigned short buffer_id) {
+    io_uring_buf_ring_add(buffer_ring, buffers.data() + static_cast<size_t>(buffer_id) * RECV_BUFFER_BYTES,
+                          RECV_BUFFER_BYTES, buffer_id, io_uring_buf_ring_mask(BUFFER_COUNT), 0);
+    io_uring_buf_ring_advance(buffer_ring, 1);
+}
+
+void UringEngine::flush(int fd, Connection& connection) {
+    coalesce(connection);
+    const string& front = connection.out.front();
+    struct io_uring_sqe* sqe = nextSqe();
+    io_uring_prep_send(sqe, fd, front.data() + connection.out_offset, front.size() - connection.out_offset,
+                       MSG_NOSIGNAL);
+    io_uring_sqe_set_data64(sqe, userData(Op::Send, fd, connection.generation));
+    connection.send_in_flight = true;
+    sends_in_flight++;
+}
+
+void UringEngine::stopListening() {
+    if (accept_armed) {
+        cancel(userData(Op::Accept, listener_fd, 0));
+        // Now rather than with the next wait: during a handoff the other
+        // process should get the next connection
+        io_uring_submit(&ring);
+        syscalls.add();
+    }
+    listener_fd = -1;
+}
+
+void UringEngine::pauseReads(int fd, Connection& connection) {
+    if (connection.recv_armed) {
+        cancel(userData(Op::Recv, fd, connection.generation));
+    }
+}
+
+void UringEngine::resumeReads(int fd, Connection& connection) {
+    // With the cancel still on its way, its completion re-arms
+    if (!connection.recv_armed) {
+        armRecv(fd, connection);
+    }
+}
+
+void UringEngine::forget(int fd, Connection& connection) {
+    // Completions still to come carry the old generation and are dropped
+    if (connection.recv_armed) {
+        cancel(userData(Op::Recv, fd, connection.generation));
+    }
+}
@@ -0,0 +1,69 @@
+#ifndef URING_ENGINE_H
+#define URING_ENGINE_H
+
+#include <cstdint>
+#include <liburing.h>
+#include <vector>
+#include "IoEngine.h"
+
+// IO_ENGINE=io_uring, built with SNIBBLE_HAVE_URING. One multishot accept on
+// the listener and one multishot recv per client that picks its buffer from
+// a provided buffer ring, so reads cost no syscall of their own. Sends are
+// SQEs submitted together with the next wait: a whole loop iteration of
+// reads re-armed, sends and the wakeup read is one io_uring_enter.
+//
+// Needs Linux 6.0 for multishot recv; setup() refuses older kernels and the
+// factory falls back to epoll.
+class UringEngine : public IoEngine {
+private:
+    // Top byte of the user data, with the connection's generation and fd below
+    enum class Op : uint8_t {
+        Accept = 1,
+        Recv,
+        Send,
+        Wake,
+        Cancel
+    };
+
+    struct io_uring ring;
+    bool ring_ready = false;
+    struct io_uring_buf_ring* buffer_ring = nullptr;
+    std::vector<char> buffers;
+    uint64_t wake_value = 0;
+    bool accept_armed = false;
+    size_t sends_in_flight = 0;
+
+    static constexpr unsigned RING_ENTRIES = 4096;
+    // Receive buffers shared by all connections, a power of two
+    static constexpr unsigned BUFFER_COUNT = 4096;
+    static constexpr int BUFFER_GROUP = 0;
+    static constexpr unsigned MAX_CQES = 256;
+
+    static uint64_t userData(Op op, int fd, uint32_t generation);
+    static bool kernelSupported();
+    // A free SQE, submitting what is queued when the ring is full
+    struct io_uring_sqe* nextSqe();
+    void armAccept();
+    void armRecv(int fd, Connection& connection);
+    void armWake();
+    void cancel(uint64_t user_data);
+    void recycle(unsigned short buffer_id);
+    void complete(const struct io_uring_cqe* cqe);
+
+protected:
+    bool setup() override;
+    void run() override;
+    void teardown() override;
+    void stopListening() override;
+    void pauseReads(int fd, Connection& connection) override;
+    void resumeReads(int fd, Connection& connection) override;
+    void flush(int fd, Connection& connection) override;
+    void forget(int fd, Connection& connection) override;
+
+public:
+    UringEngine(SocketServer* server, ClientHandler* handler, size_t workers, bool debug);
+    ~UringEngine() override;
+    const char* name() const override { return "io_uring"; }
+};
+
+#endif // URING_ENGINE_H
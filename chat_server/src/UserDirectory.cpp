@@ -0,0 +1,99 @@
+#include "UserDirectory.h"
+#include "StorageBackend.h"
+#include <algorithm>
+#include <mutex>
+using namespace std;
+
+UserDirectory::UserDirectory()
+    : lookups(MetricsRegistry::instance().counter("snibble_chat_user_lookups_total",
+                                                  "Usernames and ids read from chat_users")) {
+    MetricsRegistry::instance().gaugeFunction(
+        "snibble_chat_user_directory_entries", "Users interned by the chat server", {}, [this]() {
+            shared_lock<shared_mutex> lock(mutex_);
+            return static_cast<double>(ids.size());
+        });
+}
+
+UserDirectory::~UserDirectory() {
+    MetricsRegistry::instance().gaugeFunction("snibble_chat_user_directory_entries",
+                                              "Users interned by the chat server", {}, []() { return 0.0; });
+}
+
+void UserDirectory::attach(StorageBackend* db) {
+    this->db = db;
+}
+
+string UserDirectory::keyFor(const string& username) {
+    string key = username;
+    transform(key.begin(), key.end(), key.begin(), [](unsigned char c) { return tolower(c); });
+    return key;
+}
+
+void UserDirectory::intern(int32_t id, const string& username) {
+    string key = keyFor(username);
+    unique_lock<shared_mutex> lock(mutex_);
+    ids.emplace(move(key), id);
+    names.emplace(id, username);
+}
+
+void UserDirectory::remember(int32_t id, const string& username) {
+    if (id > 0) {
+        intern(id, username);
+    }
+}
+
+int32_t UserDirectory::find(const string& username) const {
+    string key = keyFor(username);
+    shared_lock<shared_mutex> lock(mutex_);
+    auto it = ids.find(key);
+    return it == ids.end() ? 0 : it->second;
+}
+
+int32_t UserDirectory::resolve(const string& username, bool create) {
+    int32_t id = find(username);
+    if (id != 0 || !db || username.empty()) {
+        return id;
+    }
+    lookups.add();
+    const string select = "SELECT id, username FROM chat_users WHERE username = ?";
+    auto rows = db->executeParamQuery(select, {username});
+    if (rows.empty() && create) {
+        // Another server may insert the same name first, the unique index
+        // then fails this insert and the second select finds its row
+        db->executeParamUpdate("INSERT INTO chat_users (username) VALUES (?)", {username});
+        rows = db->executeParamQuery(select, {username});
+    }
+    if (rows.empty() || rows[0].size() < 2) {
+        return 0;
+    }
+    id = static_cast<int32_t>(stol(rows[0][0]));
+    intern(id, rows[0][1]);
+    return id;
+}
+
+string UserDirectory::name(int32_t id) {
+    {
+        shared_lock<shared_mutex> lock(mutex_);
+        auto it = names.find(id);
+        if (it != names.end()) {
+            return it->second;
+        }
+    }
+    if (!db || id <= 0) {
+        return "";
+    }
+    lookups.add();
+    auto rows = db->executeParamQuery("SELECT id, username FROM chat_users WHERE id = ?", {to_string(id)});
+    if (rows.empty() || rows[0].size() < 2) {
+        return "";
+    }
+    intern(id, rows[0][1]);
+    return rows[0][1];
+}
+
+int64_t UserDirectory::conversationKey(int32_t a, int32_t b) {
+    // Ids are positive, so the key is too and sorts by its smaller id
+    uint32_t smaller = static_cast<uint32_t>(min(a, b));
+    uint32_t larger = static_cast<uint32_t>(max(a, b));
+    return static_cast<int64_t>((static_cast<uint64_t>(smaller) << 32) | larger);
+}
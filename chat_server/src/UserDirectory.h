@@ -0,0 +1,58 @@
+#ifndef USER_DIRECTORY_H
+#define USER_DIRECTORY_H
+
+#include <cstdint>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include "Metrics.h"
+
+class StorageBackend;
+
+// Interns username <-> id for the messages table, which stores integer ids
+// only. The ids live in the chat database's chat_users table (the auth
+// server's users are in another database), a name gets its row the first
+// time it sends or receives a message. Once read an entry is kept for the
+// life of the process: rows are never renamed or deleted, so it can not go
+// stale.
+class UserDirectory {
+private:
+    StorageBackend* db = nullptr;
+    mutable std::shared_mutex mutex_;
+    std::unordered_map<std::string, int32_t> ids;  // lower-cased name -> id
+    std::unordered_map<int32_t, std::string> names;  // id -> name as registered
+
+    Counter& lookups;
+
+    // chat_users compares usernames case-insensitively
+    static std::string keyFor(const std::string& username);
+    void intern(int32_t id, const std::string& username);
+
+public:
+    UserDirectory();
+    ~UserDirectory();
+
+    // Set once in SocketServer::start, before any connection is accepted
+    void attach(StorageBackend* db);
+
+    // Cached id, 0 when the name has not been resolved yet
+    int32_t find(const std::string& username) const;
+    // Cached id, or one read from chat_users. With create a missing name is
+    // inserted, otherwise 0 is returned for it (reads of a conversation that
+    // never happened). Throws when the database can not answer.
+    int32_t resolve(const std::string& username, bool create = true);
+    // Name for id, read from chat_users on a miss; empty when unknown.
+    // Throws when the database can not answer.
+    std::string name(int32_t id);
+    // Stores rows of (id, username) read by a caller's own query
+    void remember(int32_t id, const std::string& username);
+
+    // The ordered id pair in one 64 bit value, the same for both directions
+    // of a conversation: smaller id in the high half, larger in the low.
+    static int64_t conversationKey(int32_t a, int32_t b);
+
+    UserDirectory(const UserDirectory&) = delete;
+    UserDirectory& operator=(const UserDirectory&) = delete;
+};
+
+#endif // USER_DIRECTORY_H
@@ -0,0 +1,91 @@
+#ifndef CIRCUIT_BREAKER_H
+#define CIRCUIT_BREAKER_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include "Metrics.h"
+
+// Fails calls fast while a dependency is down. Closed lets everything
+// through; failureThreshold consecutive failures (or one trip) open it.
+// While open nothing is let through until the backoff passes, then one
+// caller is let through as a probe (half open). Its success closes the
+// breaker, its failure opens it again with twice the backoff, up to the
+// maximum. Calls let through before it opened only count while it is
+// closed, the probe alone decides after that.
+class CircuitBreaker {
+public:
+    enum class State {
+        Closed = 0,
+        Open = 1,
+        HalfOpen = 2
+    };
+
+    // One call allow() let through, reported once: failed() or trip() when
+    // it failed, a success when destroyed without either. So the outcome is
+    // the statement's, and a probe ending in an exception still decides.
+    class Call {
+        friend class CircuitBreaker;
+        CircuitBreaker* breaker = nullptr;
+        bool probe = false;
+    public:
+        Call() = default;
+        ~Call();
+        // Counted toward the threshold
+        void failed();
+        // Opens at once, for failures that leave no doubt (a refused reconnect)
+        void trip();
+        bool isProbe() const { return probe; }
+
+        Call(const Call&) = delete;
+        Call& operator=(const Call&) = delete;
+    };
+
+private:
+    std::atomic<State> state{State::Closed};
+    std::atomic<int64_t> retry_at_ms{0};
+    std::atomic<int> consecutive_failures{0};
+    std::mutex mutex_;  // transitions to open and closed
+    std::chrono::milliseconds backoff;
+    const int failure_threshold;
+    const std::chrono::milliseconds initial_backoff;
+    const std::chrono::milliseconds max_backoff;
+    const std::string name;
+
+    Counter& rejected;
+    Counter& opened;
+
+    static int64_t nowMillis();
+    // Under mutex_
+    void open();
+    void succeed(bool probe);
+    void fail(bool probe, bool at_once);
+
+public:
+    // name labels the metrics: snibble_circuit_state{breaker=name}, ...
+    CircuitBreaker(const std::string& name, int failure_threshold, std::chrono::milliseconds initial_backoff,
+                   std::chrono::milliseconds max_backoff);
+    ~CircuitBreaker();
+
+    // False while open; true for every call when closed and for the single
+    // probe once the backoff has passed, with call set up to report it
+    bool allow(Call& call);
+
+    // Closed, or open with the probe due: worth attempting a call
+    bool available() const;
+
+    // For outcomes outside an allowed call, like the first connect; they
+    // count only while the breaker is closed
+    void recordSuccess();
+    void recordFailure();
+    void trip();
+
+    State current() const { return state.load(std::memory_order_acquire); }
+
+    CircuitBreaker(const CircuitBreaker&) = delete;
+    CircuitBreaker& operator=(const CircuitBreaker&) = delete;
+};
+
+#endif
@@ -9,23 +9,32 @@
 #include <memory>
 #include <mutex>
 #include <vector>
+#include "StorageBackend.h"
+#include "ProfiledMutex.h"
+#include "CircuitBreaker.h"
 
-class DatabaseManager {
+// Azure SQL backend over ODBC
+class DatabaseManager : public StorageBackend {
 private:
     static std::unique_ptr<DatabaseManager> instance;
-    static std::mutex mutex_;
+    static ProfiledMutex mutex_;
 
     SQLHENV hEnv;
     SQLHDBC hDbc;
     SQLHSTMT hStmt;
     std::string connectionString;
     bool verbose;
-    std::mutex db_mutex;
+    ProfiledMutex db_mutex{"db_mutex"};
+    std::mutex env_mutex;  // allocation of hEnv, which connections need first
+    std::vector<SQLHDBC> worker_connections;  // one per I/O pool worker, used without db_mutex
+    // Open while the server is unreachable: calls fail fast instead of
+    // waiting on a dead connection, one probe reconnects after the backoff
+    CircuitBreaker breaker{"database", 3, std::chrono::seconds(1), std::chrono::seconds(60)};
 
     DatabaseManager(const std::string& server, const std::string& database, const std::string& username, const std::string& password, bool verbose = false);
 
 public:
-    ~DatabaseManager();
+    ~DatabaseManager() override;
     
     // Singleton pattern
     static DatabaseManager* getInstance(const std::string& server, const std::string& database, const std::string& username, const std::string& password, bool verbose = false);
@@ -33,19 +42,51 @@ public:
     // Database operations
     bool connectToDatabase();
     void disconnectFromDatabase();
-    bool isConnected() const;
+    bool isConnected() const override;
+    SqlDialect dialect() const override;
     
     // Thread-safe database operations
-    std::vector<std::vector<std::string>> executeQuery(const std::string& query);
-    std::vector<std::vector<std::string>> executeParamQuery(const std::string& query, const std::vector<std::string>& params);
-    bool executeUpdate(const std::string& query);
-    bool executeParamUpdate(const std::string& query, const std::vector<std::string>& params);
+    std::vector<std::vector<std::string>> executeQuery(const std::string& query) override;
+    std::vector<std::vector<std::string>> executeParamQuery(const std::string& query, const std::vector<std::string>& params) override;
+    bool executeUpdate(const std::string& query) override;
+    bool executeParamUpdate(const std::string& query, const std::vector<std::string>& params) override;
+    void forEachRow(const std::string& query, const std::vector<std::string>& params,
+                    const std::function<void(const std::vector<std::string>&)>& callback) override;
     
     // Schema initialization
-    bool initializeTables();
+    bool initializeTables() override;
     
     // Get raw connection handle (use with caution)
     SQLHDBC getConnection();
+
+protected:
+    void openWorkerConnections(size_t count) override;
+    void closeWorkerConnections() override;
+
+private:
+    bool ensureEnvironment();
+    bool openConnection(SQLHDBC& dbc);
+    // Replaces a dead connection, tripping call when that fails
+    bool reconnect(SQLHDBC& dbc, CircuitBreaker::Call& call);
+    static void closeConnection(SQLHDBC& dbc);
+    static bool connectionAlive(SQLHDBC dbc);
+    // After a failed statement: connection errors (SQLSTATE 08xxx or a dead
+    // handle) fail call, anything else means it answered and call ends as
+    // a success
+    static void noteStatementFailure(SQLHDBC dbc, const char* sql_state, CircuitBreaker::Call& call);
+    // Hands every row of every result of an executed statement or batch to
+    // callback; throws, with stmt freed, when a statement in the batch failed
+    void fetchResults(SQLHDBC dbc, SQLHSTMT stmt, const std::string& query,
+                      const std::function<void(const std::vector<std::string>&)>& callback,
+                      CircuitBreaker::Call& call);
+
+    // The calling I/O worker's own connection, or the shared one with
+    // db_mutex held through lock; site is the caller's, for lock profiling.
+    // Reconnects a dead connection, throws DatabaseUnavailable while the
+    // breaker is open or the reconnect fails. call reports the statement's
+    // outcome to the breaker, the caller keeps it until the statement is done.
+    SQLHDBC acquireConnection(std::unique_lock<ProfiledMutex>& lock, const LockSite& site, CircuitBreaker::Call& call);
+public:
     
     // Prevent copying
     DatabaseManager(const DatabaseManager&) = delete;
@@ -0,0 +1,51 @@
+#ifndef IO_POOL_H
+#define IO_POOL_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "Metrics.h"
+
+// Fixed set of threads for blocking database work, fed from a bounded FIFO.
+// Callers hand over a task and return immediately; a full queue is refused
+// rather than grown so a slow database turns into fast 503s, not a backlog.
+class IoPool {
+private:
+    std::mutex mutex_;
+    std::condition_variable work_available;
+    std::deque<std::function<void()>> tasks;
+    size_t max_queue;
+    bool stopping = false;
+    std::vector<std::thread> workers;
+    Gauge& queue_depth;
+    Counter& rejected;
+
+    void workerLoop(size_t index);
+
+public:
+    // name labels the pool's queue depth and rejection metrics
+    IoPool(size_t worker_count, size_t max_queue, const std::string& name = "io");
+    // Runs the tasks already queued, then joins the workers
+    ~IoPool();
+
+    // False if the queue is full or the pool is stopping. Exceptions thrown
+    // by a task are logged and dropped.
+    bool post(std::function<void()> task);
+
+    // Index of the calling thread among this pool's workers, -1 for any
+    // other thread. Backends use it to pick the worker's own connection.
+    int currentWorker() const;
+
+    size_t workerCount() const;
+    size_t queued();
+
+    IoPool(const IoPool&) = delete;
+    IoPool& operator=(const IoPool&) = delete;
+};
+
+#endif
@@ -0,0 +1,318 @@
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+enum class LogLevel : uint8_t {
+    Debug = 0,
+    Info = 1,
+    Warn = 2,
+    Error = 3
+};
+
+// Statements below this level are compiled out. Set with the
+// SNIBBLE_LOG_LEVEL CMake option.
+#ifndef SNIBBLE_LOG_MIN_LEVEL
+#define SNIBBLE_LOG_MIN_LEVEL 0
+#endif
+
+constexpr bool logLevelCompiled(int level) {
+    return level >= SNIBBLE_LOG_MIN_LEVEL;
+}
+
+namespace log_detail {
+
+// How one argument is copied into a record and turned back into text by
+// the flusher. Strings are copied by length, numbers by value; nothing is
+// formatted on the logging thread.
+template <typename T, typename = void>
+struct Codec;
+
+template <typename T>
+struct Codec<T, std::enable_if_t<std::is_arithmetic_v<T>>> {
+    static size_t size(const T&) { return sizeof(T); }
+    static void encode(char*& out, const T& value) {
+        std::memcpy(out, &value, sizeof(T));
+        out += sizeof(T);
+    }
+    static void decode(const char*& in, std::string& text) {
+        T value;
+        std::memcpy(&value, in, sizeof(T));
+        in += sizeof(T);
+        if constexpr (std::is_same_v<T, bool>) {
+            text += value ? "true" : "false";
+        } else if constexpr (std::is_same_v<T, char>) {
+            text += value;
+        } else {
+            text += std::to_string(value);
+        }
+    }
+};
+
+struct StringCodec {
+    static size_t size(std::string_view value) { return sizeof(uint32_t) + value.size(); }
+    static void encode(char*& out, std::string_view value) {
+        uint32_t length = static_cast<uint32_t>(value.size());
+        std::memcpy(out, &length, sizeof(length));
+        std::memcpy(out + sizeof(length), value.data(), length);
+        out += sizeof(length) + length;
+    }
+    static void decode(const char*& in, std::string& text) {
+        uint32_t length;
+        std::memcpy(&length, in, sizeof(length));
+        text.append(in + sizeof(length), length);
+        in += sizeof(length) + length;
+    }
+};
+
+template <> struct Codec<std::string> : StringCodec {};
+template <> struct Codec<std::string_view> : StringCodec {};
+template <> struct Codec<const char*> : StringCodec {
+    static size_t size(const char* value) { return StringCodec::size(value ? value : ""); }
+    static void encode(char*& out, const char* value) { StringCodec::encode(out, value ? value : ""); }
+};
+template <> struct Codec<char*> : Codec<const char*> {};
+
+template <typename T>
+using CodecFor = Codec<std::decay_t<T>>;
+
+}  // namespace log_detail
+
+// Asynchronous logger for the request paths. A log statement copies its
+// format pointer and raw arguments into a ring owned by the calling thread
+// and returns; a background thread formats, orders and writes the records.
+// A full ring drops the record and counts it, logging never blocks.
+class Logger {
+public:
+    using Decoder = void (*)(const char* format, const char* payload, std::string& text);
+
+    struct RecordHeader {
+        uint32_t size;      // whole record, 8 byte aligned
+        uint8_t level;
+        uint8_t padding;    // 1 for the filler before a wrap
+        int64_t timestamp_ns;
+        const char* format;
+        Decoder decoder;
+    };
+
+    // Single producer (the owning thread), single consumer (the flusher)
+    class Ring {
+    private:
+        std::unique_ptr<char[]> buffer;
+        size_t capacity;
+        alignas(64) std::atomic<size_t> write_pos{0};
+        size_t cached_read = 0;
+        alignas(64) std::atomic<size_t> read_pos{0};
+
+    public:
+        std::atomic<uint64_t> dropped{0};
+        std::atomic<bool> orphaned{false};  // the owning thread has exited
+        uint64_t reported_drops = 0;        // flusher only
+        uint32_t thread_index;
+
+        Ring(size_t capacity, uint32_t thread_index);
+
+        char* reserve(size_t size) {
+            size_t write = write_pos.load(std::memory_order_relaxed);
+            size_t offset = write & (capacity - 1);
+            size_t filler = offset + size > capacity ? capacity - offset : 0;
+            if (write + filler + size - cached_read > capacity) {
+                cached_read = read_pos.load(std::memory_order_acquire);
+                if (write + filler + size - cached_read > capacity) {
+                    return nullptr;
+                }
+            }
+            if (filler) {
+                RecordHeader pad{};
+                pad.size = static_cast<uint32_t>(filler);
+                pad.padding = 1;
+                std::memcpy(buffer.get() + offset, &pad, sizeof(uint32_t) + 2);
+                write += filler;
+                write_pos.store(write, std::memory_order_release);
+                offset = 0;
+            }
+            return buffer.get() + offset;
+        }
+
+        void commit(size_t size) {
+            write_pos.store(write_pos.load(std::memory_order_relaxed) + size, std::memory_order_release);
+        }
+
+        // Flusher side: hands every complete record to fn and frees it
+        template <typename Fn>
+        void drain(Fn&& fn) {
+            size_t read = read_pos.load(std::memory_order_relaxed);
+            size_t write = write_pos.load(std::memory_order_acquire);
+            while (read != write) {
+                const char* record = buffer.get() + (read & (capacity - 1));
+                RecordHeader header;
+                std::memcpy(&header, record, sizeof(uint32_t) + 2);
+                if (!header.padding) {
+                    std::memcpy(&header, record, sizeof(header));
+                    fn(header, record + sizeof(RecordHeader));
+                }
+                read += header.size;
+            }
+            read_pos.store(read, std::memory_order_release);
+        }
+
+        bool empty() const {
+            return read_pos.load(std::memory_order_acquire) == write_pos.load(std::memory_order_acquire);
+        }
+    };
+
+private:
+    std::atomic<uint8_t> min_level{static_cast<uint8_t>(LogLevel::Info)};
+    std::atomic<size_t> ring_capacity{16 * 1024};
+
+    std::mutex rings_mutex;
+    std::vector<std::shared_ptr<Ring>> rings;
+    uint32_t next_thread_index = 0;
+
+    std::mutex flush_mutex;
+    std::condition_variable flush_cv;
+    std::condition_variable flushed_cv;
+    uint64_t flush_requested = 0;
+    uint64_t flush_completed = 0;
+    bool stopping = false;
+    std::thread flusher;
+
+    Logger();
+    Ring* threadRing();
+    void flusherLoop();
+    void drainAll();
+
+    template <typename... Args>
+    static void decodeRecord(const char* format, const char* payload, std::string& text) {
+        std::string parts[sizeof...(Args) + 1];
+        size_t index = 0;
+        ((log_detail::CodecFor<Args>::decode(payload, parts[index]), index++), ...);
+        (void)payload;
+        (void)index;
+        size_t next = 0;
+        for (const char* c = format; *c; c++) {
+            if (c[0] == '{' && c[1] == '}' && next < sizeof...(Args)) {
+                text += parts[next++];
+                c++;
+            } else {
+                text += *c;
+            }
+        }
+    }
+
+public:
+    static Logger& instance();
+
+    void setLevel(LogLevel level);
+    bool enabled(LogLevel level) const {
+        return static_cast<uint8_t>(level) >= min_level.load(std::memory_order_relaxed);
+    }
+
+    // Size of each thread's ring, a power of two; applies to threads that
+    // log for the first time after the call.
+    void setRingCapacity(size_t bytes);
+
+    // Replaces each "{}" in format, which must outlive the process (a
+    // literal), with the next argument.
+    template <typename... Args>
+    void log(LogLevel level, const char* format, const Args&... args) {
+        Ring* ring = threadRing();
+        if (!ring) {
+            return;
+        }
+        size_t payload = (log_detail::CodecFor<Args>::size(args) + ... + size_t(0));
+        size_t size = (sizeof(RecordHeader) + payload + 7) & ~size_t(7);
+        char* out = ring->reserve(size);
+        if (!out) {
+            ring->dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        RecordHeader header;
+        header.size = static_cast<uint32_t>(size);
+        header.level = static_cast<uint8_t>(level);
+        header.padding = 0;
+        header.timestamp_ns = nowNanos();
+        header.format = format;
+        header.decoder = &Logger::decodeRecord<Args...>;
+        std::memcpy(out, &header, sizeof(header));
+        char* cursor = out + sizeof(header);
+        (log_detail::CodecFor<Args>::encode(cursor, args), ...);
+        (void)cursor;
+        ring->commit(size);
+        if (level == LogLevel::Error) {
+            flush_cv.notify_one();
+        }
+    }
+
+    // Blocks until everything logged before the call has been written
+    void flush();
+    // Final flush and join, registered with atexit
+    void stop();
+
+    static int64_t nowNanos();
+
+    Logger(const Logger&) = delete;
+    Logger& operator=(const Logger&) = delete;
+};
+
+// Lets at most per_second events through for one call site and counts the
+// rest, for events that happen once per message.
+class LogSampler {
+private:
+    uint32_t per_second;
+    std::atomic<int64_t> window{-1};
+    std::atomic<uint32_t> count{0};
+    std::atomic<uint64_t> suppressed{0};
+
+public:
+    explicit LogSampler(uint32_t per_second) : per_second(per_second) {}
+
+    // suppressed_before is set when a new second starts after events were dropped
+    bool admit(uint64_t& suppressed_before);
+};
+
+#define SNIBBLE_LOG(level, format, ...)                                                                  \
+    do {                                                                                                 \
+        if constexpr (logLevelCompiled(static_cast<int>(level))) {                                      \
+            if (Logger::instance().enabled(level)) {                                                     \
+                Logger::instance().log(level, "" format "" __VA_OPT__(, ) __VA_ARGS__);                  \
+            }                                                                                            \
+        }                                                                                                \
+    } while (0)
+
+#define LOG_DEBUG(format, ...) SNIBBLE_LOG(LogLevel::Debug, format __VA_OPT__(, ) __VA_ARGS__)
+#define LOG_INFO(format, ...) SNIBBLE_LOG(LogLevel::Info, format __VA_OPT__(, ) __VA_ARGS__)
+#define LOG_WARN(format, ...) SNIBBLE_LOG(LogLevel::Warn, format __VA_OPT__(, ) __VA_ARGS__)
+#define LOG_ERROR(format, ...) SNIBBLE_LOG(LogLevel::Error, format __VA_OPT__(, ) __VA_ARGS__)
+
+// Per-message events: at most per_second lines per call site, followed by
+// a count of what was skipped.
+#define LOG_SAMPLED(level, per_second, format, ...)                                                      \
+    do {                                                                                                 \
+        if constexpr (logLevelCompiled(static_cast<int>(level))) {                                      \
+            if (Logger::instance().enabled(level)) {                                                     \
+                static LogSampler snibble_sampler_(per_second);                                          \
+                uint64_t snibble_suppressed_ = 0;                                                        \
+                if (snibble_sampler_.admit(snibble_suppressed_)) {                                       \
+                    if (snibble_suppressed_ > 0) {                                                       \
+                        Logger::instance().log(level, "{} similar events suppressed at {}:{}",           \
+                                               snibble_suppressed_, __FILE__, __LINE__);                 \
+                    }                                                                                    \
+                    Logger::instance().log(level, "" format "" __VA_OPT__(, ) __VA_ARGS__);              \
+                }                                                                                        \
+            }                                                                                            \
+        }                                                                                                \
+    } while (0)
+
+#endif
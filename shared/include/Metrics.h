@@ -0,0 +1,175 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace metrics_detail {
+
+// Writers are spread over this many cache lines so threads updating the
+// same metric rarely share one. A thread keeps its stripe for life.
+constexpr size_t STRIPES = 16;
+
+size_t nextStripe();
+
+inline size_t threadStripe() {
+    thread_local size_t stripe = nextStripe();
+    return stripe;
+}
+
+}  // namespace metrics_detail
+
+// Monotonic count, e.g. connections accepted
+class Counter {
+private:
+    struct alignas(64) Stripe {
+        std::atomic<uint64_t> value{0};
+    };
+    std::array<Stripe, metrics_detail::STRIPES> stripes;
+
+public:
+    void add(uint64_t n = 1) {
+        stripes[metrics_detail::threadStripe()].value.fetch_add(n, std::memory_order_relaxed);
+    }
+    uint64_t value() const;
+};
+
+// Value that goes up and down, e.g. open sessions
+class Gauge {
+private:
+    std::atomic<int64_t> current{0};
+
+public:
+    void add(int64_t n = 1) { current.fetch_add(n, std::memory_order_relaxed); }
+    void sub(int64_t n = 1) { current.fetch_sub(n, std::memory_order_relaxed); }
+    void set(int64_t n) { current.store(n, std::memory_order_relaxed); }
+    int64_t value() const { return current.load(std::memory_order_relaxed); }
+};
+
+// Latency distribution in nanoseconds with HDR-style log-linear buckets:
+// every power of two is split into 8, so a recorded value is known to
+// within 12.5% whatever its size. Values from 2^40 ns (about 18 minutes)
+// up share the last bucket.
+class Histogram {
+public:
+    static constexpr int SUB_BITS = 3;
+    static constexpr int SUB_BUCKETS = 1 << SUB_BITS;
+    static constexpr int MAX_EXPONENT = 39;
+    static constexpr size_t BUCKETS = (MAX_EXPONENT - SUB_BITS + 2) * SUB_BUCKETS;
+
+    static size_t bucketOf(uint64_t value);
+    // Smallest value counted in the bucket above index
+    static uint64_t bucketLimit(size_t index);
+
+    struct Snapshot {
+        std::vector<uint64_t> counts;
+        uint64_t count = 0;
+        uint64_t sum = 0;
+
+        // Upper bound of the bucket holding the q-th quantile, q in [0, 1]
+        uint64_t percentile(double q) const;
+    };
+
+private:
+    struct alignas(64) Stripe {
+        std::array<std::atomic<uint64_t>, BUCKETS> counts{};
+        std::atomic<uint64_t> sum{0};
+    };
+    std::array<Stripe, metrics_detail::STRIPES> stripes;
+
+public:
+    void record(uint64_t nanos) {
+        Stripe& stripe = stripes[metrics_detail::threadStripe()];
+        stripe.counts[bucketOf(nanos)].fetch_add(1, std::memory_order_relaxed);
+        stripe.sum.fetch_add(nanos, std::memory_order_relaxed);
+    }
+
+    void record(std::chrono::steady_clock::duration elapsed) {
+        auto nanos = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+        record(static_cast<uint64_t>(nanos > 0 ? nanos : 0));
+    }
+
+    Snapshot snapshot() const;
+};
+
+// Records the time from construction to destruction into a histogram
+class ScopedTimer {
+private:
+    Histogram& histogram;
+    std::chrono::steady_clock::time_point start;
+
+public:
+    explicit ScopedTimer(Histogram& histogram)
+        : histogram(histogram), start(std::chrono::steady_clock::now()) {}
+    ~ScopedTimer() { histogram.record(std::chrono::steady_clock::now() - start); }
+
+    ScopedTimer(const ScopedTimer&) = delete;
+    ScopedTimer& operator=(const ScopedTimer&) = delete;
+};
+
+using MetricLabels = std::vector<std::pair<std::string, std::string>>;
+
+// Process wide set of metrics, rendered in the Prometheus text format.
+// Lookups take a lock, so call sites look a metric up once and keep the
+// reference; the references stay valid for the life of the process.
+class MetricsRegistry {
+private:
+    enum class Type {
+        Counter,
+        Gauge,
+        Histogram
+    };
+
+    struct Series {
+        std::string labels;  // rendered, e.g. {statement="select_users"}
+        std::unique_ptr<Counter> counter;
+        std::unique_ptr<Gauge> gauge;
+        std::unique_ptr<Histogram> histogram;
+        std::shared_ptr<const std::function<double()>> sample;  // gauges read at scrape time
+    };
+
+    struct Family {
+        std::string help;
+        Type type;
+        std::vector<std::unique_ptr<Series>> series;
+    };
+
+    std::mutex mutex_;
+    std::map<std::string, Family> families;
+
+    MetricsRegistry() = default;
+    Series& series(const std::string& name, const std::string& help, Type type, const MetricLabels& labels);
+
+public:
+    static MetricsRegistry& instance();
+
+    // The same name and labels always return the same metric
+    Counter& counter(const std::string& name, const std::string& help, const MetricLabels& labels = {});
+    Gauge& gauge(const std::string& name, const std::string& help, const MetricLabels& labels = {});
+    // Recorded in nanoseconds, exported in seconds
+    Histogram& histogram(const std::string& name, const std::string& help, const MetricLabels& labels = {});
+
+    // Gauge whose value is taken from sample at each scrape, for queue
+    // depths that already live elsewhere. Registering again replaces it.
+    void gaugeFunction(const std::string& name, const std::string& help, const MetricLabels& labels,
+                       std::function<double()> sample);
+
+    // Everything registered, as served on /metrics. Sample functions run
+    // without the registry lock, so they may take locks of their own.
+    std::string render();
+
+    MetricsRegistry(const MetricsRegistry&) = delete;
+    MetricsRegistry& operator=(const MetricsRegistry&) = delete;
+};
+
+#endif
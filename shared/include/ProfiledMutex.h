@@ -0,0 +1,237 @@
+#ifndef PROFILED_MUTEX_H
+#define PROFILED_MUTEX_H
+
+#include <mutex>
+#include <string>
+
+// Contention profiling for the few locks every request goes through.
+// Built with SNIBBLE_LOCK_PROFILING (the CMake option of the same name)
+// each acquisition records its wait and hold time per call site; without
+// it ProfiledMutex is a plain std::mutex and the macros expand to nothing.
+//
+//     mutex.lock(LOCK_SITE());          // site is file:line and function
+//     ProfiledLockGuard guard(mutex, LOCK_SITE());
+//     LOCK_TAG("storeMessage");         // names the caller in worst holders
+
+#ifndef SNIBBLE_LOCK_PROFILING
+#define SNIBBLE_LOCK_PROFILING 0
+#endif
+
+#if SNIBBLE_LOCK_PROFILING
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <thread>
+#include <vector>
+#include "Metrics.h"
+
+struct LockSiteStats;
+
+// One per call site, a function-local static created by LOCK_SITE()
+struct LockSite {
+    const char* file;
+    int line;
+    const char* function;
+    mutable std::atomic<LockSiteStats*> stats{nullptr};  // resolved on first use
+
+    LockSite(const char* file, int line, const char* function) : file(file), line(line), function(function) {}
+};
+
+#define LOCK_SITE()                                                                  \
+    ([](const char* snibble_function_) -> const LockSite& {                          \
+        static const LockSite snibble_site_(__FILE__, __LINE__, snibble_function_);  \
+        return snibble_site_;                                                        \
+    }(__func__))
+
+// Pushes a label on the calling thread's tag stack for the scope, so a
+// worst-holder entry shows the path that led to the lock
+class LockTag {
+public:
+    explicit LockTag(const char* tag);
+    ~LockTag();
+
+    LockTag(const LockTag&) = delete;
+    LockTag& operator=(const LockTag&) = delete;
+};
+
+#define SNIBBLE_LOCK_TAG_CONCAT_(a, b) a##b
+#define SNIBBLE_LOCK_TAG_NAME_(line) SNIBBLE_LOCK_TAG_CONCAT_(snibble_lock_tag_, line)
+#define LOCK_TAG(tag) LockTag SNIBBLE_LOCK_TAG_NAME_(__LINE__)(tag)
+
+struct LockSiteStats {
+    std::string mutex_name;
+    std::string label;  // "file.cpp:123 function"
+    Histogram& wait;
+    Histogram& hold;
+    Counter& contended;
+};
+
+// Everything recorded for the mutexes sharing one name
+class MutexProfile {
+public:
+    static constexpr size_t WORST_HOLDERS = 8;
+
+    struct Holder {
+        uint64_t held_ns = 0;
+        std::string site;
+        std::string tags;
+    };
+
+private:
+    std::mutex holders_mutex;
+    std::array<Holder, WORST_HOLDERS> holders;
+    std::atomic<uint64_t> admit_above{0};  // smallest kept hold once the list is full
+
+public:
+    const std::string name;
+
+    explicit MutexProfile(const std::string& name);
+
+    // Cheap unless held_ns beats the current worst holders
+    void noteHold(uint64_t held_ns, const LockSiteStats& site);
+    std::vector<Holder> worstHolders();
+};
+
+class ProfiledMutex {
+private:
+    std::mutex mutex_;
+    MutexProfile& profile;
+    LockSite default_site;
+    // Written by the holder only
+    const LockSiteStats* holder_site = nullptr;
+    int64_t acquired_ns = 0;
+
+    static int64_t nowNanos() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+    const LockSiteStats& resolve(const LockSite& site);
+
+public:
+    explicit ProfiledMutex(const char* name);
+
+    // Without a site the time is booked to "<name> unattributed", which is
+    // where std::lock_guard and std::unique_lock end up
+    void lock() { lock(default_site); }
+
+    void lock(const LockSite& site) {
+        const LockSiteStats& stats = resolve(site);
+        int64_t acquired;
+        if (mutex_.try_lock()) {
+            acquired = nowNanos();
+            stats.wait.record(uint64_t(0));
+        } else {
+            int64_t start = nowNanos();
+            mutex_.lock();
+            acquired = nowNanos();
+            stats.contended.add();
+            stats.wait.record(static_cast<uint64_t>(acquired - start));
+        }
+        holder_site = &stats;
+        acquired_ns = acquired;
+    }
+
+    bool try_lock() {
+        if (!mutex_.try_lock()) {
+            return false;
+        }
+        holder_site = &resolve(default_site);
+        acquired_ns = nowNanos();
+        return true;
+    }
+
+    void unlock() {
+        const LockSiteStats* stats = holder_site;
+        uint64_t held = static_cast<uint64_t>(nowNanos() - acquired_ns);
+        mutex_.unlock();
+        stats->hold.record(held);
+        profile.noteHold(held, *stats);
+    }
+
+    ProfiledMutex(const ProfiledMutex&) = delete;
+    ProfiledMutex& operator=(const ProfiledMutex&) = delete;
+};
+
+// Text report of every profiled mutex, optionally printed on a timer
+class LockProfiler {
+private:
+    std::mutex mutex_;
+    std::vector<MutexProfile*> profiles;
+    std::vector<LockSiteStats*> sites;
+    std::thread dump_thread;
+    std::condition_variable dump_cv;
+    bool dumping = false;
+
+    LockProfiler() = default;
+
+public:
+    static LockProfiler& instance();
+
+    MutexProfile& profile(const std::string& name);
+    const LockSiteStats& site(const MutexProfile& profile, const LockSite& site);
+
+    // Per site: acquisitions, contended share, wait and hold percentiles,
+    // then each mutex's worst holders
+    std::string report();
+    // Prints report() to stdout every interval until stopDump
+    void startDump(std::chrono::seconds interval);
+    void stopDump();
+
+    LockProfiler(const LockProfiler&) = delete;
+    LockProfiler& operator=(const LockProfiler&) = delete;
+};
+
+#else
+
+struct LockSite {};
+
+#define LOCK_SITE() LockSite{}
+#define LOCK_TAG(tag) ((void)0)
+
+class ProfiledMutex {
+private:
+    std::mutex mutex_;
+
+public:
+    explicit ProfiledMutex(const char*) {}
+
+    void lock() { mutex_.lock(); }
+    void lock(const LockSite&) { mutex_.lock(); }
+    bool try_lock() { return mutex_.try_lock(); }
+    void unlock() { mutex_.unlock(); }
+
+    ProfiledMutex(const ProfiledMutex&) = delete;
+    ProfiledMutex& operator=(const ProfiledMutex&) = delete;
+};
+
+class LockProfiler {
+public:
+    static LockProfiler& instance() {
+        static LockProfiler profiler;
+        return profiler;
+    }
+    std::string report() { return "lock profiling is not compiled in (SNIBBLE_LOCK_PROFILING)\n"; }
+    template <typename Duration>
+    void startDump(Duration) {}
+    void stopDump() {}
+};
+
+#endif
+
+// lock_guard that names its call site
+class ProfiledLockGuard {
+private:
+    ProfiledMutex& mutex_;
+
+public:
+    ProfiledLockGuard(ProfiledMutex& mutex, const LockSite& site) : mutex_(mutex) { mutex_.lock(site); }
+    ~ProfiledLockGuard() { mutex_.unlock(); }
+
+    ProfiledLockGuard(const ProfiledLockGuard&) = delete;
+    ProfiledLockGuard& operator=(const ProfiledLockGuard&) = delete;
+};
+
+#endif
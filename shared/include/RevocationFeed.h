@@ -0,0 +1,58 @@
+#ifndef REVOCATION_FEED_H
+#define REVOCATION_FEED_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <hiredis/hiredis.h>
+#include "RevocationList.h"
+
+// Keeps a RevocationList in step across auth and chat instances through
+// Redis. A revocation is added to a sorted set scored by expiry, so a server
+// that starts later can load it, and published on a channel that every
+// running server subscribes to. Redis is never on the verification path,
+// losing it only delays revocations made elsewhere until it is back.
+class RevocationFeed {
+private:
+    static constexpr const char* CHANNEL = "snibble:revocations";
+    static constexpr const char* SET_KEY = "snibble:revoked";
+
+    RevocationList& list;
+    std::string host;
+    int port;
+    bool verbose;
+
+    std::mutex publish_mutex;
+    redisContext* publisher = nullptr;
+
+    std::thread subscriber;
+    std::atomic<bool> running{false};
+    std::mutex subscriber_mutex;
+    std::condition_variable stop_cv;
+    int subscriber_fd = -1;
+
+    redisContext* connect() const;
+    void apply(const std::string& id, long long expires_at);
+    void loadSnapshot();
+    void subscribeLoop();
+
+public:
+    RevocationFeed(RevocationList& list, const std::string& host, int port, bool verbose);
+    ~RevocationFeed();
+
+    // Subscribes on a background thread, reconnecting with backoff
+    void start();
+    void stop();
+
+    // Records and announces a revocation that was already applied locally.
+    // False if Redis could not be reached.
+    bool publish(const std::string& id, std::chrono::system_clock::time_point expires_at);
+
+    RevocationFeed(const RevocationFeed&) = delete;
+    RevocationFeed& operator=(const RevocationFeed&) = delete;
+};
+
+#endif
@@ -0,0 +1,49 @@
+#ifndef REVOCATION_LIST_H
+#define REVOCATION_LIST_H
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <shared_mutex>
+#include <string_view>
+#include <unordered_set>
+
+// Token ids (jti) revoked by /logout, held until the token would have expired
+// anyway. Ids are filed in hourly buckets by the token's expiry, so a check
+// only looks in the one bucket its expiry maps to, and a bucket whose hour
+// has passed is dropped whole instead of entry by entry.
+class RevocationList {
+public:
+    using Clock = std::chrono::system_clock;
+
+    // Covers the 120 hour token lifetime with room to spare
+    static constexpr size_t BUCKET_COUNT = 128;
+
+private:
+    struct alignas(64) Bucket {
+        mutable std::shared_mutex mutex_;
+        int64_t hour = -1;  // expiry hour held, -1 when empty
+        std::unordered_set<uint64_t> keys;
+    };
+
+    std::array<Bucket, BUCKET_COUNT> buckets;
+    std::atomic<size_t> live{0};
+
+    static int64_t hourOf(Clock::time_point time);
+
+public:
+    // 64 bit digest of a token id, what is actually stored
+    static uint64_t keyOf(std::string_view id);
+
+    // False when the expiry has already passed or is further out than the
+    // buckets reach; such a token is either already rejected or not ours.
+    bool revoke(uint64_t key, Clock::time_point expires_at, Clock::time_point now);
+    bool isRevoked(uint64_t key, Clock::time_point expires_at) const;
+
+    // Frees buckets whose hour has passed. revoke() does this on the way.
+    void expire(Clock::time_point now);
+    size_t size() const;
+};
+
+#endif
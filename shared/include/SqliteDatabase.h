@@ -0,0 +1,62 @@
+#ifndef SQLITEDATABASE_H
+#define SQLITEDATABASE_H
+
+#include <sqlite3.h>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "StorageBackend.h"
+
+// Embedded backend for single-node deployments, tests and benchmarks.
+// The database file is opened in WAL mode and prepared statements are
+// cached per query text, so a message insert never leaves the process.
+class SqliteDatabase : public StorageBackend {
+private:
+    static std::unique_ptr<SqliteDatabase> instance;
+    static std::mutex mutex_;
+
+    sqlite3* db = nullptr;
+    // Mirrors db for isConnected, which must not wait behind a long query
+    // holding db_mutex
+    std::atomic<bool> connected{false};
+    std::string path;
+    bool verbose;
+    std::mutex db_mutex;
+    std::unordered_map<std::string, sqlite3_stmt*> statement_cache;
+
+    SqliteDatabase(const std::string& path, bool verbose = false);
+
+    sqlite3_stmt* prepareCached(const std::string& query);
+    void stepStatement(sqlite3_stmt* stmt, const std::vector<std::string>& params,
+                       const std::function<void(const std::vector<std::string>&)>& callback);
+    std::vector<std::vector<std::string>> runStatement(sqlite3_stmt* stmt, const std::vector<std::string>& params);
+
+public:
+    ~SqliteDatabase() override;
+
+    // Singleton pattern
+    static SqliteDatabase* getInstance(const std::string& path, bool verbose = false);
+
+    bool open();
+    void close();
+    bool isConnected() const override;
+    SqlDialect dialect() const override;
+
+    std::vector<std::vector<std::string>> executeQuery(const std::string& query) override;
+    std::vector<std::vector<std::string>> executeParamQuery(const std::string& query, const std::vector<std::string>& params) override;
+    bool executeUpdate(const std::string& query) override;
+    bool executeParamUpdate(const std::string& query, const std::vector<std::string>& params) override;
+    void forEachRow(const std::string& query, const std::vector<std::string>& params,
+                    const std::function<void(const std::vector<std::string>&)>& callback) override;
+
+    bool initializeTables() override;
+
+    // Prevent copying
+    SqliteDatabase(const SqliteDatabase&) = delete;
+    SqliteDatabase& operator=(const SqliteDatabase&) = delete;
+};
+
+#endif // SQLITEDATABASE_H
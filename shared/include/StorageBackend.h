@@ -0,0 +1,96 @@
+#ifndef STORAGE_BACKEND_H
+#define STORAGE_BACKEND_H
+
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <shared_mutex>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "IoPool.h"
+#include "Metrics.h"
+
+// The few statements that differ between engines (row limits, DDL) are
+// chosen by the caller from the backend's dialect; everything else is
+// written once with '?' placeholders.
+enum class SqlDialect {
+    SqlServer,
+    Sqlite
+};
+
+// Thrown without touching the database while it is known to be down
+class DatabaseUnavailable : public std::runtime_error {
+public:
+    explicit DatabaseUnavailable(const std::string& message) : std::runtime_error(message) {}
+};
+
+class StorageBackend {
+public:
+    using Rows = std::vector<std::vector<std::string>>;
+
+    virtual ~StorageBackend() = default;
+
+    virtual bool isConnected() const = 0;
+    virtual SqlDialect dialect() const = 0;
+
+    // Thread-safe database operations
+    virtual std::vector<std::vector<std::string>> executeQuery(const std::string& query) = 0;
+    virtual std::vector<std::vector<std::string>> executeParamQuery(const std::string& query, const std::vector<std::string>& params) = 0;
+    virtual bool executeUpdate(const std::string& query) = 0;
+    virtual bool executeParamUpdate(const std::string& query, const std::vector<std::string>& params) = 0;
+
+    // Hands each row to callback as it is fetched instead of building the
+    // whole result set, for scans of large tables. The connection stays
+    // locked until the last row, so the callback must be cheap.
+    virtual void forEachRow(const std::string& query, const std::vector<std::string>& params,
+                            const std::function<void(const std::vector<std::string>&)>& callback) = 0;
+
+    // Schema initialization
+    virtual bool initializeTables() = 0;
+
+    // Starts the I/O pool the calls below run on. Backends that support it
+    // give every worker its own connection, so queries from different
+    // workers no longer wait on one connection lock.
+    void startIoPool(size_t workers, size_t max_queue);
+    void stopIoPool();
+
+    // Runs work on the I/O pool, or inline when no pool was started. False
+    // when the queue is full; the work is then not run.
+    bool submit(std::function<void()> work);
+
+    // Rejected submissions fail the future, or call done, with a runtime_error.
+    std::future<Rows> executeParamQueryAsync(const std::string& query, const std::vector<std::string>& params);
+    void executeParamQueryAsync(const std::string& query, const std::vector<std::string>& params,
+                                std::function<void(Rows, std::exception_ptr)> done);
+    std::future<bool> executeParamUpdateAsync(const std::string& query, const std::vector<std::string>& params);
+
+    // Returns the process wide backend for STORAGE_BACKEND: "odbc" (Azure SQL
+    // through DatabaseManager) or "sqlite" (embedded, database is the file path).
+    static StorageBackend* getInstance(const std::string& backend, const std::string& server, const std::string& database, const std::string& username, const std::string& password, bool verbose = false);
+
+    // Short label for a statement, its verb and table: "INSERT INTO
+    // messages ..." is insert_messages
+    static std::string statementName(const std::string& query);
+
+protected:
+    std::unique_ptr<IoPool> io_pool;
+
+    // Called before the pool starts and after it has stopped
+    virtual void openWorkerConnections(size_t count) { (void)count; }
+    virtual void closeWorkerConnections() {}
+
+    // The calling pool worker's index, -1 outside the pool
+    int ioWorker() const;
+
+    // Execution time histogram for query, one per statementName
+    Histogram& queryLatency(const std::string& query);
+
+private:
+    std::shared_mutex latency_mutex;
+    std::unordered_map<std::string, Histogram*> latency_by_query;
+};
+
+#endif // STORAGE_BACKEND_H
@@ -0,0 +1,64 @@
+#ifndef TOKEN_CACHE_H
+#define TOKEN_CACHE_H
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+// Tokens that already passed signature and claim checks, keyed by a keyed
+// BLAKE2b digest of the token text. Split into independently locked LRU
+// shards so concurrent /verify-token calls rarely wait on each other.
+class TokenCache {
+public:
+    using Digest = std::array<unsigned char, 16>;
+
+    struct Entry {
+        std::string username;
+        std::chrono::system_clock::time_point expires_at;
+        uint64_t revocation_key;  // RevocationList key of the token id
+    };
+
+private:
+    struct DigestHash {
+        size_t operator()(const Digest& digest) const {
+            size_t value;
+            std::memcpy(&value, digest.data(), sizeof(value));
+            return value;
+        }
+    };
+
+    struct Shard {
+        std::mutex mutex_;
+        std::list<std::pair<Digest, Entry>> lru;
+        std::unordered_map<Digest, std::list<std::pair<Digest, Entry>>::iterator, DigestHash> index;
+    };
+
+    static constexpr size_t SHARD_COUNT = 16;
+
+    std::array<unsigned char, 32> digest_key;
+    size_t shard_capacity;
+    std::unique_ptr<Shard[]> shards;
+
+    Shard& shardFor(const Digest& digest);
+
+public:
+    explicit TokenCache(size_t capacity = 100000);
+
+    Digest digestOf(const std::string& token) const;
+
+    // False if the token is not cached or its expiry has passed; expired
+    // entries are dropped on the way.
+    bool get(const Digest& digest, std::chrono::system_clock::time_point now, Entry& entry);
+    void put(const Digest& digest, const Entry& entry);
+
+    TokenCache(const TokenCache&) = delete;
+    TokenCache& operator=(const TokenCache&) = delete;
+};
+
+#endif
@@ -0,0 +1,49 @@
+#ifndef TOKEN_MANAGER_H
+#define TOKEN_MANAGER_H
+
+#include <string>
+#include <jwt-cpp/jwt.h>
+#include "RevocationList.h"
+#include "TokenCache.h"
+
+// Issues and verifies the HS256 session tokens. The verifier is built once
+// with the secret, type and issuer checks, and tokens that verified are kept
+// in a TokenCache until they expire, so checking the same token again is a
+// digest and a hash lookup instead of a decode, JSON parse and HMAC.
+// Every token carries a random jti, and tokens revoked by /logout are
+// refused from the RevocationList whether or not they were cached.
+class TokenManager {
+private:
+    using Verifier = decltype(jwt::verify());
+    using Decoded = decltype(jwt::decode(std::string()));
+
+    std::string secret;
+    Verifier verifier;
+    TokenCache cache;
+    bool cache_enabled;
+    RevocationList revoked;
+
+    // The jti claim, or the signature for tokens issued before jti existed
+    static std::string revocationId(const Decoded& decoded);
+
+public:
+    explicit TokenManager(const std::string& secret, size_t cache_capacity = 100000);
+
+    std::string createToken(const std::string& username) const;
+
+    // True and the username for a valid, unexpired token. Otherwise false
+    // with the reason for the 401 in error.
+    bool verifyToken(const std::string& token, std::string& username, std::string& error);
+
+    // Verifies the token and revokes it until its expiry. The id and expiry
+    // are returned so the caller can pass the revocation on to other servers.
+    bool revokeToken(const std::string& token, std::string& id,
+                     std::chrono::system_clock::time_point& expires_at, std::string& error);
+
+    RevocationList& revocations();
+
+    TokenManager(const TokenManager&) = delete;
+    TokenManager& operator=(const TokenManager&) = delete;
+};
+
+#endif
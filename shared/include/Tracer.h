@@ -0,0 +1,93 @@
+#ifndef TRACER_H
+#define TRACER_H
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+// Identifies one sampled message; trace_id 0 means the message is not
+// traced and every span on it is a no-op.
+struct TraceContext {
+    uint64_t trace_id = 0;
+
+    bool sampled() const { return trace_id != 0; }
+};
+
+// Sampled per-message spans kept in a fixed ring in memory. Writers claim
+// a slot with one fetch_add and never wait; when the ring wraps the oldest
+// spans are overwritten. The ring is exported as Chrome trace event JSON
+// (chrome://tracing, Perfetto), one complete event per span.
+class Tracer {
+private:
+    struct Slot {
+        std::atomic<uint64_t> sequence{0};  // odd while being written
+        std::atomic<uint64_t> trace_id{0};
+        std::atomic<const char*> name{nullptr};
+        std::atomic<int64_t> start_ns{0};
+        std::atomic<int64_t> duration_ns{0};
+        std::atomic<uint32_t> thread_index{0};
+    };
+
+    std::atomic<uint32_t> sample_every{0};
+    std::unique_ptr<Slot[]> slots;
+    size_t capacity = 0;
+    std::atomic<uint64_t> next_slot{0};
+    std::atomic<uint64_t> next_trace{0};
+
+    Tracer() = default;
+
+public:
+    static Tracer& instance();
+
+    // Traces one message in sample_every (0 turns tracing off). The ring
+    // holds ring_spans spans, rounded up to a power of two. Call once at
+    // startup, before any message is traced.
+    void configure(uint32_t sample_every, size_t ring_spans);
+
+    // Sampling decision for a new message, a relaxed load when off
+    TraceContext startTrace();
+
+    // name must be a string literal
+    void record(const TraceContext& trace, const char* name, int64_t start_ns, int64_t end_ns);
+
+    static int64_t nowNanos() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // Spans currently in the ring as {"traceEvents": [...]}
+    std::string exportChromeTrace();
+    bool writeChromeTrace(const std::string& path);
+
+    Tracer(const Tracer&) = delete;
+    Tracer& operator=(const Tracer&) = delete;
+};
+
+// Times a scope as a span of trace; does nothing for unsampled messages
+class TraceSpan {
+private:
+    const TraceContext& trace;
+    const char* name;
+    int64_t start_ns;
+
+public:
+    TraceSpan(const TraceContext& trace, const char* name)
+        : trace(trace), name(name), start_ns(trace.sampled() ? Tracer::nowNanos() : 0) {}
+    ~TraceSpan() { end(); }
+
+    // Ends the span early; later calls and the destructor do nothing
+    void end() {
+        if (start_ns != 0) {
+            Tracer::instance().record(trace, name, start_ns, Tracer::nowNanos());
+            start_ns = 0;
+        }
+    }
+
+    TraceSpan(const TraceSpan&) = delete;
+    TraceSpan& operator=(const TraceSpan&) = delete;
+};
+
+#endif
@@ -0,0 +1,132 @@
+#include "CircuitBreaker.h"
+#include <algorithm>
+#include <random>
+using namespace std;
+
+CircuitBreaker::CircuitBreaker(const string& name, int failure_threshold, chrono::milliseconds initial_backoff,
+                               chrono::milliseconds max_backoff)
+    : backoff(initial_backoff), failure_threshold(max(failure_threshold, 1)), initial_backoff(initial_backoff),
+      max_backoff(max(max_backoff, initial_backoff)), name(name),
+      rejected(MetricsRegistry::instance().counter("snibble_circuit_rejected_total",
+                                                   "Calls failed fast by an open circuit breaker",
+                                                   {{"breaker", name}})),
+      opened(MetricsRegistry::instance().counter("snibble_circuit_opened_total", "Times the circuit breaker opened",
+                                                 {{"breaker", name}})) {
+    MetricsRegistry::instance().gaugeFunction(
+        "snibble_circuit_state", "0 closed, 1 open, 2 half open", {{"breaker", name}},
+        [this]() { return static_cast<double>(static_cast<int>(current())); });
+}
+
+CircuitBreaker::~CircuitBreaker() {
+    MetricsRegistry::instance().gaugeFunction("snibble_circuit_state", "0 closed, 1 open, 2 half open",
+                                              {{"breaker", name}}, []() { return 0.0; });
+}
+
+int64_t CircuitBreaker::nowMillis() {
+    return chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+CircuitBreaker::Call::~Call() {
+    if (breaker) {
+        breaker->succeed(probe);
+    }
+}
+
+void CircuitBreaker::Call::failed() {
+    if (breaker) {
+        breaker->fail(probe, false);
+        breaker = nullptr;
+    }
+}
+
+void CircuitBreaker::Call::trip() {
+    if (breaker) {
+        breaker->fail(probe, true);
+        breaker = nullptr;
+    }
+}
+
+bool CircuitBreaker::allow(Call& call) {
+    State seen = state.load(memory_order_acquire);
+    if (seen == State::Closed) {
+        call.breaker = this;
+        call.probe = false;
+        return true;
+    }
+    if (seen == State::Open && nowMillis() >= retry_at_ms.load(memory_order_relaxed)) {
+        // Exactly one caller wins the probe
+        State expected = State::Open;
+        if (state.compare_exchange_strong(expected, State::HalfOpen, memory_order_acq_rel)) {
+            call.breaker = this;
+            call.probe = true;
+            return true;
+        }
+    }
+    rejected.add();
+    return false;
+}
+
+bool CircuitBreaker::available() const {
+    State seen = state.load(memory_order_acquire);
+    return seen == State::Closed ||
+           (seen == State::Open && nowMillis() >= retry_at_ms.load(memory_order_relaxed));
+}
+
+void CircuitBreaker::recordSuccess() {
+    succeed(false);
+}
+
+void CircuitBreaker::recordFailure() {
+    fail(false, false);
+}
+
+void CircuitBreaker::trip() {
+    fail(false, true);
+}
+
+void CircuitBreaker::succeed(bool probe) {
+    if (!probe) {
+        // Hot path, every successful call: no lock and no write when clean.
+        // A call let through before the breaker opened does not close it.
+        if (state.load(memory_order_acquire) == State::Closed &&
+            consecutive_failures.load(memory_order_relaxed) != 0) {
+            consecutive_failures.store(0, memory_order_relaxed);
+        }
+        return;
+    }
+    lock_guard<mutex> lock(mutex_);
+    consecutive_failures.store(0, memory_order_relaxed);
+    backoff = initial_backoff;
+    state.store(State::Closed, memory_order_release);
+}
+
+void CircuitBreaker::fail(bool probe, bool at_once) {
+    if (!probe && state.load(memory_order_acquire) != State::Closed) {
+        // Let through before it opened and failing late: the probe decides
+        return;
+    }
+    int failures = consecutive_failures.fetch_add(1, memory_order_relaxed) + 1;
+    if (probe || at_once || failures >= failure_threshold) {
+        lock_guard<mutex> lock(mutex_);
+        // Checked again under the lock, a probe may have taken over since
+        if (probe || state.load(memory_order_acquire) == State::Closed) {
+            open();
+        }
+    }
+}
+
+void CircuitBreaker::open() {
+    State seen = state.load(memory_order_acquire);
+    // Backoff grows only on failed probes, a breaker that was closed starts over
+    if (seen == State::HalfOpen) {
+        backoff = min(backoff * 2, max_backoff);
+    } else {
+        backoff = initial_backoff;
+        opened.add();
+    }
+    // Up to a quarter of jitter so several servers do not probe in step
+    thread_local mt19937 rng(random_device{}());
+    uniform_int_distribution<int64_t> jitter(0, backoff.count() / 4);
+    retry_at_ms.store(nowMillis() + backoff.count() + jitter(rng), memory_order_relaxed);
+    state.store(State::Open, memory_order_release);
+}
@@ -6,7 +6,7 @@
 using namespace std;
 
 unique_ptr<DatabaseManager> DatabaseManager::instance = nullptr;
-mutex DatabaseManager::mutex_;
+ProfiledMutex DatabaseManager::mutex_{"database_manager_instance"};
 
 DatabaseManager::DatabaseManager(const string& server, const string& database, const string& username, const string& password, bool verbose) 
     : verbose(verbose), hEnv(SQL_NULL_HENV), hDbc(SQL_NULL_HDBC), hStmt(SQL_NULL_HSTMT) {
@@ -29,11 +29,12 @@ DatabaseManager::DatabaseManager(const string& server, const string& database, c
 }
 
 DatabaseManager::~DatabaseManager() {
+    stopIoPool();
     disconnectFromDatabase();
 }
 
 DatabaseManager* DatabaseManager::getInstance(const string& server, const string& database, const string& username, const string& password, bool verbose) {
-    lock_guard<mutex> lock(mutex_);
+    ProfiledLockGuard lock(mutex_, LOCK_SITE());
     if (instance == nullptr) {
         instance = unique_ptr<DatabaseManager>(new DatabaseManager(server, database, username, password, verbose));
         instance->connectToDatabase();
@@ -44,85 +45,194 @@ DatabaseManager* DatabaseManager::getInstance(const string& server, const string
 
 bool DatabaseManager::connectToDatabase() {
     try {
-        // Allocate environment handle
-        lock_guard<mutex> lock(db_mutex);
-        if (SQLAllocHandle(SQL_HANDLE_ENV, SQL_NULL_HANDLE, &hEnv) != SQL_SUCCESS) {
-            if(verbose) {
-                cerr << "Failed to allocate SQL environment handle." << endl;
-            }
+        if (!ensureEnvironment()) {
+            breaker.trip();
             return false;
         }
-        
-        // Set ODBC version
-        if (SQLSetEnvAttr(hEnv, SQL_ATTR_ODBC_VERSION, (void*)SQL_OV_ODBC3, 0) != SQL_SUCCESS) {
-            if(verbose) {
-                cerr << "Failed to set ODBC version." << endl;
-            }
+        ProfiledLockGuard lock(db_mutex, LOCK_SITE());
+        if (!openConnection(hDbc)) {
+            // Retried by the first call after the breaker's backoff
+            closeConnection(hDbc);
+            breaker.trip();
             return false;
         }
-        
-        // Allocate connection handle
-        if (SQLAllocHandle(SQL_HANDLE_DBC, hEnv, &hDbc) != SQL_SUCCESS) {
-            if(verbose) {
-                cerr << "Failed to allocate connection handle." << endl;
-            }
-            return false;
+        breaker.recordSuccess();
+        return true;
+    }
+    catch (const exception& e) {
+        cerr << "Database connection error: " << e.what() << endl;
+        return false;
+    }
+}
+
+bool DatabaseManager::ensureEnvironment() {
+    lock_guard<mutex> lock(env_mutex);
+    if (hEnv != SQL_NULL_HENV) {
+        return true;
+    }
+    // Allocate environment handle
+    if (SQLAllocHandle(SQL_HANDLE_ENV, SQL_NULL_HANDLE, &hEnv) != SQL_SUCCESS) {
+        if(verbose) {
+            cerr << "Failed to allocate SQL environment handle." << endl;
         }
-        
+        hEnv = SQL_NULL_HENV;
+        return false;
+    }
+    
+    // Set ODBC version
+    if (SQLSetEnvAttr(hEnv, SQL_ATTR_ODBC_VERSION, (void*)SQL_OV_ODBC3, 0) != SQL_SUCCESS) {
+        if(verbose) {
+            cerr << "Failed to set ODBC version." << endl;
+        }
+        SQLFreeHandle(SQL_HANDLE_ENV, hEnv);
+        hEnv = SQL_NULL_HENV;
+        return false;
+    }
+    return true;
+}
+
+bool DatabaseManager::reconnect(SQLHDBC& dbc, CircuitBreaker::Call& call) {
+    closeConnection(dbc);
+    if (verbose) {
+        cerr << "Database connection lost, reconnecting" << endl;
+    }
+    // A success is the statement's to report, once it ran on the new connection
+    if (ensureEnvironment() && openConnection(dbc)) {
+        return true;
+    }
+    closeConnection(dbc);
+    call.trip();
+    return false;
+}
+
+void DatabaseManager::noteStatementFailure(SQLHDBC dbc, const char* sql_state, CircuitBreaker::Call& call) {
+    if (strncmp(sql_state, "08", 2) == 0 || !connectionAlive(dbc)) {
+        call.failed();
+    }
+}
+
+bool DatabaseManager::openConnection(SQLHDBC& dbc) {
+    // Allocate connection handle
+    if (SQLAllocHandle(SQL_HANDLE_DBC, hEnv, &dbc) != SQL_SUCCESS) {
+        if(verbose) {
+            cerr << "Failed to allocate connection handle." << endl;
+        }
+        dbc = SQL_NULL_HDBC;
+        return false;
+    }
+    
+    if (verbose) {
+        cout << "Attempting to connect with connection string: " << endl;
+    }
+    
+    // Connect to Azure SQL Database
+    SQLCHAR outConnectionString[1024];
+    SQLSMALLINT outConnectionStringLength;
+    SQLRETURN ret = SQLDriverConnect(dbc, nullptr, (SQLCHAR*)connectionString.c_str(), 
+                                    SQL_NTS, outConnectionString, sizeof(outConnectionString), 
+                                    &outConnectionStringLength, SQL_DRIVER_COMPLETE);
+    
+    if (ret == SQL_SUCCESS || ret == SQL_SUCCESS_WITH_INFO) {
         if (verbose) {
-            cout << "Attempting to connect with connection string: " << endl;
+            cout << "Connected to Azure SQL Database successfully" << endl;
         }
-        
-        // Connect to Azure SQL Database
-        SQLCHAR outConnectionString[1024];
-        SQLSMALLINT outConnectionStringLength;
-        SQLRETURN ret = SQLDriverConnect(hDbc, nullptr, (SQLCHAR*)connectionString.c_str(), 
-                                        SQL_NTS, outConnectionString, sizeof(outConnectionString), 
-                                        &outConnectionStringLength, SQL_DRIVER_COMPLETE);
-        
-        if (ret == SQL_SUCCESS || ret == SQL_SUCCESS_WITH_INFO) {
-            if (verbose) {
-                cout << "Connected to Azure SQL Database successfully" << endl;
+        return true;
+    } else {
+        if(verbose) {
+            cerr << "Failed to connect to Azure SQL Database." << endl;
+            
+            // Get detailed error information
+            SQLCHAR sqlState[6] = "";
+            SQLCHAR errorMessage[SQL_MAX_MESSAGE_LENGTH];
+            SQLINTEGER nativeError;
+            SQLSMALLINT messageLength;
+            
+            if (SQLGetDiagRec(SQL_HANDLE_DBC, dbc, 1, sqlState, &nativeError, 
+                             errorMessage, sizeof(errorMessage), &messageLength) == SQL_SUCCESS) {
+                cerr << "SQL State: " << sqlState << endl;
+                cerr << "Native Error: " << nativeError << endl;
+                cerr << "Error Message: " << errorMessage << endl;
             }
-            return true;
+        }
+        return false;
+    }
+}
+
+void DatabaseManager::closeConnection(SQLHDBC& dbc) {
+    if (dbc != SQL_NULL_HDBC) {
+        SQLDisconnect(dbc);
+        SQLFreeHandle(SQL_HANDLE_DBC, dbc);
+        dbc = SQL_NULL_HDBC;
+    }
+}
+
+bool DatabaseManager::connectionAlive(SQLHDBC dbc) {
+    if (dbc == SQL_NULL_HDBC) return false;
+    
+    SQLUINTEGER connectionDead;
+    SQLRETURN ret = SQLGetConnectAttr(dbc, SQL_ATTR_CONNECTION_DEAD, &connectionDead, 0, nullptr);
+    return (ret == SQL_SUCCESS || ret == SQL_SUCCESS_WITH_INFO) && (connectionDead == SQL_CD_FALSE);
+}
+
+void DatabaseManager::openWorkerConnections(size_t count) {
+    ProfiledLockGuard lock(db_mutex, LOCK_SITE());
+    if (hEnv == SQL_NULL_HENV) {
+        return;
+    }
+    worker_connections.assign(count, SQL_NULL_HDBC);
+    size_t opened = 0;
+    for (auto& dbc : worker_connections) {
+        if (openConnection(dbc)) {
+            opened++;
         } else {
-            if(verbose) {
-                cerr << "Failed to connect to Azure SQL Database." << endl;
-                
-                // Get detailed error information
-                SQLCHAR sqlState[6];
-                SQLCHAR errorMessage[SQL_MAX_MESSAGE_LENGTH];
-                SQLINTEGER nativeError;
-                SQLSMALLINT messageLength;
-                
-                if (SQLGetDiagRec(SQL_HANDLE_DBC, hDbc, 1, sqlState, &nativeError, 
-                                 errorMessage, sizeof(errorMessage), &messageLength) == SQL_SUCCESS) {
-                    cerr << "SQL State: " << sqlState << endl;
-                    cerr << "Native Error: " << nativeError << endl;
-                    cerr << "Error Message: " << errorMessage << endl;
-                }
-            }
-            return false;
+            closeConnection(dbc);
         }
     }
-    catch (const exception& e) {
-        cerr << "Database connection error: " << e.what() << endl;
-        return false;
+    if (opened < count) {
+        cerr << "Opened " << opened << " of " << count << " I/O worker connections, the rest share the main connection" << endl;
     }
 }
 
+void DatabaseManager::closeWorkerConnections() {
+    ProfiledLockGuard lock(db_mutex, LOCK_SITE());
+    for (auto& dbc : worker_connections) {
+        closeConnection(dbc);
+    }
+    worker_connections.clear();
+}
+
+SQLHDBC DatabaseManager::acquireConnection(unique_lock<ProfiledMutex>& lock, const LockSite& site,
+                                           CircuitBreaker::Call& call) {
+    if (!breaker.allow(call)) {
+        throw DatabaseUnavailable("Database unavailable, retrying later");
+    }
+    int worker = ioWorker();
+    SQLHDBC* dbc = nullptr;
+    if (worker >= 0 && static_cast<size_t>(worker) < worker_connections.size()) {
+        dbc = &worker_connections[worker];
+    } else {
+        db_mutex.lock(site);
+        lock = unique_lock<ProfiledMutex>(db_mutex, adopt_lock);
+        dbc = &hDbc;
+    }
+    if (connectionAlive(*dbc)) {
+        return *dbc;
+    }
+    // Callers queued behind a failed reconnect give up without trying again
+    if ((!call.isProbe() && breaker.current() != CircuitBreaker::State::Closed) || !reconnect(*dbc, call)) {
+        throw DatabaseUnavailable("Database connection is not open.");
+    }
+    return *dbc;
+}
+
 void DatabaseManager::disconnectFromDatabase() {
-    lock_guard<mutex> lock(db_mutex);
+    ProfiledLockGuard lock(db_mutex, LOCK_SITE());
     try {
         if (hStmt != SQL_NULL_HSTMT) {
             SQLFreeHandle(SQL_HANDLE_STMT, hStmt);
             hStmt = SQL_NULL_HSTMT;
         }
-        if (hDbc != SQL_NULL_HDBC) {
-            SQLDisconnect(hDbc);
-            SQLFreeHandle(SQL_HANDLE_DBC, hDbc);
-            hDbc = SQL_NULL_HDBC;
-        }
+        closeConnection(hDbc);
         if (hEnv != SQL_NULL_HENV) {
             SQLFreeHandle(SQL_HANDLE_ENV, hEnv);
             hEnv = SQL_NULL_HENV;
@@ -137,30 +247,92 @@ void DatabaseManager::disconnectFromDatabase() {
 }
 
 bool DatabaseManager::isConnected() const {
-    if (hDbc == SQL_NULL_HDBC) return false;
-    
-    SQLUINTEGER connectionDead;
-    SQLRETURN ret = SQLGetConnectAttr(hDbc, SQL_ATTR_CONNECTION_DEAD, &connectionDead, 0, nullptr);
-    return (ret == SQL_SUCCESS || ret == SQL_SUCCESS_WITH_INFO) && (connectionDead == SQL_CD_FALSE);
+    // True while calls are worth attempting: a dead connection is replaced
+    // by the next call, so this only turns false while the breaker is open
+    return breaker.available();
+}
+
+SqlDialect DatabaseManager::dialect() const {
+    return SqlDialect::SqlServer;
+}
+
+void DatabaseManager::fetchResults(SQLHDBC dbc, SQLHSTMT stmt, const string& query,
+                                   const function<void(const vector<string>&)>& callback, CircuitBreaker::Call& call) {
+    SQLCHAR buffer[1024];
+    SQLLEN indicator;
+    SQLRETURN ret;
+    // A batch returns one result per statement. The statements after the
+    // first only run, and their errors only show, as results are consumed.
+    do {
+        SQLSMALLINT columnCount = 0;
+        SQLNumResultCols(stmt, &columnCount);
+        while (columnCount > 0 && SQL_SUCCEEDED(SQLFetch(stmt))) {
+            vector<string> row;
+            for (SQLSMALLINT i = 1; i <= columnCount; i++) {
+                if (SQLGetData(stmt, i, SQL_C_CHAR, buffer, sizeof(buffer), &indicator) == SQL_SUCCESS) {
+                    if (indicator == SQL_NULL_DATA) {
+                        row.push_back("");
+                    } else {
+                        row.push_back(string((char*)buffer));
+                    }
+                } else {
+                    row.push_back("");
+                }
+            }
+            try {
+                callback(row);
+            } catch (...) {
+                SQLFreeHandle(SQL_HANDLE_STMT, stmt);
+                throw;
+            }
+        }
+        ret = SQLMoreResults(stmt);
+    } while (SQL_SUCCEEDED(ret));
+
+    if (ret != SQL_NO_DATA) {
+        SQLCHAR sqlState[6] = "";
+        SQLCHAR errorMessage[SQL_MAX_MESSAGE_LENGTH];
+        SQLINTEGER nativeError;
+        SQLSMALLINT messageLength;
+        
+        if (SQLGetDiagRec(SQL_HANDLE_STMT, stmt, 1, sqlState, &nativeError, 
+                         errorMessage, sizeof(errorMessage), &messageLength) == SQL_SUCCESS) {
+            cerr << "SQL Batch Error - State: " << sqlState << ", Message: " << errorMessage << endl;
+        }
+        
+        SQLFreeHandle(SQL_HANDLE_STMT, stmt);
+        noteStatementFailure(dbc, reinterpret_cast<const char*>(sqlState), call);
+        throw runtime_error("Failed to execute query: " + query);
+    }
 }
 
 vector<vector<string>> DatabaseManager::executeQuery(const string& query) {
-    lock_guard<mutex> lock(db_mutex);
+    Histogram& latency = queryLatency(query);
+    unique_lock<ProfiledMutex> lock;
+    // Reports a success when it goes out of scope after the statement, or
+    // the failure noteStatementFailure saw
+    CircuitBreaker::Call call;
+    SQLHDBC dbc = acquireConnection(lock, LOCK_SITE(), call);
+    ScopedTimer timer(latency);
     vector<vector<string>> results;
     
     try {
-        if (!isConnected()) {
+        if (!connectionAlive(dbc)) {
+            noteStatementFailure(dbc, "", call);
             throw runtime_error("Database connection is not open.");
         }
         
         SQLHSTMT stmt;
-        if (SQLAllocHandle(SQL_HANDLE_STMT, hDbc, &stmt) != SQL_SUCCESS) {
+        if (SQLAllocHandle(SQL_HANDLE_STMT, dbc, &stmt) != SQL_SUCCESS) {
+            noteStatementFailure(dbc, "", call);
             throw runtime_error("Failed to allocate statement handle.");
         }
         
-        if (SQLExecDirect(stmt, (SQLCHAR*)query.c_str(), SQL_NTS) != SQL_SUCCESS) {
+        SQLRETURN ret = SQLExecDirect(stmt, (SQLCHAR*)query.c_str(), SQL_NTS);
+        // SQL_NO_DATA is an update or delete that matched no rows
+        if (!SQL_SUCCEEDED(ret) && ret != SQL_NO_DATA) {
             // Get detailed error information
-            SQLCHAR sqlState[6];
+            SQLCHAR sqlState[6] = "";
             SQLCHAR errorMessage[SQL_MAX_MESSAGE_LENGTH];
             SQLINTEGER nativeError;
             SQLSMALLINT messageLength;
@@ -171,30 +343,11 @@ vector<vector<string>> DatabaseManager::executeQuery(const string& query) {
             }
             
             SQLFreeHandle(SQL_HANDLE_STMT, stmt);
+            noteStatementFailure(dbc, reinterpret_cast<const char*>(sqlState), call);
             throw runtime_error("Failed to execute query: " + query);
         }
         
-        SQLSMALLINT columnCount;
-        SQLNumResultCols(stmt, &columnCount);
-        
-        SQLCHAR buffer[1024];
-        SQLLEN indicator;
-        
-        while (SQLFetch(stmt) == SQL_SUCCESS) {
-            vector<string> row;
-            for (SQLSMALLINT i = 1; i <= columnCount; i++) {
-                if (SQLGetData(stmt, i, SQL_C_CHAR, buffer, sizeof(buffer), &indicator) == SQL_SUCCESS) {
-                    if (indicator == SQL_NULL_DATA) {
-                        row.push_back("");
-                    } else {
-                        row.push_back(string((char*)buffer));
-                    }
-                } else {
-                    row.push_back("");
-                }
-            }
-            results.push_back(row);
-        }
+        fetchResults(dbc, stmt, query, [&results](const vector<string>& row) { results.push_back(row); }, call);
         
         SQLFreeHandle(SQL_HANDLE_STMT, stmt);
         return results;
@@ -206,21 +359,35 @@ vector<vector<string>> DatabaseManager::executeQuery(const string& query) {
 }
 
 vector<vector<string>> DatabaseManager::executeParamQuery(const string& query, const vector<string>& params) {
-    lock_guard<mutex> lock(db_mutex);
     vector<vector<string>> results;
+    forEachRow(query, params, [&results](const vector<string>& row) { results.push_back(row); });
+    return results;
+}
+
+void DatabaseManager::forEachRow(const string& query, const vector<string>& params,
+                                 const function<void(const vector<string>&)>& callback) {
+    Histogram& latency = queryLatency(query);
+    unique_lock<ProfiledMutex> lock;
+    CircuitBreaker::Call call;
+    SQLHDBC dbc = acquireConnection(lock, LOCK_SITE(), call);
+    // Measured once the connection is ours, so waits on db_mutex are not counted
+    ScopedTimer timer(latency);
     
     try {
-        if (!isConnected()) {
+        if (!connectionAlive(dbc)) {
+            noteStatementFailure(dbc, "", call);
             throw runtime_error("Database connection is not open.");
         }
         
         SQLHSTMT stmt;
-        if (SQLAllocHandle(SQL_HANDLE_STMT, hDbc, &stmt) != SQL_SUCCESS) {
+        if (SQLAllocHandle(SQL_HANDLE_STMT, dbc, &stmt) != SQL_SUCCESS) {
+            noteStatementFailure(dbc, "", call);
             throw runtime_error("Failed to allocate statement handle.");
         }
         
         if (SQLPrepare(stmt, (SQLCHAR*)query.c_str(), SQL_NTS) != SQL_SUCCESS) {
             SQLFreeHandle(SQL_HANDLE_STMT, stmt);
+            noteStatementFailure(dbc, "", call);
             throw runtime_error("Failed to prepare query.");
         }
         
@@ -234,9 +401,10 @@ vector<vector<string>> DatabaseManager::executeParamQuery(const string& query, c
             }
         }
         
-        if (SQLExecute(stmt) != SQL_SUCCESS) {
+        SQLRETURN ret = SQLExecute(stmt);
+        if (!SQL_SUCCEEDED(ret) && ret != SQL_NO_DATA) {
             // Get detailed error information
-            SQLCHAR sqlState[6];
+            SQLCHAR sqlState[6] = "";
             SQLCHAR errorMessage[SQL_MAX_MESSAGE_LENGTH];
             SQLINTEGER nativeError;
             SQLSMALLINT messageLength;
@@ -247,33 +415,13 @@ vector<vector<string>> DatabaseManager::executeParamQuery(const string& query, c
             }
             
             SQLFreeHandle(SQL_HANDLE_STMT, stmt);
+            noteStatementFailure(dbc, reinterpret_cast<const char*>(sqlState), call);
             throw runtime_error("Failed to execute parameterized query: " + query);
         }
         
-        SQLSMALLINT columnCount;
-        SQLNumResultCols(stmt, &columnCount);
-        
-        SQLCHAR buffer[1024];
-        SQLLEN indicator;
-        
-        while (SQLFetch(stmt) == SQL_SUCCESS) {
-            vector<string> row;
-            for (SQLSMALLINT i = 1; i <= columnCount; i++) {
-                if (SQLGetData(stmt, i, SQL_C_CHAR, buffer, sizeof(buffer), &indicator) == SQL_SUCCESS) {
-                    if (indicator == SQL_NULL_DATA) {
-                        row.push_back("");
-                    } else {
-                        row.push_back(string((char*)buffer));
-                    }
-                } else {
-                    row.push_back("");
-                }
-            }
-            results.push_back(row);
-        }
+        fetchResults(dbc, stmt, query, callback, call);
         
         SQLFreeHandle(SQL_HANDLE_STMT, stmt);
-        return results;
     }
     catch (const exception& e) {
         cerr << "Parameterized query execution error: " << e.what() << endl;
@@ -286,6 +434,9 @@ bool DatabaseManager::executeUpdate(const string& query) {
         executeQuery(query);
         return true;
     }
+    catch (const DatabaseUnavailable&) {
+        return false;
+    }
     catch (const exception& e) {
         cerr << "Update execution error: " << e.what() << endl;
         return false;
@@ -297,6 +448,10 @@ bool DatabaseManager::executeParamUpdate(const string& query, const vector<strin
         executeParamQuery(query, params);
         return true;
     }
+    catch (const DatabaseUnavailable&) {
+        // Already reported when the breaker opened
+        return false;
+    }
     catch (const exception& e) {
         cerr << "Parameterized update execution error: " << e.what() << endl;
         return false;
@@ -317,26 +472,70 @@ bool DatabaseManager::initializeTables() {
             )
         )";
         
-        string createMessagesTable = R"(
-            IF NOT EXISTS (SELECT * FROM sysobjects WHERE name='messages' AND xtype='U')
+        // The chat server's own username -> id table. Its database is not
+        // the auth server's, so names are interned here on first use.
+        string createChatUsersTable = R"(
+            IF NOT EXISTS (SELECT * FROM sysobjects WHERE name='chat_users' AND xtype='U')
+            CREATE TABLE chat_users (
+                id INT IDENTITY(1,1) PRIMARY KEY,
+                username NVARCHAR(255) UNIQUE NOT NULL
+            )
+        )";
+
+        // Users are referenced by id, and a conversation by the ordered id
+        // pair packed into one BIGINT (smaller id in the high 32 bits)
+        string messagesTable = R"(
             CREATE TABLE messages (
                 id INT IDENTITY(1,1) PRIMARY KEY,
-                sender NVARCHAR(255) NOT NULL,
-                recipient NVARCHAR(255) NOT NULL,
+                sender_id INT NOT NULL REFERENCES chat_users(id),
+                recipient_id INT NOT NULL REFERENCES chat_users(id),
                 message_content NTEXT NOT NULL,
-                timestamp DATETIME2 DEFAULT GETDATE(),
-                conversation_id NVARCHAR(511) NOT NULL,
-                delivered BIT DEFAULT 1
+                timestamp DATETIME2 DEFAULT SYSUTCDATETIME(),
+                conversation_key BIGINT NOT NULL,
+                delivered BIT DEFAULT 1,
+                content_encoding TINYINT NOT NULL DEFAULT 0,
+                journal_id BIGINT NULL,
+                journal_sequence BIGINT NULL
             )
         )";
+
+        string createMessagesTable = R"(
+            IF NOT EXISTS (SELECT * FROM sysobjects WHERE name='messages' AND xtype='U')
+        )" + messagesTable;
         
         string createConversationIndex = R"(
-            IF NOT EXISTS (SELECT * FROM sys.indexes WHERE name = 'idx_conversation_id')
-                CREATE INDEX idx_conversation_id ON messages(conversation_id);
-            IF NOT EXISTS (SELECT * FROM sys.indexes WHERE name = 'idx_timestamp')
-                CREATE INDEX idx_timestamp ON messages(timestamp);
-            IF NOT EXISTS (SELECT * FROM sys.indexes WHERE name = 'idx_recipient_delivered')
-                CREATE INDEX idx_recipient_delivered ON messages(recipient, delivered);
+            IF NOT EXISTS (SELECT * FROM sys.indexes WHERE name = 'idx_messages_conversation' AND object_id = OBJECT_ID('messages'))
+                CREATE INDEX idx_messages_conversation ON messages(conversation_key, timestamp);
+            IF NOT EXISTS (SELECT * FROM sys.indexes WHERE name = 'idx_messages_sender' AND object_id = OBJECT_ID('messages'))
+                CREATE INDEX idx_messages_sender ON messages(sender_id, recipient_id);
+            IF NOT EXISTS (SELECT * FROM sys.indexes WHERE name = 'idx_messages_recipient_delivered' AND object_id = OBJECT_ID('messages'))
+                CREATE INDEX idx_messages_recipient_delivered ON messages(recipient_id, delivered);
+            IF NOT EXISTS (SELECT * FROM sys.indexes WHERE name = 'idx_messages_delivered_timestamp' AND object_id = OBJECT_ID('messages'))
+                CREATE INDEX idx_messages_delivered_timestamp ON messages(delivered, timestamp);
+        )";
+
+        // Cold tier, filled by the chat server's MessageArchiver with
+        // delivered messages past the archive age. Clustered by conversation
+        // so a history read is one range, page compressed because it is
+        // mostly read once. No foreign keys: rows are checked on the way in.
+        string createArchiveTable = R"(
+            IF NOT EXISTS (SELECT * FROM sysobjects WHERE name='messages_archive' AND xtype='U')
+            BEGIN
+                CREATE TABLE messages_archive (
+                    id INT NOT NULL,
+                    sender_id INT NOT NULL,
+                    recipient_id INT NOT NULL,
+                    message_content NVARCHAR(MAX) NOT NULL,
+                    timestamp DATETIME2 NOT NULL,
+                    conversation_key BIGINT NOT NULL,
+                    content_encoding TINYINT NOT NULL DEFAULT 0,
+                    CONSTRAINT pk_messages_archive PRIMARY KEY NONCLUSTERED (id) WITH (DATA_COMPRESSION = PAGE)
+                );
+                CREATE UNIQUE CLUSTERED INDEX idx_archive_conversation ON messages_archive(conversation_key, timestamp, id)
+                    WITH (DATA_COMPRESSION = PAGE);
+                CREATE INDEX idx_archive_sender ON messages_archive(sender_id, recipient_id) WITH (DATA_COMPRESSION = PAGE);
+                CREATE INDEX idx_archive_recipient ON messages_archive(recipient_id, sender_id) WITH (DATA_COMPRESSION = PAGE);
+            END
         )";
         
         string addPublicKeyColumn = R"(
@@ -348,12 +547,93 @@ bool DatabaseManager::initializeTables() {
             IF NOT EXISTS (SELECT * FROM sys.columns WHERE object_id = OBJECT_ID('messages') AND name = 'delivered')
                 ALTER TABLE messages ADD delivered BIT DEFAULT 1;
         )";
+
+        // 1 marks a zstd compressed body (base64 in message_content), see
+        // the chat server's MessageCompressor
+        string addContentEncodingColumns = R"(
+            IF NOT EXISTS (SELECT * FROM sys.columns WHERE object_id = OBJECT_ID('messages') AND name = 'content_encoding')
+                ALTER TABLE messages ADD content_encoding TINYINT NOT NULL DEFAULT 0;
+            IF NOT EXISTS (SELECT * FROM sys.columns WHERE object_id = OBJECT_ID('messages_archive') AND name = 'content_encoding')
+                ALTER TABLE messages_archive ADD content_encoding TINYINT NOT NULL DEFAULT 0;
+        )";
+
+        // Timestamps are UTC, like SQLite's and the chat server's explicit
+        // send times. A table created with the old GETDATE() default gets the
+        // UTC one; its existing rows keep the server's local time.
+        string utcTimestampDefault = R"(
+            DECLARE @old_default SYSNAME;
+            SELECT @old_default = d.name FROM sys.default_constraints d
+                JOIN sys.columns c ON c.object_id = d.parent_object_id AND c.column_id = d.parent_column_id
+                WHERE d.parent_object_id = OBJECT_ID('messages') AND c.name = 'timestamp'
+                  AND d.definition LIKE '%getdate()%';
+            IF @old_default IS NOT NULL
+            BEGIN
+                DECLARE @drop NVARCHAR(300) = N'ALTER TABLE messages DROP CONSTRAINT ' + QUOTENAME(@old_default);
+                EXEC(@drop);
+                ALTER TABLE messages ADD DEFAULT SYSUTCDATETIME() FOR [timestamp];
+            END
+        )";
+
+        // The chat server's MessageJournal key, set on rows it inserted so a
+        // record replayed again after a crash is skipped. The index is its
+        // own batch, it does not compile before the columns exist.
+        string addJournalColumns = R"(
+            IF NOT EXISTS (SELECT * FROM sys.columns WHERE object_id = OBJECT_ID('messages') AND name = 'journal_id')
+                ALTER TABLE messages ADD journal_id BIGINT NULL, journal_sequence BIGINT NULL;
+        )";
+        string createJournalIndex = R"(
+            IF NOT EXISTS (SELECT * FROM sys.indexes WHERE name = 'idx_messages_journal' AND object_id = OBJECT_ID('messages'))
+                CREATE UNIQUE INDEX idx_messages_journal ON messages(journal_id, journal_sequence) WHERE journal_id IS NOT NULL;
+        )";
+
+        // A messages table from before integer ids still has the sender
+        // column. Its names are interned into chat_users, then it is renamed
+        // to messages_legacy, its rows are copied with their ids and it is
+        // dropped. The statements touching the new columns are dynamic so
+        // the batch compiles against the old table.
+        string migrateMessagesTable = R"(
+            IF EXISTS (SELECT * FROM sys.columns WHERE object_id = OBJECT_ID('messages') AND name = 'sender')
+            BEGIN
+                SET XACT_ABORT ON;
+                BEGIN TRANSACTION;
+                EXEC(N'
+                    INSERT INTO chat_users (username)
+                    SELECT n.name FROM (SELECT sender AS name FROM messages UNION SELECT recipient FROM messages) n
+                    WHERE NOT EXISTS (SELECT 1 FROM chat_users c WHERE c.username = n.name);
+                ');
+                EXEC sp_rename 'messages', 'messages_legacy';
+                EXEC(N')" + messagesTable + R"(');
+                EXEC(N'
+                    SET IDENTITY_INSERT messages ON;
+                    INSERT INTO messages (id, sender_id, recipient_id, message_content, timestamp, conversation_key, delivered)
+                    SELECT m.id, s.id, r.id, m.message_content, m.timestamp,
+                           CAST(CASE WHEN s.id < r.id THEN s.id ELSE r.id END AS BIGINT) * 4294967296
+                               + CASE WHEN s.id < r.id THEN r.id ELSE s.id END,
+                           m.delivered
+                    FROM messages_legacy m
+                    JOIN chat_users s ON s.username = m.sender
+                    JOIN chat_users r ON r.username = m.recipient;
+                    SET IDENTITY_INSERT messages OFF;
+                    DROP TABLE messages_legacy;
+                ');
+                COMMIT TRANSACTION;
+            END
+        )";
         
         executeUpdate(createUsersTable);
-        executeUpdate(createMessagesTable);
         executeUpdate(addPublicKeyColumn);
+        executeUpdate(createChatUsersTable);
         executeUpdate(addDeliveredColumn);
+        if (!executeUpdate(migrateMessagesTable)) {
+            cerr << "Migrating messages to integer user ids failed, the old table is unchanged." << endl;
+        }
+        executeUpdate(createMessagesTable);
+        executeUpdate(utcTimestampDefault);
         executeUpdate(createConversationIndex);
+        executeUpdate(createArchiveTable);
+        executeUpdate(addContentEncodingColumns);
+        executeUpdate(addJournalColumns);
+        executeUpdate(createJournalIndex);
         
         if (verbose) {
             cout << "Database tables initialized successfully." << endl;
@@ -0,0 +1,85 @@
+#include "IoPool.h"
+#include <algorithm>
+#include <exception>
+#include <iostream>
+using namespace std;
+
+namespace {
+thread_local const IoPool* current_pool = nullptr;
+thread_local int current_index = -1;
+}
+
+IoPool::IoPool(size_t worker_count, size_t max_queue, const string& name)
+    : max_queue(max<size_t>(1, max_queue)),
+      queue_depth(MetricsRegistry::instance().gauge("snibble_io_queue_depth", "Tasks waiting for an I/O worker",
+                                                    {{"pool", name}})),
+      rejected(MetricsRegistry::instance().counter("snibble_io_rejected_total", "Tasks refused on a full queue",
+                                                   {{"pool", name}})) {
+    worker_count = max<size_t>(1, worker_count);
+    for (size_t i = 0; i < worker_count; i++) {
+        workers.emplace_back(&IoPool::workerLoop, this, i);
+    }
+}
+
+IoPool::~IoPool() {
+    {
+        lock_guard<mutex> lock(mutex_);
+        stopping = true;
+    }
+    work_available.notify_all();
+    for (auto& worker : workers) {
+        worker.join();
+    }
+}
+
+bool IoPool::post(function<void()> task) {
+    {
+        lock_guard<mutex> lock(mutex_);
+        if (stopping || tasks.size() >= max_queue) {
+            rejected.add();
+            return false;
+        }
+        tasks.push_back(move(task));
+        queue_depth.set(static_cast<int64_t>(tasks.size()));
+    }
+    work_available.notify_one();
+    return true;
+}
+
+int IoPool::currentWorker() const {
+    return current_pool == this ? current_index : -1;
+}
+
+size_t IoPool::workerCount() const {
+    return workers.size();
+}
+
+size_t IoPool::queued() {
+    lock_guard<mutex> lock(mutex_);
+    return tasks.size();
+}
+
+void IoPool::workerLoop(size_t index) {
+    current_pool = this;
+    current_index = static_cast<int>(index);
+    while (true) {
+        function<void()> task;
+        {
+            unique_lock<mutex> lock(mutex_);
+            work_available.wait(lock, [this] { return stopping || !tasks.empty(); });
+            if (tasks.empty()) {
+                return;
+            }
+            task = move(tasks.front());
+            tasks.pop_front();
+            queue_depth.set(static_cast<int64_t>(tasks.size()));
+        }
+        try {
+            task();
+        } catch (const exception& e) {
+            cerr << "I/O task error: " << e.what() << endl;
+        } catch (...) {
+            cerr << "I/O task error: unknown exception" << endl;
+        }
+    }
+}
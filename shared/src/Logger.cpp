@@ -0,0 +1,207 @@
+#include "Logger.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+using namespace std;
+
+namespace {
+
+// Owns the calling thread's ring; marks it orphaned when the thread exits
+// so the flusher drops it once drained.
+struct RingHandle {
+    shared_ptr<Logger::Ring> ring;
+    ~RingHandle() {
+        if (ring) {
+            ring->orphaned.store(true, memory_order_release);
+        }
+    }
+};
+
+thread_local RingHandle ring_handle;
+
+const char* levelName(uint8_t level) {
+    switch (static_cast<LogLevel>(level)) {
+        case LogLevel::Debug: return "DEBUG";
+        case LogLevel::Info: return "INFO ";
+        case LogLevel::Warn: return "WARN ";
+        case LogLevel::Error: return "ERROR";
+    }
+    return "?    ";
+}
+
+void appendTimestamp(string& out, int64_t timestamp_ns) {
+    time_t seconds = static_cast<time_t>(timestamp_ns / 1000000000);
+    struct tm utc;
+    gmtime_r(&seconds, &utc);
+    char text[64];
+    snprintf(text, sizeof(text), "%04d-%02d-%02d %02d:%02d:%02d.%06lld", utc.tm_year + 1900, utc.tm_mon + 1,
+             utc.tm_mday, utc.tm_hour, utc.tm_min, utc.tm_sec,
+             static_cast<long long>(timestamp_ns % 1000000000 / 1000));
+    out += text;
+}
+
+}  // namespace
+
+Logger::Ring::Ring(size_t capacity, uint32_t thread_index)
+    : buffer(new char[capacity]), capacity(capacity), thread_index(thread_index) {
+}
+
+Logger::Logger() {
+    flusher = thread(&Logger::flusherLoop, this);
+}
+
+Logger& Logger::instance() {
+    // Never destroyed: threads may still log while statics are torn down
+    static Logger* logger = [] {
+        Logger* created = new Logger();
+        atexit([] { Logger::instance().stop(); });
+        return created;
+    }();
+    return *logger;
+}
+
+void Logger::setLevel(LogLevel level) {
+    min_level.store(static_cast<uint8_t>(level), memory_order_relaxed);
+}
+
+void Logger::setRingCapacity(size_t bytes) {
+    size_t capacity = 1024;
+    while (capacity < bytes) {
+        capacity <<= 1;
+    }
+    ring_capacity.store(capacity, memory_order_relaxed);
+}
+
+int64_t Logger::nowNanos() {
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::system_clock::now().time_since_epoch()).count();
+}
+
+Logger::Ring* Logger::threadRing() {
+    if (!ring_handle.ring) {
+        // First log from this thread, the only time the registry is locked
+        lock_guard<mutex> lock(rings_mutex);
+        ring_handle.ring = make_shared<Ring>(ring_capacity.load(memory_order_relaxed), next_thread_index++);
+        rings.push_back(ring_handle.ring);
+    }
+    return ring_handle.ring.get();
+}
+
+void Logger::drainAll() {
+    struct Line {
+        int64_t timestamp_ns;
+        uint8_t level;
+        uint32_t thread_index;
+        string text;
+    };
+    vector<Line> lines;
+
+    vector<shared_ptr<Ring>> snapshot;
+    {
+        lock_guard<mutex> lock(rings_mutex);
+        snapshot = rings;
+    }
+    for (auto& ring : snapshot) {
+        // Read before draining, so an orphan is only dropped once empty
+        bool orphaned = ring->orphaned.load(memory_order_acquire);
+        ring->drain([&](const RecordHeader& header, const char* payload) {
+            Line line{header.timestamp_ns, header.level, ring->thread_index, string()};
+            header.decoder(header.format, payload, line.text);
+            lines.push_back(move(line));
+        });
+        uint64_t dropped = ring->dropped.load(memory_order_relaxed);
+        if (dropped != ring->reported_drops) {
+            lines.push_back(Line{nowNanos(), static_cast<uint8_t>(LogLevel::Warn), ring->thread_index,
+                                 "logger dropped " + to_string(dropped - ring->reported_drops) +
+                                     " records, ring full"});
+            ring->reported_drops = dropped;
+        }
+        if (orphaned) {
+            lock_guard<mutex> lock(rings_mutex);
+            rings.erase(remove(rings.begin(), rings.end(), ring), rings.end());
+        }
+    }
+    if (lines.empty()) {
+        return;
+    }
+
+    // Rings are drained one after another, put the threads back in time order
+    stable_sort(lines.begin(), lines.end(),
+                [](const Line& a, const Line& b) { return a.timestamp_ns < b.timestamp_ns; });
+    string out;
+    string err;
+    for (const auto& line : lines) {
+        string& target = line.level >= static_cast<uint8_t>(LogLevel::Warn) ? err : out;
+        appendTimestamp(target, line.timestamp_ns);
+        target += ' ';
+        target += levelName(line.level);
+        target += " [t" + to_string(line.thread_index) + "] ";
+        target += line.text;
+        target += '\n';
+    }
+    if (!out.empty()) {
+        fwrite(out.data(), 1, out.size(), stdout);
+        fflush(stdout);
+    }
+    if (!err.empty()) {
+        fwrite(err.data(), 1, err.size(), stderr);
+        fflush(stderr);
+    }
+}
+
+void Logger::flusherLoop() {
+    unique_lock<mutex> lock(flush_mutex);
+    while (true) {
+        flush_cv.wait_for(lock, chrono::milliseconds(5),
+                          [this] { return stopping || flush_requested != flush_completed; });
+        bool stop_now = stopping;
+        uint64_t target = flush_requested;
+        lock.unlock();
+        drainAll();
+        lock.lock();
+        flush_completed = target;
+        flushed_cv.notify_all();
+        if (stop_now) {
+            return;
+        }
+    }
+}
+
+void Logger::flush() {
+    unique_lock<mutex> lock(flush_mutex);
+    if (stopping) {
+        return;
+    }
+    uint64_t target = ++flush_requested;
+    flush_cv.notify_one();
+    flushed_cv.wait(lock, [this, target] { return flush_completed >= target; });
+}
+
+void Logger::stop() {
+    {
+        lock_guard<mutex> lock(flush_mutex);
+        if (stopping) {
+            return;
+        }
+        stopping = true;
+    }
+    flush_cv.notify_one();
+    if (flusher.joinable()) {
+        flusher.join();
+    }
+}
+
+bool LogSampler::admit(uint64_t& suppressed_before) {
+    int64_t second = Logger::nowNanos() / 1000000000;
+    int64_t current = window.load(memory_order_relaxed);
+    if (second != current && window.compare_exchange_strong(current, second, memory_order_relaxed)) {
+        count.store(0, memory_order_relaxed);
+        suppressed_before = suppressed.exchange(0, memory_order_relaxed);
+    }
+    if (count.fetch_add(1, memory_order_relaxed) < per_second) {
+        return true;
+    }
+    suppressed.fetch_add(1, memory_order_relaxed);
+    return false;
+}
@@ -0,0 +1,251 @@
+#include "Metrics.h"
+#include <cstdio>
+#include <stdexcept>
+using namespace std;
+
+namespace metrics_detail {
+
+size_t nextStripe() {
+    static atomic<size_t> next_stripe{0};
+    return next_stripe.fetch_add(1, memory_order_relaxed) % STRIPES;
+}
+
+}  // namespace metrics_detail
+
+namespace {
+
+// Prometheus buckets, powers of two from about 1us to 34s. Each is also a
+// boundary of the internal buckets, so the cumulative counts are exact.
+constexpr int EXPORT_MIN_EXPONENT = 10;
+constexpr int EXPORT_MAX_EXPONENT = 35;
+
+string escapeLabel(const string& value) {
+    string escaped;
+    escaped.reserve(value.size());
+    for (char c : value) {
+        if (c == '\\' || c == '"') {
+            escaped += '\\';
+            escaped += c;
+        } else if (c == '\n') {
+            escaped += "\\n";
+        } else {
+            escaped += c;
+        }
+    }
+    return escaped;
+}
+
+string renderLabels(const MetricLabels& labels) {
+    if (labels.empty()) {
+        return "";
+    }
+    string rendered = "{";
+    for (size_t i = 0; i < labels.size(); i++) {
+        if (i > 0) {
+            rendered += ',';
+        }
+        rendered += labels[i].first + "=\"" + escapeLabel(labels[i].second) + "\"";
+    }
+    return rendered + "}";
+}
+
+// Adds one more label to an already rendered set
+string withLabel(const string& labels, const string& name, const string& value) {
+    string extra = name + "=\"" + value + "\"";
+    if (labels.empty()) {
+        return "{" + extra + "}";
+    }
+    return labels.substr(0, labels.size() - 1) + "," + extra + "}";
+}
+
+string formatNumber(double value) {
+    char text[32];
+    snprintf(text, sizeof(text), "%.9g", value);
+    return text;
+}
+
+}  // namespace
+
+uint64_t Counter::value() const {
+    uint64_t total = 0;
+    for (const auto& stripe : stripes) {
+        total += stripe.value.load(memory_order_relaxed);
+    }
+    return total;
+}
+
+size_t Histogram::bucketOf(uint64_t value) {
+    if (value < SUB_BUCKETS) {
+        return static_cast<size_t>(value);
+    }
+    int exponent = 63 - __builtin_clzll(value);
+    if (exponent > MAX_EXPONENT) {
+        return BUCKETS - 1;
+    }
+    size_t sub = (value >> (exponent - SUB_BITS)) & (SUB_BUCKETS - 1);
+    return static_cast<size_t>(exponent - SUB_BITS + 1) * SUB_BUCKETS + sub;
+}
+
+uint64_t Histogram::bucketLimit(size_t index) {
+    if (index < SUB_BUCKETS) {
+        return index + 1;
+    }
+    int exponent = static_cast<int>(index / SUB_BUCKETS) + SUB_BITS - 1;
+    uint64_t sub = index % SUB_BUCKETS;
+    return (SUB_BUCKETS + sub + 1) << (exponent - SUB_BITS);
+}
+
+Histogram::Snapshot Histogram::snapshot() const {
+    Snapshot snap;
+    snap.counts.assign(BUCKETS, 0);
+    for (const auto& stripe : stripes) {
+        for (size_t i = 0; i < BUCKETS; i++) {
+            snap.counts[i] += stripe.counts[i].load(memory_order_relaxed);
+        }
+        snap.sum += stripe.sum.load(memory_order_relaxed);
+    }
+    for (uint64_t count : snap.counts) {
+        snap.count += count;
+    }
+    return snap;
+}
+
+uint64_t Histogram::Snapshot::percentile(double q) const {
+    if (count == 0) {
+        return 0;
+    }
+    uint64_t rank = static_cast<uint64_t>(q * static_cast<double>(count - 1)) + 1;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < counts.size(); i++) {
+        seen += counts[i];
+        if (seen >= rank) {
+            return bucketLimit(i);
+        }
+    }
+    return bucketLimit(counts.size() - 1);
+}
+
+MetricsRegistry& MetricsRegistry::instance() {
+    // Never destroyed: detached threads may still update metrics at exit
+    static MetricsRegistry* registry = new MetricsRegistry();
+    return *registry;
+}
+
+MetricsRegistry::Series& MetricsRegistry::series(const string& name, const string& help, Type type,
+                                                 const MetricLabels& labels) {
+    auto found = families.find(name);
+    if (found == families.end()) {
+        found = families.emplace(name, Family{help, type, {}}).first;
+    } else if (found->second.type != type) {
+        throw logic_error("Metric " + name + " registered with two types");
+    }
+    string rendered = renderLabels(labels);
+    for (auto& existing : found->second.series) {
+        if (existing->labels == rendered) {
+            return *existing;
+        }
+    }
+    found->second.series.push_back(make_unique<Series>());
+    Series& created = *found->second.series.back();
+    created.labels = rendered;
+    return created;
+}
+
+Counter& MetricsRegistry::counter(const string& name, const string& help, const MetricLabels& labels) {
+    lock_guard<mutex> lock(mutex_);
+    Series& entry = series(name, help, Type::Counter, labels);
+    if (!entry.counter) {
+        entry.counter = make_unique<Counter>();
+    }
+    return *entry.counter;
+}
+
+Gauge& MetricsRegistry::gauge(const string& name, const string& help, const MetricLabels& labels) {
+    lock_guard<mutex> lock(mutex_);
+    Series& entry = series(name, help, Type::Gauge, labels);
+    if (!entry.gauge) {
+        entry.gauge = make_unique<Gauge>();
+    }
+    return *entry.gauge;
+}
+
+Histogram& MetricsRegistry::histogram(const string& name, const string& help, const MetricLabels& labels) {
+    lock_guard<mutex> lock(mutex_);
+    Series& entry = series(name, help, Type::Histogram, labels);
+    if (!entry.histogram) {
+        entry.histogram = make_unique<Histogram>();
+    }
+    return *entry.histogram;
+}
+
+void MetricsRegistry::gaugeFunction(const string& name, const string& help, const MetricLabels& labels,
+                                    function<double()> sample) {
+    lock_guard<mutex> lock(mutex_);
+    Series& entry = series(name, help, Type::Gauge, labels);
+    entry.sample = make_shared<const function<double()>>(move(sample));
+}
+
+string MetricsRegistry::render() {
+    struct SeriesView {
+        string labels;
+        const Counter* counter;
+        const Gauge* gauge;
+        const Histogram* histogram;
+        shared_ptr<const function<double()>> sample;
+    };
+    struct FamilyView {
+        string name;
+        string help;
+        Type type;
+        vector<SeriesView> series;
+    };
+
+    // Copy out under the lock; metric objects are never freed
+    vector<FamilyView> views;
+    {
+        lock_guard<mutex> lock(mutex_);
+        for (const auto& [name, family] : families) {
+            FamilyView view{name, family.help, family.type, {}};
+            for (const auto& entry : family.series) {
+                view.series.push_back(SeriesView{entry->labels, entry->counter.get(), entry->gauge.get(),
+                                                 entry->histogram.get(), entry->sample});
+            }
+            views.push_back(move(view));
+        }
+    }
+
+    string out;
+    for (const auto& family : views) {
+        const char* type = family.type == Type::Counter ? "counter"
+                         : family.type == Type::Gauge   ? "gauge"
+                                                        : "histogram";
+        out += "# HELP " + family.name + " " + family.help + "\n";
+        out += "# TYPE " + family.name + " " + type + "\n";
+        for (const auto& entry : family.series) {
+            if (entry.counter) {
+                out += family.name + entry.labels + " " + to_string(entry.counter->value()) + "\n";
+            } else if (entry.gauge) {
+                out += family.name + entry.labels + " " + to_string(entry.gauge->value()) + "\n";
+            } else if (entry.sample) {
+                out += family.name + entry.labels + " " + formatNumber((*entry.sample)()) + "\n";
+            } else if (entry.histogram) {
+                Histogram::Snapshot snap = entry.histogram->snapshot();
+                uint64_t cumulative = 0;
+                size_t bucket = 0;
+                for (int exponent = EXPORT_MIN_EXPONENT; exponent <= EXPORT_MAX_EXPONENT; exponent++) {
+                    uint64_t bound = uint64_t(1) << exponent;
+                    while (bucket < Histogram::BUCKETS && Histogram::bucketLimit(bucket) <= bound) {
+                        cumulative += snap.counts[bucket++];
+                    }
+                    out += family.name + "_bucket" + withLabel(entry.labels, "le", formatNumber(bound / 1e9)) +
+                           " " + to_string(cumulative) + "\n";
+                }
+                out += family.name + "_bucket" + withLabel(entry.labels, "le", "+Inf") + " " +
+                       to_string(snap.count) + "\n";
+                out += family.name + "_sum" + entry.labels + " " + formatNumber(snap.sum / 1e9) + "\n";
+                out += family.name + "_count" + entry.labels + " " + to_string(snap.count) + "\n";
+            }
+        }
+    }
+    return out;
+}
@@ -0,0 +1,217 @@
+#include "ProfiledMutex.h"
+
+#if SNIBBLE_LOCK_PROFILING
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+using namespace std;
+
+namespace {
+
+constexpr int MAX_TAG_DEPTH = 8;
+
+thread_local const char* tag_stack[MAX_TAG_DEPTH];
+thread_local int tag_depth = 0;
+
+string currentTags() {
+    string tags;
+    for (int i = 0; i < min(tag_depth, MAX_TAG_DEPTH); i++) {
+        if (i > 0) {
+            tags += " > ";
+        }
+        tags += tag_stack[i];
+    }
+    return tags;
+}
+
+string siteLabel(const LockSite& site) {
+    if (site.line == 0) {
+        return "unattributed";
+    }
+    const char* slash = strrchr(site.file, '/');
+    return string(slash ? slash + 1 : site.file) + ":" + to_string(site.line) + " " + site.function;
+}
+
+string formatMicros(uint64_t nanos) {
+    char text[32];
+    snprintf(text, sizeof(text), "%.1fus", nanos / 1000.0);
+    return text;
+}
+
+}  // namespace
+
+LockTag::LockTag(const char* tag) {
+    if (tag_depth < MAX_TAG_DEPTH) {
+        tag_stack[tag_depth] = tag;
+    }
+    tag_depth++;
+}
+
+LockTag::~LockTag() {
+    tag_depth--;
+}
+
+MutexProfile::MutexProfile(const string& name) : name(name) {
+    MetricsRegistry::instance().gaugeFunction(
+        "snibble_lock_worst_hold_seconds", "Longest single hold seen on the mutex", {{"mutex", name}},
+        [this]() {
+            lock_guard<mutex> lock(holders_mutex);
+            return holders[0].held_ns / 1e9;
+        });
+}
+
+void MutexProfile::noteHold(uint64_t held_ns, const LockSiteStats& site) {
+    if (held_ns <= admit_above.load(memory_order_relaxed)) {
+        return;
+    }
+    string tags = currentTags();
+    lock_guard<mutex> lock(holders_mutex);
+    // Sorted longest first, the last entry is the one to displace
+    Holder& last = holders[WORST_HOLDERS - 1];
+    if (held_ns <= last.held_ns) {
+        return;
+    }
+    last = Holder{held_ns, site.label, move(tags)};
+    sort(holders.begin(), holders.end(), [](const Holder& a, const Holder& b) { return a.held_ns > b.held_ns; });
+    admit_above.store(holders[WORST_HOLDERS - 1].held_ns, memory_order_relaxed);
+}
+
+vector<MutexProfile::Holder> MutexProfile::worstHolders() {
+    lock_guard<mutex> lock(holders_mutex);
+    vector<Holder> kept;
+    for (const auto& holder : holders) {
+        if (holder.held_ns > 0) {
+            kept.push_back(holder);
+        }
+    }
+    return kept;
+}
+
+ProfiledMutex::ProfiledMutex(const char* name)
+    : profile(LockProfiler::instance().profile(name)), default_site("", 0, "") {
+}
+
+const LockSiteStats& ProfiledMutex::resolve(const LockSite& site) {
+    LockSiteStats* stats = site.stats.load(memory_order_acquire);
+    if (stats) {
+        return *stats;
+    }
+    return LockProfiler::instance().site(profile, site);
+}
+
+LockProfiler& LockProfiler::instance() {
+    // Never destroyed, like the metrics the profiles feed
+    static LockProfiler* profiler = new LockProfiler();
+    return *profiler;
+}
+
+MutexProfile& LockProfiler::profile(const string& name) {
+    lock_guard<mutex> lock(mutex_);
+    for (auto* existing : profiles) {
+        if (existing->name == name) {
+            return *existing;
+        }
+    }
+    profiles.push_back(new MutexProfile(name));
+    return *profiles.back();
+}
+
+const LockSiteStats& LockProfiler::site(const MutexProfile& profile, const LockSite& site) {
+    string label = siteLabel(site);
+    lock_guard<mutex> lock(mutex_);
+    LockSiteStats* stats = nullptr;
+    // Another instance of the same mutex may have resolved this site already
+    for (auto* existing : sites) {
+        if (existing->mutex_name == profile.name && existing->label == label) {
+            stats = existing;
+            break;
+        }
+    }
+    if (!stats) {
+        MetricLabels labels = {{"mutex", profile.name}, {"site", label}};
+        auto& registry = MetricsRegistry::instance();
+        stats = new LockSiteStats{
+            profile.name,
+            label,
+            registry.histogram("snibble_lock_wait_seconds", "Time spent waiting to acquire the mutex", labels),
+            registry.histogram("snibble_lock_hold_seconds", "Time the mutex was held", labels),
+            registry.counter("snibble_lock_contended_total", "Acquisitions that had to wait", labels)};
+        sites.push_back(stats);
+    }
+    site.stats.store(stats, memory_order_release);
+    return *stats;
+}
+
+string LockProfiler::report() {
+    vector<MutexProfile*> profile_list;
+    vector<LockSiteStats*> site_list;
+    {
+        lock_guard<mutex> lock(mutex_);
+        profile_list = profiles;
+        site_list = sites;
+    }
+    string out = "lock profile\n";
+    for (auto* stats : site_list) {
+        Histogram::Snapshot wait = stats->wait.snapshot();
+        Histogram::Snapshot hold = stats->hold.snapshot();
+        if (wait.count == 0) {
+            continue;
+        }
+        uint64_t contended = stats->contended.value();
+        char line[512];
+        snprintf(line, sizeof(line),
+                 "  %-48s acquisitions=%llu contended=%.1f%% wait p50=%s p99=%s total=%s hold p50=%s p99=%s\n",
+                 (stats->mutex_name + " " + stats->label).c_str(), static_cast<unsigned long long>(wait.count), 100.0 * contended / wait.count,
+                 formatMicros(wait.percentile(0.5)).c_str(), formatMicros(wait.percentile(0.99)).c_str(),
+                 formatMicros(wait.sum).c_str(), formatMicros(hold.percentile(0.5)).c_str(),
+                 formatMicros(hold.percentile(0.99)).c_str());
+        out += line;
+    }
+    for (auto* profile : profile_list) {
+        auto holders = profile->worstHolders();
+        if (holders.empty()) {
+            continue;
+        }
+        out += "  worst holders of " + profile->name + "\n";
+        for (const auto& holder : holders) {
+            out += "    " + formatMicros(holder.held_ns) + " at " + holder.site;
+            if (!holder.tags.empty()) {
+                out += " [" + holder.tags + "]";
+            }
+            out += "\n";
+        }
+    }
+    return out;
+}
+
+void LockProfiler::startDump(chrono::seconds interval) {
+    lock_guard<mutex> lock(mutex_);
+    if (dumping || interval.count() <= 0) {
+        return;
+    }
+    dumping = true;
+    dump_thread = thread([this, interval]() {
+        unique_lock<mutex> lock(mutex_);
+        while (!dump_cv.wait_for(lock, interval, [this]() { return !dumping; })) {
+            lock.unlock();
+            cout << report() << flush;
+            lock.lock();
+        }
+    });
+}
+
+void LockProfiler::stopDump() {
+    {
+        lock_guard<mutex> lock(mutex_);
+        if (!dumping) {
+            return;
+        }
+        dumping = false;
+    }
+    dump_cv.notify_all();
+    dump_thread.join();
+}
+
+#endif
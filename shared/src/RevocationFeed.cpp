@@ -0,0 +1,192 @@
+#include "RevocationFeed.h"
+#include <algorithm>
+#include <iostream>
+#include <sys/socket.h>
+#include <sys/time.h>
+using namespace std;
+
+RevocationFeed::RevocationFeed(RevocationList& list, const string& host, int port, bool verbose)
+    : list(list), host(host), port(port), verbose(verbose) {
+}
+
+RevocationFeed::~RevocationFeed() {
+    stop();
+    if (publisher) {
+        redisFree(publisher);
+        publisher = nullptr;
+    }
+}
+
+redisContext* RevocationFeed::connect() const {
+    struct timeval timeout = {2, 0};
+    redisContext* context = redisConnectWithTimeout(host.c_str(), port, timeout);
+    if (context == nullptr || context->err) {
+        if (verbose) {
+            cerr << "[-] Revocation feed can't reach Redis: "
+                 << (context ? context->errstr : "can't allocate redis context") << endl;
+        }
+        if (context) {
+            redisFree(context);
+        }
+        return nullptr;
+    }
+    return context;
+}
+
+void RevocationFeed::apply(const string& id, long long expires_at) {
+    auto now = chrono::system_clock::now();
+    auto expiry = chrono::system_clock::time_point(chrono::seconds(expires_at));
+    list.revoke(RevocationList::keyOf(id), expiry, now);
+}
+
+void RevocationFeed::loadSnapshot() {
+    redisContext* context = connect();
+    if (!context) {
+        return;
+    }
+    long long now = chrono::duration_cast<chrono::seconds>(chrono::system_clock::now().time_since_epoch()).count();
+
+    // Drop what has expired, then take the rest with their expiry scores
+    redisReply* reply = (redisReply*)redisCommand(context, "ZREMRANGEBYSCORE %s -inf %lld", SET_KEY, now);
+    if (reply) {
+        freeReplyObject(reply);
+    }
+    reply = (redisReply*)redisCommand(context, "ZRANGEBYSCORE %s %lld +inf WITHSCORES", SET_KEY, now);
+    size_t loaded = 0;
+    if (reply && reply->type == REDIS_REPLY_ARRAY) {
+        for (size_t i = 0; i + 1 < reply->elements; i += 2) {
+            redisReply* id = reply->element[i];
+            redisReply* score = reply->element[i + 1];
+            if (id->type != REDIS_REPLY_STRING || score->type != REDIS_REPLY_STRING) {
+                continue;
+            }
+            try {
+                apply(string(id->str, id->len), stoll(string(score->str, score->len)));
+                loaded++;
+            } catch (const exception&) {
+                continue;
+            }
+        }
+    }
+    if (reply) {
+        freeReplyObject(reply);
+    }
+    redisFree(context);
+
+    if (verbose) {
+        cout << "[+] Loaded " << loaded << " token revocations from Redis" << endl;
+    }
+}
+
+void RevocationFeed::subscribeLoop() {
+    auto backoff = chrono::seconds(1);
+    while (running) {
+        redisContext* context = connect();
+        if (context) {
+            redisReply* reply = (redisReply*)redisCommand(context, "SUBSCRIBE %s", CHANNEL);
+            bool subscribed = reply != nullptr && reply->type != REDIS_REPLY_ERROR;
+            if (reply) {
+                freeReplyObject(reply);
+            }
+
+            if (subscribed) {
+                {
+                    lock_guard<mutex> lock(subscriber_mutex);
+                    subscriber_fd = context->fd;
+                }
+                // Subscribed before the snapshot, so nothing published in
+                // between is missed
+                loadSnapshot();
+                backoff = chrono::seconds(1);
+
+                void* raw = nullptr;
+                while (running && redisGetReply(context, &raw) == REDIS_OK) {
+                    reply = (redisReply*)raw;
+                    // ["message", channel, "<id> <expiry seconds>"]
+                    if (reply && reply->type == REDIS_REPLY_ARRAY && reply->elements == 3 &&
+                        reply->element[2]->type == REDIS_REPLY_STRING) {
+                        string payload(reply->element[2]->str, reply->element[2]->len);
+                        size_t space = payload.find(' ');
+                        if (space != string::npos) {
+                            try {
+                                apply(payload.substr(0, space), stoll(payload.substr(space + 1)));
+                            } catch (const exception&) {
+                                if (verbose) {
+                                    cerr << "[-] Malformed revocation: " << payload << endl;
+                                }
+                            }
+                        }
+                    }
+                    if (reply) {
+                        freeReplyObject(reply);
+                    }
+                }
+                if (running && verbose) {
+                    cerr << "[-] Revocation feed lost its Redis subscription, reconnecting" << endl;
+                }
+            }
+
+            {
+                lock_guard<mutex> lock(subscriber_mutex);
+                subscriber_fd = -1;
+            }
+            redisFree(context);
+        }
+
+        unique_lock<mutex> lock(subscriber_mutex);
+        stop_cv.wait_for(lock, backoff, [this]() { return !running; });
+        backoff = min(backoff * 2, chrono::seconds(30));
+    }
+}
+
+void RevocationFeed::start() {
+    if (running.exchange(true)) {
+        return;
+    }
+    subscriber = thread(&RevocationFeed::subscribeLoop, this);
+}
+
+void RevocationFeed::stop() {
+    if (!running.exchange(false)) {
+        return;
+    }
+    {
+        lock_guard<mutex> lock(subscriber_mutex);
+        // Wakes the thread out of its blocking read
+        if (subscriber_fd >= 0) {
+            shutdown(subscriber_fd, SHUT_RDWR);
+        }
+    }
+    stop_cv.notify_all();
+    if (subscriber.joinable()) {
+        subscriber.join();
+    }
+}
+
+bool RevocationFeed::publish(const string& id, chrono::system_clock::time_point expires_at) {
+    long long expiry = chrono::duration_cast<chrono::seconds>(expires_at.time_since_epoch()).count();
+    string payload = id + " " + to_string(expiry);
+
+    lock_guard<mutex> lock(publish_mutex);
+    for (int attempt = 0; attempt < 2; attempt++) {
+        if (!publisher) {
+            publisher = connect();
+            if (!publisher) {
+                return false;
+            }
+        }
+        redisReply* reply = (redisReply*)redisCommand(publisher, "ZADD %s %lld %s", SET_KEY, expiry, id.c_str());
+        if (reply) {
+            freeReplyObject(reply);
+            reply = (redisReply*)redisCommand(publisher, "PUBLISH %s %s", CHANNEL, payload.c_str());
+        }
+        if (reply) {
+            freeReplyObject(reply);
+            return true;
+        }
+        // A stale connection, try once more on a fresh one
+        redisFree(publisher);
+        publisher = nullptr;
+    }
+    return false;
+}
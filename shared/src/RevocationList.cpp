@@ -0,0 +1,79 @@
+#include "RevocationList.h"
+#include <mutex>
+using namespace std;
+
+int64_t RevocationList::hourOf(Clock::time_point time) {
+    return chrono::duration_cast<chrono::hours>(time.time_since_epoch()).count();
+}
+
+uint64_t RevocationList::keyOf(string_view id) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (unsigned char c : id) {
+        hash ^= c;
+        hash *= 1099511628211ULL;
+    }
+    hash ^= hash >> 30;
+    hash *= 0xbf58476d1ce4e5b9ULL;
+    hash ^= hash >> 27;
+    hash *= 0x94d049bb133111ebULL;
+    hash ^= hash >> 31;
+    return hash;
+}
+
+bool RevocationList::revoke(uint64_t key, Clock::time_point expires_at, Clock::time_point now) {
+    if (expires_at < now) {
+        return false;
+    }
+    int64_t hour = hourOf(expires_at);
+    if (hour - hourOf(now) >= static_cast<int64_t>(BUCKET_COUNT) - 1) {
+        return false;
+    }
+
+    expire(now);
+
+    Bucket& bucket = buckets[hour % BUCKET_COUNT];
+    unique_lock<shared_mutex> lock(bucket.mutex_);
+    if (bucket.hour != hour) {
+        // Still holding an hour that passed; expire() raced with a new hour
+        live.fetch_sub(bucket.keys.size(), memory_order_relaxed);
+        bucket.keys.clear();
+        bucket.hour = hour;
+    }
+    if (bucket.keys.insert(key).second) {
+        live.fetch_add(1, memory_order_relaxed);
+    }
+    return true;
+}
+
+bool RevocationList::isRevoked(uint64_t key, Clock::time_point expires_at) const {
+    // Nothing revoked is the usual state, keep that to one load
+    if (live.load(memory_order_relaxed) == 0) {
+        return false;
+    }
+    int64_t hour = hourOf(expires_at);
+    const Bucket& bucket = buckets[hour % BUCKET_COUNT];
+    shared_lock<shared_mutex> lock(bucket.mutex_);
+    return bucket.hour == hour && bucket.keys.count(key) > 0;
+}
+
+void RevocationList::expire(Clock::time_point now) {
+    int64_t current = hourOf(now);
+    for (Bucket& bucket : buckets) {
+        {
+            shared_lock<shared_mutex> lock(bucket.mutex_);
+            if (bucket.hour < 0 || bucket.hour >= current) {
+                continue;
+            }
+        }
+        unique_lock<shared_mutex> lock(bucket.mutex_);
+        if (bucket.hour >= 0 && bucket.hour < current) {
+            live.fetch_sub(bucket.keys.size(), memory_order_relaxed);
+            unordered_set<uint64_t>().swap(bucket.keys);
+            bucket.hour = -1;
+        }
+    }
+}
+
+size_t RevocationList::size() const {
+    return live.load(memory_order_relaxed);
+}
@@ -0,0 +1,373 @@
+#include "SqliteDatabase.h"
+#include <iostream>
+#include <stdexcept>
+
+using namespace std;
+
+unique_ptr<SqliteDatabase> SqliteDatabase::instance = nullptr;
+mutex SqliteDatabase::mutex_;
+
+SqliteDatabase::SqliteDatabase(const string& path, bool verbose)
+    : path(path), verbose(verbose) {
+}
+
+SqliteDatabase::~SqliteDatabase() {
+    // Pool workers share the one connection under db_mutex
+    stopIoPool();
+    close();
+}
+
+SqliteDatabase* SqliteDatabase::getInstance(const string& path, bool verbose) {
+    lock_guard<mutex> lock(mutex_);
+    if (instance == nullptr) {
+        instance = unique_ptr<SqliteDatabase>(new SqliteDatabase(path, verbose));
+        instance->open();
+        instance->initializeTables();
+    }
+    return instance.get();
+}
+
+bool SqliteDatabase::open() {
+    lock_guard<mutex> lock(db_mutex);
+    if (db) {
+        return true;
+    }
+    int flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_NOMUTEX;
+    if (sqlite3_open_v2(path.c_str(), &db, flags, nullptr) != SQLITE_OK) {
+        cerr << "Failed to open SQLite database " << path << ": " << (db ? sqlite3_errmsg(db) : "out of memory") << endl;
+        sqlite3_close(db);
+        db = nullptr;
+        return false;
+    }
+    // WAL keeps readers off the writer's path and NORMAL sync only fsyncs
+    // at checkpoints, which is what makes local inserts microsecond cheap.
+    const char* pragmas =
+        "PRAGMA journal_mode=WAL;"
+        "PRAGMA synchronous=NORMAL;"
+        "PRAGMA busy_timeout=5000;"
+        "PRAGMA foreign_keys=ON;";
+    char* error = nullptr;
+    if (sqlite3_exec(db, pragmas, nullptr, nullptr, &error) != SQLITE_OK) {
+        cerr << "Failed to configure SQLite database: " << (error ? error : "unknown error") << endl;
+        sqlite3_free(error);
+    }
+    connected.store(true, memory_order_release);
+    if (verbose) {
+        cout << "Opened SQLite database " << path << endl;
+    }
+    return true;
+}
+
+void SqliteDatabase::close() {
+    lock_guard<mutex> lock(db_mutex);
+    for (auto& entry : statement_cache) {
+        sqlite3_finalize(entry.second);
+    }
+    statement_cache.clear();
+    connected.store(false, memory_order_release);
+    if (db) {
+        sqlite3_close(db);
+        db = nullptr;
+        if (verbose) {
+            cout << "Closed SQLite database." << endl;
+        }
+    }
+}
+
+bool SqliteDatabase::isConnected() const {
+    return connected.load(memory_order_acquire);
+}
+
+SqlDialect SqliteDatabase::dialect() const {
+    return SqlDialect::Sqlite;
+}
+
+sqlite3_stmt* SqliteDatabase::prepareCached(const string& query) {
+    auto cached = statement_cache.find(query);
+    if (cached != statement_cache.end()) {
+        return cached->second;
+    }
+    sqlite3_stmt* stmt = nullptr;
+    if (sqlite3_prepare_v2(db, query.c_str(), static_cast<int>(query.length()), &stmt, nullptr) != SQLITE_OK) {
+        throw runtime_error("Failed to prepare query: " + string(sqlite3_errmsg(db)));
+    }
+    statement_cache[query] = stmt;
+    return stmt;
+}
+
+void SqliteDatabase::stepStatement(sqlite3_stmt* stmt, const vector<string>& params,
+                                   const function<void(const vector<string>&)>& callback) {
+    for (size_t i = 0; i < params.size(); i++) {
+        if (sqlite3_bind_text(stmt, static_cast<int>(i + 1), params[i].c_str(),
+                              static_cast<int>(params[i].length()), SQLITE_STATIC) != SQLITE_OK) {
+            sqlite3_reset(stmt);
+            sqlite3_clear_bindings(stmt);
+            throw runtime_error("Failed to bind parameter " + to_string(i + 1));
+        }
+    }
+
+    int columnCount = sqlite3_column_count(stmt);
+    vector<string> row;
+    row.reserve(columnCount);
+    int rc;
+    try {
+        while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+            row.clear();
+            for (int i = 0; i < columnCount; i++) {
+                const unsigned char* text = sqlite3_column_text(stmt, i);
+                if (text) {
+                    row.emplace_back(reinterpret_cast<const char*>(text), sqlite3_column_bytes(stmt, i));
+                } else {
+                    row.emplace_back("");
+                }
+            }
+            callback(row);
+        }
+    } catch (...) {
+        sqlite3_reset(stmt);
+        sqlite3_clear_bindings(stmt);
+        throw;
+    }
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+    if (rc != SQLITE_DONE) {
+        throw runtime_error("Failed to execute query: " + string(sqlite3_errmsg(db)));
+    }
+}
+
+vector<vector<string>> SqliteDatabase::runStatement(sqlite3_stmt* stmt, const vector<string>& params) {
+    vector<vector<string>> results;
+    stepStatement(stmt, params, [&results](const vector<string>& row) { results.push_back(row); });
+    return results;
+}
+
+vector<vector<string>> SqliteDatabase::executeQuery(const string& query) {
+    Histogram& latency = queryLatency(query);
+    lock_guard<mutex> lock(db_mutex);
+    ScopedTimer timer(latency);
+    vector<vector<string>> results;
+    try {
+        if (!db) {
+            throw runtime_error("Database connection is not open.");
+        }
+        // May hold several statements (schema scripts), so it is not cached
+        const char* tail = query.c_str();
+        while (tail && *tail) {
+            sqlite3_stmt* stmt = nullptr;
+            if (sqlite3_prepare_v2(db, tail, -1, &stmt, &tail) != SQLITE_OK) {
+                throw runtime_error("Failed to prepare query: " + string(sqlite3_errmsg(db)));
+            }
+            if (!stmt) {
+                continue;
+            }
+            try {
+                auto rows = runStatement(stmt, {});
+                results.insert(results.end(), rows.begin(), rows.end());
+            } catch (...) {
+                sqlite3_finalize(stmt);
+                throw;
+            }
+            sqlite3_finalize(stmt);
+        }
+        return results;
+    }
+    catch (const exception& e) {
+        // A script failing halfway must not leave its transaction open for
+        // the next caller of this connection
+        if (db && !sqlite3_get_autocommit(db)) {
+            sqlite3_exec(db, "ROLLBACK", nullptr, nullptr, nullptr);
+        }
+        cerr << "Query execution error: " << e.what() << endl;
+        throw;
+    }
+}
+
+vector<vector<string>> SqliteDatabase::executeParamQuery(const string& query, const vector<string>& params) {
+    Histogram& latency = queryLatency(query);
+    lock_guard<mutex> lock(db_mutex);
+    ScopedTimer timer(latency);
+    try {
+        if (!db) {
+            throw runtime_error("Database connection is not open.");
+        }
+        return runStatement(prepareCached(query), params);
+    }
+    catch (const exception& e) {
+        cerr << "Parameterized query execution error: " << e.what() << endl;
+        throw;
+    }
+}
+
+void SqliteDatabase::forEachRow(const string& query, const vector<string>& params,
+                                const function<void(const vector<string>&)>& callback) {
+    Histogram& latency = queryLatency(query);
+    lock_guard<mutex> lock(db_mutex);
+    ScopedTimer timer(latency);
+    try {
+        if (!db) {
+            throw runtime_error("Database connection is not open.");
+        }
+        stepStatement(prepareCached(query), params, callback);
+    }
+    catch (const exception& e) {
+        cerr << "Row scan error: " << e.what() << endl;
+        throw;
+    }
+}
+
+bool SqliteDatabase::executeUpdate(const string& query) {
+    try {
+        executeQuery(query);
+        return true;
+    }
+    catch (const exception& e) {
+        cerr << "Update execution error: " << e.what() << endl;
+        return false;
+    }
+}
+
+bool SqliteDatabase::executeParamUpdate(const string& query, const vector<string>& params) {
+    try {
+        executeParamQuery(query, params);
+        return true;
+    }
+    catch (const exception& e) {
+        cerr << "Parameterized update execution error: " << e.what() << endl;
+        return false;
+    }
+}
+
+bool SqliteDatabase::initializeTables() {
+    // Same schema as the SQL Server one; NOCASE mirrors the case-insensitive
+    // default collation the queries were written against.
+    string createUsersTable = R"(
+        CREATE TABLE IF NOT EXISTS users (
+            id INTEGER PRIMARY KEY AUTOINCREMENT,
+            username TEXT COLLATE NOCASE UNIQUE NOT NULL,
+            password TEXT NOT NULL,
+            public_key TEXT NULL,
+            created_at DATETIME DEFAULT CURRENT_TIMESTAMP
+        );
+    )";
+
+    // The chat server's own username -> id table, see DatabaseManager
+    string createChatUsersTable = R"(
+        CREATE TABLE IF NOT EXISTS chat_users (
+            id INTEGER PRIMARY KEY AUTOINCREMENT,
+            username TEXT COLLATE NOCASE UNIQUE NOT NULL
+        );
+    )";
+
+    // Users are referenced by id, and a conversation by the ordered id
+    // pair packed into one integer (smaller id in the high 32 bits)
+    string createMessagesTable = R"(
+        CREATE TABLE IF NOT EXISTS messages (
+            id INTEGER PRIMARY KEY AUTOINCREMENT,
+            sender_id INTEGER NOT NULL REFERENCES chat_users(id),
+            recipient_id INTEGER NOT NULL REFERENCES chat_users(id),
+            message_content TEXT NOT NULL,
+            timestamp DATETIME DEFAULT (strftime('%Y-%m-%d %H:%M:%f', 'now')),
+            conversation_key INTEGER NOT NULL,
+            delivered INTEGER DEFAULT 1,
+            content_encoding INTEGER NOT NULL DEFAULT 0,
+            journal_id INTEGER,
+            journal_sequence INTEGER
+        );
+    )";
+
+    string createIndexes = R"(
+        CREATE INDEX IF NOT EXISTS idx_messages_conversation ON messages(conversation_key, timestamp);
+        CREATE INDEX IF NOT EXISTS idx_messages_sender ON messages(sender_id, recipient_id);
+        CREATE INDEX IF NOT EXISTS idx_messages_recipient_delivered ON messages(recipient_id, delivered);
+        CREATE INDEX IF NOT EXISTS idx_messages_delivered_timestamp ON messages(delivered, timestamp);
+    )";
+
+    // Cold tier for the MessageArchiver, clustered by conversation like the
+    // SQL Server one (SQLite has no page compression)
+    string createArchiveTable = R"(
+        CREATE TABLE IF NOT EXISTS messages_archive (
+            conversation_key INTEGER NOT NULL,
+            timestamp DATETIME NOT NULL,
+            id INTEGER NOT NULL,
+            sender_id INTEGER NOT NULL,
+            recipient_id INTEGER NOT NULL,
+            message_content TEXT NOT NULL,
+            content_encoding INTEGER NOT NULL DEFAULT 0,
+            PRIMARY KEY (conversation_key, timestamp, id)
+        ) WITHOUT ROWID;
+        CREATE UNIQUE INDEX IF NOT EXISTS idx_archive_id ON messages_archive(id);
+        CREATE INDEX IF NOT EXISTS idx_archive_sender ON messages_archive(sender_id, recipient_id);
+        CREATE INDEX IF NOT EXISTS idx_archive_recipient ON messages_archive(recipient_id, sender_id);
+    )";
+
+    // A messages table from before integer ids still has the sender column.
+    // Its names are interned into chat_users, then it is renamed to
+    // messages_legacy, its old indexes dropped (index names are per database
+    // here), its rows copied with their ids and the old table dropped.
+    string migrateMessagesTable = R"(
+        BEGIN;
+        INSERT OR IGNORE INTO chat_users (username)
+            SELECT sender FROM messages UNION SELECT recipient FROM messages;
+        ALTER TABLE messages RENAME TO messages_legacy;
+        DROP INDEX IF EXISTS idx_conversation_id;
+        DROP INDEX IF EXISTS idx_timestamp;
+        DROP INDEX IF EXISTS idx_recipient_delivered;
+    )" + createMessagesTable + R"(
+        INSERT INTO messages (id, sender_id, recipient_id, message_content, timestamp, conversation_key, delivered)
+        SELECT m.id, s.id, r.id, m.message_content, m.timestamp,
+               (min(s.id, r.id) << 32) | max(s.id, r.id), m.delivered
+        FROM messages_legacy m
+        JOIN chat_users s ON s.username = m.sender
+        JOIN chat_users r ON r.username = m.recipient;
+        DROP TABLE messages_legacy;
+        COMMIT;
+    )";
+
+    bool ok = executeUpdate(createUsersTable) && executeUpdate(createChatUsersTable);
+    try {
+        auto legacy = executeQuery("SELECT COUNT(1) FROM pragma_table_info('messages') WHERE name = 'sender'");
+        if (ok && !legacy.empty() && !legacy[0].empty() && legacy[0][0] != "0") {
+            if (!executeUpdate(migrateMessagesTable)) {
+                cerr << "Migrating messages to integer user ids failed, the old table is unchanged." << endl;
+                return false;
+            }
+        }
+    }
+    catch (const exception& e) {
+        cerr << "Error checking the messages schema: " << e.what() << endl;
+        return false;
+    }
+    ok = ok && executeUpdate(createMessagesTable) && executeUpdate(createIndexes) && executeUpdate(createArchiveTable);
+    // Tables created before compressed bodies (see DatabaseManager)
+    for (const string table : {"messages", "messages_archive"}) {
+        try {
+            auto column = executeQuery("SELECT COUNT(1) FROM pragma_table_info('" + table + "') WHERE name = 'content_encoding'");
+            if (ok && !column.empty() && !column[0].empty() && column[0][0] == "0") {
+                ok = executeUpdate("ALTER TABLE " + table + " ADD COLUMN content_encoding INTEGER NOT NULL DEFAULT 0");
+            }
+        }
+        catch (const exception& e) {
+            cerr << "Error checking the " << table << " schema: " << e.what() << endl;
+            return false;
+        }
+    }
+    // Tables created before the MessageJournal key (see DatabaseManager)
+    for (const string column : {"journal_id", "journal_sequence"}) {
+        try {
+            auto found = executeQuery("SELECT COUNT(1) FROM pragma_table_info('messages') WHERE name = '" + column + "'");
+            if (ok && !found.empty() && !found[0].empty() && found[0][0] == "0") {
+                ok = executeUpdate("ALTER TABLE messages ADD COLUMN " + column + " INTEGER");
+            }
+        }
+        catch (const exception& e) {
+            cerr << "Error checking the messages schema: " << e.what() << endl;
+            return false;
+        }
+    }
+    ok = ok && executeUpdate("CREATE UNIQUE INDEX IF NOT EXISTS idx_messages_journal ON messages(journal_id, journal_sequence) "
+                             "WHERE journal_id IS NOT NULL");
+    if (ok && verbose) {
+        cout << "Database tables initialized successfully." << endl;
+    }
+    return ok;
+}
@@ -0,0 +1,136 @@
+#include "StorageBackend.h"
+#include "DatabaseManager.h"
+#include "SqliteDatabase.h"
+#include <cctype>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+
+using namespace std;
+
+StorageBackend* StorageBackend::getInstance(const string& backend, const string& server, const string& database, const string& username, const string& password, bool verbose) {
+    if (backend == "sqlite") {
+        return SqliteDatabase::getInstance(database, verbose);
+    }
+    if (backend != "odbc" && verbose) {
+        cerr << "Unknown storage backend '" << backend << "', using odbc" << endl;
+    }
+    return DatabaseManager::getInstance(server, database, username, password, verbose);
+}
+
+void StorageBackend::startIoPool(size_t workers, size_t max_queue) {
+    if (io_pool) {
+        return;
+    }
+    openWorkerConnections(workers);
+    io_pool = make_unique<IoPool>(workers, max_queue, "db");
+}
+
+void StorageBackend::stopIoPool() {
+    if (!io_pool) {
+        return;
+    }
+    // Finishes the queued work before the connections go away
+    io_pool.reset();
+    closeWorkerConnections();
+}
+
+int StorageBackend::ioWorker() const {
+    return io_pool ? io_pool->currentWorker() : -1;
+}
+
+string StorageBackend::statementName(const string& query) {
+    istringstream words(query);
+    vector<string> tokens;
+    string word;
+    while (tokens.size() < 16 && words >> word) {
+        string cleaned;
+        for (char c : word) {
+            if (isalnum(static_cast<unsigned char>(c)) || c == '_') {
+                cleaned += static_cast<char>(tolower(static_cast<unsigned char>(c)));
+            }
+        }
+        if (!cleaned.empty()) {
+            tokens.push_back(cleaned);
+        }
+    }
+    if (tokens.empty()) {
+        return "unknown";
+    }
+    const string& verb = tokens[0];
+    // The table follows FROM, INTO, UPDATE or TABLE, whichever comes first
+    for (size_t i = 0; i + 1 < tokens.size(); i++) {
+        const string& token = tokens[i];
+        if (token == "from" || token == "into" || token == "table" || (i == 0 && token == "update")) {
+            return verb + "_" + tokens[i + 1];
+        }
+    }
+    return verb;
+}
+
+Histogram& StorageBackend::queryLatency(const string& query) {
+    {
+        shared_lock<shared_mutex> lock(latency_mutex);
+        auto found = latency_by_query.find(query);
+        if (found != latency_by_query.end()) {
+            return *found->second;
+        }
+    }
+    Histogram& histogram = MetricsRegistry::instance().histogram(
+        "snibble_db_query_seconds", "Database statement execution time", {{"statement", statementName(query)}});
+    unique_lock<shared_mutex> lock(latency_mutex);
+    latency_by_query.emplace(query, &histogram);
+    return histogram;
+}
+
+bool StorageBackend::submit(function<void()> work) {
+    if (!io_pool) {
+        work();
+        return true;
+    }
+    return io_pool->post(move(work));
+}
+
+future<StorageBackend::Rows> StorageBackend::executeParamQueryAsync(const string& query, const vector<string>& params) {
+    auto promise = make_shared<std::promise<Rows>>();
+    auto result = promise->get_future();
+    executeParamQueryAsync(query, params, [promise](Rows rows, exception_ptr error) {
+        if (error) {
+            promise->set_exception(error);
+        } else {
+            promise->set_value(move(rows));
+        }
+    });
+    return result;
+}
+
+void StorageBackend::executeParamQueryAsync(const string& query, const vector<string>& params,
+                                            function<void(Rows, exception_ptr)> done) {
+    auto shared_done = make_shared<function<void(Rows, exception_ptr)>>(move(done));
+    bool queued = submit([this, query, params, shared_done]() {
+        Rows rows;
+        exception_ptr error;
+        try {
+            rows = executeParamQuery(query, params);
+        } catch (...) {
+            error = current_exception();
+        }
+        (*shared_done)(move(rows), error);
+    });
+    if (!queued) {
+        (*shared_done)(Rows(), make_exception_ptr(runtime_error("Database I/O queue is full")));
+    }
+}
+
+future<bool> StorageBackend::executeParamUpdateAsync(const string& query, const vector<string>& params) {
+    auto promise = make_shared<std::promise<bool>>();
+    auto result = promise->get_future();
+    bool queued = submit([this, query, params, promise]() {
+        promise->set_value(executeParamUpdate(query, params));
+    });
+    if (!queued) {
+        promise->set_exception(make_exception_ptr(runtime_error("Database I/O queue is full")));
+    }
+    return result;
+}
@@ -0,0 +1,61 @@
+#include "TokenCache.h"
+#include <algorithm>
+#include <sodium.h>
+#include <stdexcept>
+using namespace std;
+
+TokenCache::TokenCache(size_t capacity)
+    : shard_capacity(max<size_t>(1, (capacity + SHARD_COUNT - 1) / SHARD_COUNT)),
+      shards(new Shard[SHARD_COUNT]) {
+    // A per process key means nobody can precompute tokens that collide
+    if (sodium_init() < 0) {
+        throw runtime_error("Failed to initialize libsodium");
+    }
+    randombytes_buf(digest_key.data(), digest_key.size());
+}
+
+TokenCache::Digest TokenCache::digestOf(const string& token) const {
+    Digest digest;
+    crypto_generichash(digest.data(), digest.size(), reinterpret_cast<const unsigned char*>(token.data()),
+                       token.size(), digest_key.data(), digest_key.size());
+    return digest;
+}
+
+TokenCache::Shard& TokenCache::shardFor(const Digest& digest) {
+    // The map hashes the first bytes, the shard uses the last one
+    return shards[digest[digest.size() - 1] % SHARD_COUNT];
+}
+
+bool TokenCache::get(const Digest& digest, chrono::system_clock::time_point now, Entry& entry) {
+    Shard& shard = shardFor(digest);
+    lock_guard<mutex> lock(shard.mutex_);
+    auto found = shard.index.find(digest);
+    if (found == shard.index.end()) {
+        return false;
+    }
+    if (found->second->second.expires_at < now) {
+        shard.lru.erase(found->second);
+        shard.index.erase(found);
+        return false;
+    }
+    shard.lru.splice(shard.lru.begin(), shard.lru, found->second);
+    entry = found->second->second;
+    return true;
+}
+
+void TokenCache::put(const Digest& digest, const Entry& entry) {
+    Shard& shard = shardFor(digest);
+    lock_guard<mutex> lock(shard.mutex_);
+    auto found = shard.index.find(digest);
+    if (found != shard.index.end()) {
+        found->second->second = entry;
+        shard.lru.splice(shard.lru.begin(), shard.lru, found->second);
+        return;
+    }
+    shard.lru.emplace_front(digest, entry);
+    shard.index[digest] = shard.lru.begin();
+    if (shard.index.size() > shard_capacity) {
+        shard.index.erase(shard.lru.back().first);
+        shard.lru.pop_back();
+    }
+}
@@ -0,0 +1,128 @@
+#include "TokenManager.h"
+#include <chrono>
+#include <sodium.h>
+using namespace std;
+
+TokenManager::TokenManager(const string& secret, size_t cache_capacity)
+    : secret(secret),
+      verifier(jwt::verify()
+                   .allow_algorithm(jwt::algorithm::hs256{secret})
+                   .with_type("JWT")
+                   .with_issuer("snibble-auth")
+                   .leeway(60UL)),
+      cache(cache_capacity),
+      cache_enabled(cache_capacity > 0) {
+}
+
+string TokenManager::revocationId(const Decoded& decoded) {
+    if (decoded.has_id()) {
+        return decoded.get_id();
+    }
+    return decoded.get_signature_base64();
+}
+
+string TokenManager::createToken(const string& username) const {
+    auto now = chrono::system_clock::now();
+
+    unsigned char id_bytes[16];
+    randombytes_buf(id_bytes, sizeof(id_bytes));
+    char id[sizeof(id_bytes) * 2 + 1];
+    sodium_bin2hex(id, sizeof(id), id_bytes, sizeof(id_bytes));
+
+    return jwt::create()
+        .set_issuer("snibble-auth")
+        .set_type("JWT")
+        .set_id(id)
+        .set_payload_claim("username", jwt::claim(username))
+        .set_issued_at(now)
+        .set_expires_at(now + chrono::hours{120}) // 120 hour expiry
+        .sign(jwt::algorithm::hs256{secret});
+}
+
+bool TokenManager::verifyToken(const string& token, string& username, string& error) {
+    auto now = chrono::system_clock::now();
+
+    TokenCache::Digest digest{};
+    if (cache_enabled) {
+        digest = cache.digestOf(token);
+        TokenCache::Entry entry;
+        if (cache.get(digest, now, entry)) {
+            if (revoked.isRevoked(entry.revocation_key, entry.expires_at)) {
+                error = "Token has been revoked";
+                return false;
+            }
+            username = entry.username;
+            return true;
+        }
+    }
+
+    try {
+        auto decoded = jwt::decode(token);
+        verifier.verify(decoded);
+
+        auto exp = decoded.get_expires_at();
+        if (exp < now) {
+            error = "Token has expired";
+            return false;
+        }
+
+        if (!decoded.has_payload_claim("username")) {
+            error = "Invalid token payload";
+            return false;
+        }
+
+        uint64_t revocation_key = RevocationList::keyOf(revocationId(decoded));
+        if (revoked.isRevoked(revocation_key, exp)) {
+            error = "Token has been revoked";
+            return false;
+        }
+        username = decoded.get_payload_claim("username").as_string();
+
+        // Only verified tokens are cached, and only until their own expiry
+        if (cache_enabled) {
+            cache.put(digest, TokenCache::Entry{username, exp, revocation_key});
+        }
+        return true;
+    } catch (const jwt::error::signature_verification_exception& e) {
+        error = "Token signature verification failed";
+    } catch (const jwt::error::token_verification_exception& e) {
+        error = "Token verification failed";
+    } catch (const exception& e) {
+        error = "Token verification error: " + string(e.what());
+    }
+    return false;
+}
+
+bool TokenManager::revokeToken(const string& token, string& id, chrono::system_clock::time_point& expires_at,
+                               string& error) {
+    auto now = chrono::system_clock::now();
+    try {
+        // Only our own unexpired tokens can be revoked, so the set cannot be
+        // filled with made up ids
+        auto decoded = jwt::decode(token);
+        verifier.verify(decoded);
+
+        expires_at = decoded.get_expires_at();
+        if (expires_at < now) {
+            error = "Token has expired";
+            return false;
+        }
+        id = revocationId(decoded);
+        if (!revoked.revoke(RevocationList::keyOf(id), expires_at, now)) {
+            error = "Token expiry out of range";
+            return false;
+        }
+        return true;
+    } catch (const jwt::error::signature_verification_exception& e) {
+        error = "Token signature verification failed";
+    } catch (const jwt::error::token_verification_exception& e) {
+        error = "Token verification failed";
+    } catch (const exception& e) {
+        error = "Token verification error: " + string(e.what());
+    }
+    return false;
+}
+
+RevocationList& TokenManager::revocations() {
+    return revoked;
+}
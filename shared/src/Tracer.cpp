@@ -0,0 +1,142 @@
+#include "Tracer.h"
+#include <algorithm>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <fstream>
+#include <unistd.h>
+#include <vector>
+using namespace std;
+
+namespace {
+
+uint32_t threadIndex() {
+    static atomic<uint32_t> next_index{1};
+    thread_local uint32_t index = next_index.fetch_add(1, memory_order_relaxed);
+    return index;
+}
+
+// Where a thread's countdown first starts, spread over [1, every] so the
+// first frame of every thread (every connection on the threaded model) is
+// not always sampled. splitmix64 of the thread index and the clock.
+uint32_t firstCountdown(uint32_t every) {
+    uint64_t x = (uint64_t(threadIndex()) << 32) ^
+                 static_cast<uint64_t>(chrono::steady_clock::now().time_since_epoch().count());
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return static_cast<uint32_t>(x % every) + 1;
+}
+
+}  // namespace
+
+Tracer& Tracer::instance() {
+    // Never destroyed: detached client threads may still record at exit
+    static Tracer* tracer = new Tracer();
+    return *tracer;
+}
+
+void Tracer::configure(uint32_t every, size_t ring_spans) {
+    size_t rounded = 1024;
+    while (rounded < ring_spans) {
+        rounded <<= 1;
+    }
+    if (every > 0) {
+        slots.reset(new Slot[rounded]);
+        capacity = rounded;
+    }
+    sample_every.store(every, memory_order_release);
+}
+
+TraceContext Tracer::startTrace() {
+    TraceContext trace;
+    uint32_t every = sample_every.load(memory_order_acquire);
+    if (every == 0) {
+        return trace;
+    }
+    // Counted per thread so sampling never touches a shared cache line
+    thread_local uint32_t countdown = firstCountdown(every);
+    if (countdown <= 1) {
+        countdown = every;
+        // Thread index in the top bits keeps ids unique without coordination
+        trace.trace_id = (uint64_t(threadIndex()) << 40) | (next_trace.fetch_add(1, memory_order_relaxed) + 1);
+    } else {
+        countdown--;
+    }
+    return trace;
+}
+
+void Tracer::record(const TraceContext& trace, const char* name, int64_t start_ns, int64_t end_ns) {
+    if (!trace.sampled() || capacity == 0) {
+        return;
+    }
+    uint64_t claimed = next_slot.fetch_add(1, memory_order_relaxed);
+    Slot& slot = slots[claimed & (capacity - 1)];
+    slot.sequence.store(claimed * 2 + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    slot.trace_id.store(trace.trace_id, memory_order_relaxed);
+    slot.name.store(name, memory_order_relaxed);
+    slot.start_ns.store(start_ns, memory_order_relaxed);
+    slot.duration_ns.store(end_ns - start_ns, memory_order_relaxed);
+    slot.thread_index.store(threadIndex(), memory_order_relaxed);
+    slot.sequence.store(claimed * 2 + 2, memory_order_release);
+}
+
+string Tracer::exportChromeTrace() {
+    struct Span {
+        uint64_t trace_id;
+        const char* name;
+        int64_t start_ns;
+        int64_t duration_ns;
+        uint32_t thread_index;
+    };
+    vector<Span> spans;
+    for (size_t i = 0; i < capacity; i++) {
+        Slot& slot = slots[i];
+        uint64_t before = slot.sequence.load(memory_order_acquire);
+        if (before == 0 || (before & 1)) {
+            continue;
+        }
+        Span span{slot.trace_id.load(memory_order_relaxed), slot.name.load(memory_order_relaxed),
+                  slot.start_ns.load(memory_order_relaxed), slot.duration_ns.load(memory_order_relaxed),
+                  slot.thread_index.load(memory_order_relaxed)};
+        atomic_thread_fence(memory_order_acquire);
+        // Overwritten while we read it, the newer span is left for next time
+        if (slot.sequence.load(memory_order_relaxed) != before) {
+            continue;
+        }
+        spans.push_back(span);
+    }
+    // A parent is recorded when it closes, after its children, so the ring
+    // order says nothing; the longer span of two starting together is the
+    // parent and goes first
+    sort(spans.begin(), spans.end(), [](const Span& a, const Span& b) {
+        return a.start_ns != b.start_ns ? a.start_ns < b.start_ns : a.duration_ns > b.duration_ns;
+    });
+
+    // Complete ("X") events in microseconds
+    string out = "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+    int pid = static_cast<int>(getpid());
+    char event[256];
+    for (size_t i = 0; i < spans.size(); i++) {
+        const Span& span = spans[i];
+        snprintf(event, sizeof(event),
+                 "%s{\"name\":\"%s\",\"cat\":\"message\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+                 "\"pid\":%d,\"tid\":%" PRIu32 ",\"args\":{\"trace_id\":\"%016" PRIx64 "\"}}",
+                 i == 0 ? "" : ",", span.name, span.start_ns / 1000.0, span.duration_ns / 1000.0, pid,
+                 span.thread_index, span.trace_id);
+        out += event;
+    }
+    out += "]}\n";
+    return out;
+}
+
+bool Tracer::writeChromeTrace(const string& path) {
+    ofstream file(path, ios::trunc);
+    if (!file) {
+        return false;
+    }
+    file << exportChromeTrace();
+    return static_cast<bool>(file);
+}